@@ -30,12 +30,16 @@ void source_free(RemoteSource *source) {
 
         journal_importer_cleanup(&source->importer);
 
+        if (source->blocked)
+                LIST_REMOVE(blocked_sources, source->writer->blocked_sources, source);
+
         log_debug("Writer ref count %i", source->writer->n_ref);
         writer_unref(source->writer);
 
         sd_event_source_unref(source->event);
         sd_event_source_unref(source->buffer_event);
 
+        free(source->compressed);
         free(source);
 }
 
@@ -71,6 +75,10 @@ int process_source(RemoteSource *source, bool compress, bool seal) {
         assert(source);
         assert(source->writer);
 
+        /* Leave the data where it is while the writer can't keep up */
+        if (writer_queue_full(source->writer))
+                return -EBUSY;
+
         r = journal_importer_process_data(&source->importer);
         if (r <= 0)
                 return r;
@@ -24,14 +24,27 @@
 #include "journal-importer.h"
 #include "journal-remote-write.h"
 
-typedef struct RemoteSource {
+struct MHD_Connection;
+
+struct RemoteSource {
         JournalImporter importer;
 
         Writer *writer;
 
         sd_event_source *event;
         sd_event_source *buffer_event;
-} RemoteSource;
+
+        /* Set for HTTP uploads, which are suspended rather than disabled while the writer is busy */
+        struct MHD_Connection *connection;
+
+        bool blocked;
+        LIST_FIELDS(RemoteSource, blocked_sources);
+
+        /* Set for HTTP uploads with a Content-Encoding, which are buffered and decoded once complete */
+        int compression;
+        char *compressed;
+        size_t compressed_size, compressed_allocated;
+};
 
 RemoteSource* source_new(int fd, bool passive_fd, char *name, Writer *writer);
 void source_free(RemoteSource *source);
@@ -17,9 +17,22 @@
   along with systemd; If not, see <http://www.gnu.org/licenses/>.
 ***/
 
+#include <sys/eventfd.h>
+
 #include "alloc-util.h"
+#include "fd-util.h"
 #include "journal-remote.h"
 
+struct WriterEntry {
+        LIST_FIELDS(WriterEntry, queue);
+
+        dual_timestamp ts;
+        size_t size;
+
+        size_t n_iovec;
+        struct iovec iovec[];
+};
+
 static int do_rotate(JournalFile **f, bool compress, bool seal) {
         int r = journal_file_rotate(f, compress, seal, NULL);
         if (r < 0) {
@@ -47,14 +60,47 @@ Writer* writer_new(RemoteServer *server) {
 
         w->n_ref = 1;
         w->server = server;
+        w->notify_fd = -1;
 
         return w;
 }
 
+static void writer_stop_thread(Writer *w) {
+        assert(w);
+
+        if (!w->threaded)
+                return;
+
+        /* The thread writes out what is queued before it exits */
+        assert_se(pthread_mutex_lock(&w->mutex) == 0);
+        w->stop = true;
+        assert_se(pthread_cond_signal(&w->queued) == 0);
+        assert_se(pthread_mutex_unlock(&w->mutex) == 0);
+
+        assert_se(pthread_join(w->thread, NULL) == 0);
+        assert(!w->queue);
+
+        assert_se(pthread_mutex_destroy(&w->mutex) == 0);
+        assert_se(pthread_cond_destroy(&w->queued) == 0);
+
+        w->threaded = false;
+}
+
 Writer* writer_free(Writer *w) {
         if (!w)
                 return NULL;
 
+        writer_stop_thread(w);
+
+        if (w->server && w->error < 0 && w->server->write_error >= 0)
+                w->server->write_error = w->error;
+
+        w->notify_event = sd_event_source_unref(w->notify_event);
+        w->notify_fd = safe_close(w->notify_fd);
+
+        /* The sources hold references, hence there must not be any waiting anymore */
+        assert(!w->blocked_sources);
+
         if (w->journal) {
                 log_debug("Closing journal file %s.", w->journal->path);
                 journal_file_close(w->journal);
@@ -85,16 +131,29 @@ Writer* writer_ref(Writer *w) {
         return w;
 }
 
-int writer_write(Writer *w,
-                 struct iovec_wrapper *iovw,
-                 dual_timestamp *ts,
-                 bool compress,
-                 bool seal) {
+static void writer_count(Writer *w) {
+        assert(w);
+
+        /* Writer threads count concurrently */
+        if (w->server)
+                __sync_add_and_fetch(&w->server->event_count, 1);
+}
+
+static int writer_append(Writer *w,
+                         struct iovec *iovec,
+                         size_t n_iovec,
+                         dual_timestamp *ts,
+                         bool compress,
+                         bool seal) {
         int r;
 
         assert(w);
-        assert(iovw);
-        assert(iovw->count > 0);
+        assert(iovec);
+        assert(n_iovec > 0);
+
+        /* A failed rotation leaves us without a file */
+        if (!w->journal)
+                return -EIO;
 
         if (journal_file_rotate_suggested(w->journal, 0)) {
                 log_info("%s: Journal header limits reached or header out-of-date, rotating",
@@ -104,11 +163,10 @@ int writer_write(Writer *w,
                         return r;
         }
 
-        r = journal_file_append_entry(w->journal, ts, iovw->iovec, iovw->count,
+        r = journal_file_append_entry(w->journal, ts, iovec, n_iovec,
                                       &w->seqnum, NULL, NULL);
         if (r >= 0) {
-                if (w->server)
-                        w->server->event_count += 1;
+                writer_count(w);
                 return 1;
         }
 
@@ -120,12 +178,198 @@ int writer_write(Writer *w,
                 log_debug("%s: Successfully rotated journal", w->journal->path);
 
         log_debug("Retrying write.");
-        r = journal_file_append_entry(w->journal, ts, iovw->iovec, iovw->count,
+        r = journal_file_append_entry(w->journal, ts, iovec, n_iovec,
                                       &w->seqnum, NULL, NULL);
         if (r < 0)
                 return r;
 
-        if (w->server)
-                w->server->event_count += 1;
+        writer_count(w);
         return 1;
 }
+
+static void *writer_thread(void *p) {
+        Writer *w = p;
+
+        assert_se(pthread_mutex_lock(&w->mutex) == 0);
+
+        for (;;) {
+                WriterEntry *batch, *e;
+                size_t size = 0;
+                int error = 0;
+
+                while (!w->queue && !w->stop)
+                        assert_se(pthread_cond_wait(&w->queued, &w->mutex) == 0);
+
+                if (!w->queue)
+                        break;
+
+                /* Take everything that is queued, and write it without holding the lock. The entries stay
+                 * accounted for until they are written, so that the queue can't grow beyond its limit. */
+                batch = w->queue;
+                w->queue = w->queue_tail = NULL;
+
+                assert_se(pthread_mutex_unlock(&w->mutex) == 0);
+
+                while ((e = batch)) {
+                        int r;
+
+                        LIST_REMOVE(queue, batch, e);
+
+                        r = writer_append(w, e->iovec, e->n_iovec, &e->ts, w->compress, w->seal);
+                        if (r < 0) {
+                                log_error_errno(r, "%s: Failed to write entry of %zu bytes: %m",
+                                                w->journal ? w->journal->path : "journal", e->size);
+                                if (error >= 0)
+                                        error = r;
+                        }
+
+                        size += e->size;
+                        free(e);
+                }
+
+                assert_se(pthread_mutex_lock(&w->mutex) == 0);
+
+                w->queue_size -= size;
+
+                if (error < 0 && w->error >= 0)
+                        w->error = error;
+
+                /* Let the sources waiting for us continue once half of the queue is free again, or fail them */
+                if (w->full && (w->queue_size <= WRITER_QUEUE_MAX / 2 || w->error < 0)) {
+                        w->full = false;
+                        (void) eventfd_write(w->notify_fd, 1);
+                }
+        }
+
+        assert_se(pthread_mutex_unlock(&w->mutex) == 0);
+
+        return NULL;
+}
+
+int writer_start_thread(Writer *w, bool compress, bool seal) {
+        int r;
+
+        assert(w);
+        assert(!w->threaded);
+
+        w->notify_fd = eventfd(0, EFD_NONBLOCK|EFD_CLOEXEC);
+        if (w->notify_fd < 0)
+                return -errno;
+
+        w->compress = compress;
+        w->seal = seal;
+
+        r = pthread_mutex_init(&w->mutex, NULL);
+        if (r != 0)
+                return -r;
+
+        r = pthread_cond_init(&w->queued, NULL);
+        if (r != 0) {
+                assert_se(pthread_mutex_destroy(&w->mutex) == 0);
+                return -r;
+        }
+
+        r = pthread_create(&w->thread, NULL, writer_thread, w);
+        if (r != 0) {
+                assert_se(pthread_mutex_destroy(&w->mutex) == 0);
+                assert_se(pthread_cond_destroy(&w->queued) == 0);
+                return -r;
+        }
+
+        w->threaded = true;
+        return 0;
+}
+
+bool writer_queue_full(Writer *w) {
+        bool full;
+
+        assert(w);
+
+        if (!w->threaded)
+                return false;
+
+        /* If the queue is full, the thread notifies us when there's space again. Once the thread failed, it
+         * isn't anymore, so that the sources get the error. */
+        assert_se(pthread_mutex_lock(&w->mutex) == 0);
+        full = w->error >= 0 && w->queue_size >= WRITER_QUEUE_MAX;
+        if (full)
+                w->full = true;
+        assert_se(pthread_mutex_unlock(&w->mutex) == 0);
+
+        return full;
+}
+
+int writer_get_error(Writer *w) {
+        int r;
+
+        assert(w);
+
+        if (!w->threaded)
+                return 0;
+
+        assert_se(pthread_mutex_lock(&w->mutex) == 0);
+        r = w->error;
+        assert_se(pthread_mutex_unlock(&w->mutex) == 0);
+
+        return r;
+}
+
+static int writer_queue(Writer *w, struct iovec_wrapper *iovw, dual_timestamp *ts) {
+        WriterEntry *e;
+        size_t size, i;
+        uint8_t *p;
+        int r;
+
+        assert(w);
+        assert(iovw);
+
+        /* Once the thread failed to write an entry, accepting more would only lose them too */
+        r = writer_get_error(w);
+        if (r < 0)
+                return r;
+
+        /* The importer reuses its buffer for the next entry, hence copy the data along with the entry */
+        size = iovw_size(iovw);
+
+        e = malloc(offsetof(WriterEntry, iovec) + iovw->count * sizeof(struct iovec) + size);
+        if (!e)
+                return -ENOMEM;
+
+        e->ts = *ts;
+        e->size = size;
+        e->n_iovec = iovw->count;
+
+        p = (uint8_t*) (e->iovec + iovw->count);
+        for (i = 0; i < iovw->count; i++) {
+                e->iovec[i].iov_base = p;
+                e->iovec[i].iov_len = iovw->iovec[i].iov_len;
+                p = mempcpy(p, iovw->iovec[i].iov_base, iovw->iovec[i].iov_len);
+        }
+
+        assert_se(pthread_mutex_lock(&w->mutex) == 0);
+
+        LIST_INSERT_AFTER(queue, w->queue, w->queue_tail, e);
+        w->queue_tail = e;
+        w->queue_size += size;
+
+        assert_se(pthread_cond_signal(&w->queued) == 0);
+        assert_se(pthread_mutex_unlock(&w->mutex) == 0);
+
+        return 1;
+}
+
+int writer_write(Writer *w,
+                 struct iovec_wrapper *iovw,
+                 dual_timestamp *ts,
+                 bool compress,
+                 bool seal) {
+
+        assert(w);
+        assert(iovw);
+        assert(iovw->count > 0);
+
+        if (w->threaded)
+                return writer_queue(w, iovw, ts);
+
+        return writer_append(w, iovw->iovec, iovw->count, ts, compress, seal);
+}
@@ -19,10 +19,20 @@
   along with systemd; If not, see <http://www.gnu.org/licenses/>.
 ***/
 
+#include <pthread.h>
+
+#include "sd-event.h"
+
 #include "journal-file.h"
 #include "journal-importer.h"
+#include "list.h"
 
 typedef struct RemoteServer RemoteServer;
+typedef struct RemoteSource RemoteSource;
+typedef struct WriterEntry WriterEntry;
+
+/* How many bytes of entries may be queued for a writer thread before sources have to wait */
+#define WRITER_QUEUE_MAX (8U*1024U*1024U)
 
 typedef struct Writer {
         JournalFile *journal;
@@ -35,9 +45,34 @@ typedef struct Writer {
         uint64_t seqnum;
 
         int n_ref;
+
+        /* If the writer has a thread of its own, entries are queued and written there. Everything below is
+         * protected by the mutex, except for the fields only the main thread uses. */
+        bool threaded;
+        pthread_t thread;
+        pthread_mutex_t mutex;
+        pthread_cond_t queued;
+        LIST_HEAD(WriterEntry, queue);
+        WriterEntry *queue_tail;
+        size_t queue_size;
+        bool compress;
+        bool seal;
+        bool stop;
+        bool full;
+
+        /* The first error the thread failed to write an entry with. Entries are refused with it from then on. */
+        int error;
+
+        /* Written to by the thread when the queue is no longer full, and the sources waiting for that */
+        int notify_fd;
+        sd_event_source *notify_event;
+        LIST_HEAD(RemoteSource, blocked_sources);
 } Writer;
 
 Writer* writer_new(RemoteServer* server);
+int writer_start_thread(Writer *w, bool compress, bool seal);
+bool writer_queue_full(Writer *w);
+int writer_get_error(Writer *w);
 Writer* writer_free(Writer *w);
 
 Writer* writer_ref(Writer *w);
@@ -30,11 +30,13 @@
 #include "sd-daemon.h"
 
 #include "alloc-util.h"
+#include "compress.h"
 #include "conf-parser.h"
 #include "def.h"
 #include "escape.h"
 #include "fd-util.h"
 #include "fileio.h"
+#include "io-util.h"
 #include "journal-file.h"
 #include "journal-remote-write.h"
 #include "journal-remote.h"
@@ -48,6 +50,7 @@
 #include "string-table.h"
 #include "string-util.h"
 #include "strv.h"
+#include "unaligned.h"
 
 #define REMOTE_JOURNAL_PATH "/var/log/journal/remote"
 
@@ -55,6 +58,9 @@
 #define CERT_FILE     CERTIFICATE_ROOT "/certs/journal-remote.pem"
 #define TRUST_FILE    CERTIFICATE_ROOT "/ca/trusted.pem"
 
+/* The largest batch systemd-journal-upload sends, before and after compression */
+#define COMPRESSED_UPLOAD_SIZE_MAX (64U*1024U*1024U)
+
 static char* arg_url = NULL;
 static char* arg_getter = NULL;
 static char* arg_listen_raw = NULL;
@@ -67,6 +73,7 @@ static int http_socket = -1, https_socket = -1;
 static char** arg_gnutls_log = NULL;
 
 static JournalWriteSplitMode arg_split_mode = JOURNAL_WRITE_SPLIT_HOST;
+static bool arg_writer_threads = false;
 static char* arg_output = NULL;
 
 static char *arg_key = NULL;
@@ -217,6 +224,84 @@ static int open_output(Writer *w, const char* host) {
  **********************************************************************
  **********************************************************************/
 
+static void block_source(RemoteSource *source) {
+        assert(source);
+
+        /* Stop reading from the source until its writer has caught up. The data stays in the socket
+         * buffers, so that the sender has to wait, too. */
+
+        if (source->blocked)
+                return;
+
+        log_debug("Writer of %s is busy, pausing source.", source->importer.name);
+
+        if (source->connection)
+                MHD_suspend_connection(source->connection);
+        else {
+                sd_event_source_set_enabled(source->event, SD_EVENT_OFF);
+                if (source->buffer_event)
+                        sd_event_source_set_enabled(source->buffer_event, SD_EVENT_OFF);
+        }
+
+        source->blocked = true;
+        LIST_PREPEND(blocked_sources, source->writer->blocked_sources, source);
+}
+
+static void resume_sources(Writer *w) {
+        RemoteSource *source;
+
+        assert(w);
+
+        while ((source = w->blocked_sources)) {
+                LIST_REMOVE(blocked_sources, w->blocked_sources, source);
+                source->blocked = false;
+
+                if (source->connection)
+                        MHD_resume_connection(source->connection);
+                else {
+                        sd_event_source_set_enabled(source->event, SD_EVENT_ON);
+                        /* There might be entries in the buffer already */
+                        if (source->buffer_event)
+                                sd_event_source_set_enabled(source->buffer_event, SD_EVENT_ON);
+                }
+        }
+}
+
+static int dispatch_writer_event(sd_event_source *event,
+                                 int fd,
+                                 uint32_t revents,
+                                 void *userdata) {
+        Writer *w = userdata;
+
+        assert(w);
+
+        (void) flush_fd(fd);
+        resume_sources(w);
+
+        return 0;
+}
+
+static int start_writer_thread(RemoteServer *s, Writer *w) {
+        int r;
+
+        assert(s);
+        assert(w);
+
+        r = writer_start_thread(w, arg_compress, arg_seal);
+        if (r < 0)
+                return log_error_errno(r, "Failed to start writer thread for %s: %m", w->journal->path);
+
+        r = sd_event_add_io(s->events, &w->notify_event,
+                            w->notify_fd, EPOLLIN,
+                            dispatch_writer_event, w);
+        if (r < 0)
+                return log_error_errno(r, "Failed to add writer event source: %m");
+
+        (void) sd_event_source_set_description(w->notify_event, "writer-notify");
+
+        return 0;
+}
+
 static int init_writer_hashmap(RemoteServer *s) {
         static const struct hash_ops *hash_ops[] = {
                 [JOURNAL_WRITE_SPLIT_NONE] = NULL,
@@ -270,6 +355,12 @@ static int get_writer(RemoteServer *s, const char *host,
                 if (r < 0)
                         return r;
 
+                if (arg_writer_threads) {
+                        r = start_writer_thread(s, w);
+                        if (r < 0)
+                                return r;
+                }
+
                 r = hashmap_put(s->writers, w->hashmap_key ?: key, w);
                 if (r < 0)
                         return r;
@@ -494,6 +585,59 @@ static void request_meta_free(void *cls,
         }
 }
 
+static int content_encoding_to_compression(const char *encoding) {
+        if (!encoding || streq(encoding, "identity"))
+                return 0;
+#ifdef HAVE_ZSTD
+        if (streq(encoding, "zstd"))
+                return OBJECT_COMPRESSED_ZSTD;
+#endif
+#ifdef HAVE_LZ4
+        if (streq(encoding, "x-systemd-lz4"))
+                return OBJECT_COMPRESSED_LZ4;
+#endif
+        return -EPROTONOSUPPORT;
+}
+
+static int decode_upload(RemoteSource *source) {
+        _cleanup_free_ void *buf = NULL;
+        size_t allocated = 0, size;
+        int r;
+
+        assert(source);
+        assert(source->compression > 0);
+
+        if (source->compressed_size == 0)
+                return -EBADMSG;
+
+        /* LZ4 data is prefixed by its decompressed size, which must be checked before it is allocated */
+        if (source->compression == OBJECT_COMPRESSED_LZ4 &&
+            source->compressed_size > 8 &&
+            unaligned_read_le64(source->compressed) > COMPRESSED_UPLOAD_SIZE_MAX)
+                return -E2BIG;
+
+        r = decompress_blob(source->compression,
+                            source->compressed, source->compressed_size,
+                            &buf, &allocated, &size, COMPRESSED_UPLOAD_SIZE_MAX + 1,
+                            NULL);
+        if (r < 0)
+                return r;
+        if (size > COMPRESSED_UPLOAD_SIZE_MAX)
+                return -E2BIG;
+
+        log_trace("Decoded %zu bytes from %zu bytes", size, source->compressed_size);
+
+        r = journal_importer_push_data(&source->importer, buf, size);
+        if (r < 0)
+                return r;
+
+        source->compression = 0;
+        source->compressed = mfree(source->compressed);
+        source->compressed_size = source->compressed_allocated = 0;
+
+        return 0;
+}
+
 static int process_http_upload(
                 struct MHD_Connection *connection,
                 const char *upload_data,
@@ -509,7 +653,46 @@ static int process_http_upload(
         log_trace("%s: connection %p, %zu bytes",
                   __func__, connection, *upload_data_size);
 
+        source->connection = connection;
+
+        if (*upload_data_size && source->compression > 0) {
+                /* Compressed uploads are only parsed once they are complete */
+                if (*upload_data_size > COMPRESSED_UPLOAD_SIZE_MAX - source->compressed_size)
+                        return mhd_respondf(connection, 0, MHD_HTTP_PAYLOAD_TOO_LARGE,
+                                            "Compressed upload is too large, maximum is %u bytes.",
+                                            COMPRESSED_UPLOAD_SIZE_MAX);
+
+                if (!GREEDY_REALLOC(source->compressed, source->compressed_allocated,
+                                    source->compressed_size + *upload_data_size))
+                        return respond_oom(connection);
+
+                memcpy(source->compressed + source->compressed_size, upload_data, *upload_data_size);
+                source->compressed_size += *upload_data_size;
+                *upload_data_size = 0;
+
+                return MHD_YES;
+        }
+
+        if (*upload_data_size == 0 && source->compression > 0) {
+                r = decode_upload(source);
+                if (r == -ENOMEM)
+                        return respond_oom(connection);
+                else if (r == -E2BIG)
+                        return mhd_respondf(connection, 0, MHD_HTTP_PAYLOAD_TOO_LARGE,
+                                            "Decompressed upload is too large, maximum is %u bytes.",
+                                            COMPRESSED_UPLOAD_SIZE_MAX);
+                else if (r < 0)
+                        return mhd_respondf(connection, r, MHD_HTTP_BAD_REQUEST,
+                                            "Failed to decode upload: %m");
+        }
+
         if (*upload_data_size) {
+                /* Leave the data to µhttpd while the writer can't keep up */
+                if (writer_queue_full(source->writer)) {
+                        block_source(source);
+                        return MHD_YES;
+                }
+
                 log_trace("Received %zu bytes", *upload_data_size);
 
                 r = journal_importer_push_data(&source->importer,
@@ -525,7 +708,11 @@ static int process_http_upload(
                 r = process_source(source, arg_compress, arg_seal);
                 if (r == -EAGAIN)
                         break;
-                else if (r < 0) {
+                else if (r == -EBUSY) {
+                        /* We are called again once the connection is resumed */
+                        block_source(source);
+                        return MHD_YES;
+                } else if (r < 0) {
                         log_warning("Failed to process data for connection %p", connection);
                         if (r == -E2BIG)
                                 return mhd_respondf(connection,
@@ -566,7 +753,7 @@ static int request_handler(
                 void **connection_cls) {
 
         const char *header;
-        int r, code, fd;
+        int r, code, fd, compression;
         _cleanup_free_ char *hostname = NULL;
 
         assert(connection);
@@ -593,6 +780,13 @@ static int request_handler(
                 return mhd_respond(connection, MHD_HTTP_UNSUPPORTED_MEDIA_TYPE,
                                    "Content-Type: application/vnd.fdo.journal is required.");
 
+        header = MHD_lookup_connection_value(connection,
+                                             MHD_HEADER_KIND, "Content-Encoding");
+        compression = content_encoding_to_compression(header);
+        if (compression < 0)
+                return mhd_respondf(connection, 0, MHD_HTTP_UNSUPPORTED_MEDIA_TYPE,
+                                    "Content-Encoding: %s is not supported.", header);
+
         {
                 const union MHD_ConnectionInfo *ci;
 
@@ -628,6 +822,8 @@ static int request_handler(
                 return mhd_respondf(connection, r, MHD_HTTP_INTERNAL_SERVER_ERROR, "%m");
 
         hostname = NULL;
+
+        ((RemoteSource*) *connection_cls)->compression = compression;
         return MHD_YES;
 }
 
@@ -653,6 +849,9 @@ static int setup_microhttpd_server(RemoteServer *s,
                 MHD_USE_EPOLL |
                 MHD_USE_ITC;
 
+        if (arg_writer_threads)
+                flags |= MHD_ALLOW_SUSPEND_RESUME;
+
         const union MHD_DaemonInfo *info;
         int r, epoll_fd;
         MHDDaemonWrapper *d;
@@ -1008,6 +1207,12 @@ static int remoteserver_init(RemoteServer *s,
 static void server_destroy(RemoteServer *s) {
         size_t i;
         MHDDaemonWrapper *d;
+        Iterator j;
+        Writer *w;
+
+        /* µhttpd wants connections to be resumed before the daemon is stopped */
+        HASHMAP_FOREACH(w, s->writers, j)
+                resume_sources(w);
 
         while ((d = hashmap_steal_first(s->daemons))) {
                 MHD_stop_daemon(d->daemon);
@@ -1069,6 +1274,9 @@ static int handle_raw_source(sd_event_source *event,
         } else if (r == -E2BIG) {
                 log_notice_errno(E2BIG, "Entry too big, skipped");
                 return 1;
+        } else if (r == -EBUSY) {
+                block_source(source);
+                return 0;
         } else if (r == -EAGAIN) {
                 return 0;
         } else if (r < 0) {
@@ -1211,6 +1419,7 @@ static int parse_config(void) {
                 { "Remote",  "ServerKeyFile",          config_parse_path,             0, &arg_key        },
                 { "Remote",  "ServerCertificateFile",  config_parse_path,             0, &arg_cert       },
                 { "Remote",  "TrustedCertificateFile", config_parse_path,             0, &arg_trust      },
+                { "Remote",  "WriterThreads",          config_parse_bool,             0, &arg_writer_threads },
                 {}};
 
         return config_parse_many_nulstr(PKGSYSCONFDIR "/journal-remote.conf",
@@ -1241,6 +1450,8 @@ static void help(void) {
                "     --gnutls-log=CATEGORY...\n"
                "                            Specify a list of gnutls logging categories\n"
                "     --split-mode=none|host How many output files to create\n"
+               "     --writer-threads[=BOOL]\n"
+               "                            Write each output file in a thread of its own\n"
                "\n"
                "Note: file descriptors from sd_listen_fds() will be consumed, too.\n"
                , program_invocation_short_name);
@@ -1261,6 +1472,7 @@ static int parse_argv(int argc, char *argv[]) {
                 ARG_CERT,
                 ARG_TRUST,
                 ARG_GNUTLS_LOG,
+                ARG_WRITER_THREADS,
         };
 
         static const struct option options[] = {
@@ -1279,6 +1491,7 @@ static int parse_argv(int argc, char *argv[]) {
                 { "cert",         required_argument, NULL, ARG_CERT         },
                 { "trust",        required_argument, NULL, ARG_TRUST        },
                 { "gnutls-log",   required_argument, NULL, ARG_GNUTLS_LOG   },
+                { "writer-threads", optional_argument, NULL, ARG_WRITER_THREADS },
                 {}
         };
 
@@ -1441,6 +1654,20 @@ static int parse_argv(int argc, char *argv[]) {
 
                         break;
 
+                case ARG_WRITER_THREADS:
+                        if (optarg) {
+                                r = parse_boolean(optarg);
+                                if (r < 0) {
+                                        log_error("Failed to parse --writer-threads= parameter.");
+                                        return -EINVAL;
+                                }
+
+                                arg_writer_threads = !!r;
+                        } else
+                                arg_writer_threads = true;
+
+                        break;
+
                 case ARG_GNUTLS_LOG: {
 #ifdef HAVE_GNUTLS
                         const char* p = optarg;
@@ -1507,8 +1734,9 @@ static int parse_argv(int argc, char *argv[]) {
                 return -EINVAL;
         }
 
-        log_debug("Full config: SplitMode=%s Key=%s Cert=%s Trust=%s",
+        log_debug("Full config: SplitMode=%s WriterThreads=%s Key=%s Cert=%s Trust=%s",
                   journal_write_split_mode_to_string(arg_split_mode),
+                  yes_no(arg_writer_threads),
                   strna(arg_key),
                   strna(arg_cert),
                   strna(arg_trust));
@@ -1597,13 +1825,17 @@ int main(int argc, char **argv) {
                 }
         }
 
+        /* With writer threads, entries are only all written once the writers are gone */
+        server_destroy(&s);
+
+        if (r >= 0 && s.write_error < 0)
+                r = log_error_errno(s.write_error, "Failed to write entries: %m");
+
         sd_notifyf(false,
                    "STOPPING=1\n"
                    "STATUS=Shutting down after writing %" PRIu64 " entries...", s.event_count);
         log_info("Finishing after writing %" PRIu64 " entries", s.event_count);
 
-        server_destroy(&s);
-
         free(arg_key);
         free(arg_cert);
         free(arg_trust);
@@ -47,6 +47,9 @@ struct RemoteServer {
         Writer *_single_writer;
         uint64_t event_count;
 
+        /* The first error a writer thread failed to write an entry with */
+        int write_error;
+
         bool check_trust;
         Hashmap *daemons;
 };
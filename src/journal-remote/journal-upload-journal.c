@@ -299,6 +299,7 @@ static size_t journal_input_callback(void *buf, size_t size, size_t nmemb, void
                 if (w < 0)
                         return CURL_READFUNC_ABORT;
                 filled += w;
+                u->bytes_sent += w;
 
                 if (filled == 0) {
                         log_error("Buffer space is too small to write entry.");
@@ -326,20 +327,124 @@ void close_journal_input(Uploader *u) {
         u->timeout = 0;
 }
 
+/**
+ * Fill the batch with entries, starting with the current one, until it is at least u->batch_size bytes large.
+ * Return 1 if the batch is full, and 0 if the journal has no more entries.
+ */
+static int fill_batch(Uploader *u, UploadBatch *b) {
+        ssize_t w;
+        int r;
+
+        check_update_watchdog(u);
+
+        for (;;) {
+                if (u->entry_state == ENTRY_DONE) {
+                        if (b->size >= u->batch_size)
+                                return 1;
+
+                        r = sd_journal_next(u->journal);
+                        if (r < 0)
+                                return log_error_errno(r, "Failed to move to next entry in journal: %m");
+                        if (r == 0)
+                                return 0;
+
+                        u->entry_state = ENTRY_CURSOR;
+                }
+
+                /* Fields are written in pieces if they don't fit, but the fixed parts of an entry need some
+                 * room to be written at all */
+                if (!GREEDY_REALLOC(b->data, b->allocated, MAX(b->size + LINE_MAX, u->batch_size + 1)))
+                        return log_oom();
+
+                w = write_entry(b->data + b->size, b->allocated - b->size, u);
+                if (w < 0)
+                        return w;
+                b->size += w;
+
+                if (u->entry_state == ENTRY_DONE) {
+                        b->n_entries++;
+
+                        log_debug("Entry %zu (%s) has been added to the batch.",
+                                  u->entries_sent, u->current_cursor);
+                }
+        }
+}
+
+static int start_batches(Uploader *u) {
+        int r;
+
+        /* Called with the journal positioned on a new entry, which goes into the first batch. The following
+         * batches start with the entry after the last one of the previous batch. */
+
+        while (u->n_batches < u->batches_max) {
+                _cleanup_(batch_freep) UploadBatch *b = NULL;
+
+                b = new0(UploadBatch, 1);
+                if (!b)
+                        return log_oom();
+
+                r = fill_batch(u, b);
+                if (r < 0)
+                        return r;
+                u->backlog = r > 0;
+
+                if (b->n_entries > 0) {
+                        b->cursor = strdup(u->current_cursor);
+                        if (!b->cursor)
+                                return log_oom();
+
+                        r = start_batch(u, b);
+                        if (r < 0)
+                                return r;
+                        b = NULL;
+                }
+
+                if (!u->backlog) {
+                        if (u->input_event)
+                                log_debug("No more entries, waiting for journal.");
+                        else {
+                                log_info("No more entries, closing journal.");
+                                close_journal_input(u);
+                        }
+
+                        break;
+                }
+        }
+
+        return 0;
+}
+
 static int process_journal_input(Uploader *u, int skip) {
         int r;
 
         if (u->uploading)
                 return 0;
 
+        /* The next entry is picked up once a batch has been acknowledged */
+        if (u->batch_size > 0 && u->n_batches >= u->batches_max)
+                return 0;
+
         r = sd_journal_next_skip(u->journal, skip);
         if (r < 0)
                 return log_error_errno(r, "Failed to skip to next entry: %m");
-        else if (r < skip)
+        else if (r < skip) {
+                u->backlog = false;
+
+                /* Without following, there is nothing left to wait for */
+                if (!u->input_event) {
+                        log_info("No more entries, closing journal.");
+                        close_journal_input(u);
+                }
+
                 return 0;
+        }
 
         /* have data */
         u->entry_state = ENTRY_CURSOR;
+
+        if (u->batch_size > 0)
+                return start_batches(u);
+
         return start_upload(u, journal_input_callback, u);
 }
 
@@ -354,7 +459,9 @@ int check_journal_input(Uploader *u) {
                         return r;
                 }
 
-                if (r == SD_JOURNAL_NOP)
+                /* Entries left behind while all batches were in flight are picked up without a change to the
+                 * journal */
+                if (r == SD_JOURNAL_NOP && !u->backlog)
                         return 0;
         }
 
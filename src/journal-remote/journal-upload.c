@@ -26,6 +26,7 @@
 #include "sd-daemon.h"
 
 #include "alloc-util.h"
+#include "compress.h"
 #include "conf-parser.h"
 #include "def.h"
 #include "fd-util.h"
@@ -45,6 +46,7 @@
 #define CERT_FILE     CERTIFICATE_ROOT "/certs/journal-upload.pem"
 #define TRUST_FILE    CERTIFICATE_ROOT "/ca/trusted.pem"
 #define DEFAULT_PORT  19532
+#define DEFAULT_BATCH_SIZE (1024U*1024U)
 
 static const char* arg_url = NULL;
 static const char *arg_key = NULL;
@@ -59,6 +61,9 @@ static const char *arg_machine = NULL;
 static bool arg_merge = false;
 static int arg_follow = -1;
 static const char *arg_save_state = NULL;
+static size_t arg_batch_size = 0;
+static unsigned arg_batches_in_flight = 4;
+static int arg_compression = -1;
 
 static void close_fd_input(Uploader *u);
 
@@ -77,20 +82,22 @@ static void close_fd_input(Uploader *u);
                 }                                                       \
         } while (0)
 
+DEFINE_TRIVIAL_CLEANUP_FUNC(CURL*, curl_easy_cleanup);
+
 static size_t output_callback(char *buf,
                               size_t size,
                               size_t nmemb,
                               void *userp) {
-        Uploader *u = userp;
+        char **answer = userp;
 
-        assert(u);
+        assert(answer);
 
         log_debug("The server answers (%zu bytes): %.*s",
                   size*nmemb, (int)(size*nmemb), buf);
 
-        if (nmemb && !u->answer) {
-                u->answer = strndup(buf, size*nmemb);
-                if (!u->answer)
+        if (nmemb && !*answer) {
+                *answer = strndup(buf, size*nmemb);
+                if (!*answer)
                         log_warning_errno(ENOMEM, "Failed to store server answer (%zu bytes): %m",
                                           size*nmemb);
         }
@@ -180,6 +187,77 @@ static int load_cursor_state(Uploader *u) {
 
 
 
+static int make_easy(Uploader *u,
+                     struct curl_slist *header,
+                     char *error,
+                     char **answer,
+                     CURL **ret) {
+        _cleanup_(curl_easy_cleanupp) CURL *curl = NULL;
+        CURLcode code;
+
+        assert(u);
+        assert(ret);
+
+        curl = curl_easy_init();
+        if (!curl) {
+                log_error("Call to curl_easy_init failed.");
+                return -ENOSR;
+        }
+
+        /* tell it to POST to the URL */
+        easy_setopt(curl, CURLOPT_POST, 1L,
+                    LOG_ERR, return -EXFULL);
+
+        easy_setopt(curl, CURLOPT_ERRORBUFFER, error,
+                    LOG_ERR, return -EXFULL);
+
+        /* set where to write to */
+        easy_setopt(curl, CURLOPT_WRITEFUNCTION, output_callback,
+                    LOG_ERR, return -EXFULL);
+
+        easy_setopt(curl, CURLOPT_WRITEDATA, answer,
+                    LOG_ERR, return -EXFULL);
+
+        /* use our special own mime type */
+        easy_setopt(curl, CURLOPT_HTTPHEADER, header,
+                    LOG_ERR, return -EXFULL);
+
+        if (_unlikely_(log_get_max_level() >= LOG_DEBUG))
+                /* enable verbose for easier tracing */
+                easy_setopt(curl, CURLOPT_VERBOSE, 1L, LOG_WARNING, );
+
+        easy_setopt(curl, CURLOPT_USERAGENT,
+                    "systemd-journal-upload " PACKAGE_STRING,
+                    LOG_WARNING, );
+
+        if (arg_key || startswith(u->url, "https://")) {
+                easy_setopt(curl, CURLOPT_SSLKEY, arg_key ?: PRIV_KEY_FILE,
+                            LOG_ERR, return -EXFULL);
+                easy_setopt(curl, CURLOPT_SSLCERT, arg_cert ?: CERT_FILE,
+                            LOG_ERR, return -EXFULL);
+        }
+
+        if (streq_ptr(arg_trust, "all"))
+                easy_setopt(curl, CURLOPT_SSL_VERIFYPEER, 0,
+                            LOG_ERR, return -EUCLEAN);
+        else if (arg_trust || startswith(u->url, "https://"))
+                easy_setopt(curl, CURLOPT_CAINFO, arg_trust ?: TRUST_FILE,
+                            LOG_ERR, return -EXFULL);
+
+        if (arg_key || arg_trust)
+                easy_setopt(curl, CURLOPT_SSLVERSION, CURL_SSLVERSION_TLSv1,
+                            LOG_WARNING, );
+
+        /* upload to this place */
+        easy_setopt(curl, CURLOPT_URL, u->url,
+                    LOG_ERR, return -EXFULL);
+
+        *ret = curl;
+        curl = NULL;
+
+        return 0;
+}
+
 int start_upload(Uploader *u,
                  size_t (*input_callback)(void *ptr,
                                           size_t size,
@@ -187,6 +265,7 @@ int start_upload(Uploader *u,
                                           void *userdata),
                  void *data) {
         CURLcode code;
+        int r;
 
         assert(u);
         assert(input_callback);
@@ -216,85 +295,187 @@ int start_upload(Uploader *u,
         if (!u->easy) {
                 CURL *curl;
 
-                curl = curl_easy_init();
-                if (!curl) {
-                        log_error("Call to curl_easy_init failed.");
-                        return -ENOSR;
+                r = make_easy(u, u->header, u->error, &u->answer, &curl);
+                if (r < 0)
+                        return r;
+
+                /* set where to read from, and use chunked transfer */
+                easy_setopt(curl, CURLOPT_READFUNCTION, input_callback,
+                            LOG_ERR, curl_easy_cleanup(curl); return -EXFULL);
+
+                easy_setopt(curl, CURLOPT_READDATA, data,
+                            LOG_ERR, curl_easy_cleanup(curl); return -EXFULL);
+
+                u->easy = curl;
+        } else {
+                /* truncate the potential old error message */
+                u->error[0] = '\0';
+
+                u->answer = mfree(u->answer);
+        }
+
+        u->uploading = true;
+
+        return 0;
+}
+
+static struct curl_slist *make_batch_header(const char *encoding) {
+        /* Each batch is sent with its size known up front, don't wait for the server to agree to that. The
+         * encoding may be NULL, which ends the list early. */
+        const char *fields[] = {
+                "Content-Type: application/vnd.fdo.journal",
+                "Accept: text/plain",
+                "Expect:",
+                encoding,
+        };
+        struct curl_slist *h = NULL;
+        unsigned i;
+
+        for (i = 0; i < ELEMENTSOF(fields) && fields[i]; i++) {
+                struct curl_slist *n;
+
+                n = curl_slist_append(h, fields[i]);
+                if (!n) {
+                        curl_slist_free_all(h);
+                        return NULL;
                 }
 
-                /* tell it to POST to the URL */
-                easy_setopt(curl, CURLOPT_POST, 1L,
-                            LOG_ERR, return -EXFULL);
+                h = n;
+        }
 
-                easy_setopt(curl, CURLOPT_ERRORBUFFER, u->error,
-                            LOG_ERR, return -EXFULL);
+        return h;
+}
 
-                /* set where to write to */
-                easy_setopt(curl, CURLOPT_WRITEFUNCTION, output_callback,
-                            LOG_ERR, return -EXFULL);
+static int setup_batches(Uploader *u) {
+        assert(u);
 
-                easy_setopt(curl, CURLOPT_WRITEDATA, data,
-                            LOG_ERR, return -EXFULL);
+        u->batch_header = make_batch_header(NULL);
+        if (!u->batch_header)
+                return log_oom();
 
-                /* set where to read from */
-                easy_setopt(curl, CURLOPT_READFUNCTION, input_callback,
-                            LOG_ERR, return -EXFULL);
+        if (u->compression >= 0) {
+                const char *encoding;
 
-                easy_setopt(curl, CURLOPT_READDATA, data,
-                            LOG_ERR, return -EXFULL);
+                /* zstd data is a standard zstd frame. LZ4 data is a raw block prefixed by its size, which is not
+                 * any registered coding, hence it gets a private token. */
+                encoding = strjoina("Content-Encoding: ",
+                                    u->compression == OBJECT_COMPRESSED_LZ4 ? "x-systemd-lz4" : "zstd");
 
-                /* use our special own mime type and chunked transfer */
-                easy_setopt(curl, CURLOPT_HTTPHEADER, u->header,
-                            LOG_ERR, return -EXFULL);
+                u->batch_header_compressed = make_batch_header(encoding);
+                if (!u->batch_header_compressed)
+                        return log_oom();
+        }
 
-                if (_unlikely_(log_get_max_level() >= LOG_DEBUG))
-                        /* enable verbose for easier tracing */
-                        easy_setopt(curl, CURLOPT_VERBOSE, 1L, LOG_WARNING, );
+        u->multi = curl_multi_init();
+        if (!u->multi) {
+                log_error("Call to curl_multi_init failed.");
+                return -ENOSR;
+        }
 
-                easy_setopt(curl, CURLOPT_USERAGENT,
-                            "systemd-journal-upload " PACKAGE_STRING,
-                            LOG_WARNING, );
+        return 0;
+}
 
-                if (arg_key || startswith(u->url, "https://")) {
-                        easy_setopt(curl, CURLOPT_SSLKEY, arg_key ?: PRIV_KEY_FILE,
-                                    LOG_ERR, return -EXFULL);
-                        easy_setopt(curl, CURLOPT_SSLCERT, arg_cert ?: CERT_FILE,
-                                    LOG_ERR, return -EXFULL);
-                }
+static int compress_batch(Uploader *u, UploadBatch *b) {
+        _cleanup_free_ char *buf = NULL;
+        size_t size;
+        int r;
 
-                if (streq_ptr(arg_trust, "all"))
-                        easy_setopt(curl, CURLOPT_SSL_VERIFYPEER, 0,
-                                    LOG_ERR, return -EUCLEAN);
-                else if (arg_trust || startswith(u->url, "https://"))
-                        easy_setopt(curl, CURLOPT_CAINFO, arg_trust ?: TRUST_FILE,
-                                    LOG_ERR, return -EXFULL);
+        assert(u);
+        assert(b);
 
-                if (arg_key || arg_trust)
-                        easy_setopt(curl, CURLOPT_SSLVERSION, CURL_SSLVERSION_TLSv1,
-                                    LOG_WARNING, );
+        buf = malloc(b->size);
+        if (!buf)
+                return log_oom();
 
-                u->easy = curl;
-        } else {
-                /* truncate the potential old error message */
-                u->error[0] = '\0';
+        if (u->compression == OBJECT_COMPRESSED_LZ4)
+                r = compress_blob_lz4(b->data, b->size, buf, b->size - 1, &size);
+        else
+                r = compress_blob_zstd(b->data, b->size, buf, b->size - 1, &size);
+        if (r == -ENOBUFS)
+                return 0;
+        if (r < 0)
+                return log_error_errno(r, "Failed to compress batch: %m");
+
+        free_and_replace(b->data, buf);
+        b->allocated = b->size;
+        b->size = size;
+
+        return 1;
+}
+
+int start_batch(Uploader *u, UploadBatch *b) {
+        CURLMcode mcode;
+        CURLcode code;
+        size_t uncompressed;
+        bool compressed = false;
+        int r;
+
+        assert(u);
+        assert(b);
+        assert(u->multi);
+        assert(b->size > 0);
+
+        uncompressed = b->size;
 
-                free(u->answer);
-                u->answer = 0;
+        if (u->compression >= 0) {
+                r = compress_batch(u, b);
+                if (r < 0)
+                        return r;
+                compressed = r > 0;
         }
 
-        /* upload to this place */
-        code = curl_easy_setopt(u->easy, CURLOPT_URL, u->url);
-        if (code) {
-                log_error("curl_easy_setopt CURLOPT_URL failed: %s",
-                          curl_easy_strerror(code));
+        r = make_easy(u, compressed ? u->batch_header_compressed : u->batch_header,
+                      b->error, &b->answer, &b->easy);
+        if (r < 0)
+                return r;
+
+        easy_setopt(b->easy, CURLOPT_PRIVATE, b,
+                    LOG_ERR, return -EXFULL);
+
+        easy_setopt(b->easy, CURLOPT_POSTFIELDSIZE_LARGE, (curl_off_t) b->size,
+                    LOG_ERR, return -EXFULL);
+
+        easy_setopt(b->easy, CURLOPT_POSTFIELDS, b->data,
+                    LOG_ERR, return -EXFULL);
+
+        mcode = curl_multi_add_handle(u->multi, b->easy);
+        if (mcode != CURLM_OK) {
+                log_error("curl_multi_add_handle failed: %s", curl_multi_strerror(mcode));
                 return -EXFULL;
         }
 
-        u->uploading = true;
+        b->uploader = u;
+        LIST_APPEND(batches, u->batches, b);
+        u->n_batches++;
+
+        u->bytes_uncompressed += uncompressed;
+
+        log_debug("Sending batch of %zu entries, %zu bytes (%zu uncompressed), %u batches in flight.",
+                  b->n_entries, b->size, uncompressed, u->n_batches);
 
         return 0;
 }
 
+UploadBatch* batch_free(UploadBatch *b) {
+        if (!b)
+                return NULL;
+
+        if (b->uploader) {
+                LIST_REMOVE(batches, b->uploader->batches, b);
+                b->uploader->n_batches--;
+
+                if (b->easy)
+                        (void) curl_multi_remove_handle(b->uploader->multi, b->easy);
+        }
+
+        curl_easy_cleanup(b->easy);
+        free(b->answer);
+        free(b->data);
+        free(b->cursor);
+
+        return mfree(b);
+}
+
 static size_t fd_input_callback(void *buf, size_t size, size_t nmemb, void *userp) {
         Uploader *u = userp;
 
@@ -309,8 +490,10 @@ static size_t fd_input_callback(void *buf, size_t size, size_t nmemb, void *user
         r = read(u->input, buf, size * nmemb);
         log_debug("%s: allowed %zu, read %zd", __func__, size*nmemb, r);
 
-        if (r > 0)
+        if (r > 0) {
+                u->bytes_sent += r;
                 return r;
+        }
 
         u->uploading = false;
         if (r == 0) {
@@ -455,6 +638,16 @@ static int setup_uploader(Uploader *u, const char *url, const char *state_file)
 
         u->state_file = state_file;
 
+        /* Compression is applied to whole batches, hence it implies batching */
+        u->compression = arg_compression;
+        u->batch_size = arg_batch_size > 0 || arg_compression < 0 ? arg_batch_size : DEFAULT_BATCH_SIZE;
+        u->batches_max = MAX(arg_batches_in_flight, 1U);
+        if (u->batch_size > 0) {
+                r = setup_batches(u);
+                if (r < 0)
+                        return r;
+        }
+
         r = sd_event_default(&u->events);
         if (r < 0)
                 return log_error_errno(r, "sd_event_default failed: %m");
@@ -471,6 +664,12 @@ static int setup_uploader(Uploader *u, const char *url, const char *state_file)
 static void destroy_uploader(Uploader *u) {
         assert(u);
 
+        while (u->batches)
+                batch_free(u->batches);
+        curl_multi_cleanup(u->multi);
+        curl_slist_free_all(u->batch_header);
+        curl_slist_free_all(u->batch_header_compressed);
+
         curl_easy_cleanup(u->easy);
         curl_slist_free_all(u->header);
         free(u->answer);
@@ -490,25 +689,23 @@ static void destroy_uploader(Uploader *u) {
         sd_event_unref(u->events);
 }
 
-static int perform_upload(Uploader *u) {
-        CURLcode code;
+static int check_response(Uploader *u, CURL *easy, CURLcode code, const char *error, const char *answer) {
         long status;
 
         assert(u);
+        assert(easy);
 
-        u->watchdog_timestamp = now(CLOCK_MONOTONIC);
-        code = curl_easy_perform(u->easy);
         if (code) {
-                if (u->error[0])
+                if (error[0])
                         log_error("Upload to %s failed: %.*s",
-                                  u->url, (int) sizeof(u->error), u->error);
+                                  u->url, CURL_ERROR_SIZE, error);
                 else
                         log_error("Upload to %s failed: %s",
                                   u->url, curl_easy_strerror(code));
                 return -EIO;
         }
 
-        code = curl_easy_getinfo(u->easy, CURLINFO_RESPONSE_CODE, &status);
+        code = curl_easy_getinfo(easy, CURLINFO_RESPONSE_CODE, &status);
         if (code) {
                 log_error("Failed to retrieve response code: %s",
                           curl_easy_strerror(code));
@@ -517,27 +714,195 @@ static int perform_upload(Uploader *u) {
 
         if (status >= 300) {
                 log_error("Upload to %s failed with code %ld: %s",
-                          u->url, status, strna(u->answer));
+                          u->url, status, strna(answer));
                 return -EIO;
         } else if (status < 200) {
                 log_error("Upload to %s finished with unexpected code %ld: %s",
-                          u->url, status, strna(u->answer));
+                          u->url, status, strna(answer));
                 return -EIO;
         } else
                 log_debug("Upload finished successfully with code %ld: %s",
-                          status, strna(u->answer));
+                          status, strna(answer));
+
+        return 0;
+}
+
+static int perform_upload(Uploader *u) {
+        CURLcode code;
+        int r;
+
+        assert(u);
+
+        u->watchdog_timestamp = now(CLOCK_MONOTONIC);
+        code = curl_easy_perform(u->easy);
+
+        r = check_response(u, u->easy, code, u->error, u->answer);
+        if (r < 0)
+                return r;
 
         free_and_replace(u->last_cursor, u->current_cursor);
 
         return update_cursor_state(u);
 }
 
+static int finish_batches(Uploader *u) {
+        UploadBatch *b;
+        CURLMsg *msg;
+        int k, r, ret = 0;
+        bool done = false;
+
+        assert(u);
+
+        while ((msg = curl_multi_info_read(u->multi, &k))) {
+                char *p;
+
+                if (msg->msg != CURLMSG_DONE)
+                        continue;
+
+                assert_se(curl_easy_getinfo(msg->easy_handle, CURLINFO_PRIVATE, &p) == CURLE_OK);
+                b = (UploadBatch*) p;
+
+                /* Keep going after a failed batch, so that the cursor still moves past the batches before it
+                 * that did make it */
+                r = check_response(u, b->easy, msg->data.result, b->error, b->answer);
+                if (r < 0) {
+                        if (ret >= 0)
+                                ret = r;
+                        continue;
+                }
+
+                u->bytes_sent += b->size;
+                b->done = true;
+        }
+
+        /* Batches may finish in any order, but the cursor may only move past those that the server has, and
+         * everything before them */
+        while (u->batches && u->batches->done) {
+                b = u->batches;
+
+                log_debug("Batch of %zu entries has been uploaded.", b->n_entries);
+
+                free_and_replace(u->last_cursor, b->cursor);
+                batch_free(b);
+                done = true;
+        }
+
+        if (done) {
+                r = update_cursor_state(u);
+                if (r < 0 && ret >= 0)
+                        ret = r;
+        }
+
+        if (ret < 0)
+                return ret;
+
+        return done;
+}
+
+static int perform_batches(Uploader *u) {
+        struct curl_waitfd wfd = {
+                .events = CURL_WAIT_POLLIN,
+        };
+        CURLMcode mcode;
+        int running, n, r;
+
+        assert(u);
+
+        mcode = curl_multi_perform(u->multi, &running);
+        if (mcode != CURLM_OK) {
+                log_error("curl_multi_perform failed: %s", curl_multi_strerror(mcode));
+                return -EIO;
+        }
+
+        r = finish_batches(u);
+        if (r != 0)
+                return r;
+
+        /* Nothing happened yet, wait for the transfers, and for anything else the event loop is interested in */
+        wfd.fd = sd_event_get_fd(u->events);
+        if (wfd.fd < 0)
+                return wfd.fd;
+
+        mcode = curl_multi_wait(u->multi, &wfd, 1, 1000, &n);
+        if (mcode != CURLM_OK) {
+                log_error("curl_multi_wait failed: %s", curl_multi_strerror(mcode));
+                return -EIO;
+        }
+
+        return 0;
+}
+
+static int parse_compression(const char *s) {
+        int b;
+
+        b = parse_boolean(s);
+        if (b == 0)
+                return -1;
+#ifdef HAVE_ZSTD
+        if (b > 0 || streq(s, "zstd"))
+                return OBJECT_COMPRESSED_ZSTD;
+#endif
+#ifdef HAVE_LZ4
+        if (b > 0 || streq(s, "lz4"))
+                return OBJECT_COMPRESSED_LZ4;
+#endif
+        return -EINVAL;
+}
+
+static int config_parse_batch_size(const char* unit,
+                                   const char *filename,
+                                   unsigned line,
+                                   const char *section,
+                                   unsigned section_line,
+                                   const char *lvalue,
+                                   int ltype,
+                                   const char *rvalue,
+                                   void *data,
+                                   void *userdata) {
+        uint64_t v;
+        int r;
+
+        r = parse_size(rvalue, 1024, &v);
+        if (r < 0 || v > UPLOAD_BATCH_SIZE_MAX) {
+                log_syntax(unit, LOG_ERR, filename, line, r, "Failed to parse batch size, ignoring: %s", rvalue);
+                return 0;
+        }
+
+        arg_batch_size = v;
+        return 0;
+}
+
+static int config_parse_compression(const char* unit,
+                                    const char *filename,
+                                    unsigned line,
+                                    const char *section,
+                                    unsigned section_line,
+                                    const char *lvalue,
+                                    int ltype,
+                                    const char *rvalue,
+                                    void *data,
+                                    void *userdata) {
+        int c;
+
+        c = parse_compression(rvalue);
+        if (c == -EINVAL) {
+                log_syntax(unit, LOG_ERR, filename, line, c, "Unsupported compression, ignoring: %s", rvalue);
+                return 0;
+        }
+
+        arg_compression = c;
+        return 0;
+}
+
 static int parse_config(void) {
         const ConfigTableItem items[] = {
-                { "Upload",  "URL",                    config_parse_string, 0, &arg_url    },
-                { "Upload",  "ServerKeyFile",          config_parse_path,   0, &arg_key    },
-                { "Upload",  "ServerCertificateFile",  config_parse_path,   0, &arg_cert   },
-                { "Upload",  "TrustedCertificateFile", config_parse_path,   0, &arg_trust  },
+                { "Upload",  "URL",                    config_parse_string,      0, &arg_url                },
+                { "Upload",  "ServerKeyFile",          config_parse_path,        0, &arg_key                },
+                { "Upload",  "ServerCertificateFile",  config_parse_path,        0, &arg_cert               },
+                { "Upload",  "TrustedCertificateFile", config_parse_path,        0, &arg_trust              },
+                { "Upload",  "BatchSize",              config_parse_batch_size,  0, NULL                    },
+                { "Upload",  "BatchesInFlight",        config_parse_unsigned,    0, &arg_batches_in_flight  },
+                { "Upload",  "Compression",            config_parse_compression, 0, NULL                    },
                 {}};
 
         return config_parse_many_nulstr(PKGSYSCONFDIR "/journal-upload.conf",
@@ -570,6 +935,10 @@ static void help(void) {
                "     --follow[=BOOL]        Do [not] wait for input\n"
                "     --save-state[=FILE]    Save uploaded cursors (default \n"
                "                            " STATE_FILE ")\n"
+               "     --batch-size=BYTES     Upload journal entries in batches of this size\n"
+               "     --batches-in-flight=N  Send up to N batches before the first is acknowledged\n"
+               "                            (default: 4)\n"
+               "     --compress=zstd|lz4|no Compress batches (default: no)\n"
                "  -h --help                 Show this help and exit\n"
                "     --version              Print version string and exit\n"
                , program_invocation_short_name);
@@ -588,25 +957,31 @@ static int parse_argv(int argc, char *argv[]) {
                 ARG_AFTER_CURSOR,
                 ARG_FOLLOW,
                 ARG_SAVE_STATE,
+                ARG_BATCH_SIZE,
+                ARG_BATCHES_IN_FLIGHT,
+                ARG_COMPRESS,
         };
 
         static const struct option options[] = {
-                { "help",         no_argument,       NULL, 'h'                },
-                { "version",      no_argument,       NULL, ARG_VERSION        },
-                { "url",          required_argument, NULL, 'u'                },
-                { "key",          required_argument, NULL, ARG_KEY            },
-                { "cert",         required_argument, NULL, ARG_CERT           },
-                { "trust",        required_argument, NULL, ARG_TRUST          },
-                { "system",       no_argument,       NULL, ARG_SYSTEM         },
-                { "user",         no_argument,       NULL, ARG_USER           },
-                { "merge",        no_argument,       NULL, 'm'                },
-                { "machine",      required_argument, NULL, 'M'                },
-                { "directory",    required_argument, NULL, 'D'                },
-                { "file",         required_argument, NULL, ARG_FILE           },
-                { "cursor",       required_argument, NULL, ARG_CURSOR         },
-                { "after-cursor", required_argument, NULL, ARG_AFTER_CURSOR   },
-                { "follow",       optional_argument, NULL, ARG_FOLLOW         },
-                { "save-state",   optional_argument, NULL, ARG_SAVE_STATE     },
+                { "help",              no_argument,       NULL, 'h'                   },
+                { "version",           no_argument,       NULL, ARG_VERSION           },
+                { "url",               required_argument, NULL, 'u'                   },
+                { "key",               required_argument, NULL, ARG_KEY               },
+                { "cert",              required_argument, NULL, ARG_CERT              },
+                { "trust",             required_argument, NULL, ARG_TRUST             },
+                { "system",            no_argument,       NULL, ARG_SYSTEM            },
+                { "user",              no_argument,       NULL, ARG_USER              },
+                { "merge",             no_argument,       NULL, 'm'                   },
+                { "machine",           required_argument, NULL, 'M'                   },
+                { "directory",         required_argument, NULL, 'D'                   },
+                { "file",              required_argument, NULL, ARG_FILE              },
+                { "cursor",            required_argument, NULL, ARG_CURSOR            },
+                { "after-cursor",      required_argument, NULL, ARG_AFTER_CURSOR      },
+                { "follow",            optional_argument, NULL, ARG_FOLLOW            },
+                { "save-state",        optional_argument, NULL, ARG_SAVE_STATE        },
+                { "batch-size",        required_argument, NULL, ARG_BATCH_SIZE        },
+                { "batches-in-flight", required_argument, NULL, ARG_BATCHES_IN_FLIGHT },
+                { "compress",          required_argument, NULL, ARG_COMPRESS          },
                 {}
         };
 
@@ -735,6 +1110,36 @@ static int parse_argv(int argc, char *argv[]) {
                         arg_save_state = optarg ?: STATE_FILE;
                         break;
 
+                case ARG_BATCH_SIZE: {
+                        uint64_t v;
+
+                        r = parse_size(optarg, 1024, &v);
+                        if (r < 0 || v > UPLOAD_BATCH_SIZE_MAX) {
+                                log_error("Failed to parse --batch-size= parameter, maximum is %u bytes.",
+                                          UPLOAD_BATCH_SIZE_MAX);
+                                return -EINVAL;
+                        }
+
+                        arg_batch_size = v;
+                        break;
+                }
+
+                case ARG_BATCHES_IN_FLIGHT:
+                        r = safe_atou(optarg, &arg_batches_in_flight);
+                        if (r < 0 || arg_batches_in_flight == 0) {
+                                log_error("Failed to parse --batches-in-flight= parameter.");
+                                return -EINVAL;
+                        }
+                        break;
+
+                case ARG_COMPRESS:
+                        arg_compression = parse_compression(optarg);
+                        if (arg_compression == -EINVAL) {
+                                log_error("Unsupported compression: %s", optarg);
+                                return -EINVAL;
+                        }
+                        break;
+
                 case '?':
                         log_error("Unknown option %s.", argv[optind-1]);
                         return -EINVAL;
@@ -782,8 +1187,35 @@ static int open_journal(sd_journal **j) {
         return r;
 }
 
+static void log_uploaded(Uploader *u, usec_t start) {
+        char sent[FORMAT_BYTES_MAX], uncompressed[FORMAT_BYTES_MAX], elapsed[FORMAT_TIMESPAN_MAX];
+        usec_t t;
+
+        assert(u);
+
+        if (u->entries_sent == 0)
+                return;
+
+        t = now(CLOCK_MONOTONIC) - start;
+
+        if (u->batch_size > 0)
+                log_info("Uploaded %zu entries in %s, %.0f entries/s, %s sent (%s before compression).",
+                         u->entries_sent,
+                         format_timespan(elapsed, sizeof(elapsed), t, USEC_PER_MSEC),
+                         (double) u->entries_sent * USEC_PER_SEC / MAX(t, 1U),
+                         format_bytes(sent, sizeof(sent), u->bytes_sent),
+                         format_bytes(uncompressed, sizeof(uncompressed), u->bytes_uncompressed));
+        else
+                log_info("Uploaded %zu entries in %s, %.0f entries/s, %s sent.",
+                         u->entries_sent,
+                         format_timespan(elapsed, sizeof(elapsed), t, USEC_PER_MSEC),
+                         (double) u->entries_sent * USEC_PER_SEC / MAX(t, 1U),
+                         format_bytes(sent, sizeof(sent), u->bytes_sent));
+}
+
 int main(int argc, char **argv) {
         Uploader u;
+        usec_t start = 0;
         int r;
         bool use_journal;
 
@@ -831,6 +1263,8 @@ int main(int argc, char **argv) {
                   "READY=1\n"
                   "STATUS=Processing input...");
 
+        start = now(CLOCK_MONOTONIC);
+
         for (;;) {
                 r = sd_event_get_state(u.events);
                 if (r < 0)
@@ -839,10 +1273,11 @@ int main(int argc, char **argv) {
                         break;
 
                 if (use_journal) {
-                        if (!u.journal)
+                        if (!u.journal && u.n_batches == 0)
                                 break;
 
-                        r = check_journal_input(&u);
+                        if (u.journal)
+                                r = check_journal_input(&u);
                 } else if (u.input < 0 && !use_journal) {
                         if (optind >= argc)
                                 break;
@@ -859,7 +1294,15 @@ int main(int argc, char **argv) {
                                 break;
                 }
 
-                r = sd_event_run(u.events, u.timeout);
+                if (u.n_batches > 0) {
+                        r = perform_batches(&u);
+                        if (r < 0)
+                                break;
+                }
+
+                /* While batches are in flight, we wait for them, and only look at events that are already
+                 * pending. Entries left behind are sent as soon as there is room for another batch. */
+                r = sd_event_run(u.events, u.n_batches > 0 || u.backlog ? 0 : u.timeout);
                 if (r < 0) {
                         log_error_errno(r, "Failed to run event loop: %m");
                         break;
@@ -871,6 +1314,8 @@ cleanup:
                   "STOPPING=1\n"
                   "STATUS=Shutting down...");
 
+        log_uploaded(&u, start);
+
         destroy_uploader(&u);
 
 finish:
@@ -4,6 +4,7 @@
 
 #include "sd-event.h"
 #include "sd-journal.h"
+#include "list.h"
 #include "time-util.h"
 
 typedef enum {
@@ -20,7 +21,29 @@ typedef enum {
         ENTRY_DONE,                 /* Need to move to a new field. */
 } entry_state;
 
-typedef struct Uploader {
+typedef struct Uploader Uploader;
+typedef struct UploadBatch UploadBatch;
+
+/* A number of complete entries in export format, sent as a request of its own */
+struct UploadBatch {
+        Uploader *uploader;
+
+        CURL *easy;
+        char error[CURL_ERROR_SIZE];
+        char *answer;
+
+        char *data;
+        size_t size, allocated;
+        size_t n_entries;
+
+        /* The cursor of the last entry, saved once this and all earlier batches are acknowledged */
+        char *cursor;
+        bool done;
+
+        LIST_FIELDS(UploadBatch, batches);
+};
+
+struct Uploader {
         sd_event *events;
         sd_event_source *sigint_event, *sigterm_event;
 
@@ -44,23 +67,40 @@ typedef struct Uploader {
         const void *field_data;
         size_t field_pos, field_length;
 
+        /* batches, used for journal input if batch_size is set */
+        size_t batch_size;
+        unsigned batches_max;
+        int compression;
+        CURLM *multi;
+        struct curl_slist *batch_header, *batch_header_compressed;
+        LIST_HEAD(UploadBatch, batches);
+        unsigned n_batches;
+        bool backlog;
+
         /* general metrics */
         const char *state_file;
 
         size_t entries_sent;
+        uint64_t bytes_sent, bytes_uncompressed;
         char *last_cursor, *current_cursor;
         usec_t watchdog_timestamp;
         usec_t watchdog_usec;
-} Uploader;
+};
 
 #define JOURNAL_UPLOAD_POLL_TIMEOUT (10 * USEC_PER_SEC)
 
+/* The largest batch systemd-journal-remote accepts, compressed or not */
+#define UPLOAD_BATCH_SIZE_MAX (64U*1024U*1024U)
+
 int start_upload(Uploader *u,
                  size_t (*input_callback)(void *ptr,
                                           size_t size,
                                           size_t nmemb,
                                           void *userdata),
                  void *data);
+int start_batch(Uploader *u, UploadBatch *b);
+UploadBatch* batch_free(UploadBatch *b);
+DEFINE_TRIVIAL_CLEANUP_FUNC(UploadBatch*, batch_free);
 
 int open_journal_for_upload(Uploader *u,
                             sd_journal *j,
@@ -1,12 +1,19 @@
 #!/usr/bin/env python3
 import sys
 import argparse
+import socket
+import threading
+import time
 
 PARSER = argparse.ArgumentParser()
 PARSER.add_argument('n', type=int)
 PARSER.add_argument('--dots', action='store_true')
 PARSER.add_argument('--data-size', type=int, default=4000)
 PARSER.add_argument('--data-type', choices={'random', 'simple'})
+PARSER.add_argument('--connect', metavar='HOST:PORT',
+                    help='send the entries to systemd-journal-remote --listen-raw= instead of printing them')
+PARSER.add_argument('--uploaders', type=int, default=1,
+                    help='with --connect, the number of concurrent connections, each sending n entries')
 OPTIONS = PARSER.parse_args()
 
 template = """\
@@ -41,34 +48,74 @@ src = open('/dev/urandom', 'rb')
 bytes = 0
 counter = 0
 
-for i in range(OPTIONS.n):
-    message = repr(src.read(2000))
-    if OPTIONS.data_type == 'random':
-        data = repr(src.read(OPTIONS.data_size))
-    else:
-        # keep the pattern non-repeating so we get a different blob every time
-        data = '{:0{}}'.format(counter, OPTIONS.data_size)
-        counter += 1
-
-    entry = template.format(m=m,
-                            realtime_ts=realtime_ts,
-                            monotonic_ts=monotonic_ts,
-                            source_realtime_ts=source_realtime_ts,
-                            priority=priority,
-                            facility=facility,
-                            message=message,
-                            data=data)
-    m += 1
-    realtime_ts += 1
-    monotonic_ts += 1
-    source_realtime_ts += 1
-
-    bytes += len(entry)
+def generate(n):
+    global m, realtime_ts, monotonic_ts, source_realtime_ts, bytes, counter
 
-    print(entry)
+    for i in range(n):
+        message = repr(src.read(2000))
+        if OPTIONS.data_type == 'random':
+            data = repr(src.read(OPTIONS.data_size))
+        else:
+            # keep the pattern non-repeating so we get a different blob every time
+            data = '{:0{}}'.format(counter, OPTIONS.data_size)
+            counter += 1
+
+        entry = template.format(m=m,
+                                realtime_ts=realtime_ts,
+                                monotonic_ts=monotonic_ts,
+                                source_realtime_ts=source_realtime_ts,
+                                priority=priority,
+                                facility=facility,
+                                message=message,
+                                data=data)
+        m += 1
+        realtime_ts += 1
+        monotonic_ts += 1
+        source_realtime_ts += 1
+
+        bytes += len(entry)
+
+        yield entry
+
+        if OPTIONS.dots:
+            print('.', file=sys.stderr, end='', flush=True)
+
+def upload(address, payload):
+    with socket.create_connection(address) as sock:
+        sock.sendall(payload)
+        sock.shutdown(socket.SHUT_WR)
+        # journal-remote closes the connection once it has processed everything
+        while sock.recv(4096):
+            pass
 
+if OPTIONS.connect:
+    host, port = OPTIONS.connect.rsplit(':', 1)
+    address = (host, int(port))
+
+    # Generate everything first, so that only sending is measured
+    payloads = [''.join(entry + '\n' for entry in generate(OPTIONS.n)).encode()
+                for i in range(OPTIONS.uploaders)]
     if OPTIONS.dots:
-        print('.', file=sys.stderr, end='', flush=True)
+        print(file=sys.stderr)
+
+    threads = [threading.Thread(target=upload, args=(address, payload))
+               for payload in payloads]
+
+    start = time.monotonic()
+    for thread in threads:
+        thread.start()
+    for thread in threads:
+        thread.join()
+    elapsed = time.monotonic() - start
+
+    entries = OPTIONS.n * OPTIONS.uploaders
+    print('Sent {} entries ({} bytes) over {} connections in {:.2f}s, {:.0f} entries/s'
+          .format(entries, bytes, OPTIONS.uploaders, elapsed, entries / elapsed),
+          file=sys.stderr)
+    sys.exit(0)
+
+for entry in generate(OPTIONS.n):
+    print(entry)
 
 if OPTIONS.dots:
     print(file=sys.stderr)
@@ -49,6 +49,11 @@
 #  define MHD_USE_POLL_INTERNAL_THREAD MHD_USE_POLL_INTERNALLY
 #endif
 
+/* Renamed in µhttpd 0.9.59 */
+#ifndef MHD_USE_SUSPEND_RESUME
+#  define MHD_ALLOW_SUSPEND_RESUME MHD_USE_SUSPEND_RESUME
+#endif
+
 /* Both the old and new names are defines, check for the new one. */
 
 /* Compatiblity with libmicrohttpd < 0.9.38 */
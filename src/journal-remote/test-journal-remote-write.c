@@ -0,0 +1,93 @@
+/***
+  This file is part of systemd.
+
+  systemd is free software; you can redistribute it and/or modify it
+  under the terms of the GNU Lesser General Public License as published by
+  the Free Software Foundation; either version 2.1 of the License, or
+  (at your option) any later version.
+
+  systemd is distributed in the hope that it will be useful, but
+  WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+  Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public License
+  along with systemd; If not, see <http://www.gnu.org/licenses/>.
+***/
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "alloc-util.h"
+#include "journal-remote-write.h"
+#include "log.h"
+#include "rm-rf.h"
+#include "string-util.h"
+#include "util.h"
+
+static int write_entry(Writer *w, const char *message, size_t size) {
+        struct iovec iovec = { .iov_base = (char*) message, .iov_len = size };
+        struct iovec_wrapper iovw = { .iovec = &iovec, .size_bytes = 1, .count = 1 };
+        dual_timestamp ts;
+
+        dual_timestamp_get(&ts);
+
+        return writer_write(w, &iovw, &ts, false, false);
+}
+
+static void test_writer_thread_error(void) {
+        char dn[] = "/var/tmp/test-journal-remote-write-XXXXXX";
+        _cleanup_free_ char *big = NULL;
+        Writer *w;
+        const char *p;
+        unsigned i;
+        int r;
+
+        assert_se(mkdtemp(dn));
+        p = strjoina(dn, "/test.journal");
+
+        w = writer_new(NULL);
+        assert_se(w);
+
+        /* Entries larger than the file may grow make appending fail */
+        w->metrics.max_size = 512 * 1024;
+        assert_se(journal_file_open(-1, p, O_RDWR|O_CREAT, 0644, false, false, &w->metrics, w->mmap, NULL, NULL, &w->journal) >= 0);
+        assert_se(writer_start_thread(w, false, false) >= 0);
+
+        assert_se(write_entry(w, "MESSAGE=first", strlen("MESSAGE=first")) > 0);
+
+        /* Without the directory, the rotation after the failed append fails too */
+        assert_se(rm_rf(dn, REMOVE_ROOT|REMOVE_PHYSICAL) >= 0);
+
+        big = malloc(1024 * 1024);
+        assert_se(big);
+        memcpy(big, "MESSAGE=", strlen("MESSAGE="));
+        memset(big + strlen("MESSAGE="), 'x', 1024 * 1024 - strlen("MESSAGE="));
+
+        /* The entry is only queued, the thread fails to write it later */
+        assert_se(write_entry(w, big, 1024 * 1024) > 0);
+
+        for (i = 0; (r = writer_get_error(w)) == 0; i++) {
+                assert_se(i < 1000);
+                usleep(10 * USEC_PER_MSEC);
+        }
+
+        log_info_errno(r, "Writer thread failed: %m");
+
+        /* The error sticks, and is returned for all entries from now on */
+        assert_se(writer_queue_full(w) == false);
+        assert_se(write_entry(w, "MESSAGE=second", strlen("MESSAGE=second")) == r);
+        assert_se(writer_get_error(w) == r);
+
+        writer_unref(w);
+}
+
+int main(int argc, char *argv[]) {
+        log_set_max_level(LOG_DEBUG);
+        log_parse_environment();
+        log_open();
+
+        test_writer_thread_error();
+
+        return 0;
+}
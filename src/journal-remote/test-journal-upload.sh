@@ -0,0 +1,67 @@
+#!/bin/bash -eu
+
+# Uploads a journal file with systemd-journal-upload to systemd-journal-remote, streamed and in batches with
+# each of the given compressions, and checks that all entries arrive.
+#
+# Usage: test-journal-upload.sh UPLOAD REMOTE JOURNALCTL [COMPRESSION...]
+
+upload="$1"
+remote="$2"
+journalctl="$3"
+shift 3
+
+d="$(mktemp -d --tmpdir test-journal-upload.XXXXXX)"
+pid=
+cleanup() {
+        [ -z "$pid" ] || kill "$pid" 2>/dev/null || :
+        rm -rf "$d"
+}
+trap cleanup EXIT
+
+# The input file, large enough for a number of batches
+for i in $(seq 4000); do
+        printf '__REALTIME_TIMESTAMP=%d\n__MONOTONIC_TIMESTAMP=%d\n_BOOT_ID=3b0a9a1a1f0c4cd7a6cc6e1a2c0e1f2d\nMESSAGE=Message number %d, which is padded to compress a bit: %080d\n\n' \
+               $((1500000000000000 + i)) $((1000000 + i)) $i $i
+done | "$remote" --output="$d/in.journal" --split-mode=none -
+"$journalctl" --file="$d/in.journal" -o cat >"$d/in.txt"
+[ "$(wc -l <"$d/in.txt")" -eq 4000 ]
+
+port=$((20000 + RANDOM % 20000))
+"$remote" --output="$d/out.journal" --split-mode=none --listen-http="127.0.0.1:$port" &
+pid=$!
+
+for i in $(seq 100); do
+        (exec 3<>"/dev/tcp/127.0.0.1/$port") 2>/dev/null && break
+        sleep 0.1
+done
+
+runs=0
+for compress in "" "$@"; do
+        rm -f "$d/state"
+
+        if [ -z "$compress" ]; then
+                echo "Uploading streamed"
+                "$upload" --url="http://127.0.0.1:$port" --file="$d/in.journal" --follow=no \
+                          --save-state="$d/state"
+        else
+                echo "Uploading in batches with --compress=$compress"
+                "$upload" --url="http://127.0.0.1:$port" --file="$d/in.journal" --follow=no \
+                          --save-state="$d/state" --batch-size=16K --compress="$compress"
+        fi
+
+        # The cursor of the last entry is saved once everything was acknowledged
+        grep -q "^LAST_CURSOR=$("$journalctl" --file="$d/in.journal" -n1 -o export | sed -n 's/^__CURSOR=//p')\$" "$d/state"
+
+        runs=$((runs + 1))
+done
+
+kill "$pid"
+wait "$pid"
+pid=
+
+for i in $(seq $runs); do
+        cat "$d/in.txt"
+done | sort >"$d/expected.txt"
+"$journalctl" --file="$d/out.journal" -o cat | sort >"$d/out.txt"
+
+cmp "$d/expected.txt" "$d/out.txt"
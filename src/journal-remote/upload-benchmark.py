@@ -0,0 +1,176 @@
+#!/usr/bin/env python3
+# Uploads a journal file to systemd-journal-remote over the loopback interface, once streamed and once for
+# each set of batching options, and reports the bytes on the wire and the entries per second.
+#
+# The upload goes through a proxy, which counts the bytes, and may limit their rate and hold back the
+# answers of the server to simulate a slower link.
+
+import argparse
+import os
+import re
+import socket
+import subprocess
+import sys
+import tempfile
+import threading
+import time
+from http.server import BaseHTTPRequestHandler, ThreadingHTTPServer
+
+PARSER = argparse.ArgumentParser()
+PARSER.add_argument('file', help='the journal file to upload')
+PARSER.add_argument('--upload', default='systemd-journal-upload',
+                    help='the systemd-journal-upload binary')
+PARSER.add_argument('--remote', default='systemd-journal-remote',
+                    help='the systemd-journal-remote binary')
+PARSER.add_argument('--sink', action='store_true',
+                    help='accept and discard the uploads instead of running systemd-journal-remote')
+PARSER.add_argument('--rtt', type=float, default=0,
+                    help='simulated round trip time in ms')
+PARSER.add_argument('--rate', type=float, default=0,
+                    help='simulated upload bandwidth in Mbit/s')
+PARSER.add_argument('--batch-size', default='1M')
+PARSER.add_argument('--batches-in-flight', type=int, default=4)
+PARSER.add_argument('--compress', action='append', default=[],
+                    help='compression to measure, may be repeated (default: zstd)')
+OPTIONS = PARSER.parse_args()
+
+def nodelay(sock):
+    # Don't let the proxy and the sink hold back the small answers
+    sock.setsockopt(socket.IPPROTO_TCP, socket.TCP_NODELAY, 1)
+
+class Sink(BaseHTTPRequestHandler):
+    protocol_version = 'HTTP/1.1'
+
+    def setup(self):
+        super().setup()
+        nodelay(self.connection)
+
+    def do_POST(self):
+        if 'Content-Length' in self.headers:
+            self.rfile.read(int(self.headers['Content-Length']))
+        else:
+            while True:
+                size = int(self.rfile.readline(), 16)
+                self.rfile.read(size + 2)
+                if size == 0:
+                    break
+
+        self.send_response(202)
+        self.send_header('Content-Length', '3')
+        self.end_headers()
+        self.wfile.write(b'OK.')
+
+    def log_message(self, *args):
+        pass
+
+class Proxy:
+    def __init__(self, upstream, rtt, rate):
+        self.upstream = upstream
+        self.rtt = rtt / 1000
+        self.rate = rate * 1000000 / 8
+        self.free = 0
+        self.sent = 0
+        self.lock = threading.Lock()
+        self.sock = socket.socket()
+        self.sock.bind(('127.0.0.1', 0))
+        self.sock.listen(64)
+        self.port = self.sock.getsockname()[1]
+        threading.Thread(target=self.accept, daemon=True).start()
+
+    def accept(self):
+        while True:
+            client, _ = self.sock.accept()
+            server = socket.create_connection(self.upstream)
+            nodelay(client)
+            nodelay(server)
+            threading.Thread(target=self.forward, args=(client, server, True), daemon=True).start()
+            threading.Thread(target=self.forward, args=(server, client, False), daemon=True).start()
+
+    def forward(self, src, dst, count):
+        while True:
+            data = src.recv(65536)
+            if not data:
+                break
+            if count:
+                with self.lock:
+                    self.sent += len(data)
+                    # All connections share the bandwidth
+                    self.free = max(self.free, time.monotonic()) + len(data) / (self.rate or float('inf'))
+                    delay = self.free - time.monotonic()
+                if delay > 0:
+                    time.sleep(delay)
+            elif self.rtt:
+                # The whole round trip is charged to the answers, the requests are forwarded right away
+                time.sleep(self.rtt)
+            dst.sendall(data)
+        try:
+            dst.shutdown(socket.SHUT_WR)
+        except OSError:
+            pass
+
+def start_server(directory):
+    if OPTIONS.sink:
+        server = ThreadingHTTPServer(('127.0.0.1', 0), Sink)
+        threading.Thread(target=server.serve_forever, daemon=True).start()
+        return None, server.server_address[1]
+
+    sock = socket.socket()
+    sock.bind(('127.0.0.1', 0))
+    port = sock.getsockname()[1]
+    sock.close()
+
+    remote = subprocess.Popen([OPTIONS.remote,
+                               '--listen-http=127.0.0.1:{}'.format(port),
+                               '--split-mode=none',
+                               '--output={}/remote.journal'.format(directory)])
+    for i in range(100):
+        try:
+            socket.create_connection(('127.0.0.1', port)).close()
+            break
+        except OSError:
+            time.sleep(0.1)
+    return remote, port
+
+def upload(proxy, options):
+    sent = proxy.sent
+    start = time.monotonic()
+    result = subprocess.run([OPTIONS.upload,
+                             '--url=http://127.0.0.1:{}'.format(proxy.port),
+                             '--file={}'.format(OPTIONS.file),
+                             '--follow=no'] + options,
+                            env=dict(os.environ, SYSTEMD_LOG_TARGET='console'),
+                            stderr=subprocess.PIPE, universal_newlines=True, check=True)
+    elapsed = time.monotonic() - start
+
+    m = re.search(r'Uploaded (\d+) entries', result.stderr)
+    entries = int(m.group(1)) if m else 0
+
+    return entries, proxy.sent - sent, elapsed
+
+def main():
+    variants = [('streamed', [])]
+    for batches in sorted({1, OPTIONS.batches_in_flight}):
+        variants.append(('{} batch{} in flight'.format(batches, '' if batches == 1 else 'es'),
+                         ['--batch-size={}'.format(OPTIONS.batch_size),
+                          '--batches-in-flight={}'.format(batches)]))
+    for compression in OPTIONS.compress or ['zstd']:
+        variants.append(('{}, {} in flight'.format(compression, OPTIONS.batches_in_flight),
+                         ['--batch-size={}'.format(OPTIONS.batch_size),
+                          '--batches-in-flight={}'.format(OPTIONS.batches_in_flight),
+                          '--compress={}'.format(compression)]))
+
+    with tempfile.TemporaryDirectory() as directory:
+        remote, port = start_server(directory)
+        proxy = Proxy(('127.0.0.1', port), OPTIONS.rtt, OPTIONS.rate)
+
+        try:
+            print('{:24} {:>10} {:>14} {:>12}'.format('', 'entries', 'bytes sent', 'entries/s'))
+            for name, options in variants:
+                entries, sent, elapsed = upload(proxy, options)
+                print('{:24} {:>10} {:>14} {:>12.0f}'.format(name, entries, sent, entries / elapsed))
+        finally:
+            if remote:
+                remote.terminate()
+                remote.wait()
+
+main()
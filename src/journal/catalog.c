@@ -20,9 +20,11 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <locale.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <string.h>
 #include <sys/mman.h>
+#include <sys/stat.h>
 #include <unistd.h>
 
 #include "sd-id128.h"
@@ -41,6 +43,7 @@
 #include "strbuf.h"
 #include "string-util.h"
 #include "strv.h"
+#include "time-util.h"
 #include "util.h"
 
 const char * const catalog_file_dirs[] = {
@@ -51,6 +54,16 @@ const char * const catalog_file_dirs[] = {
 
 #define CATALOG_SIGNATURE (uint8_t[]) { 'R', 'H', 'H', 'H', 'K', 'S', 'L', 'P' }
 
+/* How often a process checks whether the database it has mapped was replaced */
+#define CATALOG_RECHECK_USEC (1*USEC_PER_SEC)
+
+/* Give up on the hash table rather than searching displacements forever */
+#define CATALOG_HASH_DISPLACEMENT_MAX (1U << 20)
+
+enum {
+        CATALOG_COMPATIBLE_HASH_TABLE = 1 << 0,
+};
+
 typedef struct CatalogHeader {
         uint8_t signature[8];  /* "RHHHKSLP" */
         le32_t compatible_flags;
@@ -58,8 +71,29 @@ typedef struct CatalogHeader {
         le64_t header_size;
         le64_t n_items;
         le64_t catalog_item_size;
+
+        /* Added with CATALOG_COMPATIBLE_HASH_TABLE: a perfect hash of the items, as n_hash_buckets displacements
+         * followed by n_hash_slots item indices plus one, all le32_t. Readers that don't know about it bisect
+         * the items, which are still sorted. */
+        le64_t hash_table_offset;
+        le64_t n_hash_buckets;
+        le64_t n_hash_slots;
 } CatalogHeader;
 
+typedef struct CatalogCache {
+        char *database;
+        void *p;
+        struct stat st;
+        usec_t checked;
+} CatalogCache;
+
+/* The database last used by a thread is kept mapped for it, and unmapped when the thread exits */
+static pthread_key_t catalog_cache_key;
+static pthread_once_t catalog_cache_once = PTHREAD_ONCE_INIT;
+static bool catalog_cache_key_valid = false;
+
+static void catalog_cache_drop(const char *database);
+
 typedef struct CatalogItem {
         sd_id128_t id;
         char language[32];
@@ -92,6 +126,124 @@ const struct hash_ops catalog_hash_ops = {
         .compare = catalog_compare_func
 };
 
+static uint64_t catalog_item_fingerprint(const CatalogItem *i) {
+        uint64_t f;
+        size_t k;
+
+        /* Message IDs are random already, so this only needs to be cheap and the same on all architectures,
+         * as the hash table is part of the database. */
+        f = le64toh(i->id.qwords[0]) ^ (le64toh(i->id.qwords[1]) * UINT64_C(0x9e3779b97f4a7c15));
+        for (k = 0; k < sizeof(i->language) && i->language[k]; k++)
+                f = (f ^ (uint8_t) i->language[k]) * UINT64_C(0x100000001b3);
+
+        return f;
+}
+
+static uint64_t catalog_hash(uint64_t fingerprint, uint32_t seed) {
+        uint64_t h = fingerprint ^ (seed * UINT64_C(0x9e3779b97f4a7c15));
+
+        /* The finalizer of MurmurHash3 */
+        h ^= h >> 33;
+        h *= UINT64_C(0xff51afd7ed558ccd);
+        h ^= h >> 33;
+        h *= UINT64_C(0xc4ceb9fe1a85ec53);
+        h ^= h >> 33;
+
+        return h;
+}
+
+static bool place_bucket(const uint64_t *fingerprints, const size_t *bucket, size_t n_bucket, uint32_t d,
+                         const le32_t *slots, size_t n_slots, size_t *chosen) {
+        size_t k, l;
+
+        /* Checks whether the displacement d puts all items of the bucket into distinct free slots */
+
+        for (k = 0; k < n_bucket; k++) {
+                chosen[k] = catalog_hash(fingerprints[bucket[k]], d) % n_slots;
+
+                if (slots[chosen[k]] != 0)
+                        return false;
+
+                for (l = 0; l < k; l++)
+                        if (chosen[l] == chosen[k])
+                                return false;
+        }
+
+        return true;
+}
+
+static int build_hash_table(const CatalogItem *items, size_t n, le32_t **ret, size_t *ret_n_buckets, size_t *ret_n_slots) {
+        _cleanup_free_ size_t *bucket_of = NULL, *start = NULL, *fill = NULL, *by_bucket = NULL, *chosen = NULL;
+        _cleanup_free_ uint64_t *fingerprints = NULL;
+        _cleanup_free_ le32_t *table = NULL;
+        size_t n_buckets, n_slots, max_size = 0, size, b, k;
+        le32_t *slots;
+
+        /* "Hash and displace": the items are spread over buckets by one hash, and for each bucket, largest
+         * first, we look for the seed of a second hash that puts all of its items into free slots. Looking an
+         * item up then takes two hashes and a single comparison. */
+
+        if (n >= UINT32_MAX)
+                return -E2BIG;
+
+        n_buckets = n / 4 + 1;
+        n_slots = n + n / 4 + 1;
+
+        table = new0(le32_t, n_buckets + n_slots);
+        fingerprints = new(uint64_t, n);
+        bucket_of = new(size_t, n);
+        start = new0(size_t, n_buckets + 1);
+        fill = new(size_t, n_buckets);
+        by_bucket = new(size_t, n);
+        if (!table || !fingerprints || !bucket_of || !start || !fill || !by_bucket)
+                return -ENOMEM;
+
+        slots = table + n_buckets;
+
+        /* Sort the items by bucket */
+        for (k = 0; k < n; k++) {
+                fingerprints[k] = catalog_item_fingerprint(items + k);
+                bucket_of[k] = catalog_hash(fingerprints[k], 0) % n_buckets;
+                start[bucket_of[k] + 1]++;
+        }
+
+        for (b = 0; b < n_buckets; b++) {
+                max_size = MAX(max_size, start[b + 1]);
+                start[b + 1] += start[b];
+                fill[b] = start[b];
+        }
+
+        for (k = 0; k < n; k++)
+                by_bucket[fill[bucket_of[k]]++] = k;
+
+        chosen = new(size_t, max_size);
+        if (!chosen)
+                return -ENOMEM;
+
+        for (size = max_size; size > 0; size--)
+                for (b = 0; b < n_buckets; b++) {
+                        uint32_t d;
+
+                        if (start[b + 1] - start[b] != size)
+                                continue;
+
+                        for (d = 1; !place_bucket(fingerprints, by_bucket + start[b], size, d, slots, n_slots, chosen); d++)
+                                if (d >= CATALOG_HASH_DISPLACEMENT_MAX)
+                                        return -E2BIG;
+
+                        table[b] = htole32(d);
+                        for (k = 0; k < size; k++)
+                                slots[chosen[k]] = htole32(by_bucket[start[b] + k] + 1);
+                }
+
+        *ret = table;
+        table = NULL;
+        *ret_n_buckets = n_buckets;
+        *ret_n_slots = n_slots;
+
+        return 0;
+}
+
 static bool next_header(const char **s) {
         const char *e;
 
@@ -391,8 +543,11 @@ int catalog_import_file(Hashmap *h, const char *path) {
 }
 
 static int64_t write_catalog(const char *database, struct strbuf *sb,
-                             CatalogItem *items, size_t n) {
+                             CatalogItem *items, size_t n,
+                             const le32_t *table, size_t n_buckets, size_t n_slots) {
+        static const uint8_t padding[8] = {};
         CatalogHeader header;
+        uint64_t offset;
         _cleanup_fclose_ FILE *w = NULL;
         int r;
         _cleanup_free_ char *d, *p = NULL;
@@ -417,6 +572,15 @@ static int64_t write_catalog(const char *database, struct strbuf *sb,
         header.catalog_item_size = htole64(sizeof(CatalogItem));
         header.n_items = htole64(n);
 
+        /* The hash table follows the strings */
+        offset = ALIGN_TO(sizeof(CatalogHeader), 8) + n * sizeof(CatalogItem) + sb->len;
+        if (table) {
+                header.compatible_flags = htole32(CATALOG_COMPATIBLE_HASH_TABLE);
+                header.hash_table_offset = htole64(ALIGN_TO(offset, 8));
+                header.n_hash_buckets = htole64(n_buckets);
+                header.n_hash_slots = htole64(n_slots);
+        }
+
         r = -EIO;
 
         k = fwrite(&header, 1, sizeof(header), w);
@@ -437,6 +601,14 @@ static int64_t write_catalog(const char *database, struct strbuf *sb,
                 goto error;
         }
 
+        if (table) {
+                if (fwrite(padding, 1, ALIGN_TO(offset, 8) - offset, w) != ALIGN_TO(offset, 8) - offset ||
+                    fwrite(table, sizeof(le32_t), n_buckets + n_slots, w) != n_buckets + n_slots) {
+                        log_error("%s: failed to write hash table.", p);
+                        goto error;
+                }
+        }
+
         r = fflush_and_check(w);
         if (r < 0) {
                 log_error_errno(r, "%s: failed to write database: %m", p);
@@ -463,6 +635,8 @@ int catalog_update(const char* database, const char* root, const char* const* di
         struct strbuf *sb = NULL;
         _cleanup_hashmap_free_free_free_ Hashmap *h = NULL;
         _cleanup_free_ CatalogItem *items = NULL;
+        _cleanup_free_ le32_t *table = NULL;
+        size_t n_buckets = 0, n_slots = 0;
         ssize_t offset;
         char *payload;
         CatalogItem *i;
@@ -526,7 +700,15 @@ int catalog_update(const char* database, const char* root, const char* const* di
 
         strbuf_complete(sb);
 
-        sz = write_catalog(database, sb, items, n);
+        r = build_hash_table(items, n, &table, &n_buckets, &n_slots);
+        if (r == -ENOMEM) {
+                log_oom();
+                goto finish;
+        }
+        if (r < 0)
+                log_warning_errno(r, "Failed to build hash table of catalog, readers will bisect it: %m");
+
+        sz = write_catalog(database, sb, items, n, table, n_buckets, n_slots);
         if (sz < 0)
                 r = log_error_errno(sz, "Failed to write %s: %m", database);
         else {
@@ -538,6 +720,9 @@ int catalog_update(const char* database, const char* root, const char* const* di
 finish:
         strbuf_cleanup(sb);
 
+        /* Don't keep using the database we just replaced */
+        catalog_cache_drop(database);
+
         return r;
 }
 
@@ -560,7 +745,7 @@ static int open_mmap(const char *database, int *_fd, struct stat *_st, void **_p
                 return -errno;
         }
 
-        if (st.st_size < (off_t) sizeof(CatalogHeader)) {
+        if (st.st_size < (off_t) offsetof(CatalogHeader, hash_table_offset)) {
                 safe_close(fd);
                 return -EINVAL;
         }
@@ -573,14 +758,29 @@ static int open_mmap(const char *database, int *_fd, struct stat *_st, void **_p
 
         h = p;
         if (memcmp(h->signature, CATALOG_SIGNATURE, sizeof(h->signature)) != 0 ||
-            le64toh(h->header_size) < sizeof(CatalogHeader) ||
+            le64toh(h->header_size) < offsetof(CatalogHeader, hash_table_offset) ||
             le64toh(h->catalog_item_size) < sizeof(CatalogItem) ||
             h->incompatible_flags != 0 ||
             le64toh(h->n_items) <= 0 ||
-            st.st_size < (off_t) (le64toh(h->header_size) + le64toh(h->catalog_item_size) * le64toh(h->n_items))) {
-                safe_close(fd);
-                munmap(p, st.st_size);
-                return -EBADMSG;
+            st.st_size < (off_t) (le64toh(h->header_size) + le64toh(h->catalog_item_size) * le64toh(h->n_items)))
+                goto fail;
+
+        if (le32toh(h->compatible_flags) & CATALOG_COMPATIBLE_HASH_TABLE) {
+                uint64_t offset, n;
+
+                if (le64toh(h->header_size) < sizeof(CatalogHeader))
+                        goto fail;
+
+                offset = le64toh(h->hash_table_offset);
+                n = le64toh(h->n_hash_buckets) + le64toh(h->n_hash_slots);
+
+                if (le64toh(h->n_hash_buckets) <= 0 ||
+                    le64toh(h->n_hash_slots) <= 0 ||
+                    n < le64toh(h->n_hash_slots) ||
+                    offset % sizeof(le32_t) != 0 ||
+                    offset > (uint64_t) st.st_size ||
+                    ((uint64_t) st.st_size - offset) / sizeof(le32_t) < n)
+                        goto fail;
         }
 
         *_fd = fd;
@@ -588,11 +788,41 @@ static int open_mmap(const char *database, int *_fd, struct stat *_st, void **_p
         *_p = p;
 
         return 0;
+
+fail:
+        safe_close(fd);
+        munmap(p, st.st_size);
+        return -EBADMSG;
 }
 
-static const char *find_id(void *p, sd_id128_t id) {
-        CatalogItem key, *f = NULL;
+static const CatalogItem *find_item(const void *p, const CatalogItem *key) {
         const CatalogHeader *h = p;
+        const uint8_t *items = (const uint8_t*) p + le64toh(h->header_size);
+
+        if (le32toh(h->compatible_flags) & CATALOG_COMPATIBLE_HASH_TABLE) {
+                const le32_t *table = (const le32_t*) ((const uint8_t*) p + le64toh(h->hash_table_offset));
+                uint64_t n_buckets = le64toh(h->n_hash_buckets), f;
+                const CatalogItem *i;
+                uint32_t d, k;
+
+                f = catalog_item_fingerprint(key);
+                d = le32toh(table[catalog_hash(f, 0) % n_buckets]);
+                k = le32toh(table[n_buckets + catalog_hash(f, d) % le64toh(h->n_hash_slots)]);
+                if (k <= 0 || k > le64toh(h->n_items))
+                        return NULL;
+
+                /* Keys that are not in the table land on some other item, or none */
+                i = (const CatalogItem*) (items + (k - 1) * le64toh(h->catalog_item_size));
+                return catalog_compare_func(key, i) == 0 ? i : NULL;
+        }
+
+        return bsearch(key, items, le64toh(h->n_items), le64toh(h->catalog_item_size), catalog_compare_func);
+}
+
+static const char *find_id(const void *p, sd_id128_t id) {
+        const CatalogItem *f = NULL;
+        const CatalogHeader *h = p;
+        CatalogItem key;
         const char *loc;
 
         zero(key);
@@ -603,21 +833,21 @@ static const char *find_id(void *p, sd_id128_t id) {
                 strncpy(key.language, loc, sizeof(key.language));
                 key.language[strcspn(key.language, ".@")] = 0;
 
-                f = bsearch(&key, (const uint8_t*) p + le64toh(h->header_size), le64toh(h->n_items), le64toh(h->catalog_item_size), catalog_compare_func);
+                f = find_item(p, &key);
                 if (!f) {
                         char *e;
 
                         e = strchr(key.language, '_');
                         if (e) {
                                 *e = 0;
-                                f = bsearch(&key, (const uint8_t*) p + le64toh(h->header_size), le64toh(h->n_items), le64toh(h->catalog_item_size), catalog_compare_func);
+                                f = find_item(p, &key);
                         }
                 }
         }
 
         if (!f) {
                 zero(key.language);
-                f = bsearch(&key, (const uint8_t*) p + le64toh(h->header_size), le64toh(h->n_items), le64toh(h->catalog_item_size), catalog_compare_func);
+                f = find_item(p, &key);
         }
 
         if (!f)
@@ -629,40 +859,151 @@ static const char *find_id(void *p, sd_id128_t id) {
                 le64toh(f->offset);
 }
 
-int catalog_get(const char* database, sd_id128_t id, char **_text) {
+static void catalog_cache_flush(CatalogCache *c) {
+        assert(c);
+
+        if (c->p)
+                munmap(c->p, c->st.st_size);
+
+        c->p = NULL;
+        c->database = mfree(c->database);
+        c->checked = 0;
+}
+
+static void catalog_cache_free(void *p) {
+        CatalogCache *c = p;
+
+        if (!c)
+                return;
+
+        catalog_cache_flush(c);
+        free(c);
+}
+
+static void catalog_cache_key_create(void) {
+        catalog_cache_key_valid = pthread_key_create(&catalog_cache_key, catalog_cache_free) == 0;
+}
+
+static CatalogCache* catalog_cache_of_thread(bool create) {
+        CatalogCache *c;
+
+        assert_se(pthread_once(&catalog_cache_once, catalog_cache_key_create) == 0);
+        if (!catalog_cache_key_valid)
+                return NULL;
+
+        c = pthread_getspecific(catalog_cache_key);
+        if (c || !create)
+                return c;
+
+        c = new0(CatalogCache, 1);
+        if (!c)
+                return NULL;
+
+        if (pthread_setspecific(catalog_cache_key, c) != 0) {
+                free(c);
+                return NULL;
+        }
+
+        return c;
+}
+
+static void catalog_cache_drop(const char *database) {
+        CatalogCache *c;
+
+        c = catalog_cache_of_thread(false);
+        if (c && c->database && streq(c->database, database))
+                catalog_cache_flush(c);
+}
+
+static int catalog_cache_get(const char *database, const void **ret) {
         _cleanup_close_ int fd = -1;
-        void *p = NULL;
-        struct stat st = {};
-        char *text = NULL;
+        CatalogCache *c;
+        struct stat st;
+        usec_t n;
+        void *p;
         int r;
-        const char *s;
 
-        assert(_text);
+        /* Keep the database mapped rather than mapping it for each lookup, but notice when it is replaced */
+
+        c = catalog_cache_of_thread(true);
+        if (!c)
+                return -ENOMEM;
+
+        n = now(CLOCK_MONOTONIC);
+
+        if (c->p && streq(c->database, database)) {
+                if (c->checked + CATALOG_RECHECK_USEC > n) {
+                        *ret = c->p;
+                        return 0;
+                }
+
+                /* catalog_update() replaces the file rather than writing to it */
+                if (stat(database, &st) >= 0 &&
+                    st.st_dev == c->st.st_dev &&
+                    st.st_ino == c->st.st_ino) {
+                        c->checked = n;
+                        *ret = c->p;
+                        return 0;
+                }
+        }
+
+        catalog_cache_flush(c);
 
         r = open_mmap(database, &fd, &st, &p);
         if (r < 0)
                 return r;
 
-        s = find_id(p, id);
-        if (!s) {
-                r = -ENOENT;
-                goto finish;
+        c->database = strdup(database);
+        if (!c->database) {
+                munmap(p, st.st_size);
+                return -ENOMEM;
         }
 
-        text = strdup(s);
-        if (!text) {
-                r = -ENOMEM;
-                goto finish;
-        }
+        c->p = p;
+        c->st = st;
+        c->checked = n;
 
-        *_text = text;
-        r = 0;
+        *ret = p;
+        return 0;
+}
 
-finish:
-        if (p)
-                munmap(p, st.st_size);
+int catalog_find(const char* database, sd_id128_t id, const char **ret) {
+        const void *p;
+        const char *s;
+        int r;
 
-        return r;
+        assert(database);
+        assert(ret);
+
+        r = catalog_cache_get(database, &p);
+        if (r < 0)
+                return r;
+
+        s = find_id(p, id);
+        if (!s)
+                return -ENOENT;
+
+        *ret = s;
+        return 0;
+}
+
+int catalog_get(const char* database, sd_id128_t id, char **_text) {
+        const char *s;
+        char *text;
+        int r;
+
+        assert(_text);
+
+        r = catalog_find(database, id, &s);
+        if (r < 0)
+                return r;
+
+        text = strdup(s);
+        if (!text)
+                return -ENOMEM;
+
+        *_text = text;
+        return 0;
 }
 
 static char *find_header(const char *s, const char *header) {
@@ -18,6 +18,7 @@
 ***/
 
 #include <inttypes.h>
+#include <pthread.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/mman.h>
@@ -32,6 +33,12 @@
 #include <lz4frame.h>
 #endif
 
+#ifdef HAVE_ZSTD
+#include <zdict.h>
+#include <zstd.h>
+#include <zstd_errors.h>
+#endif
+
 #include "alloc-util.h"
 #include "compress.h"
 #include "fd-util.h"
@@ -48,11 +55,104 @@ DEFINE_TRIVIAL_CLEANUP_FUNC(LZ4F_compressionContext_t, LZ4F_freeCompressionConte
 DEFINE_TRIVIAL_CLEANUP_FUNC(LZ4F_decompressionContext_t, LZ4F_freeDecompressionContext);
 #endif
 
+#ifdef HAVE_ZSTD
+/* Journal fields are mostly short, hence favour speed over ratio */
+#define ZSTD_COMPRESSION_LEVEL 1
+
+/* Setting up a compression or decompression context is expensive compared
+ * to compressing a short field, hence keep one of each around per thread.
+ * They are freed by the key's destructor when the thread exits. */
+typedef struct ZstdContexts {
+        ZSTD_CCtx *cctx;
+        ZSTD_DCtx *dctx;
+} ZstdContexts;
+
+static pthread_key_t zstd_contexts_key;
+static pthread_once_t zstd_contexts_once = PTHREAD_ONCE_INIT;
+static bool zstd_contexts_key_valid = false;
+
+static void zstd_contexts_free(void *p) {
+        ZstdContexts *c = p;
+
+        if (!c)
+                return;
+
+        ZSTD_freeCCtx(c->cctx);
+        ZSTD_freeDCtx(c->dctx);
+        free(c);
+}
+
+static void zstd_contexts_key_create(void) {
+        zstd_contexts_key_valid = pthread_key_create(&zstd_contexts_key, zstd_contexts_free) == 0;
+}
+
+static ZstdContexts* zstd_get_contexts(void) {
+        ZstdContexts *c;
+
+        assert_se(pthread_once(&zstd_contexts_once, zstd_contexts_key_create) == 0);
+        if (!zstd_contexts_key_valid)
+                return NULL;
+
+        c = pthread_getspecific(zstd_contexts_key);
+        if (c)
+                return c;
+
+        c = new0(ZstdContexts, 1);
+        if (!c)
+                return NULL;
+
+        if (pthread_setspecific(zstd_contexts_key, c) != 0) {
+                free(c);
+                return NULL;
+        }
+
+        return c;
+}
+
+static ZSTD_CCtx* zstd_get_cctx(void) {
+        ZstdContexts *c;
+
+        c = zstd_get_contexts();
+        if (!c)
+                return NULL;
+
+        if (!c->cctx)
+                c->cctx = ZSTD_createCCtx();
+
+        return c->cctx;
+}
+
+static ZSTD_DCtx* zstd_get_dctx(void) {
+        ZstdContexts *c;
+
+        c = zstd_get_contexts();
+        if (!c)
+                return NULL;
+
+        if (!c->dctx)
+                c->dctx = ZSTD_createDCtx();
+
+        return c->dctx;
+}
+
+static int zstd_ret_to_errno(size_t ret) {
+        switch (ZSTD_getErrorCode(ret)) {
+        case ZSTD_error_dstSize_tooSmall:
+                return -ENOBUFS;
+        case ZSTD_error_memory_allocation:
+                return -ENOMEM;
+        default:
+                return -EBADMSG;
+        }
+}
+#endif
+
 #define ALIGN_8(l) ALIGN_TO(l, sizeof(size_t))
 
 static const char* const object_compressed_table[_OBJECT_COMPRESSED_MAX] = {
         [OBJECT_COMPRESSED_XZ] = "XZ",
         [OBJECT_COMPRESSED_LZ4] = "LZ4",
+        [OBJECT_COMPRESSED_ZSTD] = "ZSTD",
 };
 
 DEFINE_STRING_TABLE_LOOKUP(object_compressed, int);
@@ -129,6 +229,128 @@ int compress_blob_lz4(const void *src, uint64_t src_size,
 #endif
 }
 
+int compress_blob_zstd(const void *src, uint64_t src_size,
+                       void *dst, size_t dst_alloc_size, size_t *dst_size) {
+        return compress_blob_zstd_dictionary(src, src_size, dst, dst_alloc_size, dst_size, NULL);
+}
+
+int compress_blob_zstd_dictionary(const void *src, uint64_t src_size,
+                                  void *dst, size_t dst_alloc_size, size_t *dst_size,
+                                  CompressDictionary *dict) {
+#ifdef HAVE_ZSTD
+        ZSTD_CCtx *c;
+        size_t k;
+
+        assert(src);
+        assert(src_size > 0);
+        assert(dst);
+        assert(dst_alloc_size > 0);
+        assert(dst_size);
+
+        /* Returns < 0 if we couldn't compress the data or the
+         * compressed result is longer than the original */
+
+        c = zstd_get_cctx();
+        if (!c)
+                return -ENOMEM;
+
+        if (dict) {
+                if (!dict->cdict) {
+                        dict->cdict = ZSTD_createCDict(dict->data, dict->size, ZSTD_COMPRESSION_LEVEL);
+                        if (!dict->cdict)
+                                return -ENOMEM;
+                }
+
+                k = ZSTD_compress_usingCDict(c, dst, dst_alloc_size, src, src_size, dict->cdict);
+        } else
+                k = ZSTD_compressCCtx(c, dst, dst_alloc_size, src, src_size, ZSTD_COMPRESSION_LEVEL);
+        if (ZSTD_isError(k))
+                return zstd_ret_to_errno(k);
+
+        *dst_size = k;
+        return 0;
+#else
+        return -EPROTONOSUPPORT;
+#endif
+}
+
+int compress_dictionary_new(const void *data, size_t size, CompressDictionary **ret) {
+#ifdef HAVE_ZSTD
+        _cleanup_(compress_dictionary_freep) CompressDictionary *d = NULL;
+        unsigned id;
+
+        assert(data);
+        assert(ret);
+
+        /* We rely on the dictionary ID stored in compressed frames to tell
+         * which of them need the dictionary, hence refuse raw content. */
+        id = ZSTD_getDictID_fromDict(data, size);
+        if (id == 0)
+                return -EINVAL;
+
+        d = new0(CompressDictionary, 1);
+        if (!d)
+                return -ENOMEM;
+
+        d->data = memdup(data, size);
+        if (!d->data)
+                return -ENOMEM;
+
+        d->size = size;
+        d->id = id;
+
+        *ret = d;
+        d = NULL;
+
+        return 0;
+#else
+        return -EPROTONOSUPPORT;
+#endif
+}
+
+CompressDictionary* compress_dictionary_free(CompressDictionary *d) {
+        if (!d)
+                return NULL;
+
+#ifdef HAVE_ZSTD
+        ZSTD_freeCDict(d->cdict);
+        ZSTD_freeDDict(d->ddict);
+#endif
+        free(d->data);
+
+        return mfree(d);
+}
+
+int compress_dictionary_train(const void *samples, const size_t *sample_sizes, unsigned n_samples,
+                              size_t max_size, void **ret, size_t *ret_size) {
+#ifdef HAVE_ZSTD
+        _cleanup_free_ void *buf = NULL;
+        size_t k;
+
+        assert(samples);
+        assert(sample_sizes);
+        assert(max_size > 0);
+        assert(ret);
+        assert(ret_size);
+
+        buf = malloc(max_size);
+        if (!buf)
+                return -ENOMEM;
+
+        k = ZDICT_trainFromBuffer(buf, max_size, samples, sample_sizes, n_samples);
+        if (ZDICT_isError(k))
+                /* Most likely there weren't enough or not varied enough samples */
+                return -ENODATA;
+
+        *ret = buf;
+        *ret_size = k;
+        buf = NULL;
+
+        return 0;
+#else
+        return -EPROTONOSUPPORT;
+#endif
+}
 
 int decompress_blob_xz(const void *src, uint64_t src_size,
                        void **dst, size_t *dst_alloc_size, size_t* dst_size, size_t dst_max) {
@@ -230,15 +452,148 @@ int decompress_blob_lz4(const void *src, uint64_t src_size,
 #endif
 }
 
+#ifdef HAVE_ZSTD
+static int zstd_get_ddict(const void *src, uint64_t src_size, CompressDictionary *dict, const ZSTD_DDict **ret) {
+        unsigned id;
+
+        /* Frames compressed with a dictionary carry its ID */
+        id = ZSTD_getDictID_fromFrame(src, src_size);
+        if (id == 0) {
+                *ret = NULL;
+                return 0;
+        }
+
+        if (!dict || dict->id != id)
+                return -EBADMSG;
+
+        if (!dict->ddict) {
+                dict->ddict = ZSTD_createDDict(dict->data, dict->size);
+                if (!dict->ddict)
+                        return -ENOMEM;
+        }
+
+        *ret = dict->ddict;
+        return 0;
+}
+
+static int zstd_decompress_partial(const void *src, uint64_t src_size,
+                                   void *dst, size_t dst_size, size_t *ret_size,
+                                   const ZSTD_DDict *ddict) {
+        ZSTD_inBuffer input = {
+                .src = src,
+                .size = src_size,
+        };
+        ZSTD_outBuffer output = {
+                .dst = dst,
+                .size = dst_size,
+        };
+        ZSTD_DCtx *d;
+        size_t k;
+
+        /* Decompresses at most dst_size bytes from the start of the frame */
+
+        d = zstd_get_dctx();
+        if (!d)
+                return -ENOMEM;
+
+        k = ZSTD_DCtx_reset(d, ZSTD_reset_session_only);
+        if (ZSTD_isError(k))
+                return zstd_ret_to_errno(k);
+
+        k = ZSTD_DCtx_refDDict(d, ddict);
+        if (ZSTD_isError(k))
+                return zstd_ret_to_errno(k);
+
+        while (output.pos < output.size) {
+                k = ZSTD_decompressStream(d, &output, &input);
+                if (ZSTD_isError(k))
+                        return zstd_ret_to_errno(k);
+                if (k == 0)
+                        break;
+                if (input.pos >= input.size && output.pos < output.size)
+                        return -EBADMSG;
+        }
+
+        *ret_size = output.pos;
+        return 0;
+}
+
+static int decompress_blob_zstd_internal(const void *src, uint64_t src_size,
+                                         void **dst, size_t *dst_alloc_size, size_t* dst_size, size_t dst_max,
+                                         CompressDictionary *dict) {
+        const ZSTD_DDict *ddict;
+        unsigned long long size;
+        ZSTD_DCtx *d;
+        size_t k;
+        int r;
+
+        assert(src);
+        assert(src_size > 0);
+        assert(dst);
+        assert(dst_alloc_size);
+        assert(dst_size);
+        assert(*dst_alloc_size == 0 || *dst);
+
+        size = ZSTD_getFrameContentSize(src, src_size);
+        if (IN_SET(size, ZSTD_CONTENTSIZE_ERROR, ZSTD_CONTENTSIZE_UNKNOWN))
+                return -EBADMSG;
+
+        if (dst_max > 0 && size > dst_max)
+                size = dst_max;
+        if (size > SIZE_MAX)
+                return -E2BIG;
+
+        r = zstd_get_ddict(src, src_size, dict, &ddict);
+        if (r < 0)
+                return r;
+
+        if (!greedy_realloc(dst, dst_alloc_size, MAX(size, 1U), 1))
+                return -ENOMEM;
+
+        if (dst_max > 0 && size == dst_max)
+                /* Only the beginning was asked for, don't bother with the rest */
+                return zstd_decompress_partial(src, src_size, *dst, size, dst_size, ddict);
+
+        d = zstd_get_dctx();
+        if (!d)
+                return -ENOMEM;
+
+        k = ZSTD_decompress_usingDDict(d, *dst, size, src, src_size, ddict);
+        if (ZSTD_isError(k))
+                return zstd_ret_to_errno(k);
+        if (k != size)
+                return -EBADMSG;
+
+        *dst_size = size;
+        return 0;
+}
+#endif
+
+int decompress_blob_zstd(const void *src, uint64_t src_size,
+                         void **dst, size_t *dst_alloc_size, size_t* dst_size, size_t dst_max) {
+#ifdef HAVE_ZSTD
+        return decompress_blob_zstd_internal(src, src_size, dst, dst_alloc_size, dst_size, dst_max, NULL);
+#else
+        return -EPROTONOSUPPORT;
+#endif
+}
+
 int decompress_blob(int compression,
                     const void *src, uint64_t src_size,
-                    void **dst, size_t *dst_alloc_size, size_t* dst_size, size_t dst_max) {
+                    void **dst, size_t *dst_alloc_size, size_t* dst_size, size_t dst_max,
+                    CompressDictionary *dict) {
         if (compression == OBJECT_COMPRESSED_XZ)
                 return decompress_blob_xz(src, src_size,
                                           dst, dst_alloc_size, dst_size, dst_max);
         else if (compression == OBJECT_COMPRESSED_LZ4)
                 return decompress_blob_lz4(src, src_size,
                                            dst, dst_alloc_size, dst_size, dst_max);
+#ifdef HAVE_ZSTD
+        else if (compression == OBJECT_COMPRESSED_ZSTD)
+                return decompress_blob_zstd_internal(src, src_size,
+                                                     dst, dst_alloc_size, dst_size, dst_max,
+                                                     dict);
+#endif
         else
                 return -EBADMSG;
 }
@@ -352,11 +707,66 @@ int decompress_startswith_lz4(const void *src, uint64_t src_size,
 #endif
 }
 
+#ifdef HAVE_ZSTD
+static int decompress_startswith_zstd_internal(const void *src, uint64_t src_size,
+                                               void **buffer, size_t *buffer_size,
+                                               const void *prefix, size_t prefix_len,
+                                               uint8_t extra,
+                                               CompressDictionary *dict) {
+        const ZSTD_DDict *ddict;
+        size_t size;
+        int r;
+
+        /* Checks whether the decompressed blob starts with the
+         * mentioned prefix. The byte extra needs to follow the
+         * prefix */
+
+        assert(src);
+        assert(src_size > 0);
+        assert(buffer);
+        assert(buffer_size);
+        assert(prefix);
+        assert(*buffer_size == 0 || *buffer);
+
+        r = zstd_get_ddict(src, src_size, dict, &ddict);
+        if (r < 0)
+                return r;
+
+        if (!(greedy_realloc(buffer, buffer_size, ALIGN_8(prefix_len + 1), 1)))
+                return -ENOMEM;
+
+        r = zstd_decompress_partial(src, src_size, *buffer, prefix_len + 1, &size, ddict);
+        if (r < 0)
+                return r;
+
+        if (size >= prefix_len + 1)
+                return memcmp(*buffer, prefix, prefix_len) == 0 &&
+                        ((const uint8_t*) *buffer)[prefix_len] == extra;
+        else
+                return 0;
+}
+#endif
+
+int decompress_startswith_zstd(const void *src, uint64_t src_size,
+                               void **buffer, size_t *buffer_size,
+                               const void *prefix, size_t prefix_len,
+                               uint8_t extra) {
+#ifdef HAVE_ZSTD
+        return decompress_startswith_zstd_internal(src, src_size,
+                                                   buffer, buffer_size,
+                                                   prefix, prefix_len,
+                                                   extra, NULL);
+#else
+        return -EPROTONOSUPPORT;
+#endif
+}
+
 int decompress_startswith(int compression,
                           const void *src, uint64_t src_size,
                           void **buffer, size_t *buffer_size,
                           const void *prefix, size_t prefix_len,
-                          uint8_t extra) {
+                          uint8_t extra,
+                          CompressDictionary *dict) {
         if (compression == OBJECT_COMPRESSED_XZ)
                 return decompress_startswith_xz(src, src_size,
                                                 buffer, buffer_size,
@@ -367,6 +777,13 @@ int decompress_startswith(int compression,
                                                  buffer, buffer_size,
                                                  prefix, prefix_len,
                                                  extra);
+#ifdef HAVE_ZSTD
+        else if (compression == OBJECT_COMPRESSED_ZSTD)
+                return decompress_startswith_zstd_internal(src, src_size,
+                                                           buffer, buffer_size,
+                                                           prefix, prefix_len,
+                                                           extra, dict);
+#endif
         else
                 return -EBADMSG;
 }
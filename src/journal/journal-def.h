@@ -42,6 +42,7 @@ typedef struct EntryObject EntryObject;
 typedef struct HashTableObject HashTableObject;
 typedef struct EntryArrayObject EntryArrayObject;
 typedef struct TagObject TagObject;
+typedef struct DictionaryObject DictionaryObject;
 
 typedef struct EntryItem EntryItem;
 typedef struct HashItem HashItem;
@@ -58,6 +59,7 @@ typedef enum ObjectType {
         OBJECT_FIELD_HASH_TABLE,
         OBJECT_ENTRY_ARRAY,
         OBJECT_TAG,
+        OBJECT_DICTIONARY,
         _OBJECT_TYPE_MAX
 } ObjectType;
 
@@ -65,10 +67,11 @@ typedef enum ObjectType {
 enum {
         OBJECT_COMPRESSED_XZ = 1 << 0,
         OBJECT_COMPRESSED_LZ4 = 1 << 1,
+        OBJECT_COMPRESSED_ZSTD = 1 << 2,
         _OBJECT_COMPRESSED_MAX
 };
 
-#define OBJECT_COMPRESSION_MASK (OBJECT_COMPRESSED_XZ | OBJECT_COMPRESSED_LZ4)
+#define OBJECT_COMPRESSION_MASK (OBJECT_COMPRESSED_XZ | OBJECT_COMPRESSED_LZ4 | OBJECT_COMPRESSED_ZSTD)
 
 struct ObjectHeader {
         uint8_t type;
@@ -137,6 +140,13 @@ struct TagObject {
         uint8_t tag[TAG_LENGTH]; /* SHA-256 HMAC */
 } _packed_;
 
+/* A zstd dictionary, referenced from the header, which zstd compressed
+ * data objects may have been compressed with */
+struct DictionaryObject {
+        ObjectHeader object;
+        uint8_t payload[];
+} _packed_;
+
 union Object {
         ObjectHeader object;
         DataObject data;
@@ -145,6 +155,7 @@ union Object {
         HashTableObject hash_table;
         EntryArrayObject entry_array;
         TagObject tag;
+        DictionaryObject dictionary;
 };
 
 enum {
@@ -158,19 +169,33 @@ enum {
 enum {
         HEADER_INCOMPATIBLE_COMPRESSED_XZ = 1 << 0,
         HEADER_INCOMPATIBLE_COMPRESSED_LZ4 = 1 << 1,
+        HEADER_INCOMPATIBLE_COMPRESSED_ZSTD = 1 << 2,
+        HEADER_INCOMPATIBLE_KEYED_HASH = 1 << 3,
 };
 
-#define HEADER_INCOMPATIBLE_ANY (HEADER_INCOMPATIBLE_COMPRESSED_XZ|HEADER_INCOMPATIBLE_COMPRESSED_LZ4)
+#define HEADER_INCOMPATIBLE_ANY \
+        (HEADER_INCOMPATIBLE_COMPRESSED_XZ|HEADER_INCOMPATIBLE_COMPRESSED_LZ4|HEADER_INCOMPATIBLE_COMPRESSED_ZSTD| \
+         HEADER_INCOMPATIBLE_KEYED_HASH)
 
-#if defined(HAVE_XZ) && defined(HAVE_LZ4)
-#  define HEADER_INCOMPATIBLE_SUPPORTED HEADER_INCOMPATIBLE_ANY
-#elif defined(HAVE_XZ)
-#  define HEADER_INCOMPATIBLE_SUPPORTED HEADER_INCOMPATIBLE_COMPRESSED_XZ
-#elif defined(HAVE_LZ4)
-#  define HEADER_INCOMPATIBLE_SUPPORTED HEADER_INCOMPATIBLE_COMPRESSED_LZ4
+#ifdef HAVE_XZ
+#  define HEADER_INCOMPATIBLE_SUPPORTED_XZ HEADER_INCOMPATIBLE_COMPRESSED_XZ
 #else
-#  define HEADER_INCOMPATIBLE_SUPPORTED 0
+#  define HEADER_INCOMPATIBLE_SUPPORTED_XZ 0
 #endif
+#ifdef HAVE_LZ4
+#  define HEADER_INCOMPATIBLE_SUPPORTED_LZ4 HEADER_INCOMPATIBLE_COMPRESSED_LZ4
+#else
+#  define HEADER_INCOMPATIBLE_SUPPORTED_LZ4 0
+#endif
+#ifdef HAVE_ZSTD
+#  define HEADER_INCOMPATIBLE_SUPPORTED_ZSTD HEADER_INCOMPATIBLE_COMPRESSED_ZSTD
+#else
+#  define HEADER_INCOMPATIBLE_SUPPORTED_ZSTD 0
+#endif
+
+#define HEADER_INCOMPATIBLE_SUPPORTED \
+        (HEADER_INCOMPATIBLE_SUPPORTED_XZ|HEADER_INCOMPATIBLE_SUPPORTED_LZ4|HEADER_INCOMPATIBLE_SUPPORTED_ZSTD| \
+         HEADER_INCOMPATIBLE_KEYED_HASH)
 
 enum {
         HEADER_COMPATIBLE_SEALED = 1
@@ -216,8 +241,10 @@ struct Header {
         /* Added in 189 */
         le64_t n_tags;
         le64_t n_entry_arrays;
+        /* Added in 235 */
+        le64_t dictionary_offset;
 
-        /* Size: 240 */
+        /* Size: 248 */
 } _packed_;
 
 #define FSS_HEADER_SIGNATURE ((char[]) { 'K', 'S', 'H', 'H', 'R', 'H', 'L', 'P' })
@@ -22,6 +22,7 @@
 #include <linux/fs.h>
 #include <pthread.h>
 #include <stddef.h>
+#include <sys/eventfd.h>
 #include <sys/mman.h>
 #include <sys/statvfs.h>
 #include <sys/uio.h>
@@ -31,10 +32,14 @@
 #include "btrfs-util.h"
 #include "chattr-util.h"
 #include "compress.h"
+#include "env-util.h"
 #include "fd-util.h"
 #include "journal-authenticate.h"
 #include "journal-def.h"
 #include "journal-file.h"
+#include "journal-summary.h"
+#include "keyed-hash.h"
+#include "list.h"
 #include "lookup3.h"
 #include "parse-util.h"
 #include "path-util.h"
@@ -50,6 +55,20 @@
 
 #define COMPRESSION_SIZE_THRESHOLD (512ULL)
 
+/* With a dictionary even short payloads compress well */
+#define DICTIONARY_COMPRESSION_SIZE_THRESHOLD (64ULL)
+
+/* How large a dictionary to train, and how many payloads to collect for that. zstd suggests
+ * about a hundred times the dictionary size in total as training input. */
+#define DICTIONARY_SIZE_MAX (16U*1024U)
+#define DICTIONARY_SAMPLES_MAX 4096U
+#define DICTIONARY_SAMPLES_SIZE_MAX (1024U*1024U)
+#define DICTIONARY_SAMPLE_SIZE_MAX (4U*1024U)
+
+/* How many times a dictionary is carried over to the file replacing the one it was trained for. The last
+ * file using it collects payloads again, and its successor gets a new dictionary trained from them. */
+#define DICTIONARY_CARRY_OVER_MAX 8U
+
 /* This is the minimum journal file size */
 #define JOURNAL_FILE_SIZE_MIN (512ULL*1024ULL)                 /* 512 KiB */
 
@@ -90,6 +109,76 @@
 /* The mmap context to use for the header we pick as one above the last defined typed */
 #define CONTEXT_HEADER _OBJECT_TYPE_MAX
 
+/* How many threads to offline journal files with at max */
+#define OFFLINE_THREADS_MAX 4
+
+/* How long an offline thread waits for more work before it exits */
+#define OFFLINE_THREAD_IDLE_USEC (10*USEC_PER_SEC)
+
+/* Journal files are offlined asynchronously by a pool of threads shared by all files of the process, so
+ * that syncing many files at once neither creates a thread per file, nor syncs them one after the other.
+ * The same threads train compression dictionaries, when no file is waiting to be offlined. Everything in
+ * here is protected by the mutex, as are the offline_pending, offline_queue and offline_latency_usec
+ * fields of each JournalFile, and those about dictionary training. */
+static struct {
+        pthread_mutex_t mutex;
+        pthread_cond_t queued;
+        pthread_cond_t done;
+
+        LIST_HEAD(JournalFile, queue);
+#ifdef HAVE_ZSTD
+        LIST_HEAD(JournalFile, training_queue);
+#endif
+        unsigned n_queued;
+        unsigned n_threads;
+        unsigned n_idle;
+
+        int notify_fd;
+} offline_pool = {
+        .mutex = PTHREAD_MUTEX_INITIALIZER,
+        .queued = PTHREAD_COND_INITIALIZER,
+        .done = PTHREAD_COND_INITIALIZER,
+        .notify_fd = -1,
+};
+
+typedef struct ChainIndexItem {
+        uint64_t array; /* the array */
+        uint64_t begin; /* the first item in the array */
+        uint64_t total; /* the total number of items in all arrays before this one in the chain */
+} ChainIndexItem;
+
+typedef struct ChainCacheItem {
+        uint64_t first; /* the array at the beginning of the chain */
+        uint64_t array; /* the cached array */
+        uint64_t begin; /* the first item in the cached array */
+        uint64_t total; /* the total number of items in all arrays before this one in the chain */
+        uint64_t last_index; /* the last index we looked at, to optimize locality when bisecting */
+
+        /* All arrays of the chain we walked through so far, in order. Arrays are only ever appended to
+         * the end of a chain and never move, hence this index never needs to be invalidated, only
+         * extended. It allows us to find the right array with a bisection over the arrays, instead of
+         * walking the chain array by array. */
+        ChainIndexItem *index;
+        size_t n_index, n_index_allocated;
+} ChainCacheItem;
+
+static ChainCacheItem* chain_cache_item_free(ChainCacheItem *ci) {
+        if (!ci)
+                return NULL;
+
+        free(ci->index);
+        return mfree(ci);
+}
+
+static void chain_cache_free(OrderedHashmap *h) {
+        ChainCacheItem *ci;
+
+        while ((ci = ordered_hashmap_steal_first(h)))
+                chain_cache_item_free(ci);
+
+        ordered_hashmap_free(h);
+}
+
 /* This may be called from a separate thread to prevent blocking the caller for the duration of fsync().
  * As a result we use atomic operations on f->offline_state for inter-thread communications with
  * journal_file_set_offline() and journal_file_set_online(). */
@@ -116,6 +205,16 @@ static void journal_file_set_offline_internal(JournalFile *f) {
                         break;
 
                 case OFFLINE_SYNCING:
+                        if (f->archive) {
+                                int r;
+
+                                /* The file won't be written to anymore, let's leave a summary of it behind for
+                                 * readers. This is just an optimization, hence don't fail if it doesn't work. */
+                                r = journal_file_write_summary(f);
+                                if (r < 0)
+                                        log_debug_errno(r, "Failed to write summary of %s, ignoring: %m", f->path);
+                        }
+
                         (void) fsync(f->fd);
 
                         if (!__sync_bool_compare_and_swap(&f->offline_state, OFFLINE_SYNCING, OFFLINE_OFFLINING))
@@ -140,25 +239,254 @@ static void journal_file_set_offline_internal(JournalFile *f) {
         }
 }
 
-static void * journal_file_set_offline_thread(void *arg) {
-        JournalFile *f = arg;
+#ifdef HAVE_ZSTD
+static void journal_file_train_dictionary(JournalFile *f) {
+        _cleanup_free_ void *dict = NULL;
+        char ts[FORMAT_TIMESPAN_MAX];
+        size_t size;
+        usec_t start;
+        int r;
+
+        assert(f);
+
+        /* Called in an offline thread, without the mutex held. The payloads are not touched by anyone else
+         * while the training is pending. */
+
+        start = now(CLOCK_MONOTONIC);
+
+        r = compress_dictionary_train(f->dictionary_samples, f->dictionary_sample_sizes, f->n_dictionary_samples,
+                                      DICTIONARY_SIZE_MAX, &dict, &size);
+        if (r < 0) {
+                log_debug_errno(r, "Failed to train compression dictionary from payloads of %s, ignoring: %m", f->path);
+                return;
+        }
+
+        log_debug("Trained compression dictionary of %zu bytes from %u payloads of %s in %s.",
+                  size, f->n_dictionary_samples, f->path,
+                  format_timespan(ts, sizeof(ts), now(CLOCK_MONOTONIC) - start, 0));
+
+        assert_se(pthread_mutex_lock(&offline_pool.mutex) == 0);
+        f->dictionary_trained = dict;
+        f->dictionary_trained_size = size;
+        assert_se(pthread_mutex_unlock(&offline_pool.mutex) == 0);
+
+        dict = NULL;
+}
+#endif
+
+static void *journal_file_offline_thread(void *arg) {
+        assert_se(pthread_mutex_lock(&offline_pool.mutex) == 0);
+
+        for (;;) {
+                JournalFile *f;
+                usec_t n;
+
+                f = offline_pool.queue;
 
-        journal_file_set_offline_internal(f);
+#ifdef HAVE_ZSTD
+                /* Offlining is what callers may wait for, hence dictionaries are trained only in between */
+                if (!f && offline_pool.training_queue) {
+                        f = offline_pool.training_queue;
+                        LIST_REMOVE(dictionary_queue, offline_pool.training_queue, f);
+                        offline_pool.n_queued--;
+
+                        assert_se(pthread_mutex_unlock(&offline_pool.mutex) == 0);
+                        journal_file_train_dictionary(f);
+                        assert_se(pthread_mutex_lock(&offline_pool.mutex) == 0);
+
+                        /* After this the file may be freed any time, don't touch it anymore */
+                        f->dictionary_training_pending = false;
+                        assert_se(pthread_cond_broadcast(&offline_pool.done) == 0);
+                        continue;
+                }
+#endif
+
+                if (!f) {
+                        struct timespec ts;
+                        int r;
+
+                        offline_pool.n_idle++;
+                        r = pthread_cond_timedwait(&offline_pool.queued, &offline_pool.mutex,
+                                                   timespec_store(&ts, now(CLOCK_REALTIME) + OFFLINE_THREAD_IDLE_USEC));
+                        offline_pool.n_idle--;
+
+                        if (r == ETIMEDOUT && offline_pool.n_queued == 0)
+                                break;
+
+                        continue;
+                }
+
+                LIST_REMOVE(offline_queue, offline_pool.queue, f);
+                offline_pool.n_queued--;
+
+                assert_se(pthread_mutex_unlock(&offline_pool.mutex) == 0);
+
+                journal_file_set_offline_internal(f);
+                n = now(CLOCK_MONOTONIC);
+
+                assert_se(pthread_mutex_lock(&offline_pool.mutex) == 0);
+
+                /* After this the file may be freed any time, don't touch it anymore */
+                f->offline_latency_usec = MAX(n - f->offline_submitted_usec, (usec_t) 1);
+                f->offline_pending = false;
+                assert_se(pthread_cond_broadcast(&offline_pool.done) == 0);
+
+                if (offline_pool.notify_fd >= 0)
+                        (void) eventfd_write(offline_pool.notify_fd, 1);
+        }
+
+        offline_pool.n_threads--;
+        assert_se(pthread_mutex_unlock(&offline_pool.mutex) == 0);
 
         return NULL;
 }
 
-static int journal_file_set_offline_thread_join(JournalFile *f) {
+static int offline_pool_dispatch(void) {
+        int r = 0;
+
+        /* Called with the mutex held, after queueing work. Returns a positive errno if no thread will get
+         * to it, in which case the caller has to take it back from the queue. */
+
+        /* Start another thread only if the idle ones can't keep up */
+        if (offline_pool.n_queued > offline_pool.n_idle &&
+            offline_pool.n_threads < OFFLINE_THREADS_MAX) {
+                pthread_attr_t attr;
+                pthread_t t;
+
+                r = pthread_attr_init(&attr);
+                if (r == 0) {
+                        r = pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+                        if (r == 0)
+                                r = pthread_create(&t, &attr, journal_file_offline_thread, NULL);
+
+                        (void) pthread_attr_destroy(&attr);
+                }
+                if (r == 0)
+                        offline_pool.n_threads++;
+                else if (offline_pool.n_threads > 0)
+                        /* One of the running threads will get to it eventually */
+                        r = 0;
+        }
+
+        if (r == 0)
+                assert_se(pthread_cond_signal(&offline_pool.queued) == 0);
+
+        return r;
+}
+
+static int journal_file_offline_submit(JournalFile *f) {
+        int r;
+
+        assert(f);
+
+        assert_se(pthread_mutex_lock(&offline_pool.mutex) == 0);
+
+        assert(!f->offline_pending);
+
+        f->offline_pending = true;
+        f->offline_submitted_usec = now(CLOCK_MONOTONIC);
+        LIST_APPEND(offline_queue, offline_pool.queue, f);
+        offline_pool.n_queued++;
+
+        r = offline_pool_dispatch();
+        if (r != 0) {
+                LIST_REMOVE(offline_queue, offline_pool.queue, f);
+                offline_pool.n_queued--;
+                f->offline_pending = false;
+        }
+
+        assert_se(pthread_mutex_unlock(&offline_pool.mutex) == 0);
+
+        return -r;
+}
+
+#ifdef HAVE_ZSTD
+static int journal_file_dictionary_submit(JournalFile *f) {
         int r;
 
         assert(f);
 
+        assert_se(pthread_mutex_lock(&offline_pool.mutex) == 0);
+
+        assert(!f->dictionary_training_pending);
+
+        f->dictionary_training_pending = true;
+        LIST_APPEND(dictionary_queue, offline_pool.training_queue, f);
+        offline_pool.n_queued++;
+
+        r = offline_pool_dispatch();
+        if (r != 0) {
+                LIST_REMOVE(dictionary_queue, offline_pool.training_queue, f);
+                offline_pool.n_queued--;
+                f->dictionary_training_pending = false;
+        }
+
+        assert_se(pthread_mutex_unlock(&offline_pool.mutex) == 0);
+
+        return -r;
+}
+
+static void journal_file_dictionary_join(JournalFile *f, bool cancel) {
+        assert(f);
+
+        assert_se(pthread_mutex_lock(&offline_pool.mutex) == 0);
+
+        /* If no thread got to the file yet and nobody needs the dictionary anymore, take it back from the
+         * queue. Otherwise wait for the training to finish. */
+        if (cancel && f->dictionary_training_pending &&
+            (offline_pool.training_queue == f || f->dictionary_queue_prev)) {
+                LIST_REMOVE(dictionary_queue, offline_pool.training_queue, f);
+                offline_pool.n_queued--;
+                f->dictionary_training_pending = false;
+        } else
+                while (f->dictionary_training_pending)
+                        assert_se(pthread_cond_wait(&offline_pool.done, &offline_pool.mutex) == 0);
+
+        assert_se(pthread_mutex_unlock(&offline_pool.mutex) == 0);
+}
+#endif
+
+void journal_file_wait_for_dictionary(JournalFile *f) {
+        assert(f);
+
+#ifdef HAVE_ZSTD
+        journal_file_dictionary_join(f, false);
+#endif
+}
+
+static int journal_file_set_offline_thread_join(JournalFile *f) {
+        bool queued;
+
+        assert(f);
+
         if (f->offline_state == OFFLINE_JOINED)
                 return 0;
 
-        r = pthread_join(f->offline_thread, NULL);
-        if (r)
-                return -r;
+        assert_se(pthread_mutex_lock(&offline_pool.mutex) == 0);
+
+        /* If no thread got to the file yet, take it back from the queue and do the work here, rather than
+         * waiting for the threads to get through the files queued before it */
+        queued = f->offline_pending && (offline_pool.queue == f || f->offline_queue_prev);
+        if (queued) {
+                LIST_REMOVE(offline_queue, offline_pool.queue, f);
+                offline_pool.n_queued--;
+        } else
+                while (f->offline_pending)
+                        assert_se(pthread_cond_wait(&offline_pool.done, &offline_pool.mutex) == 0);
+
+        assert_se(pthread_mutex_unlock(&offline_pool.mutex) == 0);
+
+        if (queued) {
+                usec_t n;
+
+                journal_file_set_offline_internal(f);
+                n = now(CLOCK_MONOTONIC);
+
+                assert_se(pthread_mutex_lock(&offline_pool.mutex) == 0);
+                f->offline_latency_usec = MAX(n - f->offline_submitted_usec, (usec_t) 1);
+                f->offline_pending = false;
+                assert_se(pthread_mutex_unlock(&offline_pool.mutex) == 0);
+        }
 
         f->offline_state = OFFLINE_JOINED;
 
@@ -168,6 +496,43 @@ static int journal_file_set_offline_thread_join(JournalFile *f) {
         return 0;
 }
 
+int journal_file_offline_notify_fd(void) {
+        int fd;
+
+        /* Returns an eventfd which becomes readable whenever an asynchronous offline of any journal file
+         * completed, for integration into an event loop. The caller should read it before looking at the
+         * files, but must not close it. */
+
+        assert_se(pthread_mutex_lock(&offline_pool.mutex) == 0);
+
+        if (offline_pool.notify_fd < 0)
+                offline_pool.notify_fd = eventfd(0, EFD_CLOEXEC|EFD_NONBLOCK);
+
+        fd = offline_pool.notify_fd < 0 ? -errno : offline_pool.notify_fd;
+
+        assert_se(pthread_mutex_unlock(&offline_pool.mutex) == 0);
+
+        return fd;
+}
+
+usec_t journal_file_get_offline_latency(JournalFile *f) {
+        usec_t u;
+
+        assert(f);
+
+        /* Returns how long the last asynchronous offline of this file took from being requested to being
+         * completed, once. Returns 0 if there's nothing new to report. */
+
+        assert_se(pthread_mutex_lock(&offline_pool.mutex) == 0);
+
+        u = f->offline_latency_usec;
+        f->offline_latency_usec = 0;
+
+        assert_se(pthread_mutex_unlock(&offline_pool.mutex) == 0);
+
+        return u;
+}
+
 /* Trigger a restart if the offline thread is mid-flight in a restartable state. */
 static bool journal_file_set_offline_try_restart(JournalFile *f) {
         for (;;) {
@@ -199,9 +564,10 @@ static bool journal_file_set_offline_try_restart(JournalFile *f) {
 
 /* Sets a journal offline.
  *
- * If wait is false then an offline is dispatched in a separate thread for a
+ * If wait is false then an offline is dispatched to the offline thread pool for a
  * subsequent journal_file_set_offline() or journal_file_set_online() of the
- * same journal to synchronize with.
+ * same journal to synchronize with. Completion is signalled on the fd returned by
+ * journal_file_offline_notify_fd().
  *
  * If wait is true, then either an existing offline thread will be restarted
  * and joined, or if none exists the offline is simply performed in this
@@ -241,10 +607,10 @@ int journal_file_set_offline(JournalFile *f, bool wait) {
         if (wait) /* Without using a thread if waiting. */
                 journal_file_set_offline_internal(f);
         else {
-                r = pthread_create(&f->offline_thread, NULL, journal_file_set_offline_thread, f);
-                if (r > 0) {
+                r = journal_file_offline_submit(f);
+                if (r < 0) {
                         f->offline_state = OFFLINE_JOINED;
-                        return -r;
+                        return r;
                 }
         }
 
@@ -356,6 +722,11 @@ JournalFile* journal_file_close(JournalFile *f) {
 
         journal_file_set_offline(f, true);
 
+#ifdef HAVE_ZSTD
+        /* The payloads must not be freed while a thread trains a dictionary from them */
+        journal_file_dictionary_join(f, true);
+#endif
+
         if (f->mmap && f->cache_fd)
                 mmap_cache_free_fd(f->mmap, f->cache_fd);
 
@@ -377,12 +748,22 @@ JournalFile* journal_file_close(JournalFile *f) {
 
         mmap_cache_unref(f->mmap);
 
-        ordered_hashmap_free_free(f->chain_cache);
+        chain_cache_free(f->chain_cache);
 
-#if defined(HAVE_XZ) || defined(HAVE_LZ4)
+        strv_free(f->summary_fields);
+        journal_summary_free(f->summary);
+
+#if defined(HAVE_XZ) || defined(HAVE_LZ4) || defined(HAVE_ZSTD)
         free(f->compress_buffer);
 #endif
 
+#ifdef HAVE_ZSTD
+        compress_dictionary_free(f->dictionary);
+        free(f->dictionary_samples);
+        free(f->dictionary_sample_sizes);
+        free(f->dictionary_trained);
+#endif
+
 #ifdef HAVE_GCRYPT
         if (f->fss_file)
                 munmap(f->fss_file, PAGE_ALIGN(f->fss_file_size));
@@ -393,6 +774,7 @@ JournalFile* journal_file_close(JournalFile *f) {
 
         if (f->hmac)
                 gcry_md_close(f->hmac);
+        free(f->hmac_batch);
 #endif
 
         return mfree(f);
@@ -419,7 +801,9 @@ static int journal_file_init_header(JournalFile *f, JournalFile *template) {
 
         h.incompatible_flags |= htole32(
                 f->compress_xz * HEADER_INCOMPATIBLE_COMPRESSED_XZ |
-                f->compress_lz4 * HEADER_INCOMPATIBLE_COMPRESSED_LZ4);
+                f->compress_lz4 * HEADER_INCOMPATIBLE_COMPRESSED_LZ4 |
+                f->compress_zstd * HEADER_INCOMPATIBLE_COMPRESSED_ZSTD |
+                f->keyed_hash * HEADER_INCOMPATIBLE_KEYED_HASH);
 
         h.compatible_flags = htole32(
                 f->seal * HEADER_COMPATIBLE_SEALED);
@@ -522,7 +906,7 @@ static bool warn_wrong_flags(const JournalFile *f, bool compatible) {
                                   f->path, type, flags & ~any);
                 flags = (flags & any) & ~supported;
                 if (flags) {
-                        const char* strv[3];
+                        const char* strv[5];
                         unsigned n = 0;
                         _cleanup_free_ char *t = NULL;
 
@@ -532,6 +916,10 @@ static bool warn_wrong_flags(const JournalFile *f, bool compatible) {
                                 strv[n++] = "xz-compressed";
                         if (!compatible && (flags & HEADER_INCOMPATIBLE_COMPRESSED_LZ4))
                                 strv[n++] = "lz4-compressed";
+                        if (!compatible && (flags & HEADER_INCOMPATIBLE_COMPRESSED_ZSTD))
+                                strv[n++] = "zstd-compressed";
+                        if (!compatible && (flags & HEADER_INCOMPATIBLE_KEYED_HASH))
+                                strv[n++] = "keyed-hash";
                         strv[n] = NULL;
                         assert(n < ELEMENTSOF(strv));
 
@@ -589,6 +977,11 @@ static int journal_file_verify_header(JournalFile *f) {
             !VALID64(le64toh(f->header->entry_array_offset)))
                 return -ENODATA;
 
+        if (JOURNAL_HEADER_CONTAINS(f->header, dictionary_offset) &&
+            (!VALID64(le64toh(f->header->dictionary_offset)) ||
+             le64toh(f->header->dictionary_offset) > header_size + arena_size))
+                return -ENODATA;
+
         if (f->writable) {
                 sd_id128_t machine_id;
                 uint8_t state;
@@ -627,6 +1020,9 @@ static int journal_file_verify_header(JournalFile *f) {
 
         f->compress_xz = JOURNAL_HEADER_COMPRESSED_XZ(f->header);
         f->compress_lz4 = JOURNAL_HEADER_COMPRESSED_LZ4(f->header);
+        f->compress_zstd = JOURNAL_HEADER_COMPRESSED_ZSTD(f->header);
+
+        f->keyed_hash = JOURNAL_HEADER_KEYED_HASH(f->header);
 
         f->seal = JOURNAL_HEADER_SEALED(f->header);
 
@@ -762,6 +1158,7 @@ static uint64_t minimum_header_size(Object *o) {
                 [OBJECT_FIELD_HASH_TABLE] = sizeof(HashTableObject),
                 [OBJECT_ENTRY_ARRAY] = sizeof(EntryArrayObject),
                 [OBJECT_TAG] = sizeof(TagObject),
+                [OBJECT_DICTIONARY] = sizeof(DictionaryObject),
         };
 
         if (o->object.type >= ELEMENTSOF(table) || table[o->object.type] <= 0)
@@ -913,7 +1310,7 @@ int journal_file_append_object(JournalFile *f, ObjectType type, uint64_t size, O
         return 0;
 }
 
-static int journal_file_setup_data_hash_table(JournalFile *f) {
+static int journal_file_setup_data_hash_table(JournalFile *f, JournalFile *template) {
         uint64_t s, p;
         Object *o;
         int r;
@@ -927,6 +1324,30 @@ static int journal_file_setup_data_hash_table(JournalFile *f) {
            the maximum file size based on these metrics. */
 
         s = (f->metrics.max_size * 4 / 768 / 3) * sizeof(HashItem);
+
+        /* If we replace another file, we know better: extrapolate the number of data objects it ended up
+         * with to the maximum file size, so that logs with many distinct field values don't fill the
+         * hash table again before the file is full. */
+        if (template && JOURNAL_HEADER_CONTAINS(template->header, n_data)) {
+                uint64_t n, used;
+
+                n = le64toh(template->header->n_data);
+
+                /* Don't count its hash tables, they don't grow with the number of entries */
+                used = LESS_BY(le64toh(template->header->tail_object_offset),
+                               le64toh(template->header->data_hash_table_size) +
+                               le64toh(template->header->field_hash_table_size));
+
+                if (f->metrics.max_size > used && used > 0)
+                        n = (uint64_t) ((double) n * f->metrics.max_size / used);
+
+                s = MAX(s, n * 4 / 3 * sizeof(HashItem));
+
+                /* But never let the hash table take up a good part of the file */
+                if (f->metrics.max_size > 0)
+                        s = MIN(s, f->metrics.max_size / 4 / sizeof(HashItem) * sizeof(HashItem));
+        }
+
         if (s < DEFAULT_DATA_HASH_TABLE_SIZE)
                 s = DEFAULT_DATA_HASH_TABLE_SIZE;
 
@@ -947,7 +1368,7 @@ static int journal_file_setup_data_hash_table(JournalFile *f) {
         return 0;
 }
 
-static int journal_file_setup_field_hash_table(JournalFile *f) {
+static int journal_file_setup_field_hash_table(JournalFile *f, JournalFile *template) {
         uint64_t s, p;
         Object *o;
         int r;
@@ -956,9 +1377,13 @@ static int journal_file_setup_field_hash_table(JournalFile *f) {
         assert(f->header);
 
         /* We use a fixed size hash table for the fields as this
-         * number should grow very slowly only */
+         * number should grow very slowly only, unless the file we
+         * replace saw so many fields that it would have been more
+         * than half full. */
 
         s = DEFAULT_FIELD_HASH_TABLE_SIZE;
+        if (template && JOURNAL_HEADER_CONTAINS(template->header, n_fields))
+                s = MAX(s, le64toh(template->header->n_fields) * 2 * sizeof(HashItem));
         r = journal_file_append_object(f,
                                        OBJECT_FIELD_HASH_TABLE,
                                        offsetof(Object, hash_table.items) + s,
@@ -1026,6 +1451,33 @@ int journal_file_map_field_hash_table(JournalFile *f) {
         return 0;
 }
 
+uint64_t journal_file_hash_data(JournalFile *f, const void *data, size_t size) {
+        assert(f);
+        assert(f->header);
+        assert(data || size == 0);
+
+        /* Keyed hashes use the file ID as key, so that the hash table layout of one file tells nothing
+         * about that of another, and cannot be predicted by whoever controls the data logged. */
+
+        if (f->keyed_hash)
+                return keyed_hash64(data, size, f->header->file_id.bytes);
+
+        return hash64(data, size);
+}
+
+static uint64_t journal_file_entry_item_hash(JournalFile *f, const void *data, size_t size, uint64_t hash) {
+        assert(f);
+
+        /* Returns what a field contributes to the xor_hash of an entry. This is used to recognize the same
+         * entry in different files, including files with and without keyed hashes, hence it is always
+         * lookup3's hash64(), as in files without keyed hashes, where that is the data hash. */
+
+        if (f->keyed_hash)
+                return hash64(data, size);
+
+        return hash;
+}
+
 static int journal_file_link_field(
                 JournalFile *f,
                 Object *o,
@@ -1187,7 +1639,7 @@ int journal_file_find_field_object(
         assert(f);
         assert(field && size > 0);
 
-        hash = hash64(field, size);
+        hash = journal_file_hash_data(f, field, size);
 
         return journal_file_find_field_object_with_hash(f,
                                                         field, size, hash,
@@ -1235,7 +1687,7 @@ int journal_file_find_data_object_with_hash(
                         goto next;
 
                 if (o->object.flags & OBJECT_COMPRESSION_MASK) {
-#if defined(HAVE_XZ) || defined(HAVE_LZ4)
+#if defined(HAVE_XZ) || defined(HAVE_LZ4) || defined(HAVE_ZSTD)
                         uint64_t l;
                         size_t rsize = 0;
 
@@ -1246,7 +1698,8 @@ int journal_file_find_data_object_with_hash(
                         l -= offsetof(Object, data.payload);
 
                         r = decompress_blob(o->object.flags & OBJECT_COMPRESSION_MASK,
-                                            o->data.payload, l, &f->compress_buffer, &f->compress_buffer_size, &rsize, 0);
+                                            o->data.payload, l, &f->compress_buffer, &f->compress_buffer_size, &rsize, 0,
+                                            journal_file_dictionary(f));
                         if (r < 0)
                                 return r;
 
@@ -1293,7 +1746,7 @@ int journal_file_find_data_object(
         assert(f);
         assert(data || size == 0);
 
-        hash = hash64(data, size);
+        hash = journal_file_hash_data(f, data, size);
 
         return journal_file_find_data_object_with_hash(f,
                                                        data, size, hash,
@@ -1313,7 +1766,7 @@ static int journal_file_append_field(
         assert(f);
         assert(field && size > 0);
 
-        hash = hash64(field, size);
+        hash = journal_file_hash_data(f, field, size);
 
         r = journal_file_find_field_object_with_hash(f, field, size, hash, &o, &p);
         if (r < 0)
@@ -1362,12 +1815,274 @@ static int journal_file_append_field(
         return 0;
 }
 
-static int journal_file_append_data(
+#ifdef HAVE_ZSTD
+static int journal_file_load_dictionary(JournalFile *f) {
+        _cleanup_free_ void *buf = NULL;
+        ObjectHeader h;
+        uint64_t p, l;
+        ssize_t k;
+
+        assert(f);
+
+        /* This is called with pointers into mapped objects held by the caller, hence read the dictionary
+         * with pread() instead of through the mmap cache, so that we don't invalidate them. */
+
+        p = le64toh(f->header->dictionary_offset);
+        if (!VALID64(p) || p < le64toh(f->header->header_size))
+                return -EBADMSG;
+
+        k = pread(f->fd, &h, sizeof(h), p);
+        if (k < 0)
+                return -errno;
+        if ((size_t) k != sizeof(h))
+                return -EIO;
+
+        l = le64toh(h.size);
+        if (h.type != OBJECT_DICTIONARY ||
+            l <= offsetof(DictionaryObject, payload) ||
+            l - offsetof(DictionaryObject, payload) > DICTIONARY_SIZE_MAX)
+                return -EBADMSG;
+
+        l -= offsetof(DictionaryObject, payload);
+
+        buf = malloc(l);
+        if (!buf)
+                return -ENOMEM;
+
+        k = pread(f->fd, buf, l, p + offsetof(DictionaryObject, payload));
+        if (k < 0)
+                return -errno;
+        if ((uint64_t) k != l)
+                return -EIO;
+
+        return compress_dictionary_new(buf, l, &f->dictionary);
+}
+#endif
+
+CompressDictionary* journal_file_dictionary(JournalFile *f) {
+#ifdef HAVE_ZSTD
+        int r;
+
+        assert(f);
+        assert(f->header);
+
+        if (f->dictionary)
+                return f->dictionary;
+
+        if (!JOURNAL_HEADER_CONTAINS(f->header, dictionary_offset) ||
+            f->header->dictionary_offset == 0)
+                return NULL;
+
+        r = journal_file_load_dictionary(f);
+        if (r < 0) {
+                log_debug_errno(r, "Failed to load compression dictionary of %s, ignoring: %m", f->path);
+                return NULL;
+        }
+
+        return f->dictionary;
+#else
+        return NULL;
+#endif
+}
+
+#ifdef HAVE_ZSTD
+static int journal_file_append_dictionary(JournalFile *f, const void *data, size_t size) {
+        _cleanup_(compress_dictionary_freep) CompressDictionary *d = NULL;
+        uint64_t p;
+        Object *o;
+        int r;
+
+        assert(f);
+        assert(data);
+        assert(!f->dictionary);
+
+        if (!JOURNAL_HEADER_CONTAINS(f->header, dictionary_offset))
+                return -EOPNOTSUPP;
+
+        r = compress_dictionary_new(data, size, &d);
+        if (r < 0)
+                return r;
+
+        r = journal_file_append_object(f, OBJECT_DICTIONARY, offsetof(Object, dictionary.payload) + size, &o, &p);
+        if (r < 0)
+                return r;
+
+        memcpy(o->dictionary.payload, data, size);
+
+#ifdef HAVE_GCRYPT
+        r = journal_file_hmac_put_object(f, OBJECT_DICTIONARY, o, p);
+        if (r < 0)
+                return r;
+#endif
+
+        f->header->dictionary_offset = htole64(p);
+
+        f->dictionary = d;
+        d = NULL;
+
+        return 0;
+}
+
+static void journal_file_drop_dictionary_samples(JournalFile *f) {
+        assert(f);
+
+        f->dictionary_samples = mfree(f->dictionary_samples);
+        f->dictionary_sample_sizes = mfree(f->dictionary_sample_sizes);
+        f->dictionary_samples_size = f->dictionary_samples_allocated = f->dictionary_sample_sizes_allocated = 0;
+        f->n_dictionary_samples = 0;
+}
+
+static int journal_file_setup_dictionary(JournalFile *f, JournalFile *template) {
+        _cleanup_free_ void *dict = NULL;
+        CompressDictionary *d;
+        size_t size;
+        int r;
+
+        assert(f);
+        assert(template);
+
+        /* Sets up the dictionary of a file replacing the template. Training takes a while, hence it is done
+         * by the offline threads once the template collected enough payloads, and never waited for here. If
+         * a dictionary was trained for the template by now, it is used. Otherwise the template's one is
+         * carried over, and the payloads the template collected so far are passed on to the new file, to
+         * be trained from once it collected the rest. */
+
+        assert_se(pthread_mutex_lock(&offline_pool.mutex) == 0);
+        dict = template->dictionary_trained;
+        size = template->dictionary_trained_size;
+        template->dictionary_trained = NULL;
+        assert_se(pthread_mutex_unlock(&offline_pool.mutex) == 0);
+
+        if (dict) {
+                r = journal_file_append_dictionary(f, dict, size);
+                if (r < 0)
+                        return r;
+
+                journal_file_drop_dictionary_samples(template);
+                return 0;
+        }
+
+        if (!template->dictionary_training_submitted) {
+                f->dictionary_samples = template->dictionary_samples;
+                f->dictionary_samples_size = template->dictionary_samples_size;
+                f->dictionary_samples_allocated = template->dictionary_samples_allocated;
+                f->dictionary_sample_sizes = template->dictionary_sample_sizes;
+                f->dictionary_sample_sizes_allocated = template->dictionary_sample_sizes_allocated;
+                f->n_dictionary_samples = template->n_dictionary_samples;
+
+                template->dictionary_samples = NULL;
+                template->dictionary_sample_sizes = NULL;
+                journal_file_drop_dictionary_samples(template);
+        }
+
+        d = journal_file_dictionary(template);
+        if (!d)
+                return 0;
+
+        r = journal_file_append_dictionary(f, d->data, d->size);
+        if (r < 0)
+                return r;
+
+        f->dictionary_carried_over = template->dictionary_carried_over + 1;
+        return 0;
+}
+
+static void journal_file_sample_for_dictionary(JournalFile *f, const void *data, uint64_t size) {
+        int r;
+
+        assert(f);
+
+        /* Collects payloads of new data objects, for training a dictionary for the file replacing this one.
+         * Only payloads we'd compress with a dictionary are interesting. Once enough were collected, they
+         * are handed to the offline threads for training. */
+
+        if (!f->compress_zstd || f->dictionary_training_submitted)
+                return;
+
+        if (size < DICTIONARY_COMPRESSION_SIZE_THRESHOLD || size > DICTIONARY_SAMPLE_SIZE_MAX)
+                return;
+
+        if (f->n_dictionary_samples >= DICTIONARY_SAMPLES_MAX ||
+            f->dictionary_samples_size + size > DICTIONARY_SAMPLES_SIZE_MAX)
+                return;
+
+        if (!JOURNAL_HEADER_CONTAINS(f->header, dictionary_offset))
+                return;
+
+        /* Files with a dictionary that is still fresh enough pass it on as it is */
+        if (journal_file_dictionary(f) && f->dictionary_carried_over < DICTIONARY_CARRY_OVER_MAX)
+                return;
+
+        if (!GREEDY_REALLOC(f->dictionary_samples, f->dictionary_samples_allocated, f->dictionary_samples_size + size) ||
+            !GREEDY_REALLOC(f->dictionary_sample_sizes, f->dictionary_sample_sizes_allocated, f->n_dictionary_samples + 1))
+                return;
+
+        memcpy((uint8_t*) f->dictionary_samples + f->dictionary_samples_size, data, size);
+        f->dictionary_samples_size += size;
+        f->dictionary_sample_sizes[f->n_dictionary_samples++] = size;
+
+        if (f->n_dictionary_samples < DICTIONARY_SAMPLES_MAX &&
+            f->dictionary_samples_size + DICTIONARY_SAMPLE_SIZE_MAX <= DICTIONARY_SAMPLES_SIZE_MAX)
+                return;
+
+        f->dictionary_training_submitted = true;
+
+        r = journal_file_dictionary_submit(f);
+        if (r < 0) {
+                log_debug_errno(r, "Failed to start training compression dictionary for %s, ignoring: %m", f->path);
+                journal_file_drop_dictionary_samples(f);
+        }
+}
+#endif
+
+#if defined(HAVE_XZ) || defined(HAVE_LZ4) || defined(HAVE_ZSTD)
+static int journal_file_compress_data(JournalFile *f, const void *data, uint64_t size, void *dst, size_t *dst_size) {
+        int r;
+
+        assert(f);
+
+        /* Compresses the data with the algorithm this file was created for. Returns the object
+         * compression flag on success. */
+
+#ifdef HAVE_ZSTD
+        if (f->compress_zstd) {
+                CompressDictionary *dict;
+
+                dict = journal_file_dictionary(f);
+                if (dict && size >= DICTIONARY_COMPRESSION_SIZE_THRESHOLD)
+                        r = compress_blob_zstd_dictionary(data, size, dst, size - 1, dst_size, dict);
+                else if (size >= COMPRESSION_SIZE_THRESHOLD)
+                        r = compress_blob_zstd(data, size, dst, size - 1, dst_size);
+                else
+                        return -ENOBUFS;
+
+                return r < 0 ? r : OBJECT_COMPRESSED_ZSTD;
+        }
+#endif
+
+        if (size < COMPRESSION_SIZE_THRESHOLD)
+                return -ENOBUFS;
+
+        if (f->compress_lz4) {
+                r = compress_blob_lz4(data, size, dst, size - 1, dst_size);
+                return r < 0 ? r : OBJECT_COMPRESSED_LZ4;
+        }
+
+        if (f->compress_xz) {
+                r = compress_blob_xz(data, size, dst, size - 1, dst_size);
+                return r < 0 ? r : OBJECT_COMPRESSED_XZ;
+        }
+
+        return -EOPNOTSUPP;
+}
+#endif
+
+static int journal_file_append_data_with_hash(
                 JournalFile *f,
-                const void *data, uint64_t size,
+                const void *data, uint64_t size, uint64_t hash,
                 Object **ret, uint64_t *offset) {
 
-        uint64_t hash, p;
+        uint64_t p;
         uint64_t osize;
         Object *o;
         int r, compression = 0;
@@ -1376,8 +2091,6 @@ static int journal_file_append_data(
         assert(f);
         assert(data || size == 0);
 
-        hash = hash64(data, size);
-
         r = journal_file_find_data_object_with_hash(f, data, size, hash, &o, &p);
         if (r < 0)
                 return r;
@@ -1392,6 +2105,10 @@ static int journal_file_append_data(
                 return 0;
         }
 
+#ifdef HAVE_ZSTD
+        journal_file_sample_for_dictionary(f, data, size);
+#endif
+
         osize = offsetof(Object, data.payload) + size;
         r = journal_file_append_object(f, OBJECT_DATA, osize, &o, &p);
         if (r < 0)
@@ -1399,11 +2116,11 @@ static int journal_file_append_data(
 
         o->data.hash = htole64(hash);
 
-#if defined(HAVE_XZ) || defined(HAVE_LZ4)
-        if (JOURNAL_FILE_COMPRESS(f) && size >= COMPRESSION_SIZE_THRESHOLD) {
+#if defined(HAVE_XZ) || defined(HAVE_LZ4) || defined(HAVE_ZSTD)
+        if (JOURNAL_FILE_COMPRESS(f)) {
                 size_t rsize = 0;
 
-                compression = compress_blob(data, size, o->data.payload, size - 1, &rsize);
+                compression = journal_file_compress_data(f, data, size, o->data.payload, &rsize);
 
                 if (compression >= 0) {
                         o->object.size = htole64(offsetof(Object, data.payload) + rsize);
@@ -1463,6 +2180,17 @@ static int journal_file_append_data(
         return 0;
 }
 
+static int journal_file_append_data(
+                JournalFile *f,
+                const void *data, uint64_t size,
+                Object **ret, uint64_t *offset) {
+
+        assert(f);
+        assert(data || size == 0);
+
+        return journal_file_append_data_with_hash(f, data, size, journal_file_hash_data(f, data, size), ret, offset);
+}
+
 uint64_t journal_file_entry_n_items(Object *o) {
         assert(o);
 
@@ -1809,22 +2537,39 @@ static int entry_item_cmp(const void *_a, const void *_b) {
         return 0;
 }
 
-int journal_file_append_entry(JournalFile *f, const dual_timestamp *ts, const struct iovec iovec[], unsigned n_iovec, uint64_t *seqnum, Object **ret, uint64_t *offset) {
+/* When appending a batch of entries, most entries share a good part of their fields (hostname, boot ID, unit,
+ * ...). Remember where we put the data objects we already looked up or created during the batch, so that we
+ * don't have to walk the on-disk hash chains again for each of them. This is a simple direct-mapped cache,
+ * indexed by the hash of the payload. The cached data pointers point into the caller's iovecs, which stay
+ * valid for the duration of the batch. */
+typedef struct DataCacheItem {
+        uint64_t hash;
+        uint64_t item_hash;
+        const void *data;
+        uint64_t size;
+        uint64_t offset;
+} DataCacheItem;
+
+#define DATA_CACHE_MAX 256
+
+static int journal_file_append_entry_full(
+                JournalFile *f,
+                const dual_timestamp *ts,
+                const struct iovec iovec[], unsigned n_iovec,
+                DataCacheItem *cache,
+                uint64_t *seqnum,
+                Object **ret, uint64_t *offset) {
+
         unsigned i;
         EntryItem *items;
         int r;
         uint64_t xor_hash = 0;
-        struct dual_timestamp _ts;
 
         assert(f);
         assert(f->header);
+        assert(ts);
         assert(iovec || n_iovec == 0);
 
-        if (!ts) {
-                dual_timestamp_get(&_ts);
-                ts = &_ts;
-        }
-
 #ifdef HAVE_GCRYPT
         r = journal_file_maybe_append_tag(f, ts->realtime);
         if (r < 0)
@@ -1835,23 +2580,56 @@ int journal_file_append_entry(JournalFile *f, const dual_timestamp *ts, const st
         items = alloca(sizeof(EntryItem) * MAX(1u, n_iovec));
 
         for (i = 0; i < n_iovec; i++) {
-                uint64_t p;
+                DataCacheItem *ci = NULL;
+                uint64_t p, h, ih;
                 Object *o;
 
-                r = journal_file_append_data(f, iovec[i].iov_base, iovec[i].iov_len, &o, &p);
+                h = journal_file_hash_data(f, iovec[i].iov_base, iovec[i].iov_len);
+
+                if (cache) {
+                        ci = cache + (h % DATA_CACHE_MAX);
+
+                        if (ci->offset > 0 &&
+                            ci->hash == h &&
+                            ci->size == iovec[i].iov_len &&
+                            memcmp_safe(ci->data, iovec[i].iov_base, iovec[i].iov_len) == 0) {
+
+                                xor_hash ^= ci->item_hash;
+                                items[i].object_offset = htole64(ci->offset);
+                                items[i].hash = htole64(h);
+                                continue;
+                        }
+                }
+
+                r = journal_file_append_data_with_hash(f, iovec[i].iov_base, iovec[i].iov_len, h, &o, &p);
                 if (r < 0)
                         return r;
 
-                xor_hash ^= le64toh(o->data.hash);
+                ih = journal_file_entry_item_hash(f, iovec[i].iov_base, iovec[i].iov_len, h);
+
+                xor_hash ^= ih;
                 items[i].object_offset = htole64(p);
                 items[i].hash = o->data.hash;
+
+                if (ci)
+                        *ci = (DataCacheItem) {
+                                .hash = h,
+                                .item_hash = ih,
+                                .data = iovec[i].iov_base,
+                                .size = iovec[i].iov_len,
+                                .offset = p,
+                        };
         }
 
         /* Order by the position on disk, in order to improve seek
          * times for rotating media. */
         qsort_safe(items, n_iovec, sizeof(EntryItem), entry_item_cmp);
 
-        r = journal_file_append_entry_internal(f, ts, xor_hash, items, n_iovec, seqnum, ret, offset);
+        return journal_file_append_entry_internal(f, ts, xor_hash, items, n_iovec, seqnum, ret, offset);
+}
+
+static int journal_file_post_append(JournalFile *f, int r) {
+        assert(f);
 
         /* If the memory mapping triggered a SIGBUS then we return an
          * IO error and ignore the error code passed down to us, since
@@ -1869,46 +2647,179 @@ int journal_file_append_entry(JournalFile *f, const dual_timestamp *ts, const st
         return r;
 }
 
-typedef struct ChainCacheItem {
-        uint64_t first; /* the array at the beginning of the chain */
-        uint64_t array; /* the cached array */
-        uint64_t begin; /* the first item in the cached array */
-        uint64_t total; /* the total number of items in all arrays before this one in the chain */
-        uint64_t last_index; /* the last index we looked at, to optimize locality when bisecting */
-} ChainCacheItem;
+int journal_file_append_entry(JournalFile *f, const dual_timestamp *ts, const struct iovec iovec[], unsigned n_iovec, uint64_t *seqnum, Object **ret, uint64_t *offset) {
+        struct dual_timestamp _ts;
+        int r;
 
-static void chain_cache_put(
+        assert(f);
+        assert(f->header);
+        assert(iovec || n_iovec == 0);
+
+        if (!ts) {
+                dual_timestamp_get(&_ts);
+                ts = &_ts;
+        }
+
+        r = journal_file_append_entry_full(f, ts, iovec, n_iovec, NULL, seqnum, ret, offset);
+
+        return journal_file_post_append(f, r);
+}
+
+/* Appends a number of entries in one go. This is cheaper than calling journal_file_append_entry() for each
+ * of them, as data objects shared between the entries are only looked up once and the change notification
+ * is posted only once for the whole batch. Entries are appended in order. On failure the entries before the
+ * failing one stay appended, and their number is returned in ret_n_appended. */
+int journal_file_append_entries(
+                JournalFile *f,
+                const JournalEntryBatchItem entries[], unsigned n_entries,
+                uint64_t *seqnum,
+                unsigned *ret_n_appended) {
+
+        _cleanup_free_ DataCacheItem *cache = NULL;
+        struct dual_timestamp _ts;
+        unsigned i;
+        int r = 0;
+
+        assert(f);
+        assert(f->header);
+        assert(entries || n_entries == 0);
+
+        /* Don't bother with the cache for a single entry, there's nothing to share */
+        if (n_entries > 1) {
+                cache = new0(DataCacheItem, DATA_CACHE_MAX);
+                if (!cache)
+                        return -ENOMEM;
+        }
+
+        for (i = 0; i < n_entries; i++) {
+                const dual_timestamp *ts = entries[i].ts;
+
+                if (!ts) {
+                        dual_timestamp_get(&_ts);
+                        ts = &_ts;
+                }
+
+                r = journal_file_append_entry_full(f, ts, entries[i].iovec, entries[i].n_iovec, cache, seqnum, NULL, NULL);
+                if (r < 0)
+                        break;
+        }
+
+        if (ret_n_appended)
+                *ret_n_appended = i;
+
+        if (i == 0 && r >= 0)
+                return 0;
+
+        return journal_file_post_append(f, r);
+}
+
+static void chain_cache_index(
                 OrderedHashmap *h,
-                ChainCacheItem *ci,
+                ChainCacheItem **ci,
                 uint64_t first,
+                uint64_t first_begin,
                 uint64_t array,
                 uint64_t begin,
-                uint64_t total,
-                uint64_t last_index) {
+                uint64_t total) {
+
+        ChainCacheItem *c;
+
+        assert(h);
+        assert(ci);
+
+        /* Adds an array we came across while walking the chain to the index. The caller must walk the
+         * chain without gaps, from the first array or from an array already in the index. */
 
-        if (!ci) {
-                /* If the chain item to cache for this chain is the
-                 * first one it's not worth caching anything */
+        if (!*ci) {
+                /* If the chain consists of one array only it's not worth caching anything. The first
+                 * array is added to the index together with the second one. */
                 if (array == first)
                         return;
 
                 if (ordered_hashmap_size(h) >= CHAIN_CACHE_MAX) {
-                        ci = ordered_hashmap_steal_first(h);
-                        assert(ci);
+                        c = ordered_hashmap_steal_first(h);
+                        assert(c);
+                        c->n_index = 0;
                 } else {
-                        ci = new(ChainCacheItem, 1);
-                        if (!ci)
+                        c = new0(ChainCacheItem, 1);
+                        if (!c)
                                 return;
                 }
 
-                ci->first = first;
+                c->first = first;
+                c->array = first;
+                c->begin = first_begin;
+                c->total = 0;
+                c->last_index = (uint64_t) -1;
 
-                if (ordered_hashmap_put(h, &ci->first, ci) < 0) {
-                        free(ci);
+                if (!GREEDY_REALLOC(c->index, c->n_index_allocated, 2) ||
+                    ordered_hashmap_put(h, &c->first, c) < 0) {
+                        chain_cache_item_free(c);
                         return;
                 }
+
+                c->index[c->n_index++] = (ChainIndexItem) {
+                        .array = first,
+                        .begin = first_begin,
+                };
+
+                *ci = c;
         } else
-                assert(ci->first == first);
+                c = *ci;
+
+        assert(c->first == first);
+        assert(c->n_index > 0);
+
+        /* Arrays further down the chain always have a higher total, hence this catches both arrays we
+         * already know, and the first array we haven't seen before */
+        if (total <= c->index[c->n_index - 1].total)
+                return;
+
+        if (!GREEDY_REALLOC(c->index, c->n_index_allocated, c->n_index + 1))
+                return;
+
+        c->index[c->n_index++] = (ChainIndexItem) {
+                .array = array,
+                .begin = begin,
+                .total = total,
+        };
+}
+
+static const ChainIndexItem* chain_cache_find_index(ChainCacheItem *ci, uint64_t i) {
+        size_t left, right;
+
+        assert(ci);
+        assert(ci->n_index > 0);
+
+        /* Returns the last array we know of that starts with item i or before it */
+
+        left = 0;
+        right = ci->n_index - 1;
+        while (left < right) {
+                size_t m = (left + right + 1) / 2;
+
+                if (ci->index[m].total <= i)
+                        left = m;
+                else
+                        right = m - 1;
+        }
+
+        return ci->index + left;
+}
+
+static void chain_cache_put(
+                ChainCacheItem *ci,
+                uint64_t first,
+                uint64_t array,
+                uint64_t begin,
+                uint64_t total,
+                uint64_t last_index) {
+
+        /* Chains consisting of a single array don't get an item, see chain_cache_index() */
+        if (!ci)
+                return;
+
+        assert(ci->first == first);
 
         ci->array = array;
         ci->begin = begin;
@@ -1923,7 +2834,7 @@ static int generic_array_get(
                 Object **ret, uint64_t *offset) {
 
         Object *o;
-        uint64_t p = 0, a, t = 0;
+        uint64_t p = 0, a, t = 0, first_begin = 0;
         int r;
         ChainCacheItem *ci;
 
@@ -1933,10 +2844,13 @@ static int generic_array_get(
 
         /* Try the chain cache first */
         ci = ordered_hashmap_get(f->chain_cache, &first);
-        if (ci && i > ci->total) {
-                a = ci->array;
-                i -= ci->total;
-                t = ci->total;
+        if (ci) {
+                const ChainIndexItem *e;
+
+                e = chain_cache_find_index(ci, i);
+                a = e->array;
+                i -= e->total;
+                t = e->total;
         }
 
         while (a > 0) {
@@ -1947,6 +2861,13 @@ static int generic_array_get(
                         return r;
 
                 k = journal_file_entry_array_n_items(o);
+                if (k <= 0)
+                        return -EBADMSG;
+
+                if (t == 0)
+                        first_begin = le64toh(o->entry_array.items[0]);
+                chain_cache_index(f->chain_cache, &ci, first, first_begin, a, le64toh(o->entry_array.items[0]), t);
+
                 if (i < k) {
                         p = le64toh(o->entry_array.items[i]);
                         goto found;
@@ -1961,7 +2882,7 @@ static int generic_array_get(
 
 found:
         /* Let's cache this item for the next invocation */
-        chain_cache_put(f->chain_cache, ci, first, a, le64toh(o->entry_array.items[0]), t, i);
+        chain_cache_put(ci, first, a, le64toh(o->entry_array.items[0]), t, i);
 
         r = journal_file_move_to_object(f, OBJECT_ENTRY, p, &o);
         if (r < 0)
@@ -2023,7 +2944,7 @@ static int generic_array_bisect(
                 uint64_t *offset,
                 uint64_t *idx) {
 
-        uint64_t a, p, t = 0, i = 0, last_p = 0, last_index = (uint64_t) -1;
+        uint64_t a, p, t = 0, i = 0, last_p = 0, last_index = (uint64_t) -1, first_begin = 0;
         bool subtract_one = false;
         Object *o, *array = NULL;
         int r;
@@ -2036,27 +2957,56 @@ static int generic_array_bisect(
         a = first;
 
         ci = ordered_hashmap_get(f->chain_cache, &first);
-        if (ci && n > ci->total) {
-                /* Ah, we have iterated this bisection array chain
-                 * previously! Let's see if we can skip ahead in the
-                 * chain, as far as the last time. But we can't jump
-                 * backwards in the chain, so let's check that
-                 * first. */
-
-                r = test_object(f, ci->begin, needle);
-                if (r < 0)
-                        return r;
+        if (ci) {
+                size_t left = 0, right = ci->n_index, step = 1;
+                bool galloping = true;
+
+                /* Ah, we have iterated this bisection array chain previously! Let's search the arrays
+                 * we saw then for the last one which begins left of what we are looking for, and jump
+                 * straight to it. Since every array is twice as large as the one before it, most items
+                 * are in the last few arrays, hence start looking at the end of the chain and take
+                 * growing steps towards its beginning, before bisecting the range found that way.
+                 * This only looks at the first item of a few arrays, instead of at the last item of
+                 * every array on the way. */
+
+                /* Only consider arrays with valid items */
+                while (right > 0 && ci->index[right - 1].total >= n)
+                        right--;
+
+                while (left < right) {
+                        size_t m;
+
+                        if (galloping)
+                                m = right > left + step ? right - step : left;
+                        else
+                                m = (left + right) / 2;
+
+                        r = test_object(f, ci->index[m].begin, needle);
+                        if (r < 0)
+                                return r;
 
-                if (r == TEST_LEFT) {
-                        /* OK, what we are looking for is right of the
-                         * begin of this EntryArray, so let's jump
-                         * straight to previously cached array in the
-                         * chain */
+                        if (r == TEST_FOUND)
+                                r = direction == DIRECTION_DOWN ? TEST_RIGHT : TEST_LEFT;
 
-                        a = ci->array;
-                        n -= ci->total;
-                        t = ci->total;
-                        last_index = ci->last_index;
+                        if (r == TEST_LEFT) {
+                                left = m + 1;
+                                galloping = false;
+                        } else {
+                                right = m;
+                                step *= 2;
+                        }
+                }
+
+                if (left > 0) {
+                        const ChainIndexItem *e = ci->index + left - 1;
+
+                        a = e->array;
+                        n -= e->total;
+                        t = e->total;
+
+                        /* If this is where we ended up last time, try to stay close to that */
+                        if (a == ci->array && ci->last_index < n)
+                                last_index = ci->last_index;
                 }
         }
 
@@ -2072,6 +3022,10 @@ static int generic_array_bisect(
                 if (right <= 0)
                         return 0;
 
+                if (t == 0)
+                        first_begin = le64toh(array->entry_array.items[0]);
+                chain_cache_index(f->chain_cache, &ci, first, first_begin, a, le64toh(array->entry_array.items[0]), t);
+
                 i = right - 1;
                 lp = p = le64toh(array->entry_array.items[i]);
                 if (p <= 0)
@@ -2204,7 +3158,7 @@ found:
                 return 0;
 
         /* Let's cache this item for the next invocation */
-        chain_cache_put(f->chain_cache, ci, first, a, le64toh(array->entry_array.items[0]), t, subtract_one ? (i > 0 ? i-1 : (uint64_t) -1) : i);
+        chain_cache_put(ci, first, a, le64toh(array->entry_array.items[0]), t, subtract_one ? (i > 0 ? i-1 : (uint64_t) -1) : i);
 
         if (subtract_one && i == 0)
                 p = last_p;
@@ -2912,6 +3866,10 @@ void journal_file_dump(JournalFile *f) {
                                le64toh(o->tag.epoch));
                         break;
 
+                case OBJECT_DICTIONARY:
+                        printf("Type: OBJECT_DICTIONARY\n");
+                        break;
+
                 default:
                         printf("Type: unknown (%i)\n", o->object.type);
                         break;
@@ -2957,7 +3915,7 @@ void journal_file_print_header(JournalFile *f) {
                "Sequential Number ID: %s\n"
                "State: %s\n"
                "Compatible Flags:%s%s\n"
-               "Incompatible Flags:%s%s%s\n"
+               "Incompatible Flags:%s%s%s%s%s\n"
                "Header size: %"PRIu64"\n"
                "Arena size: %"PRIu64"\n"
                "Data Hash Table Size: %"PRIu64"\n"
@@ -2982,6 +3940,8 @@ void journal_file_print_header(JournalFile *f) {
                (le32toh(f->header->compatible_flags) & ~HEADER_COMPATIBLE_ANY) ? " ???" : "",
                JOURNAL_HEADER_COMPRESSED_XZ(f->header) ? " COMPRESSED-XZ" : "",
                JOURNAL_HEADER_COMPRESSED_LZ4(f->header) ? " COMPRESSED-LZ4" : "",
+               JOURNAL_HEADER_COMPRESSED_ZSTD(f->header) ? " COMPRESSED-ZSTD" : "",
+               JOURNAL_HEADER_KEYED_HASH(f->header) ? " KEYED-HASH" : "",
                (le32toh(f->header->incompatible_flags) & ~HEADER_INCOMPATIBLE_ANY) ? " ???" : "",
                le64toh(f->header->header_size),
                le64toh(f->header->arena_size),
@@ -3014,6 +3974,15 @@ void journal_file_print_header(JournalFile *f) {
         if (JOURNAL_HEADER_CONTAINS(f->header, n_entry_arrays))
                 printf("Entry Array Objects: %"PRIu64"\n",
                        le64toh(f->header->n_entry_arrays));
+        if (JOURNAL_HEADER_CONTAINS(f->header, dictionary_offset) && f->header->dictionary_offset != 0) {
+                CompressDictionary *dict;
+
+                dict = journal_file_dictionary(f);
+                if (dict)
+                        printf("Compression Dictionary: %"PRIu32" (%zu bytes)\n", dict->id, dict->size);
+                else
+                        printf("Compression Dictionary: unreadable\n");
+        }
 
         if (fstat(f->fd, &st) >= 0)
                 printf("Disk usage: %s\n", format_bytes(bytes, sizeof(bytes), (uint64_t) st.st_blocks * 512ULL));
@@ -3095,7 +4064,9 @@ int journal_file_open(
         f->flags = flags;
         f->prot = prot_from_flags(flags);
         f->writable = (flags & O_ACCMODE) != O_RDONLY;
-#if defined(HAVE_LZ4)
+#if defined(HAVE_ZSTD)
+        f->compress_zstd = compress;
+#elif defined(HAVE_LZ4)
         f->compress_lz4 = compress;
 #elif defined(HAVE_XZ)
         f->compress_xz = compress;
@@ -3104,6 +4075,16 @@ int journal_file_open(
         f->seal = seal;
 #endif
 
+        /* Keyed hashes are used for new files by default, but can be turned off, so that files can be
+         * created which older versions can read */
+        r = getenv_bool("SYSTEMD_JOURNAL_KEYED_HASH");
+        if (r < 0) {
+                if (r != -ENXIO)
+                        log_debug_errno(r, "Failed to parse $SYSTEMD_JOURNAL_KEYED_HASH, ignoring: %m");
+                f->keyed_hash = true;
+        } else
+                f->keyed_hash = r;
+
         if (mmap_cache)
                 f->mmap = mmap_cache_ref(mmap_cache);
         else {
@@ -3227,6 +4208,14 @@ int journal_file_open(
                 } else if (template)
                         f->metrics = template->metrics;
 
+                if (template && template->summary_fields) {
+                        f->summary_fields = strv_copy(template->summary_fields);
+                        if (!f->summary_fields) {
+                                r = -ENOMEM;
+                                goto fail;
+                        }
+                }
+
                 r = journal_file_refresh_header(f);
                 if (r < 0)
                         goto fail;
@@ -3239,11 +4228,11 @@ int journal_file_open(
 #endif
 
         if (newly_created) {
-                r = journal_file_setup_field_hash_table(f);
+                r = journal_file_setup_field_hash_table(f, template);
                 if (r < 0)
                         goto fail;
 
-                r = journal_file_setup_data_hash_table(f);
+                r = journal_file_setup_data_hash_table(f, template);
                 if (r < 0)
                         goto fail;
 
@@ -3252,6 +4241,14 @@ int journal_file_open(
                 if (r < 0)
                         goto fail;
 #endif
+
+#ifdef HAVE_ZSTD
+                if (template && f->compress_zstd) {
+                        r = journal_file_setup_dictionary(f, template);
+                        if (r < 0)
+                                goto fail;
+                }
+#endif
         }
 
         if (mmap_cache_got_sigbus(f->mmap, f->cache_fd)) {
@@ -3284,10 +4281,37 @@ fail:
         return r;
 }
 
+int journal_file_archived_path(JournalFile *f, char **ret) {
+        size_t l;
+
+        assert(f);
+        assert(ret);
+
+        /* The name a file gets when it is rotated */
+
+        /* Is this a journal file that was passed to us as fd? If so, we synthesized a path name for it, and we refuse
+         * rotation, since we don't know the actual path, and couldn't rename the file hence. */
+        if (path_startswith(f->path, "/proc/self/fd"))
+                return -EINVAL;
+
+        if (!endswith(f->path, ".journal"))
+                return -EINVAL;
+
+        l = strlen(f->path);
+        if (asprintf(ret, "%.*s@" SD_ID128_FORMAT_STR "-%016"PRIx64"-%016"PRIx64".journal",
+                     (int) l - 8, f->path,
+                     SD_ID128_FORMAT_VAL(f->header->seqnum_id),
+                     le64toh(f->header->head_entry_seqnum),
+                     le64toh(f->header->head_entry_realtime)) < 0)
+                return -ENOMEM;
+
+        return 0;
+}
+
 int journal_file_rotate(JournalFile **f, bool compress, bool seal, Set *deferred_closes) {
         _cleanup_free_ char *p = NULL;
-        size_t l;
         JournalFile *old_file, *new_file = NULL;
+        bool renamed;
         int r;
 
         assert(f);
@@ -3298,22 +4322,9 @@ int journal_file_rotate(JournalFile **f, bool compress, bool seal, Set *deferred
         if (!old_file->writable)
                 return -EINVAL;
 
-        /* Is this a journal file that was passed to us as fd? If so, we synthesized a path name for it, and we refuse
-         * rotation, since we don't know the actual path, and couldn't rename the file hence. */
-        if (path_startswith(old_file->path, "/proc/self/fd"))
-                return -EINVAL;
-
-        if (!endswith(old_file->path, ".journal"))
-                return -EINVAL;
-
-        l = strlen(old_file->path);
-        r = asprintf(&p, "%.*s@" SD_ID128_FORMAT_STR "-%016"PRIx64"-%016"PRIx64".journal",
-                     (int) l - 8, old_file->path,
-                     SD_ID128_FORMAT_VAL(old_file->header->seqnum_id),
-                     le64toh((*f)->header->head_entry_seqnum),
-                     le64toh((*f)->header->head_entry_realtime));
+        r = journal_file_archived_path(old_file, &p);
         if (r < 0)
-                return -ENOMEM;
+                return r;
 
         /* Try to rename the file to the archived version. If the file
          * already was deleted, we'll get ENOENT, let's ignore that
@@ -3321,6 +4332,7 @@ int journal_file_rotate(JournalFile **f, bool compress, bool seal, Set *deferred
         r = rename(old_file->path, p);
         if (r < 0 && errno != ENOENT)
                 return -errno;
+        renamed = r >= 0;
 
         /* Sync the rename to disk */
         (void) fsync_directory_of_file(old_file->fd);
@@ -3340,6 +4352,10 @@ int journal_file_rotate(JournalFile **f, bool compress, bool seal, Set *deferred
 
         r = journal_file_open(-1, old_file->path, old_file->flags, old_file->mode, compress, seal, NULL, old_file->mmap, deferred_closes, old_file, &new_file);
 
+        /* From now on refer to the old file by its archived name, so that its summary is written next to it */
+        if (renamed)
+                free_and_replace(old_file->path, p);
+
         if (deferred_closes &&
             set_put(deferred_closes, old_file) >= 0)
                 (void) journal_file_set_offline(old_file, false);
@@ -3434,7 +4450,7 @@ int journal_file_copy_entry(JournalFile *from, JournalFile *to, Object *o, uint6
         items = alloca(sizeof(EntryItem) * MAX(1u, n));
 
         for (i = 0; i < n; i++) {
-                uint64_t l, h;
+                uint64_t l, h, dh, ih;
                 le64_t le_hash;
                 size_t t;
                 void *data;
@@ -3458,11 +4474,12 @@ int journal_file_copy_entry(JournalFile *from, JournalFile *to, Object *o, uint6
                         return -E2BIG;
 
                 if (o->object.flags & OBJECT_COMPRESSION_MASK) {
-#if defined(HAVE_XZ) || defined(HAVE_LZ4)
+#if defined(HAVE_XZ) || defined(HAVE_LZ4) || defined(HAVE_ZSTD)
                         size_t rsize = 0;
 
                         r = decompress_blob(o->object.flags & OBJECT_COMPRESSION_MASK,
-                                            o->data.payload, l, &from->compress_buffer, &from->compress_buffer_size, &rsize, 0);
+                                            o->data.payload, l, &from->compress_buffer, &from->compress_buffer_size, &rsize, 0,
+                                            journal_file_dictionary(from));
                         if (r < 0)
                                 return r;
 
@@ -3474,11 +4491,15 @@ int journal_file_copy_entry(JournalFile *from, JournalFile *to, Object *o, uint6
                 } else
                         data = o->data.payload;
 
-                r = journal_file_append_data(to, data, l, &u, &h);
+                /* Calculate these before appending, as that might invalidate data */
+                dh = journal_file_hash_data(to, data, l);
+                ih = journal_file_entry_item_hash(to, data, l, dh);
+
+                r = journal_file_append_data_with_hash(to, data, l, dh, &u, &h);
                 if (r < 0)
                         return r;
 
-                xor_hash ^= le64toh(u->data.hash);
+                xor_hash ^= ih;
                 items[i].object_offset = htole64(h);
                 items[i].hash = u->data.hash;
 
@@ -27,8 +27,10 @@
 
 #include "sd-id128.h"
 
+#include "compress.h"
 #include "hashmap.h"
 #include "journal-def.h"
+#include "list.h"
 #include "macro.h"
 #include "mmap-cache.h"
 #include "sd-event.h"
@@ -73,6 +75,12 @@ typedef enum OfflineState {
         OFFLINE_DONE
 } OfflineState;
 
+typedef struct JournalEntryBatchItem {
+        const dual_timestamp *ts; /* NULL means "now" */
+        const struct iovec *iovec;
+        unsigned n_iovec;
+} JournalEntryBatchItem;
+
 typedef struct JournalFile {
         int fd;
         MMapFileDescriptor *cache_fd;
@@ -84,6 +92,8 @@ typedef struct JournalFile {
         bool writable:1;
         bool compress_xz:1;
         bool compress_lz4:1;
+        bool compress_zstd:1;
+        bool keyed_hash:1;
         bool seal:1;
         bool defrag_on_close:1;
         bool close_fd:1;
@@ -118,17 +128,53 @@ typedef struct JournalFile {
 
         OrderedHashmap *chain_cache;
 
-        pthread_t offline_thread;
+        /* The fields whose values are listed in the summary written on archival, NULL for the defaults */
+        char **summary_fields;
+
+        /* The summary of an archived file, opened on first use and kept with the file */
+        struct JournalSummary *summary;
+        bool summary_checked;
+
         volatile OfflineState offline_state;
+        bool offline_pending; /* queued or running in the offline thread pool */
+        usec_t offline_submitted_usec;
+        usec_t offline_latency_usec;
+        LIST_FIELDS(struct JournalFile, offline_queue);
 
-#if defined(HAVE_XZ) || defined(HAVE_LZ4)
+#if defined(HAVE_XZ) || defined(HAVE_LZ4) || defined(HAVE_ZSTD)
         void *compress_buffer;
         size_t compress_buffer_size;
 #endif
 
+#ifdef HAVE_ZSTD
+        CompressDictionary *dictionary;
+
+        /* How many files used the dictionary before this one */
+        unsigned dictionary_carried_over;
+
+        /* Payloads collected to train a dictionary from for the file replacing this one */
+        void *dictionary_samples;
+        size_t dictionary_samples_size;
+        size_t dictionary_samples_allocated;
+        size_t *dictionary_sample_sizes;
+        size_t dictionary_sample_sizes_allocated;
+        unsigned n_dictionary_samples;
+
+        /* Once enough payloads were collected, an offline thread trains a dictionary from them, which is
+         * left here. The payloads are not touched anymore then. All but the first field are protected by
+         * the mutex of the offline threads. */
+        bool dictionary_training_submitted;
+        bool dictionary_training_pending; /* queued or running in the offline thread pool */
+        void *dictionary_trained;
+        size_t dictionary_trained_size;
+        LIST_FIELDS(struct JournalFile, dictionary_queue);
+#endif
+
 #ifdef HAVE_GCRYPT
         gcry_md_hd_t hmac;
         bool hmac_running;
+        void *hmac_batch;
+        size_t hmac_batch_size;
 
         FSSHeader *fss_file;
         size_t fss_file_size;
@@ -159,6 +205,9 @@ int journal_file_open(
 
 int journal_file_set_offline(JournalFile *f, bool wait);
 bool journal_file_is_offlining(JournalFile *f);
+int journal_file_offline_notify_fd(void);
+usec_t journal_file_get_offline_latency(JournalFile *f);
+void journal_file_wait_for_dictionary(JournalFile *f);
 JournalFile* journal_file_close(JournalFile *j);
 void journal_file_close_set(Set *s);
 
@@ -208,6 +257,12 @@ static inline bool VALID_EPOCH(uint64_t u) {
 #define JOURNAL_HEADER_COMPRESSED_LZ4(h) \
         (!!(le32toh((h)->incompatible_flags) & HEADER_INCOMPATIBLE_COMPRESSED_LZ4))
 
+#define JOURNAL_HEADER_COMPRESSED_ZSTD(h) \
+        (!!(le32toh((h)->incompatible_flags) & HEADER_INCOMPATIBLE_COMPRESSED_ZSTD))
+
+#define JOURNAL_HEADER_KEYED_HASH(h) \
+        (!!(le32toh((h)->incompatible_flags) & HEADER_INCOMPATIBLE_KEYED_HASH))
+
 int journal_file_move_to_object(JournalFile *f, ObjectType type, uint64_t offset, Object **ret);
 
 uint64_t journal_file_entry_n_items(Object *o) _pure_;
@@ -216,6 +271,9 @@ uint64_t journal_file_hash_table_n_items(Object *o) _pure_;
 
 int journal_file_append_object(JournalFile *f, ObjectType type, uint64_t size, Object **ret, uint64_t *offset);
 int journal_file_append_entry(JournalFile *f, const dual_timestamp *ts, const struct iovec iovec[], unsigned n_iovec, uint64_t *seqno, Object **ret, uint64_t *offset);
+int journal_file_append_entries(JournalFile *f, const JournalEntryBatchItem entries[], unsigned n_entries, uint64_t *seqno, unsigned *ret_n_appended);
+
+uint64_t journal_file_hash_data(JournalFile *f, const void *data, size_t size);
 
 int journal_file_find_data_object(JournalFile *f, const void *data, uint64_t size, Object **ret, uint64_t *offset);
 int journal_file_find_data_object_with_hash(JournalFile *f, const void *data, uint64_t size, uint64_t hash, Object **ret, uint64_t *offset);
@@ -244,6 +302,7 @@ int journal_file_copy_entry(JournalFile *from, JournalFile *to, Object *o, uint6
 void journal_file_dump(JournalFile *f);
 void journal_file_print_header(JournalFile *f);
 
+int journal_file_archived_path(JournalFile *f, char **ret);
 int journal_file_rotate(JournalFile **f, bool compress, bool seal, Set *deferred_closes);
 
 void journal_file_post_change(JournalFile *f);
@@ -260,7 +319,9 @@ bool journal_file_rotate_suggested(JournalFile *f, usec_t max_file_usec);
 int journal_file_map_data_hash_table(JournalFile *f);
 int journal_file_map_field_hash_table(JournalFile *f);
 
+CompressDictionary* journal_file_dictionary(JournalFile *f);
+
 static inline bool JOURNAL_FILE_COMPRESS(JournalFile *f) {
         assert(f);
-        return f->compress_xz || f->compress_lz4;
+        return f->compress_xz || f->compress_lz4 || f->compress_zstd;
 }
@@ -29,12 +29,14 @@
 #include "hashmap.h"
 #include "journal-def.h"
 #include "journal-file.h"
+#include "journal-summary.h"
 #include "list.h"
 #include "set.h"
 
 typedef struct Match Match;
 typedef struct Location Location;
 typedef struct Directory Directory;
+typedef struct SeekPool SeekPool;
 
 typedef enum MatchType {
         MATCH_DISCRETE,
@@ -90,6 +92,12 @@ struct sd_journal {
         OrderedHashmap *files;
         MMapCache *mmap;
 
+        /* Archived files found in directories, which are only opened once their summary doesn't rule out that
+         * they have entries matching, or something needs all files. By path. */
+        Hashmap *deferred_files;
+        /* Changed whenever the matches are, so that files are tested against their summary only once */
+        unsigned match_generation;
+
         Location current_location;
 
         JournalFile *current_file;
@@ -107,6 +115,12 @@ struct sd_journal {
         char *unique_field;
         JournalFile *unique_file;
         uint64_t unique_offset;
+        /* The values of the field in unique_file, if its summary lists them */
+        JournalSummaryValues unique_summary_values;
+        /* The values returned so far, by their hash, to recognize them when found in later files */
+        Hashmap *unique_values;
+        char *unique_buffer;
+        size_t unique_buffer_allocated;
 
         /* Iterating through known fields */
         JournalFile *fields_file;
@@ -125,11 +139,16 @@ struct sd_journal {
                                     files, so sd_j_enumerate_unique
                                     will return a value equal to 0. */
         bool fields_file_lost:1;
+        bool unique_from_summary:1;
         bool has_runtime_files:1;
         bool has_persistent_files:1;
 
         size_t data_threshold;
 
+        /* With SD_JOURNAL_PARALLEL: how many threads to position files with at max, 0 picks automatically */
+        unsigned n_threads_max;
+        SeekPool *seek_pool;
+
         Hashmap *directories_by_path;
         Hashmap *directories_by_wd;
 
@@ -138,6 +157,7 @@ struct sd_journal {
 
 char *journal_make_match_string(sd_journal *j);
 void journal_print_header(sd_journal *j);
+int journal_open_deferred_files(sd_journal *j);
 
 #define JOURNAL_FOREACH_DATA_RETVAL(j, data, l, retval)                     \
         for (sd_journal_restart_data(j); ((retval) = sd_journal_enumerate_data((j), &(data), &(l))) > 0; )
@@ -41,6 +41,11 @@
 
 #define SNDBUF_SIZE (8*1024*1024)
 
+/* Messages this large are always passed in a memfd. Below this, a datagram is cheaper for journald to
+ * process, but above it the memfd costs about the same, and keeps the datagram from taking up much of
+ * journald's receive queue, which all local clients share. */
+#define MEMFD_THRESHOLD (4*1024*1024)
+
 #define ALLOCA_CODE_FUNC(f, func)                 \
         do {                                      \
                 size_t _fl;                       \
@@ -226,6 +231,7 @@ _public_ int sd_journal_sendv(const struct iovec *iov, int n) {
                 .msg_namelen = SOCKADDR_UN_LEN(sa.un),
         };
         ssize_t k;
+        size_t size = 0;
         bool have_syslog_identifier = false;
         bool seal = true;
 
@@ -303,18 +309,23 @@ _public_ int sd_journal_sendv(const struct iovec *iov, int n) {
         mh.msg_iov = w;
         mh.msg_iovlen = j;
 
-        k = sendmsg(fd, &mh, MSG_NOSIGNAL);
-        if (k >= 0)
-                return 0;
+        for (i = 0; i < j; i++)
+                size += w[i].iov_len;
 
-        /* Fail silently if the journal is not available */
-        if (errno == ENOENT)
-                return 0;
+        if (size < MEMFD_THRESHOLD) {
+                k = sendmsg(fd, &mh, MSG_NOSIGNAL);
+                if (k >= 0)
+                        return 0;
 
-        if (errno != EMSGSIZE && errno != ENOBUFS)
-                return -errno;
+                /* Fail silently if the journal is not available */
+                if (errno == ENOENT)
+                        return 0;
+
+                if (errno != EMSGSIZE && errno != ENOBUFS)
+                        return -errno;
+        }
 
-        /* Message doesn't fit... Let's dump the data in a memfd or
+        /* Message doesn't fit, or is large... Let's dump the data in a memfd or
          * temporary file and just pass a file descriptor of it to the
          * other side.
          *
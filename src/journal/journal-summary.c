@@ -0,0 +1,669 @@
+/***
+  This file is part of systemd.
+
+  systemd is free software; you can redistribute it and/or modify it
+  under the terms of the GNU Lesser General Public License as published by
+  the Free Software Foundation; either version 2.1 of the License, or
+  (at your option) any later version.
+
+  systemd is distributed in the hope that it will be useful, but
+  WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+  Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public License
+  along with systemd; If not, see <http://www.gnu.org/licenses/>.
+***/
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "alloc-util.h"
+#include "compress.h"
+#include "fd-util.h"
+#include "fileio.h"
+#include "io-util.h"
+#include "journal-def.h"
+#include "journal-summary.h"
+#include "string-util.h"
+#include "strv.h"
+#include "util.h"
+
+typedef struct SummaryItem {
+        uint64_t offset;
+        size_t position;
+        size_t size;
+        const uint8_t *value;
+} SummaryItem;
+
+static uint64_t summary_block(uint64_t hash, uint64_t n_blocks) {
+        return (hash >> 32) % n_blocks;
+}
+
+static unsigned summary_bit(uint64_t hash, unsigned i) {
+        uint64_t z;
+
+        /* Remix the hash, so that the bit positions within the block are independent of the block index. Each
+         * bit index takes 9 bits of the result. */
+        assert_cc(JOURNAL_SUMMARY_BLOCK_SIZE * 8 == 512);
+        assert_cc(JOURNAL_SUMMARY_BLOOM_K * 9 <= 64);
+
+        z = hash * UINT64_C(0x9E3779B97F4A7C15);
+        return (z >> (i * 9)) & 511U;
+}
+
+static void summary_add(uint8_t *bloom, uint64_t n_blocks, uint64_t hash) {
+        uint8_t *block;
+        unsigned i;
+
+        block = bloom + summary_block(hash, n_blocks) * JOURNAL_SUMMARY_BLOCK_SIZE;
+
+        for (i = 0; i < JOURNAL_SUMMARY_BLOOM_K; i++) {
+                unsigned b = summary_bit(hash, i);
+
+                block[b / 8] |= 1U << (b % 8);
+        }
+}
+
+static int summary_pread(int fd, void *buf, size_t size, uint64_t offset) {
+        ssize_t k;
+
+        k = pread(fd, buf, size, offset);
+        if (k < 0)
+                return -errno;
+        if ((size_t) k != size)
+                return -EIO;
+
+        return 0;
+}
+
+static int summary_item_compare(const void *a, const void *b) {
+        const SummaryItem *x = a, *y = b;
+        int r;
+
+        r = memcmp(x->value, y->value, MIN(x->size, y->size));
+        if (r != 0)
+                return r;
+
+        if (x->size < y->size)
+                return -1;
+        if (x->size > y->size)
+                return 1;
+
+        return 0;
+}
+
+static int summary_find_field(JournalFile *f, const char *field, uint64_t *ret) {
+        uint64_t n_buckets, hash, q, k = 0;
+        size_t n = strlen(field);
+        HashItem item;
+        char *name;
+        int r;
+
+        /* Looks for the FIELD object with pread(), and returns the offset of its first DATA object, or 0 if the
+         * field isn't in the file at all */
+
+        *ret = 0;
+
+        n_buckets = le64toh(f->header->field_hash_table_size) / sizeof(HashItem);
+        if (n_buckets <= 0)
+                return 0;
+
+        hash = journal_file_hash_data(f, field, n);
+
+        r = summary_pread(f->fd, &item, sizeof(item),
+                          le64toh(f->header->field_hash_table_offset) + (hash % n_buckets) * sizeof(HashItem));
+        if (r < 0)
+                return r;
+
+        name = newa(char, n);
+
+        q = le64toh(item.head_hash_offset);
+        while (q > 0) {
+                FieldObject o;
+
+                if (++k > le64toh(f->header->n_fields))
+                        return -EBADMSG;
+
+                r = summary_pread(f->fd, &o, offsetof(FieldObject, payload), q);
+                if (r < 0)
+                        return r;
+                if (o.object.type != OBJECT_FIELD)
+                        return -EBADMSG;
+
+                if (le64toh(o.hash) == hash &&
+                    le64toh(o.object.size) == offsetof(FieldObject, payload) + n) {
+
+                        r = summary_pread(f->fd, name, n, q + offsetof(FieldObject, payload));
+                        if (r < 0)
+                                return r;
+
+                        if (memcmp(name, field, n) == 0) {
+                                *ret = le64toh(o.head_data_offset);
+                                return 1;
+                        }
+                }
+
+                q = le64toh(o.next_hash_offset);
+        }
+
+        return 0;
+}
+
+static int summary_append_values(JournalFile *f, const char *field, uint8_t **buffer, size_t *allocated, size_t *size) {
+        _cleanup_free_ uint8_t *payload = NULL, *values = NULL;
+        _cleanup_free_ SummaryItem *items = NULL;
+        _cleanup_free_ void *decompressed = NULL;
+        size_t payload_allocated = 0, values_allocated = 0, values_size = 0, items_allocated = 0, n_items = 0,
+                decompressed_allocated = 0, n = strlen(field), record, i;
+        JournalSummaryFieldHeader *h;
+        uint64_t q, k = 0;
+        uint8_t *p;
+        int r;
+
+        /* Appends a record with the sorted values of the field. Returns 0 and appends nothing if the field
+         * has too many values to be listed. */
+
+        r = summary_find_field(f, field, &q);
+        if (r < 0)
+                return r;
+
+        while (q > 0) {
+                const uint8_t *d;
+                uint64_t l;
+                size_t dsize;
+                DataObject o;
+
+                if (++k > le64toh(f->header->n_data))
+                        return -EBADMSG;
+                if (k > JOURNAL_SUMMARY_VALUES_MAX)
+                        return 0;
+
+                r = summary_pread(f->fd, &o, offsetof(DataObject, payload), q);
+                if (r < 0)
+                        return r;
+                if (o.object.type != OBJECT_DATA ||
+                    le64toh(o.object.size) <= offsetof(DataObject, payload))
+                        return -EBADMSG;
+
+                l = le64toh(o.object.size) - offsetof(DataObject, payload);
+                if (l > JOURNAL_SUMMARY_VALUES_SIZE_MAX)
+                        return 0;
+
+                if (!GREEDY_REALLOC(payload, payload_allocated, l))
+                        return -ENOMEM;
+
+                r = summary_pread(f->fd, payload, l, q + offsetof(DataObject, payload));
+                if (r < 0)
+                        return r;
+
+                if (o.object.flags & OBJECT_COMPRESSION_MASK) {
+#if defined(HAVE_XZ) || defined(HAVE_LZ4) || defined(HAVE_ZSTD)
+                        CompressDictionary *dict = NULL;
+
+#ifdef HAVE_ZSTD
+                        /* A file that is archived has its dictionary loaded already, if it has one */
+                        dict = f->dictionary;
+#endif
+                        r = decompress_blob(o.object.flags & OBJECT_COMPRESSION_MASK,
+                                            payload, l, &decompressed, &decompressed_allocated, &dsize, 0, dict);
+                        if (r < 0) {
+                                log_debug_errno(r, "Failed to decompress value of %s in %s, not listing its values: %m", field, f->path);
+                                return 0;
+                        }
+
+                        d = decompressed;
+#else
+                        return -EPROTONOSUPPORT;
+#endif
+                } else {
+                        d = payload;
+                        dsize = l;
+                }
+
+                if (dsize <= n || memcmp(d, field, n) != 0 || d[n] != '=')
+                        return -EBADMSG;
+
+                if (values_size + dsize - n - 1 > JOURNAL_SUMMARY_VALUES_SIZE_MAX)
+                        return 0;
+
+                /* One byte more than needed, so that empty values allocate as well */
+                if (!GREEDY_REALLOC(values, values_allocated, values_size + dsize - n) ||
+                    !GREEDY_REALLOC(items, items_allocated, n_items + 1))
+                        return -ENOMEM;
+
+                items[n_items++] = (SummaryItem) {
+                        .offset = q,
+                        .position = values_size,
+                        .size = dsize - n - 1,
+                };
+
+                memcpy_safe(values + values_size, d + n + 1, dsize - n - 1);
+                values_size += dsize - n - 1;
+
+                q = le64toh(o.next_field_offset);
+        }
+
+        record = sizeof(JournalSummaryFieldHeader) + n + n_items * sizeof(JournalSummaryValue) + values_size;
+
+        for (i = 0; i < n_items; i++)
+                items[i].value = values + items[i].position;
+
+        qsort_safe(items, n_items, sizeof(SummaryItem), summary_item_compare);
+
+        if (!GREEDY_REALLOC(*buffer, *allocated, *size + record))
+                return -ENOMEM;
+
+        h = (JournalSummaryFieldHeader*) (*buffer + *size);
+        h->size = htole64(record);
+        h->n_values = htole64(n_items);
+        h->name_size = htole64(n);
+        p = mempcpy(h->name, field, n);
+
+        for (i = 0; i < n_items; i++) {
+                JournalSummaryValue *v = (JournalSummaryValue*) p;
+
+                v->offset = htole64(items[i].offset);
+                v->size = htole64(items[i].size);
+                p = mempcpy(v->value, items[i].value, items[i].size);
+        }
+
+        assert(p == *buffer + *size + record);
+        *size += record;
+
+        return 1;
+}
+
+int journal_summary_path(const char *journal_path, char **ret) {
+        char *p;
+
+        assert(journal_path);
+        assert(ret);
+
+        p = strappend(journal_path, JOURNAL_SUMMARY_SUFFIX);
+        if (!p)
+                return -ENOMEM;
+
+        *ret = p;
+        return 0;
+}
+
+int journal_file_write_summary(JournalFile *f) {
+        _cleanup_free_ char *p = NULL, *tmp = NULL;
+        _cleanup_free_ HashItem *table = NULL;
+        _cleanup_free_ uint8_t *bloom = NULL, *values = NULL;
+        _cleanup_close_ int fd = -1;
+        JournalSummaryHeader h = {};
+        uint64_t n_data, n_buckets, n_blocks, n = 0, i;
+        size_t values_size = 0, values_allocated = 0;
+        char **field;
+        ssize_t k;
+        int r;
+
+        assert(f);
+        assert(f->fd >= 0);
+        assert(f->header);
+
+        /* This may be called from the offlining thread, hence we must not touch the mmap cache here: all
+         * objects are read with pread() instead. The journal file is not modified anymore at this point. */
+
+        if (!JOURNAL_HEADER_CONTAINS(f->header, n_data))
+                return -EOPNOTSUPP;
+
+        n_data = le64toh(f->header->n_data);
+        n_buckets = le64toh(f->header->data_hash_table_size) / sizeof(HashItem);
+        if (n_buckets <= 0)
+                return -EBADMSG;
+
+        n_blocks = MAX(DIV_ROUND_UP(n_data * JOURNAL_SUMMARY_BITS_PER_ITEM, JOURNAL_SUMMARY_BLOCK_SIZE * 8), 1U);
+
+        table = new(HashItem, n_buckets);
+        bloom = malloc0(n_blocks * JOURNAL_SUMMARY_BLOCK_SIZE);
+        if (!table || !bloom)
+                return -ENOMEM;
+
+        k = pread(f->fd, table, n_buckets * sizeof(HashItem), le64toh(f->header->data_hash_table_offset));
+        if (k < 0)
+                return -errno;
+        if ((size_t) k != n_buckets * sizeof(HashItem))
+                return -EIO;
+
+        for (i = 0; i < n_buckets; i++) {
+                uint64_t q;
+
+                q = le64toh(table[i].head_hash_offset);
+                while (q > 0) {
+                        DataObject o;
+
+                        /* Refuse hash chains that loop, or are longer than the file claims */
+                        if (n >= n_data)
+                                return -EBADMSG;
+
+                        k = pread(f->fd, &o, offsetof(DataObject, payload), q);
+                        if (k < 0)
+                                return -errno;
+                        if ((size_t) k != offsetof(DataObject, payload))
+                                return -EIO;
+                        if (o.object.type != OBJECT_DATA)
+                                return -EBADMSG;
+
+                        summary_add(bloom, n_blocks, le64toh(o.hash));
+                        n++;
+
+                        q = le64toh(o.next_hash_offset);
+                }
+        }
+
+        if (n != n_data)
+                return -EBADMSG;
+
+        STRV_FOREACH(field, f->summary_fields ?: JOURNAL_SUMMARY_FIELDS_DEFAULT) {
+                r = summary_append_values(f, *field, &values, &values_allocated, &values_size);
+                if (r < 0)
+                        return r;
+        }
+
+        memcpy(h.signature, JOURNAL_SUMMARY_SIGNATURE, sizeof(h.signature));
+        h.file_id = f->header->file_id;
+        h.header_size = htole64(sizeof(h));
+        h.n_data = f->header->n_data;
+        h.n_blocks = htole64(n_blocks);
+        if (values_size > 0) {
+                h.values_offset = htole64(sizeof(h) + n_blocks * JOURNAL_SUMMARY_BLOCK_SIZE);
+                h.values_size = htole64(values_size);
+        }
+
+        r = journal_summary_path(f->path, &p);
+        if (r < 0)
+                return r;
+
+        fd = open_tmpfile_linkable(p, O_WRONLY|O_CLOEXEC, &tmp);
+        if (fd < 0)
+                return fd;
+
+        r = loop_write(fd, &h, sizeof(h), false);
+        if (r >= 0)
+                r = loop_write(fd, bloom, n_blocks * JOURNAL_SUMMARY_BLOCK_SIZE, false);
+        if (r >= 0 && values_size > 0)
+                r = loop_write(fd, values, values_size, false);
+        if (r >= 0) {
+                /* A summary might be left over from an earlier offlining attempt, replace it */
+                (void) unlink(p);
+                r = link_tmpfile(fd, tmp, p);
+        }
+        if (r < 0) {
+                if (tmp)
+                        (void) unlink(tmp);
+                return r;
+        }
+
+        return 0;
+}
+
+int journal_summary_open(const char *journal_path, const Header *header, JournalSummary *ret) {
+        _cleanup_free_ char *p = NULL;
+        _cleanup_close_ int fd = -1;
+        JournalSummaryHeader h = {};
+        uint64_t header_size, n_blocks, values_offset, values_size, map_size;
+        struct stat st;
+        void *map;
+        ssize_t k;
+        int r;
+
+        assert(journal_path);
+        assert(header);
+        assert(ret);
+
+        /* Returns 0 if there's no usable summary for the journal file with the specified header, 1 if there
+         * is. Summaries that don't belong to the journal file, or were written before it was last modified
+         * are ignored. */
+
+        if (!JOURNAL_HEADER_CONTAINS(header, n_data))
+                return 0;
+
+        r = journal_summary_path(journal_path, &p);
+        if (r < 0)
+                return r;
+
+        fd = open(p, O_RDONLY|O_CLOEXEC|O_NOCTTY);
+        if (fd < 0)
+                return errno == ENOENT ? 0 : -errno;
+
+        k = pread(fd, &h, sizeof(h), 0);
+        if (k < 0)
+                return -errno;
+        if ((size_t) k < sizeof(h))
+                return 0;
+
+        if (memcmp(h.signature, JOURNAL_SUMMARY_SIGNATURE, sizeof(h.signature)) != 0 ||
+            le32toh(h.incompatible_flags) != 0 ||
+            !sd_id128_equal(h.file_id, header->file_id) ||
+            h.n_data != header->n_data)
+                return 0;
+
+        header_size = le64toh(h.header_size);
+        n_blocks = le64toh(h.n_blocks);
+        if (header_size < sizeof(h) || n_blocks <= 0)
+                return 0;
+
+        if (fstat(fd, &st) < 0)
+                return -errno;
+        if ((uint64_t) st.st_size < header_size + n_blocks * JOURNAL_SUMMARY_BLOCK_SIZE)
+                return 0;
+
+        values_offset = le64toh(h.values_offset);
+        values_size = le64toh(h.values_size);
+
+        /* The Bloom filter is still good if the values are not */
+        if (values_offset < header_size + n_blocks * JOURNAL_SUMMARY_BLOCK_SIZE ||
+            values_size > (uint64_t) st.st_size ||
+            values_offset > (uint64_t) st.st_size - values_size)
+                values_offset = values_size = 0;
+
+        /* The Bloom filter is tested for every seek, hence map it rather than reading it block by block */
+        map_size = header_size + n_blocks * JOURNAL_SUMMARY_BLOCK_SIZE;
+        if (map_size > SIZE_MAX)
+                return 0;
+
+        map = mmap(NULL, map_size, PROT_READ, MAP_SHARED, fd, 0);
+        if (map == MAP_FAILED)
+                return -errno;
+
+        ret->fd = fd;
+        ret->map = map;
+        ret->map_size = map_size;
+        ret->header_size = header_size;
+        ret->n_blocks = n_blocks;
+        ret->values_offset = values_offset;
+        ret->values_size = values_size;
+        fd = -1;
+
+        return 1;
+}
+
+int journal_summary_test(JournalSummary *s, uint64_t hash) {
+        const uint8_t *block;
+        unsigned i;
+
+        assert(s);
+        assert(s->map);
+
+        /* Returns 0 if no DATA object with the specified hash is in the journal file, 1 if there might be one */
+
+        block = s->map + s->header_size + summary_block(hash, s->n_blocks) * JOURNAL_SUMMARY_BLOCK_SIZE;
+
+        for (i = 0; i < JOURNAL_SUMMARY_BLOOM_K; i++) {
+                unsigned b = summary_bit(hash, i);
+
+                if (!(block[b / 8] & (1U << (b % 8))))
+                        return 0;
+        }
+
+        return 1;
+}
+
+int journal_summary_read_values(JournalSummary *s, const char *field, JournalSummaryValues *ret) {
+        size_t n = strlen(field);
+        uint64_t p, end;
+        char *name;
+        int r;
+
+        assert(s);
+        assert(s->fd >= 0);
+        assert(field);
+        assert(ret);
+
+        /* Returns 0 if the field's values are not listed in the summary, 1 if they are. Note that a field
+         * that is listed may have no values, if it isn't in the journal file at all. */
+
+        if (s->values_size <= 0)
+                return 0;
+
+        name = newa(char, n);
+
+        p = s->values_offset;
+        end = s->values_offset + s->values_size;
+
+        while (p < end) {
+                JournalSummaryFieldHeader h;
+                uint64_t size, name_size;
+                uint8_t *record;
+
+                if (end - p < sizeof(h))
+                        return -EBADMSG;
+
+                r = summary_pread(s->fd, &h, sizeof(h), p);
+                if (r < 0)
+                        return r;
+
+                size = le64toh(h.size);
+                name_size = le64toh(h.name_size);
+                if (size < sizeof(h) || size > end - p || name_size > size - sizeof(h))
+                        return -EBADMSG;
+
+                if (name_size == n) {
+                        r = summary_pread(s->fd, name, n, p + sizeof(h));
+                        if (r < 0)
+                                return r;
+
+                        if (memcmp(name, field, n) == 0) {
+                                if (size > SIZE_MAX)
+                                        return -E2BIG;
+
+                                record = malloc(size);
+                                if (!record)
+                                        return -ENOMEM;
+
+                                r = summary_pread(s->fd, record, size, p);
+                                if (r < 0) {
+                                        free(record);
+                                        return r;
+                                }
+
+                                *ret = (JournalSummaryValues) {
+                                        .record = record,
+                                        .size = size,
+                                        .position = sizeof(h) + n,
+                                        .n_values = le64toh(h.n_values),
+                                };
+
+                                return 1;
+                        }
+                }
+
+                p += size;
+        }
+
+        return 0;
+}
+
+void journal_summary_close(JournalSummary *s) {
+        assert(s);
+
+        if (s->map) {
+                (void) munmap(s->map, s->map_size);
+                s->map = NULL;
+        }
+
+        s->fd = safe_close(s->fd);
+}
+
+JournalSummary* journal_summary_free(JournalSummary *s) {
+        if (!s)
+                return NULL;
+
+        journal_summary_close(s);
+        return mfree(s);
+}
+
+int journal_file_get_summary(JournalFile *f, JournalSummary **ret) {
+        _cleanup_free_ JournalSummary *s = NULL;
+        int r;
+
+        assert(f);
+        assert(ret);
+
+        /* Returns 0 if the journal file has no usable summary, 1 if it has one. It is looked for only once,
+         * and then kept open with the file, hence this is only suitable for archived files. */
+
+        if (!f->summary_checked) {
+                s = new0(JournalSummary, 1);
+                if (!s)
+                        return -ENOMEM;
+
+                r = journal_summary_open(f->path, f->header, s);
+                if (r < 0)
+                        return r;
+
+                f->summary_checked = true;
+                if (r > 0) {
+                        f->summary = s;
+                        s = NULL;
+                }
+        }
+
+        *ret = f->summary;
+        return !!f->summary;
+}
+
+int journal_summary_values_next(JournalSummaryValues *v, const void **value, size_t *size, uint64_t *offset) {
+        JournalSummaryValue *e;
+        uint64_t l;
+
+        assert(v);
+        assert(value);
+        assert(size);
+
+        /* Returns the next value of the field, without the field name, and the offset of its DATA object */
+
+        if (v->index >= v->n_values)
+                return 0;
+
+        if (v->size - v->position < sizeof(JournalSummaryValue))
+                return -EBADMSG;
+
+        e = (JournalSummaryValue*) (v->record + v->position);
+        l = le64toh(e->size);
+        if (l > v->size - v->position - sizeof(JournalSummaryValue))
+                return -EBADMSG;
+
+        *value = e->value;
+        *size = l;
+        if (offset)
+                *offset = le64toh(e->offset);
+
+        v->position += sizeof(JournalSummaryValue) + l;
+        v->index++;
+
+        return 1;
+}
+
+void journal_summary_values_done(JournalSummaryValues *v) {
+        assert(v);
+
+        v->record = mfree(v->record);
+        v->size = v->position = 0;
+        v->n_values = v->index = 0;
+}
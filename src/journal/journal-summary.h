@@ -0,0 +1,114 @@
+#pragma once
+
+/***
+  This file is part of systemd.
+
+  systemd is free software; you can redistribute it and/or modify it
+  under the terms of the GNU Lesser General Public License as published by
+  the Free Software Foundation; either version 2.1 of the License, or
+  (at your option) any later version.
+
+  systemd is distributed in the hope that it will be useful, but
+  WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+  Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public License
+  along with systemd; If not, see <http://www.gnu.org/licenses/>.
+***/
+
+#include <inttypes.h>
+
+#include "sd-id128.h"
+
+#include "journal-file.h"
+#include "macro.h"
+#include "sparse-endian.h"
+
+/* A summary is a small sidecar file written next to an archived journal file. It carries a blocked Bloom
+ * filter over the hashes of all DATA objects in the journal file, so that readers can rule out that a file
+ * contains any entry matching a set of field=value matches without mapping the journal file itself.
+ *
+ * After the Bloom filter, a summary may list the distinct values of a few fields that are commonly
+ * enumerated, sorted, so that readers don't have to follow the field's chain of DATA objects through the
+ * journal file to find them. */
+
+#define JOURNAL_SUMMARY_SUFFIX ".summary"
+
+#define JOURNAL_SUMMARY_SIGNATURE ((const char[]) { 'L', 'P', 'K', 'S', 'S', 'U', 'M', 'M' })
+
+/* Every hash sets JOURNAL_SUMMARY_BLOOM_K bits within one block of JOURNAL_SUMMARY_BLOCK_SIZE bytes, so
+ * that testing a hash requires reading a single block only. */
+#define JOURNAL_SUMMARY_BLOCK_SIZE 64U
+#define JOURNAL_SUMMARY_BLOOM_K 7U
+#define JOURNAL_SUMMARY_BITS_PER_ITEM 10U
+
+/* The fields whose values are listed, unless configured otherwise */
+#define JOURNAL_SUMMARY_FIELDS_DEFAULT ((char**) ((const char* const[]) { "_SYSTEMD_UNIT", "PRIORITY", "_BOOT_ID", "_COMM", NULL }))
+
+/* Fields with more or larger values than this are not listed, readers walk their chain instead */
+#define JOURNAL_SUMMARY_VALUES_MAX 65536U
+#define JOURNAL_SUMMARY_VALUES_SIZE_MAX (16U*1024U*1024U)
+
+typedef struct JournalSummaryHeader {
+        uint8_t signature[8]; /* "LPKSSUMM" */
+        le32_t compatible_flags;
+        le32_t incompatible_flags;
+        sd_id128_t file_id;   /* of the journal file this summary belongs to */
+        le64_t header_size;
+        le64_t n_data;
+        le64_t n_blocks;
+        le64_t values_offset;
+        le64_t values_size;
+} _packed_ JournalSummaryHeader;
+
+/* The values of one field. The record is followed by the field name, and then by the values, each one as a
+ * JournalSummaryValue, in memcmp() order. */
+typedef struct JournalSummaryFieldHeader {
+        le64_t size;          /* of the whole record */
+        le64_t n_values;
+        le64_t name_size;
+        uint8_t name[];
+} _packed_ JournalSummaryFieldHeader;
+
+typedef struct JournalSummaryValue {
+        le64_t offset;        /* of the DATA object in the journal file */
+        le64_t size;          /* of the value, without the field name and "=" */
+        uint8_t value[];
+} _packed_ JournalSummaryValue;
+
+typedef struct JournalSummary {
+        int fd;
+
+        /* The header and the Bloom filter, mapped */
+        uint8_t *map;
+        size_t map_size;
+
+        uint64_t header_size;
+        uint64_t n_blocks;
+        uint64_t values_offset;
+        uint64_t values_size;
+} JournalSummary;
+
+/* The values of one field, as read from a summary, and the position when iterating through them */
+typedef struct JournalSummaryValues {
+        uint8_t *record;
+        size_t size;
+        size_t position;
+        uint64_t n_values, index;
+} JournalSummaryValues;
+
+int journal_file_write_summary(JournalFile *f);
+
+int journal_summary_open(const char *journal_path, const Header *header, JournalSummary *ret);
+int journal_summary_test(JournalSummary *s, uint64_t hash);
+int journal_summary_read_values(JournalSummary *s, const char *field, JournalSummaryValues *ret);
+void journal_summary_close(JournalSummary *s);
+JournalSummary* journal_summary_free(JournalSummary *s);
+
+int journal_file_get_summary(JournalFile *f, JournalSummary **ret);
+
+int journal_summary_values_next(JournalSummaryValues *v, const void **value, size_t *size, uint64_t *offset);
+void journal_summary_values_done(JournalSummaryValues *v);
+
+int journal_summary_path(const char *journal_path, char **ret);
@@ -26,10 +26,14 @@
 #include "alloc-util.h"
 #include "dirent-util.h"
 #include "fd-util.h"
+#include "hashmap.h"
 #include "journal-def.h"
 #include "journal-file.h"
+#include "journal-summary.h"
 #include "journal-vacuum.h"
 #include "parse-util.h"
+#include "path-util.h"
+#include "prioq.h"
 #include "string-util.h"
 #include "util.h"
 #include "xattr-util.h"
@@ -43,6 +47,27 @@ struct vacuum_info {
         sd_id128_t seqnum_id;
         uint64_t seqnum;
         bool have_seqnum;
+
+        uint64_t summary_usage;
+
+        /* Archived and corrupted files may be vacuumed, active ones count towards n_max_files */
+        bool archived;
+        bool active;
+        unsigned idx;
+};
+
+struct JournalVacuumIndex {
+        char *directory;
+        DIR *dir;
+
+        Hashmap *files;   /* file name → struct vacuum_info */
+        Prioq *archived;  /* the archived files, oldest first */
+
+        uint64_t usage;
+        uint64_t archived_usage;
+        unsigned n_active;
+
+        uint64_t freed;
 };
 
 static int vacuum_compare(const void *_a, const void *_b) {
@@ -71,11 +96,20 @@ static int vacuum_compare(const void *_a, const void *_b) {
                 return strcmp(a->filename, b->filename);
 }
 
+static void unlink_summary(int fd, const char *fn) {
+        const char *s;
+
+        /* Archived journal files might come with a summary, remove it together with the file */
+        s = strjoina(fn, JOURNAL_SUMMARY_SUFFIX);
+        if (unlinkat(fd, s, 0) < 0 && errno != ENOENT)
+                log_debug_errno(errno, "Failed to delete summary %s, ignoring: %m", s);
+}
+
 static void patch_realtime(
                 int fd,
                 const char *fn,
                 const struct stat *st,
-                unsigned long long *realtime) {
+                usec_t *realtime) {
 
         usec_t x, crtime = 0;
 
@@ -142,208 +176,418 @@ static int journal_file_empty(int dir_fd, const char *name) {
         return le64toh(n_entries) <= 0;
 }
 
-int journal_directory_vacuum(
-                const char *directory,
-                uint64_t max_use,
-                uint64_t n_max_files,
-                usec_t max_retention_usec,
-                usec_t *oldest_usec,
-                bool verbose) {
+static int parse_filename(const char *fn, struct vacuum_info *info) {
+        unsigned long long seqnum, realtime, tmp;
+        size_t q;
 
-        _cleanup_closedir_ DIR *d = NULL;
-        struct vacuum_info *list = NULL;
-        unsigned n_list = 0, i, n_active_files = 0;
-        size_t n_allocated = 0;
-        uint64_t sum = 0, freed = 0;
-        usec_t retention_limit = 0;
-        char sbytes[FORMAT_BYTES_MAX];
-        struct dirent *de;
-        int r;
+        assert(fn);
+        assert(info);
 
-        assert(directory);
+        /* Returns > 0 for archived and corrupted files, which may be vacuumed, 0 for active files, which are
+         * left around, and -EINVAL for anything that is not a journal file */
 
-        if (max_use <= 0 && max_retention_usec <= 0 && n_max_files <= 0)
-                return 0;
+        q = strlen(fn);
 
-        if (max_retention_usec > 0) {
-                retention_limit = now(CLOCK_REALTIME);
-                if (retention_limit > max_retention_usec)
-                        retention_limit -= max_retention_usec;
-                else
-                        max_retention_usec = retention_limit = 0;
+        if (endswith(fn, ".journal")) {
+
+                if (q < 1 + 32 + 1 + 16 + 1 + 16 + 8)
+                        return 0;
+
+                if (fn[q-8-16-1] != '-' ||
+                    fn[q-8-16-1-16-1] != '-' ||
+                    fn[q-8-16-1-16-1-32-1] != '@')
+                        return 0;
+
+                if (sd_id128_from_string(strndupa(fn + q-8-16-1-16-1-32, 32), &info->seqnum_id) < 0)
+                        return 0;
+
+                if (sscanf(fn + q-8-16-1-16, "%16llx-%16llx.journal", &seqnum, &realtime) != 2)
+                        return 0;
+
+                info->seqnum = seqnum;
+                info->realtime = realtime;
+                info->have_seqnum = true;
+                return 1;
+
+        } else if (endswith(fn, ".journal~")) {
+
+                if (q < 1 + 16 + 1 + 16 + 8 + 1)
+                        return 0;
+
+                if (fn[q-1-8-16-1] != '-' ||
+                    fn[q-1-8-16-1-16-1] != '@')
+                        return 0;
+
+                if (sscanf(fn + q-1-8-16-1-16, "%16llx-%16llx.journal~", &realtime, &tmp) != 2)
+                        return 0;
+
+                info->realtime = realtime;
+                info->have_seqnum = false;
+                return 1;
         }
 
-        d = opendir(directory);
-        if (!d)
-                return -errno;
+        return -EINVAL;
+}
 
-        FOREACH_DIRENT_ALL(de, d, r = -errno; goto finish) {
+static struct vacuum_info* vacuum_info_free(struct vacuum_info *info) {
+        if (!info)
+                return NULL;
 
-                unsigned long long seqnum = 0, realtime;
-                _cleanup_free_ char *p = NULL;
-                sd_id128_t seqnum_id;
-                bool have_seqnum;
-                uint64_t size;
-                struct stat st;
-                size_t q;
+        free(info->filename);
+        return mfree(info);
+}
 
-                if (fstatat(dirfd(d), de->d_name, &st, AT_SYMLINK_NOFOLLOW) < 0) {
-                        log_debug_errno(errno, "Failed to stat file %s while vacuuming, ignoring: %m", de->d_name);
-                        continue;
-                }
+DEFINE_TRIVIAL_CLEANUP_FUNC(struct vacuum_info*, vacuum_info_free);
 
-                if (!S_ISREG(st.st_mode))
-                        continue;
+static uint64_t summary_usage(JournalVacuumIndex *i, const char *fn) {
+        struct stat st;
 
-                q = strlen(de->d_name);
+        if (fstatat(dirfd(i->dir), strjoina(fn, JOURNAL_SUMMARY_SUFFIX), &st, AT_SYMLINK_NOFOLLOW) < 0 ||
+            !S_ISREG(st.st_mode))
+                return 0;
 
-                if (endswith(de->d_name, ".journal")) {
+        return 512UL * (uint64_t) st.st_blocks;
+}
 
-                        /* Vacuum archived files. Active files are
-                         * left around */
+static void index_account(JournalVacuumIndex *i, struct vacuum_info *info, bool add) {
+        uint64_t usage = info->usage + info->summary_usage;
+
+        if (add) {
+                i->usage += usage;
+                if (info->archived)
+                        i->archived_usage += info->usage;
+                else if (info->active)
+                        i->n_active++;
+        } else {
+                i->usage = LESS_BY(i->usage, usage);
+                if (info->archived)
+                        i->archived_usage = LESS_BY(i->archived_usage, info->usage);
+                else if (info->active)
+                        i->n_active--;
+        }
+}
 
-                        if (q < 1 + 32 + 1 + 16 + 1 + 16 + 8) {
-                                n_active_files++;
-                                continue;
-                        }
+static void index_remove(JournalVacuumIndex *i, struct vacuum_info *info) {
+        index_account(i, info, false);
 
-                        if (de->d_name[q-8-16-1] != '-' ||
-                            de->d_name[q-8-16-1-16-1] != '-' ||
-                            de->d_name[q-8-16-1-16-1-32-1] != '@') {
-                                n_active_files++;
-                                continue;
-                        }
+        if (info->archived)
+                prioq_remove(i->archived, info, &info->idx);
+        hashmap_remove(i->files, info->filename);
 
-                        p = strdup(de->d_name);
-                        if (!p) {
-                                r = -ENOMEM;
-                                goto finish;
-                        }
+        vacuum_info_free(info);
+}
 
-                        de->d_name[q-8-16-1-16-1] = 0;
-                        if (sd_id128_from_string(de->d_name + q-8-16-1-16-1-32, &seqnum_id) < 0) {
-                                n_active_files++;
-                                continue;
-                        }
+static int index_add(JournalVacuumIndex *i, const char *fn, const struct stat *st, bool verbose) {
+        _cleanup_(vacuum_info_freep) struct vacuum_info *info = NULL;
+        char sbytes[FORMAT_BYTES_MAX];
+        int r;
 
-                        if (sscanf(de->d_name + q-8-16-1-16, "%16llx-%16llx.journal", &seqnum, &realtime) != 2) {
-                                n_active_files++;
-                                continue;
-                        }
+        info = new0(struct vacuum_info, 1);
+        if (!info)
+                return -ENOMEM;
 
-                        have_seqnum = true;
+        info->idx = PRIOQ_IDX_NULL;
 
-                } else if (endswith(de->d_name, ".journal~")) {
-                        unsigned long long tmp;
+        r = parse_filename(fn, info);
+        if (r < 0) {
+                /* We do not vacuum unknown files! */
+                log_debug("Not vacuuming unknown file %s.", fn);
+                return 0;
+        }
 
-                        /* Vacuum corrupted files */
+        info->filename = strdup(fn);
+        if (!info->filename)
+                return -ENOMEM;
 
-                        if (q < 1 + 16 + 1 + 16 + 8 + 1) {
-                                n_active_files++;
-                                continue;
-                        }
+        info->usage = 512UL * (uint64_t) st->st_blocks;
+        info->summary_usage = summary_usage(i, fn);
 
-                        if (de->d_name[q-1-8-16-1] != '-' ||
-                            de->d_name[q-1-8-16-1-16-1] != '@') {
-                                n_active_files++;
-                                continue;
-                        }
+        if (r > 0) {
+                r = journal_file_empty(dirfd(i->dir), fn);
+                if (r < 0)
+                        /* Counted towards the usage, but neither vacuumed nor considered active */
+                        log_debug_errno(r, "Failed check if %s is empty, ignoring: %m", fn);
+                else if (r > 0) {
+                        /* Always vacuum empty non-online files. */
 
-                        p = strdup(de->d_name);
-                        if (!p) {
-                                r = -ENOMEM;
-                                goto finish;
-                        }
+                        if (unlinkat(dirfd(i->dir), fn, 0) >= 0) {
+                                unlink_summary(dirfd(i->dir), fn);
 
-                        if (sscanf(de->d_name + q-1-8-16-1-16, "%16llx-%16llx.journal~", &realtime, &tmp) != 2) {
-                                n_active_files++;
-                                continue;
+                                log_full(verbose ? LOG_INFO : LOG_DEBUG,
+                                         "Deleted empty archived journal %s/%s (%s).", i->directory, fn, format_bytes(sbytes, sizeof(sbytes), info->usage));
+
+                                i->freed += info->usage + info->summary_usage;
+                                return 0;
                         }
 
-                        have_seqnum = false;
+                        if (errno != ENOENT)
+                                log_warning_errno(errno, "Failed to delete empty archived journal %s/%s: %m", i->directory, fn);
+                        return 0;
                 } else {
-                        /* We do not vacuum unknown files! */
-                        log_debug("Not vacuuming unknown file %s.", de->d_name);
-                        continue;
+                        patch_realtime(dirfd(i->dir), fn, st, &info->realtime);
+                        info->archived = true;
                 }
+        } else
+                info->active = true;
 
-                size = 512UL * (uint64_t) st.st_blocks;
+        r = hashmap_put(i->files, info->filename, info);
+        if (r < 0)
+                return r;
 
-                r = journal_file_empty(dirfd(d), p);
+        if (info->archived) {
+                r = prioq_put(i->archived, info, &info->idx);
                 if (r < 0) {
-                        log_debug_errno(r, "Failed check if %s is empty, ignoring: %m", p);
-                        continue;
+                        hashmap_remove(i->files, info->filename);
+                        return r;
                 }
-                if (r > 0) {
-                        /* Always vacuum empty non-online files. */
+        }
 
-                        if (unlinkat(dirfd(d), p, 0) >= 0) {
+        index_account(i, info, true);
+        info = NULL;
 
-                                log_full(verbose ? LOG_INFO : LOG_DEBUG,
-                                         "Deleted empty archived journal %s/%s (%s).", directory, p, format_bytes(sbytes, sizeof(sbytes), size));
+        return 1;
+}
 
-                                freed += size;
-                        } else if (errno != ENOENT)
-                                log_warning_errno(errno, "Failed to delete empty archived journal %s/%s: %m", directory, p);
+int journal_vacuum_index_new(const char *directory, bool verbose, JournalVacuumIndex **ret) {
+        _cleanup_(journal_vacuum_index_freep) JournalVacuumIndex *i = NULL;
+        struct dirent *de;
+        int r;
 
+        assert(directory);
+        assert(ret);
+
+        i = new0(JournalVacuumIndex, 1);
+        if (!i)
+                return -ENOMEM;
+
+        i->directory = strdup(directory);
+        if (!i->directory)
+                return -ENOMEM;
+
+        i->files = hashmap_new(&string_hash_ops);
+        if (!i->files)
+                return -ENOMEM;
+
+        i->archived = prioq_new(vacuum_compare);
+        if (!i->archived)
+                return -ENOMEM;
+
+        i->dir = opendir(directory);
+        if (!i->dir)
+                return -errno;
+
+        FOREACH_DIRENT_ALL(de, i->dir, return -errno) {
+                struct stat st;
+
+                if (fstatat(dirfd(i->dir), de->d_name, &st, AT_SYMLINK_NOFOLLOW) < 0) {
+                        /* Summaries are removed together with their journal file, possibly before we get to them */
+                        if (errno != ENOENT)
+                                log_debug_errno(errno, "Failed to stat file %s while vacuuming, ignoring: %m", de->d_name);
                         continue;
                 }
 
-                patch_realtime(dirfd(d), p, &st, &realtime);
+                if (!S_ISREG(st.st_mode))
+                        continue;
 
-                if (!GREEDY_REALLOC(list, n_allocated, n_list + 1)) {
-                        r = -ENOMEM;
-                        goto finish;
+                if (endswith(de->d_name, ".journal" JOURNAL_SUMMARY_SUFFIX)) {
+                        const char *fn;
+
+                        /* Summaries are accounted for with their journal file. Vacuum those whose journal
+                         * file is gone. */
+
+                        fn = strndupa(de->d_name, strlen(de->d_name) - strlen(JOURNAL_SUMMARY_SUFFIX));
+                        if (faccessat(dirfd(i->dir), fn, F_OK, AT_SYMLINK_NOFOLLOW) >= 0 || errno != ENOENT)
+                                continue;
+
+                        if (unlinkat(dirfd(i->dir), de->d_name, 0) >= 0)
+                                i->freed += 512UL * (uint64_t) st.st_blocks;
+                        else if (errno != ENOENT)
+                                log_debug_errno(errno, "Failed to delete stale summary %s/%s, ignoring: %m", directory, de->d_name);
+
+                        continue;
                 }
 
-                list[n_list].filename = p;
-                list[n_list].usage = size;
-                list[n_list].seqnum = seqnum;
-                list[n_list].realtime = realtime;
-                list[n_list].seqnum_id = seqnum_id;
-                list[n_list].have_seqnum = have_seqnum;
-                n_list++;
+                r = index_add(i, de->d_name, &st, verbose);
+                if (r < 0)
+                        return r;
+        }
+
+        *ret = i;
+        i = NULL;
+
+        return 0;
+}
+
+JournalVacuumIndex* journal_vacuum_index_free(JournalVacuumIndex *i) {
+        struct vacuum_info *info;
+
+        if (!i)
+                return NULL;
 
-                p = NULL;
-                sum += size;
+        while ((info = hashmap_steal_first(i->files)))
+                vacuum_info_free(info);
+
+        hashmap_free(i->files);
+        prioq_free(i->archived);
+
+        if (i->dir)
+                closedir(i->dir);
+        free(i->directory);
+
+        return mfree(i);
+}
+
+int journal_vacuum_index_update(JournalVacuumIndex *i, const char *path) {
+        struct vacuum_info *info;
+        struct stat st;
+        const char *fn;
+
+        assert(i);
+        assert(path);
+
+        /* Picks up a file that was created, has grown, or was archived since the directory was listed, and
+         * drops it if it is gone. Files in other directories are ignored. */
+
+        fn = path_startswith(path, i->directory);
+        if (isempty(fn) || strchr(fn, '/'))
+                return 0;
+
+        info = hashmap_get(i->files, fn);
+
+        if (fstatat(dirfd(i->dir), fn, &st, AT_SYMLINK_NOFOLLOW) < 0) {
+                if (errno != ENOENT)
+                        return -errno;
+
+                if (info)
+                        index_remove(i, info);
+                return 0;
         }
 
-        qsort_safe(list, n_list, sizeof(struct vacuum_info), vacuum_compare);
+        if (!S_ISREG(st.st_mode))
+                return 0;
+
+        if (!info)
+                return index_add(i, fn, &st, false);
+
+        /* Everything else about the file is derived from its name, only the sizes change */
+        index_account(i, info, false);
+        info->usage = 512UL * (uint64_t) st.st_blocks;
+        info->summary_usage = summary_usage(i, fn);
+        index_account(i, info, true);
+
+        return 1;
+}
+
+uint64_t journal_vacuum_index_usage(JournalVacuumIndex *i) {
+        assert(i);
+
+        /* The space used by all journal files and their summaries */
+        return i->usage;
+}
+
+unsigned journal_vacuum_index_n_archived(JournalVacuumIndex *i) {
+        assert(i);
 
-        for (i = 0; i < n_list; i++) {
+        return prioq_size(i->archived);
+}
+
+int journal_vacuum_index_vacuum(
+                JournalVacuumIndex *i,
+                uint64_t max_use,
+                uint64_t n_max_files,
+                usec_t max_retention_usec,
+                usec_t *oldest_usec,
+                bool verbose) {
+
+        _cleanup_free_ struct vacuum_info **failed = NULL;
+        size_t n_failed = 0, n_allocated = 0, k;
+        struct vacuum_info *info;
+        usec_t retention_limit = 0;
+        char sbytes[FORMAT_BYTES_MAX];
+        int r = 0;
+
+        assert(i);
+
+        if (max_retention_usec > 0) {
+                retention_limit = now(CLOCK_REALTIME);
+                if (retention_limit > max_retention_usec)
+                        retention_limit -= max_retention_usec;
+                else
+                        max_retention_usec = retention_limit = 0;
+        }
+
+        /* Only archived files are counted against max_use, and we remove the oldest of them until we are below
+         * all limits. Files we fail to remove are put back once we are done. */
+        while ((info = prioq_peek(i->archived))) {
                 unsigned left;
 
-                left = n_active_files + n_list - i;
+                left = i->n_active + prioq_size(i->archived) + n_failed;
 
-                if ((max_retention_usec <= 0 || list[i].realtime >= retention_limit) &&
-                    (max_use <= 0 || sum <= max_use) &&
+                if ((max_retention_usec <= 0 || info->realtime >= retention_limit) &&
+                    (max_use <= 0 || i->archived_usage <= max_use) &&
                     (n_max_files <= 0 || left <= n_max_files))
                         break;
 
-                if (unlinkat(dirfd(d), list[i].filename, 0) >= 0) {
-                        log_full(verbose ? LOG_INFO : LOG_DEBUG, "Deleted archived journal %s/%s (%s).", directory, list[i].filename, format_bytes(sbytes, sizeof(sbytes), list[i].usage));
-                        freed += list[i].usage;
+                if (unlinkat(dirfd(i->dir), info->filename, 0) >= 0) {
+                        unlink_summary(dirfd(i->dir), info->filename);
 
-                        if (list[i].usage < sum)
-                                sum -= list[i].usage;
-                        else
-                                sum = 0;
+                        log_full(verbose ? LOG_INFO : LOG_DEBUG, "Deleted archived journal %s/%s (%s).", i->directory, info->filename, format_bytes(sbytes, sizeof(sbytes), info->usage));
+                        i->freed += info->usage + info->summary_usage;
 
-                } else if (errno != ENOENT)
-                        log_warning_errno(errno, "Failed to delete archived journal %s/%s: %m", directory, list[i].filename);
-        }
+                } else if (errno != ENOENT) {
+                        log_warning_errno(errno, "Failed to delete archived journal %s/%s: %m", i->directory, info->filename);
+
+                        if (!GREEDY_REALLOC(failed, n_allocated, n_failed + 1)) {
+                                r = -ENOMEM;
+                                break;
+                        }
 
-        if (oldest_usec && i < n_list && (*oldest_usec == 0 || list[i].realtime < *oldest_usec))
-                *oldest_usec = list[i].realtime;
+                        assert_se(prioq_pop(i->archived) == info);
+                        info->idx = PRIOQ_IDX_NULL;
+                        failed[n_failed++] = info;
+                        continue;
+                }
+
+                index_remove(i, info);
+        }
 
-        r = 0;
+        if (oldest_usec && info && (*oldest_usec == 0 || info->realtime < *oldest_usec))
+                *oldest_usec = info->realtime;
 
-finish:
-        for (i = 0; i < n_list; i++)
-                free(list[i].filename);
-        free(list);
+        for (k = 0; k < n_failed; k++)
+                if (prioq_put(i->archived, failed[k], &failed[k]->idx) < 0) {
+                        /* Forget about the file, the next listing of the directory will find it again */
+                        index_account(i, failed[k], false);
+                        hashmap_remove(i->files, failed[k]->filename);
+                        vacuum_info_free(failed[k]);
+                        r = -ENOMEM;
+                }
 
-        log_full(verbose ? LOG_INFO : LOG_DEBUG, "Vacuuming done, freed %s of archived journals from %s.", format_bytes(sbytes, sizeof(sbytes), freed), directory);
+        log_full(verbose ? LOG_INFO : LOG_DEBUG, "Vacuuming done, freed %s of archived journals from %s.", format_bytes(sbytes, sizeof(sbytes), i->freed), i->directory);
+        i->freed = 0;
 
         return r;
 }
+
+int journal_directory_vacuum(
+                const char *directory,
+                uint64_t max_use,
+                uint64_t n_max_files,
+                usec_t max_retention_usec,
+                usec_t *oldest_usec,
+                bool verbose) {
+
+        _cleanup_(journal_vacuum_index_freep) JournalVacuumIndex *i = NULL;
+        int r;
+
+        assert(directory);
+
+        if (max_use <= 0 && max_retention_usec <= 0 && n_max_files <= 0)
+                return 0;
+
+        r = journal_vacuum_index_new(directory, verbose, &i);
+        if (r < 0)
+                return r;
+
+        return journal_vacuum_index_vacuum(i, max_use, n_max_files, max_retention_usec, oldest_usec, verbose);
+}
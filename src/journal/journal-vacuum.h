@@ -22,6 +22,21 @@
 #include <inttypes.h>
 #include <stdbool.h>
 
+#include "macro.h"
 #include "time-util.h"
 
+/* An index of the journal files in a directory and their sizes, with the archived files ordered oldest
+ * first. It is built by listing the directory once, and then kept up-to-date by telling it about the files
+ * that changed, so that repeated vacuuming only needs to look at the files it removes. */
+typedef struct JournalVacuumIndex JournalVacuumIndex;
+
+int journal_vacuum_index_new(const char *directory, bool verbose, JournalVacuumIndex **ret);
+JournalVacuumIndex* journal_vacuum_index_free(JournalVacuumIndex *i);
+DEFINE_TRIVIAL_CLEANUP_FUNC(JournalVacuumIndex*, journal_vacuum_index_free);
+
+int journal_vacuum_index_update(JournalVacuumIndex *i, const char *path);
+uint64_t journal_vacuum_index_usage(JournalVacuumIndex *i) _pure_;
+unsigned journal_vacuum_index_n_archived(JournalVacuumIndex *i) _pure_;
+int journal_vacuum_index_vacuum(JournalVacuumIndex *i, uint64_t max_use, uint64_t n_max_files, usec_t max_retention_usec, usec_t *oldest_usec, bool verbose);
+
 int journal_directory_vacuum(const char *directory, uint64_t max_use, uint64_t n_max_files, usec_t max_retention_usec, usec_t *oldest_usec, bool verbose);
@@ -17,21 +17,15 @@
   along with systemd; If not, see <http://www.gnu.org/licenses/>.
 ***/
 
-#include <fcntl.h>
 #include <stddef.h>
-#include <sys/mman.h>
 #include <unistd.h>
 
 #include "alloc-util.h"
 #include "compress.h"
-#include "fd-util.h"
-#include "fileio.h"
-#include "fs-util.h"
 #include "journal-authenticate.h"
 #include "journal-def.h"
 #include "journal-file.h"
 #include "journal-verify.h"
-#include "lookup3.h"
 #include "macro.h"
 #include "terminal-util.h"
 #include "util.h"
@@ -171,16 +165,16 @@ static int journal_file_object_verify(JournalFile *f, uint64_t offset, Object *o
                         r = decompress_blob(compression,
                                             o->data.payload,
                                             le64toh(o->object.size) - offsetof(Object, data.payload),
-                                            &b, &alloc, &b_size, 0);
+                                            &b, &alloc, &b_size, 0, journal_file_dictionary(f));
                         if (r < 0) {
                                 error_errno(offset, r, "%s decompression failed: %m",
                                             object_compressed_to_string(compression));
                                 return r;
                         }
 
-                        h2 = hash64(b, b_size);
+                        h2 = journal_file_hash_data(f, b, b_size);
                 } else
-                        h2 = hash64(o->data.payload, le64toh(o->object.size) - offsetof(Object, data.payload));
+                        h2 = journal_file_hash_data(f, o->data.payload, le64toh(o->object.size) - offsetof(Object, data.payload));
 
                 if (h1 != h2) {
                         error(offset, "Invalid hash (%08"PRIx64" vs. %08"PRIx64, h1, h2);
@@ -359,62 +353,101 @@ static int journal_file_object_verify(JournalFile *f, uint64_t offset, Object *o
                         return -EBADMSG;
                 }
 
+                break;
+
+        case OBJECT_DICTIONARY:
+                if (le64toh(o->object.size) <= offsetof(DictionaryObject, payload)) {
+                        error(offset,
+                              "Bad dictionary size (<= %zu): %"PRIu64,
+                              offsetof(DictionaryObject, payload),
+                              le64toh(o->object.size));
+                        return -EBADMSG;
+                }
+
                 break;
         }
 
         return 0;
 }
 
-static int write_uint64(int fd, uint64_t p) {
-        ssize_t k;
+/* The offsets of all objects of one type. Objects are found in the order they are in the file, hence the
+ * offsets are appended in ascending order and may be looked up by bisection. */
+typedef struct OffsetSet {
+        uint64_t *offsets;
+        size_t n, allocated;
+} OffsetSet;
+
+static int offset_set_add(OffsetSet *s, uint64_t p) {
+        assert(s);
+        assert(s->n == 0 || s->offsets[s->n - 1] < p);
 
-        k = write(fd, &p, sizeof(p));
-        if (k < 0)
-                return -errno;
-        if (k != sizeof(p))
-                return -EIO;
+        if (!GREEDY_REALLOC(s->offsets, s->allocated, s->n + 1))
+                return -ENOMEM;
 
+        s->offsets[s->n++] = p;
         return 0;
 }
 
-static int contains_uint64(MMapCache *m, MMapFileDescriptor *f, uint64_t n, uint64_t p) {
-        uint64_t a, b;
-        int r;
+static bool offset_set_contains(const OffsetSet *s, uint64_t p) {
+        size_t a, b;
 
-        assert(m);
-        assert(f);
+        assert(s);
 
         /* Bisection ... */
 
-        a = 0; b = n;
+        a = 0; b = s->n;
         while (a < b) {
-                uint64_t c, *z;
+                size_t c;
 
-                c = (a + b) / 2;
+                c = a + (b - a) / 2;
 
-                r = mmap_cache_get(m, f, PROT_READ|PROT_WRITE, 0, false, c * sizeof(uint64_t), sizeof(uint64_t), NULL, (void **) &z, NULL);
-                if (r < 0)
-                        return r;
-
-                if (*z == p)
-                        return 1;
+                if (s->offsets[c] == p)
+                        return true;
 
-                if (a + 1 >= b)
-                        return 0;
-
-                if (p < *z)
+                if (p < s->offsets[c])
                         b = c;
                 else
-                        a = c;
+                        a = c + 1;
         }
 
-        return 0;
+        return false;
+}
+
+/* Limits how fast a file is read, so that it may be verified while the system is busy with other things. The
+ * time to sleep is only calculated after each chunk, not for every object. */
+#define THROTTLE_CHUNK (1024ULL*1024ULL)
+
+typedef struct Throttle {
+        uint64_t max_bytes_per_sec;
+        usec_t begin;
+        uint64_t bytes;
+        uint64_t pending;
+} Throttle;
+
+static void throttle(Throttle *t, uint64_t bytes) {
+        usec_t n, due;
+
+        assert(t);
+
+        if (t->max_bytes_per_sec == 0)
+                return;
+
+        t->pending += bytes;
+        if (t->pending < THROTTLE_CHUNK)
+                return;
+
+        t->bytes += t->pending;
+        t->pending = 0;
+
+        n = now(CLOCK_MONOTONIC);
+        due = t->begin + t->bytes * USEC_PER_SEC / t->max_bytes_per_sec;
+        if (due > n)
+                (void) usleep(due - n);
 }
 
 static int entry_points_to_data(
                 JournalFile *f,
-                MMapFileDescriptor *cache_entry_fd,
-                uint64_t n_entries,
+                const OffsetSet *entries,
                 uint64_t entry_p,
                 uint64_t data_p) {
 
@@ -424,9 +457,9 @@ static int entry_points_to_data(
         bool found = false;
 
         assert(f);
-        assert(cache_entry_fd);
+        assert(entries);
 
-        if (!contains_uint64(f->mmap, cache_entry_fd, n_entries, entry_p)) {
+        if (!offset_set_contains(entries, entry_p)) {
                 error(data_p, "Data object references invalid entry at "OFSfmt, entry_p);
                 return -EBADMSG;
         }
@@ -500,16 +533,16 @@ static int entry_points_to_data(
 static int verify_data(
                 JournalFile *f,
                 Object *o, uint64_t p,
-                MMapFileDescriptor *cache_entry_fd, uint64_t n_entries,
-                MMapFileDescriptor *cache_entry_array_fd, uint64_t n_entry_arrays) {
+                const OffsetSet *entries,
+                const OffsetSet *entry_arrays) {
 
         uint64_t i, n, a, last, q;
         int r;
 
         assert(f);
         assert(o);
-        assert(cache_entry_fd);
-        assert(cache_entry_array_fd);
+        assert(entries);
+        assert(entry_arrays);
 
         n = le64toh(o->data.n_entries);
         a = le64toh(o->data.entry_array_offset);
@@ -527,7 +560,7 @@ static int verify_data(
         assert(o->data.entry_offset);
 
         last = q = le64toh(o->data.entry_offset);
-        r = entry_points_to_data(f, cache_entry_fd, n_entries, q, p);
+        r = entry_points_to_data(f, entries, q, p);
         if (r < 0)
                 return r;
 
@@ -540,7 +573,7 @@ static int verify_data(
                         return -EBADMSG;
                 }
 
-                if (!contains_uint64(f->mmap, cache_entry_array_fd, n_entry_arrays, a)) {
+                if (!offset_set_contains(entry_arrays, a)) {
                         error(p, "Invalid array offset "OFSfmt, a);
                         return -EBADMSG;
                 }
@@ -565,7 +598,7 @@ static int verify_data(
                         }
                         last = q;
 
-                        r = entry_points_to_data(f, cache_entry_fd, n_entries, q, p);
+                        r = entry_points_to_data(f, entries, q, p);
                         if (r < 0)
                                 return r;
 
@@ -583,9 +616,10 @@ static int verify_data(
 
 static int verify_hash_table(
                 JournalFile *f,
-                MMapFileDescriptor *cache_data_fd, uint64_t n_data,
-                MMapFileDescriptor *cache_entry_fd, uint64_t n_entries,
-                MMapFileDescriptor *cache_entry_array_fd, uint64_t n_entry_arrays,
+                const OffsetSet *data,
+                const OffsetSet *entries,
+                const OffsetSet *entry_arrays,
+                Throttle *t,
                 usec_t *last_usec,
                 bool show_progress) {
 
@@ -593,9 +627,10 @@ static int verify_hash_table(
         int r;
 
         assert(f);
-        assert(cache_data_fd);
-        assert(cache_entry_fd);
-        assert(cache_entry_array_fd);
+        assert(data);
+        assert(entries);
+        assert(entry_arrays);
+        assert(t);
         assert(last_usec);
 
         n = le64toh(f->header->data_hash_table_size) / sizeof(HashItem);
@@ -617,7 +652,7 @@ static int verify_hash_table(
                         Object *o;
                         uint64_t next;
 
-                        if (!contains_uint64(f->mmap, cache_data_fd, n_data, p)) {
+                        if (!offset_set_contains(data, p)) {
                                 error(p, "Invalid data object at hash entry %"PRIu64" of %"PRIu64, i, n);
                                 return -EBADMSG;
                         }
@@ -637,7 +672,9 @@ static int verify_hash_table(
                                 return -EBADMSG;
                         }
 
-                        r = verify_data(f, o, p, cache_entry_fd, n_entries, cache_entry_array_fd, n_entry_arrays);
+                        throttle(t, ALIGN64(le64toh(o->object.size)));
+
+                        r = verify_data(f, o, p, entries, entry_arrays);
                         if (r < 0)
                                 return r;
 
@@ -689,14 +726,14 @@ static int data_object_in_hash_table(JournalFile *f, uint64_t hash, uint64_t p)
 static int verify_entry(
                 JournalFile *f,
                 Object *o, uint64_t p,
-                MMapFileDescriptor *cache_data_fd, uint64_t n_data) {
+                const OffsetSet *data) {
 
         uint64_t i, n;
         int r;
 
         assert(f);
         assert(o);
-        assert(cache_data_fd);
+        assert(data);
 
         n = journal_file_entry_n_items(o);
         for (i = 0; i < n; i++) {
@@ -706,7 +743,7 @@ static int verify_entry(
                 q = le64toh(o->entry.items[i].object_offset);
                 h = le64toh(o->entry.items[i].hash);
 
-                if (!contains_uint64(f->mmap, cache_data_fd, n_data, q)) {
+                if (!offset_set_contains(data, q)) {
                         error(p, "Invalid data object of entry");
                         return -EBADMSG;
                 }
@@ -734,9 +771,10 @@ static int verify_entry(
 
 static int verify_entry_array(
                 JournalFile *f,
-                MMapFileDescriptor *cache_data_fd, uint64_t n_data,
-                MMapFileDescriptor *cache_entry_fd, uint64_t n_entries,
-                MMapFileDescriptor *cache_entry_array_fd, uint64_t n_entry_arrays,
+                const OffsetSet *data,
+                const OffsetSet *entries,
+                const OffsetSet *entry_arrays,
+                Throttle *t,
                 usec_t *last_usec,
                 bool show_progress) {
 
@@ -744,9 +782,10 @@ static int verify_entry_array(
         int r;
 
         assert(f);
-        assert(cache_data_fd);
-        assert(cache_entry_fd);
-        assert(cache_entry_array_fd);
+        assert(data);
+        assert(entries);
+        assert(entry_arrays);
+        assert(t);
         assert(last_usec);
 
         n = le64toh(f->header->n_entries);
@@ -763,7 +802,7 @@ static int verify_entry_array(
                         return -EBADMSG;
                 }
 
-                if (!contains_uint64(f->mmap, cache_entry_array_fd, n_entry_arrays, a)) {
+                if (!offset_set_contains(entry_arrays, a)) {
                         error(a, "Invalid array %"PRIu64" of %"PRIu64, i, n);
                         return -EBADMSG;
                 }
@@ -789,7 +828,7 @@ static int verify_entry_array(
                         }
                         last = p;
 
-                        if (!contains_uint64(f->mmap, cache_entry_fd, n_entries, p)) {
+                        if (!offset_set_contains(entries, p)) {
                                 error(a, "Invalid array entry at %"PRIu64" of %"PRIu64, i, n);
                                 return -EBADMSG;
                         }
@@ -798,7 +837,9 @@ static int verify_entry_array(
                         if (r < 0)
                                 return r;
 
-                        r = verify_entry(f, o, p, cache_data_fd, n_data);
+                        throttle(t, ALIGN64(le64toh(o->object.size)));
+
+                        r = verify_entry(f, o, p, data);
                         if (r < 0)
                                 return r;
 
@@ -817,6 +858,7 @@ static int verify_entry_array(
 int journal_file_verify(
                 JournalFile *f,
                 const char *key,
+                uint64_t max_bytes_per_sec,
                 usec_t *first_contained, usec_t *last_validated, usec_t *last_contained,
                 bool show_progress) {
         int r;
@@ -828,11 +870,13 @@ int journal_file_verify(
         bool entry_seqnum_set = false, entry_monotonic_set = false, entry_realtime_set = false, found_main_entry_array = false;
         uint64_t n_weird = 0, n_objects = 0, n_entries = 0, n_data = 0, n_fields = 0, n_data_hash_tables = 0, n_field_hash_tables = 0, n_entry_arrays = 0, n_tags = 0;
         usec_t last_usec = 0;
-        int data_fd = -1, entry_fd = -1, entry_array_fd = -1;
-        MMapFileDescriptor *cache_data_fd = NULL, *cache_entry_fd = NULL, *cache_entry_array_fd = NULL;
+        OffsetSet data = {}, entries = {}, entry_arrays = {};
+        Throttle t = {
+                .max_bytes_per_sec = max_bytes_per_sec,
+                .begin = now(CLOCK_MONOTONIC),
+        };
         unsigned i;
         bool found_last = false;
-        const char *tmp_dir = NULL;
 
 #ifdef HAVE_GCRYPT
         uint64_t last_tag = 0;
@@ -852,49 +896,6 @@ int journal_file_verify(
         } else if (f->seal)
                 return -ENOKEY;
 
-        r = var_tmp_dir(&tmp_dir);
-        if (r < 0) {
-                log_error_errno(r, "Failed to determine temporary directory: %m");
-                goto fail;
-        }
-
-        data_fd = open_tmpfile_unlinkable(tmp_dir, O_RDWR | O_CLOEXEC);
-        if (data_fd < 0) {
-                r = log_error_errno(data_fd, "Failed to create data file: %m");
-                goto fail;
-        }
-
-        entry_fd = open_tmpfile_unlinkable(tmp_dir, O_RDWR | O_CLOEXEC);
-        if (entry_fd < 0) {
-                r = log_error_errno(entry_fd, "Failed to create entry file: %m");
-                goto fail;
-        }
-
-        entry_array_fd = open_tmpfile_unlinkable(tmp_dir, O_RDWR | O_CLOEXEC);
-        if (entry_array_fd < 0) {
-                r = log_error_errno(entry_array_fd,
-                                    "Failed to create entry array file: %m");
-                goto fail;
-        }
-
-        cache_data_fd = mmap_cache_add_fd(f->mmap, data_fd);
-        if (!cache_data_fd) {
-                r = log_oom();
-                goto fail;
-        }
-
-        cache_entry_fd = mmap_cache_add_fd(f->mmap, entry_fd);
-        if (!cache_entry_fd) {
-                r = log_oom();
-                goto fail;
-        }
-
-        cache_entry_array_fd = mmap_cache_add_fd(f->mmap, entry_array_fd);
-        if (!cache_entry_array_fd) {
-                r = log_oom();
-                goto fail;
-        }
-
         if (le32toh(f->header->compatible_flags) & ~HEADER_COMPATIBLE_SUPPORTED) {
                 log_error("Cannot verify file with unknown extensions.");
                 r = -EOPNOTSUPP;
@@ -934,14 +935,15 @@ int journal_file_verify(
 
                 n_objects++;
 
+                throttle(&t, ALIGN64(le64toh(o->object.size)));
+
                 r = journal_file_object_verify(f, p, o);
                 if (r < 0) {
                         error_errno(p, r, "Invalid object contents: %m");
                         goto fail;
                 }
 
-                if ((o->object.flags & OBJECT_COMPRESSED_XZ) &&
-                    (o->object.flags & OBJECT_COMPRESSED_LZ4)) {
+                if (__builtin_popcount(o->object.flags & OBJECT_COMPRESSION_MASK) > 1) {
                         error(p, "Objected with double compression");
                         r = -EINVAL;
                         goto fail;
@@ -959,12 +961,20 @@ int journal_file_verify(
                         goto fail;
                 }
 
+                if ((o->object.flags & OBJECT_COMPRESSED_ZSTD) && !JOURNAL_HEADER_COMPRESSED_ZSTD(f->header)) {
+                        error(p, "ZSTD compressed object in file without ZSTD compression");
+                        r = -EBADMSG;
+                        goto fail;
+                }
+
                 switch (o->object.type) {
 
                 case OBJECT_DATA:
-                        r = write_uint64(data_fd, p);
-                        if (r < 0)
+                        r = offset_set_add(&data, p);
+                        if (r < 0) {
+                                log_oom();
                                 goto fail;
+                        }
 
                         n_data++;
                         break;
@@ -980,9 +990,11 @@ int journal_file_verify(
                                 goto fail;
                         }
 
-                        r = write_uint64(entry_fd, p);
-                        if (r < 0)
+                        r = offset_set_add(&entries, p);
+                        if (r < 0) {
+                                log_oom();
                                 goto fail;
+                        }
 
                         if (le64toh(o->entry.realtime) < last_tag_realtime) {
                                 error(p, "Older entry after newer tag");
@@ -1067,9 +1079,11 @@ int journal_file_verify(
                         break;
 
                 case OBJECT_ENTRY_ARRAY:
-                        r = write_uint64(entry_array_fd, p);
-                        if (r < 0)
+                        r = offset_set_add(&entry_arrays, p);
+                        if (r < 0) {
+                                log_oom();
                                 goto fail;
+                        }
 
                         if (p == le64toh(f->header->entry_array_offset)) {
                                 if (found_main_entry_array) {
@@ -1153,7 +1167,7 @@ int journal_file_verify(
                                 if (r < 0)
                                         goto fail;
 
-                                if (memcmp(o->tag.tag, gcry_md_read(f->hmac, 0), TAG_LENGTH) != 0) {
+                                if (memcmp(o->tag.tag, journal_file_hmac_read(f), TAG_LENGTH) != 0) {
                                         error(p, "Tag failed verification");
                                         r = -EBADMSG;
                                         goto fail;
@@ -1172,6 +1186,22 @@ int journal_file_verify(
                         n_tags++;
                         break;
 
+                case OBJECT_DICTIONARY:
+                        if (!JOURNAL_HEADER_COMPRESSED_ZSTD(f->header)) {
+                                error(p, "Dictionary object in file without ZSTD compression");
+                                r = -EBADMSG;
+                                goto fail;
+                        }
+
+                        if (!JOURNAL_HEADER_CONTAINS(f->header, dictionary_offset) ||
+                            le64toh(f->header->dictionary_offset) != p) {
+                                error(p, "Dictionary object not referenced from header");
+                                r = -EBADMSG;
+                                goto fail;
+                        }
+
+                        break;
+
                 default:
                         n_weird++;
                 }
@@ -1266,18 +1296,20 @@ int journal_file_verify(
          * referenced is consistent. */
 
         r = verify_entry_array(f,
-                               cache_data_fd, n_data,
-                               cache_entry_fd, n_entries,
-                               cache_entry_array_fd, n_entry_arrays,
+                               &data,
+                               &entries,
+                               &entry_arrays,
+                               &t,
                                &last_usec,
                                show_progress);
         if (r < 0)
                 goto fail;
 
         r = verify_hash_table(f,
-                              cache_data_fd, n_data,
-                              cache_entry_fd, n_entries,
-                              cache_entry_array_fd, n_entry_arrays,
+                              &data,
+                              &entries,
+                              &entry_arrays,
+                              &t,
                               &last_usec,
                               show_progress);
         if (r < 0)
@@ -1286,13 +1318,9 @@ int journal_file_verify(
         if (show_progress)
                 flush_progress();
 
-        mmap_cache_free_fd(f->mmap, cache_data_fd);
-        mmap_cache_free_fd(f->mmap, cache_entry_fd);
-        mmap_cache_free_fd(f->mmap, cache_entry_array_fd);
-
-        safe_close(data_fd);
-        safe_close(entry_fd);
-        safe_close(entry_array_fd);
+        free(data.offsets);
+        free(entries.offsets);
+        free(entry_arrays.offsets);
 
         if (first_contained)
                 *first_contained = le64toh(f->header->head_entry_realtime);
@@ -1313,23 +1341,9 @@ fail:
                   (unsigned long long) f->last_stat.st_size,
                   100 * p / f->last_stat.st_size);
 
-        if (data_fd >= 0)
-                safe_close(data_fd);
-
-        if (entry_fd >= 0)
-                safe_close(entry_fd);
-
-        if (entry_array_fd >= 0)
-                safe_close(entry_array_fd);
-
-        if (cache_data_fd)
-                mmap_cache_free_fd(f->mmap, cache_data_fd);
-
-        if (cache_entry_fd)
-                mmap_cache_free_fd(f->mmap, cache_entry_fd);
-
-        if (cache_entry_array_fd)
-                mmap_cache_free_fd(f->mmap, cache_entry_array_fd);
+        free(data.offsets);
+        free(entries.offsets);
+        free(entry_arrays.offsets);
 
         return r;
 }
@@ -21,4 +21,4 @@
 
 #include "journal-file.h"
 
-int journal_file_verify(JournalFile *f, const char *key, usec_t *first_contained, usec_t *last_validated, usec_t *last_contained, bool show_progress);
+int journal_file_verify(JournalFile *f, const char *key, uint64_t max_bytes_per_sec, usec_t *first_contained, usec_t *last_validated, usec_t *last_contained, bool show_progress);
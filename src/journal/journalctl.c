@@ -24,6 +24,7 @@
 #include <linux/fs.h>
 #include <locale.h>
 #include <poll.h>
+#include <pthread.h>
 #include <signal.h>
 #include <stddef.h>
 #include <stdio.h>
@@ -46,6 +47,7 @@
 #include "fileio.h"
 #include "fs-util.h"
 #include "fsprg.h"
+#include "gcrypt-util.h"
 #include "glob-util.h"
 #include "hostname-util.h"
 #include "io-util.h"
@@ -74,6 +76,7 @@
 #include "user-util.h"
 
 #define DEFAULT_FSS_INTERVAL_USEC (15*USEC_PER_MINUTE)
+#define STDOUT_BUFFER_SIZE (128*1024)
 
 enum {
         /* Special values for arg_lines */
@@ -82,6 +85,7 @@ enum {
 };
 
 static OutputMode arg_output = OUTPUT_SHORT;
+static Set *arg_output_fields = NULL;
 static bool arg_utc = false;
 static bool arg_pager_end = false;
 static bool arg_follow = false;
@@ -105,6 +109,8 @@ static char **arg_file = NULL;
 static bool arg_file_stdin = false;
 static int arg_priorities = 0xFF;
 static char *arg_verify_key = NULL;
+static unsigned arg_verify_threads = 0;
+static uint64_t arg_verify_rate = 0;
 #ifdef HAVE_GCRYPT
 static usec_t arg_interval = DEFAULT_FSS_INTERVAL_USEC;
 static bool arg_force = false;
@@ -302,6 +308,7 @@ static void help(void) {
                "                             short-iso, short-iso-precise, short-full,\n"
                "                             short-monotonic, short-unix, verbose, export,\n"
                "                             json, json-pretty, json-sse, cat)\n"
+               "     --output-fields=LIST  Select fields to print in verbose/export/json modes\n"
                "     --utc                 Express time in Coordinated Universal Time (UTC)\n"
                "  -x --catalog             Add message explanations where available\n"
                "     --no-full             Ellipsize fields\n"
@@ -328,6 +335,8 @@ static void help(void) {
                "     --vacuum-files=INT    Leave only the specified number of journal files\n"
                "     --vacuum-time=TIME    Remove journal files older than specified time\n"
                "     --verify              Verify journal file consistency\n"
+               "     --verify-threads=INT  Verify this many journal files at the same time\n"
+               "     --verify-rate=BYTES   Limit how many bytes per second are verified\n"
                "     --sync                Synchronize unwritten journal messages to disk\n"
                "     --flush               Flush all journal data from /run into /var\n"
                "     --rotate              Request immediate rotation of the journal files\n"
@@ -361,6 +370,8 @@ static int parse_argv(int argc, char *argv[]) {
                 ARG_INTERVAL,
                 ARG_VERIFY,
                 ARG_VERIFY_KEY,
+                ARG_VERIFY_THREADS,
+                ARG_VERIFY_RATE,
                 ARG_DISK_USAGE,
                 ARG_AFTER_CURSOR,
                 ARG_SHOW_CURSOR,
@@ -377,6 +388,7 @@ static int parse_argv(int argc, char *argv[]) {
                 ARG_VACUUM_FILES,
                 ARG_VACUUM_TIME,
                 ARG_NO_HOSTNAME,
+                ARG_OUTPUT_FIELDS,
         };
 
         static const struct option options[] = {
@@ -387,6 +399,7 @@ static int parse_argv(int argc, char *argv[]) {
                 { "follow",         no_argument,       NULL, 'f'                },
                 { "force",          no_argument,       NULL, ARG_FORCE          },
                 { "output",         required_argument, NULL, 'o'                },
+                { "output-fields",  required_argument, NULL, ARG_OUTPUT_FIELDS  },
                 { "all",            no_argument,       NULL, 'a'                },
                 { "full",           no_argument,       NULL, 'l'                },
                 { "no-full",        no_argument,       NULL, ARG_NO_FULL        },
@@ -411,6 +424,8 @@ static int parse_argv(int argc, char *argv[]) {
                 { "interval",       required_argument, NULL, ARG_INTERVAL       },
                 { "verify",         no_argument,       NULL, ARG_VERIFY         },
                 { "verify-key",     required_argument, NULL, ARG_VERIFY_KEY     },
+                { "verify-threads", required_argument, NULL, ARG_VERIFY_THREADS },
+                { "verify-rate",    required_argument, NULL, ARG_VERIFY_RATE    },
                 { "disk-usage",     no_argument,       NULL, ARG_DISK_USAGE     },
                 { "cursor",         required_argument, NULL, 'c'                },
                 { "after-cursor",   required_argument, NULL, ARG_AFTER_CURSOR   },
@@ -486,6 +501,17 @@ static int parse_argv(int argc, char *argv[]) {
 
                         break;
 
+                case ARG_OUTPUT_FIELDS:
+                        r = set_ensure_allocated(&arg_output_fields, &string_hash_ops);
+                        if (r < 0)
+                                return log_oom();
+
+                        r = set_put_strsplit(arg_output_fields, optarg, ",", 0);
+                        if (r < 0)
+                                return log_error_errno(r, "Failed to parse output fields: %s", optarg);
+
+                        break;
+
                 case 'l':
                         arg_full = true;
                         break;
@@ -639,6 +665,24 @@ static int parse_argv(int argc, char *argv[]) {
                         arg_action = ACTION_VERIFY;
                         break;
 
+                case ARG_VERIFY_THREADS:
+                        r = safe_atou(optarg, &arg_verify_threads);
+                        if (r < 0 || arg_verify_threads <= 0) {
+                                log_error("Failed to parse number of verification threads: %s", optarg);
+                                return -EINVAL;
+                        }
+
+                        break;
+
+                case ARG_VERIFY_RATE:
+                        r = parse_size(optarg, 1024, &arg_verify_rate);
+                        if (r < 0) {
+                                log_error("Failed to parse verification rate: %s", optarg);
+                                return r;
+                        }
+
+                        break;
+
                 case ARG_DISK_USAGE:
                         arg_action = ACTION_DISK_USAGE;
                         break;
@@ -1760,50 +1804,204 @@ finish:
 #endif
 }
 
+/* Never verify more than this many files at the same time */
+#define VERIFY_THREADS_MAX 16
+
+typedef struct VerifyJob {
+        JournalFile *file;
+        bool done;
+        int r;
+        usec_t first, validated, last;
+        usec_t duration;
+} VerifyJob;
+
+typedef struct VerifyQueue {
+        pthread_mutex_t mutex;
+        pthread_cond_t done;
+
+        VerifyJob *jobs;
+        unsigned n_jobs;
+        unsigned next;
+        bool cancelled;
+
+        uint64_t max_bytes_per_sec;
+        bool show_progress;
+} VerifyQueue;
+
+static void *verify_thread(void *userdata) {
+        VerifyQueue *q = userdata;
+
+        /* The files are opened in parallel mode, hence each comes with its own MMapCache, and may be
+         * verified independently of the others. */
+
+        assert_se(pthread_mutex_lock(&q->mutex) == 0);
+
+        while (!q->cancelled && q->next < q->n_jobs) {
+                VerifyJob *job = q->jobs + q->next++;
+                usec_t start;
+
+                assert_se(pthread_mutex_unlock(&q->mutex) == 0);
+
+                start = now(CLOCK_MONOTONIC);
+                job->r = journal_file_verify(job->file, arg_verify_key, q->max_bytes_per_sec,
+                                             &job->first, &job->validated, &job->last, q->show_progress);
+                job->duration = now(CLOCK_MONOTONIC) - start;
+
+                assert_se(pthread_mutex_lock(&q->mutex) == 0);
+
+                job->done = true;
+
+                /* If the key was invalid give up right-away. */
+                if (job->r == -EINVAL)
+                        q->cancelled = true;
+
+                assert_se(pthread_cond_broadcast(&q->done) == 0);
+        }
+
+        assert_se(pthread_mutex_unlock(&q->mutex) == 0);
+
+        return NULL;
+}
+
+static double verify_rate(uint64_t bytes, usec_t duration) {
+        return (double) bytes / 1024 / 1024 / ((double) MAX(duration, (usec_t) 1) / USEC_PER_SEC);
+}
+
 static int verify(sd_journal *j) {
-        int r = 0;
+        VerifyQueue q = {
+                .mutex = PTHREAD_MUTEX_INITIALIZER,
+                .done = PTHREAD_COND_INITIALIZER,
+        };
+        _cleanup_free_ VerifyJob *jobs = NULL;
+        char bytes[FORMAT_BYTES_MAX], timespan[FORMAT_TIMESPAN_MAX];
+        unsigned n_threads, n_started = 0, k;
+        uint64_t total_bytes = 0;
+        pthread_t *threads;
+        usec_t start, duration;
         Iterator i;
         JournalFile *f;
+        int r = 0;
 
         assert(j);
 
         log_show_color(true);
 
-        ORDERED_HASHMAP_FOREACH(f, j->files, i) {
-                int k;
-                usec_t first = 0, validated = 0, last = 0;
+        r = journal_open_deferred_files(j);
+        if (r < 0)
+                return log_error_errno(r, "Failed to open journal files: %m");
+
+        jobs = new0(VerifyJob, ordered_hashmap_size(j->files));
+        if (!jobs)
+                return log_oom();
 
+        ORDERED_HASHMAP_FOREACH(f, j->files, i) {
 #ifdef HAVE_GCRYPT
                 if (!arg_verify_key && JOURNAL_HEADER_SEALED(f->header))
                         log_notice("Journal file %s has sealing enabled but verification key has not been passed using --verify-key=.", f->path);
 #endif
 
-                k = journal_file_verify(f, arg_verify_key, &first, &validated, &last, true);
-                if (k == -EINVAL) {
-                        /* If the key was invalid give up right-away. */
-                        return k;
-                } else if (k < 0) {
-                        log_warning_errno(k, "FAIL: %s (%m)", f->path);
-                        r = k;
+                jobs[q.n_jobs++].file = f;
+        }
+
+        if (arg_verify_threads > 0)
+                n_threads = arg_verify_threads;
+        else {
+                long n_cpus;
+
+                n_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+                n_threads = n_cpus > 0 ? (unsigned) n_cpus : 1;
+        }
+
+        n_threads = MIN3(n_threads, q.n_jobs, (unsigned) VERIFY_THREADS_MAX);
+
+        /* The rate limit applies to all threads together. Progress is only shown for one file at a time. */
+        q.jobs = jobs;
+        q.max_bytes_per_sec = arg_verify_rate > 0 ? MAX(arg_verify_rate / MAX(n_threads, 1u), (uint64_t) 1) : 0;
+        q.show_progress = n_threads <= 1;
+
+#ifdef HAVE_GCRYPT
+        /* Make sure libgcrypt is set up before any of the threads may use it */
+        if (arg_verify_key)
+                initialize_libgcrypt(false);
+#endif
+
+        start = now(CLOCK_MONOTONIC);
+
+        /* If no thread can be started, we do the work ourselves */
+        threads = newa(pthread_t, MAX(n_threads, 1u));
+        for (k = 0; k < n_threads; k++) {
+                int t;
+
+                t = pthread_create(&threads[n_started], NULL, verify_thread, &q);
+                if (t != 0) {
+                        log_debug_errno(t, "Failed to start verification thread, continuing with %u threads: %m", n_started);
+                        break;
+                }
+
+                n_started++;
+        }
+
+        if (n_started == 0)
+                (void) verify_thread(&q);
+
+        /* Report the results in the order of the files, as they become available */
+        for (k = 0; k < q.n_jobs; k++) {
+                VerifyJob *job = jobs + k;
+                uint64_t size;
+
+                assert_se(pthread_mutex_lock(&q.mutex) == 0);
+                while (!job->done && !(q.cancelled && k >= q.next))
+                        assert_se(pthread_cond_wait(&q.done, &q.mutex) == 0);
+                assert_se(pthread_mutex_unlock(&q.mutex) == 0);
+
+                if (!job->done)
+                        break;
+
+                f = job->file;
+                size = (uint64_t) f->last_stat.st_size;
+                total_bytes += size;
+
+                if (job->r == -EINVAL) {
+                        r = job->r;
+                        break;
+                } else if (job->r < 0) {
+                        log_warning_errno(job->r, "FAIL: %s (%m)", f->path);
+                        r = job->r;
                 } else {
                         char a[FORMAT_TIMESTAMP_MAX], b[FORMAT_TIMESTAMP_MAX], c[FORMAT_TIMESPAN_MAX];
-                        log_info("PASS: %s", f->path);
+                        log_info("PASS: %s (%s in %s, %.1f MiB/s)",
+                                 f->path,
+                                 format_bytes(bytes, sizeof(bytes), size),
+                                 format_timespan(timespan, sizeof(timespan), job->duration, USEC_PER_MSEC),
+                                 verify_rate(size, job->duration));
 
                         if (arg_verify_key && JOURNAL_HEADER_SEALED(f->header)) {
-                                if (validated > 0) {
+                                if (job->validated > 0) {
                                         log_info("=> Validated from %s to %s, final %s entries not sealed.",
-                                                 format_timestamp_maybe_utc(a, sizeof(a), first),
-                                                 format_timestamp_maybe_utc(b, sizeof(b), validated),
-                                                 format_timespan(c, sizeof(c), last > validated ? last - validated : 0, 0));
-                                } else if (last > 0)
+                                                 format_timestamp_maybe_utc(a, sizeof(a), job->first),
+                                                 format_timestamp_maybe_utc(b, sizeof(b), job->validated),
+                                                 format_timespan(c, sizeof(c), job->last > job->validated ? job->last - job->validated : 0, 0));
+                                } else if (job->last > 0)
                                         log_info("=> No sealing yet, %s of entries not sealed.",
-                                                 format_timespan(c, sizeof(c), last - first, 0));
+                                                 format_timespan(c, sizeof(c), job->last - job->first, 0));
                                 else
                                         log_info("=> No sealing yet, no entries in file.");
                         }
                 }
         }
 
+        for (k = 0; k < n_started; k++)
+                assert_se(pthread_join(threads[k], NULL) == 0);
+
+        duration = now(CLOCK_MONOTONIC) - start;
+
+        if (q.n_jobs > 1 && r != -EINVAL)
+                log_info("Verified %u files with %u threads: %s in %s, %.1f MiB/s",
+                         q.n_jobs, MAX(n_started, 1u),
+                         format_bytes(bytes, sizeof(bytes), total_bytes),
+                         format_timespan(timespan, sizeof(timespan), duration, USEC_PER_MSEC),
+                         verify_rate(total_bytes, duration));
+
         return r;
 }
 
@@ -1968,6 +2166,7 @@ int main(int argc, char *argv[]) {
         bool previous_boot_id_valid = false, first_line = true;
         int n_shown = 0;
         bool ellipsized = false;
+        int open_flags;
 
         setlocale(LC_ALL, "");
         log_parse_environment();
@@ -1985,6 +2184,14 @@ int main(int argc, char *argv[]) {
          * be split up into many files. */
         setrlimit_closest(RLIMIT_NOFILE, &RLIMIT_MAKE_CONST(16384));
 
+        /* When the output doesn't go to a terminal, e.g. when exporting entries or piping them into another
+         * program, write it in large chunks rather than in stdio's default page-sized ones */
+        if (!isatty(STDOUT_FILENO)) {
+                static char stdout_buffer[STDOUT_BUFFER_SIZE];
+
+                (void) setvbuf(stdout, stdout_buffer, _IOFBF, sizeof(stdout_buffer));
+        }
+
         switch (arg_action) {
 
         case ACTION_NEW_ID128:
@@ -2053,15 +2260,18 @@ int main(int argc, char *argv[]) {
                 assert_not_reached("Unknown action");
         }
 
+        /* Files are verified from multiple threads, which requires each to have its own MMapCache */
+        open_flags = arg_action == ACTION_VERIFY ? SD_JOURNAL_PARALLEL : 0;
+
         if (arg_directory)
-                r = sd_journal_open_directory(&j, arg_directory, arg_journal_type);
+                r = sd_journal_open_directory(&j, arg_directory, arg_journal_type | open_flags);
         else if (arg_root)
-                r = sd_journal_open_directory(&j, arg_root, arg_journal_type | SD_JOURNAL_OS_ROOT);
+                r = sd_journal_open_directory(&j, arg_root, arg_journal_type | SD_JOURNAL_OS_ROOT | open_flags);
         else if (arg_file_stdin) {
                 int ifd = STDIN_FILENO;
-                r = sd_journal_open_files_fd(&j, &ifd, 1, 0);
+                r = sd_journal_open_files_fd(&j, &ifd, 1, open_flags);
         } else if (arg_file)
-                r = sd_journal_open_files(&j, (const char**) arg_file, 0);
+                r = sd_journal_open_files(&j, (const char**) arg_file, open_flags);
         else if (arg_machine) {
                 _cleanup_(sd_bus_error_free) sd_bus_error error = SD_BUS_ERROR_NULL;
                 _cleanup_(sd_bus_message_unrefp) sd_bus_message *reply = NULL;
@@ -2108,11 +2318,11 @@ int main(int argc, char *argv[]) {
                         goto finish;
                 }
 
-                r = sd_journal_open_directory_fd(&j, fd, SD_JOURNAL_OS_ROOT);
+                r = sd_journal_open_directory_fd(&j, fd, SD_JOURNAL_OS_ROOT | open_flags);
                 if (r < 0)
                         safe_close(fd);
         } else
-                r = sd_journal_open(&j, !arg_merge*SD_JOURNAL_LOCAL_ONLY + arg_journal_type);
+                r = sd_journal_open(&j, !arg_merge*SD_JOURNAL_LOCAL_ONLY + arg_journal_type + open_flags);
         if (r < 0) {
                 log_error_errno(r, "Failed to open %s: %m", arg_directory ?: arg_file ? "files" : "journal");
                 goto finish;
@@ -2456,7 +2666,7 @@ int main(int argc, char *argv[]) {
                                 arg_utc * OUTPUT_UTC |
                                 arg_no_hostname * OUTPUT_NO_HOSTNAME;
 
-                        r = output_journal(stdout, j, arg_output, 0, flags, &ellipsized);
+                        r = output_journal(stdout, j, arg_output, 0, flags, arg_output_fields, &ellipsized);
                         need_seek = true;
                         if (r == -EADDRNOTAVAIL)
                                 break;
@@ -2506,5 +2716,7 @@ finish:
         free(arg_root);
         free(arg_verify_key);
 
+        set_free_free(arg_output_fields);
+
         return r < 0 ? EXIT_FAILURE : EXIT_SUCCESS;
 }
@@ -17,6 +17,9 @@
   along with systemd; If not, see <http://www.gnu.org/licenses/>.
 ***/
 
+#include <sys/inotify.h>
+#include <unistd.h>
+
 #ifdef HAVE_SELINUX
 #include <selinux/selinux.h>
 #endif
@@ -24,8 +27,11 @@
 #include "alloc-util.h"
 #include "audit-util.h"
 #include "cgroup-util.h"
+#include "fd-util.h"
+#include "fs-util.h"
 #include "journald-context.h"
 #include "process-util.h"
+#include "selinux-util.h"
 #include "string-util.h"
 #include "user-util.h"
 
@@ -40,6 +46,11 @@
  * refreshed in an incremental way (meaning: data is reread from /proc, but any old data we can't refresh is not
  * flushed out). Data newer than 1s is used immediately without refresh.
  *
+ * Refreshing an entry doesn't read anything right-away though: it only marks the cached data as out-of-date, and each
+ * group of fields is then read again when a log message needs it first. Messages that are dropped because of their
+ * priority or because of rate limiting hence don't cause any reads, and fields that are not available on the system
+ * (SELinux labels, audit sessions) are never asked for.
+ *
  * Log stream clients (i.e. all clients using the AF_UNIX/SOCK_STREAM stdout/stderr transport) will pin a cache entry
  * as long as their socket is connected. Note that cache entries are shared between different transports. That means a
  * cache entry pinned for the stream connection logic may be reused for the syslog or native protocols.
@@ -70,6 +81,20 @@
  * clients itself is limited.) */
 #define CACHE_MAX (16*1024)
 
+/* Keep at most 1K invocation IDs in the cache, each of which takes up an inotify watch */
+#define UNITS_MAX 1024
+
+/* The invocation ID of a unit is read from an extended attribute on its cgroup, which PID 1 sets whenever the unit is
+ * started. As many processes (and hence cache entries) usually belong to the same unit, we cache the invocation ID
+ * per unit cgroup too, and let the kernel tell us when PID 1 changes it: setting the attribute on an existing cgroup
+ * triggers IN_ATTRIB on the cgroup, and removing or creating the cgroup triggers IN_DELETE or IN_CREATE on the
+ * slice it is in. Hence, unlike the rest of the metadata, cached invocation IDs never need to be refreshed. */
+typedef struct ClientUnit {
+        char *path;
+        int wd;
+        sd_id128_t invocation_id;
+} ClientUnit;
+
 static int client_context_compare(const void *a, const void *b) {
         const ClientContext *x = a, *y = b;
 
@@ -122,6 +147,8 @@ static int client_context_new(Server *s, pid_t pid, ClientContext **ret) {
                 return r;
         }
 
+        s->client_context_stats.n_new++;
+
         *ret = c;
         return 0;
 }
@@ -130,6 +157,7 @@ static void client_context_reset(ClientContext *c) {
         assert(c);
 
         c->timestamp = USEC_INFINITY;
+        c->loaded = 0;
 
         c->uid = UID_INVALID;
         c->gid = GID_INVALID;
@@ -172,25 +200,293 @@ static ClientContext* client_context_free(Server *s, ClientContext *c) {
         return mfree(c);
 }
 
-static void client_context_read_uid_gid(ClientContext *c, const struct ucred *ucred) {
+static ClientUnit* client_unit_free(Server *s, ClientUnit *u) {
+        assert(s);
+
+        if (!u)
+                return NULL;
+
+        assert_se(hashmap_remove(s->client_units, u->path) == u);
+
+        if (u->wd >= 0) {
+                assert_se(hashmap_remove(s->client_unit_watches, INT_TO_PTR(u->wd)) == u);
+
+                /* The watch might be shared with a slice, if the unit is one */
+                if (!hashmap_contains(s->client_slice_watches, INT_TO_PTR(u->wd)))
+                        (void) inotify_rm_watch(s->client_units_inotify_fd, u->wd);
+        }
+
+        free(u->path);
+        return mfree(u);
+}
+
+static void client_units_flush(Server *s) {
+        ClientUnit *u;
+
+        assert(s);
+
+        /* The watches go away with the inotify fd, hence there's no need to remove them one by one */
+        if (s->client_units) {
+                s->client_units_event_source = sd_event_source_unref(s->client_units_event_source);
+                s->client_units_inotify_fd = safe_close(s->client_units_inotify_fd);
+
+                while ((u = hashmap_first(s->client_units))) {
+                        u->wd = -1;
+                        client_unit_free(s, u);
+                }
+        }
+
+        s->client_units = hashmap_free(s->client_units);
+        s->client_unit_watches = hashmap_free(s->client_unit_watches);
+        s->client_slice_watches = hashmap_free_free(s->client_slice_watches);
+}
+
+static void client_unit_invalidate(Server *s, ClientUnit *u) {
+        assert(s);
+
+        if (!u)
+                return;
+
+        client_unit_free(s, u);
+        s->client_context_stats.n_invocation_id_invalidations++;
+}
+
+static int client_context_process_unit_events(Server *s) {
+        assert(s);
+
+        /* Processes all queued notifications about changed unit cgroups. This is called before any cached
+         * invocation ID is used, so that a unit that was just restarted is never logged with its previous
+         * invocation ID, even if journald didn't get around to handle the inotify event yet. */
+
+        if (!s->client_units)
+                return 0;
+
+        for (;;) {
+                union inotify_event_buffer buffer;
+                struct inotify_event *e;
+                ssize_t l;
+
+                l = read(s->client_units_inotify_fd, &buffer, sizeof(buffer));
+                if (l < 0) {
+                        if (errno == EINTR || errno == EAGAIN)
+                                return 0;
+
+                        /* If we can't tell what changed, we can't trust anything we cached */
+                        client_units_flush(s);
+                        return log_error_errno(errno, "Failed to read control group inotify events: %m");
+                }
+
+                FOREACH_INOTIFY_EVENT(e, buffer, l) {
+                        _cleanup_free_ char *p = NULL;
+                        const char *slice;
+
+                        if (e->mask & IN_Q_OVERFLOW) {
+                                log_debug("Control group inotify queue overflowed, flushing invocation ID cache.");
+                                client_units_flush(s);
+                                return 0;
+                        }
+
+                        client_unit_invalidate(s, hashmap_get(s->client_unit_watches, INT_TO_PTR(e->wd)));
+
+                        slice = hashmap_get(s->client_slice_watches, INT_TO_PTR(e->wd));
+                        if (!slice)
+                                continue;
+
+                        if (e->mask & IN_IGNORED) {
+                                /* The slice is gone, and with it all units in it */
+                                free(hashmap_remove(s->client_slice_watches, INT_TO_PTR(e->wd)));
+                                continue;
+                        }
+
+                        if (e->len == 0)
+                                continue;
+
+                        p = strjoin(slice, "/", e->name);
+                        if (!p) {
+                                client_units_flush(s);
+                                return log_oom();
+                        }
+
+                        client_unit_invalidate(s, hashmap_get(s->client_units, p));
+                }
+        }
+}
+
+static int on_unit_inotify_event(sd_event_source *es, int fd, uint32_t revents, void *userdata) {
+        Server *s = userdata;
+
+        assert(s);
+
+        (void) client_context_process_unit_events(s);
+        return 0;
+}
+
+static int client_units_ensure_allocated(Server *s) {
+        int r;
+
+        assert(s);
+
+        if (s->client_units)
+                return 0;
+
+        r = hashmap_ensure_allocated(&s->client_unit_watches, NULL);
+        if (r < 0)
+                return r;
+
+        r = hashmap_ensure_allocated(&s->client_slice_watches, NULL);
+        if (r < 0)
+                return r;
+
+        s->client_units_inotify_fd = inotify_init1(IN_NONBLOCK|IN_CLOEXEC);
+        if (s->client_units_inotify_fd < 0)
+                return -errno;
+
+        if (s->event) {
+                r = sd_event_add_io(s->event, &s->client_units_event_source, s->client_units_inotify_fd, EPOLLIN, on_unit_inotify_event, s);
+                if (r < 0)
+                        goto fail;
+
+                (void) sd_event_source_set_description(s->client_units_event_source, "client-units-inotify");
+        }
+
+        r = hashmap_ensure_allocated(&s->client_units, &string_hash_ops);
+        if (r < 0)
+                goto fail;
+
+        return 0;
+
+fail:
+        s->client_units_event_source = sd_event_source_unref(s->client_units_event_source);
+        s->client_units_inotify_fd = safe_close(s->client_units_inotify_fd);
+        return r;
+}
+
+static int client_unit_watch_slice(Server *s, const char *slice) {
+        _cleanup_free_ char *fs = NULL;
+        int wd, r;
+
+        assert(s);
+        assert(slice);
+
+        r = cg_get_path(SYSTEMD_CGROUP_CONTROLLER, slice, NULL, &fs);
+        if (r < 0)
+                return r;
+
+        wd = inotify_add_watch(s->client_units_inotify_fd, fs, IN_CREATE|IN_DELETE|IN_MOVE|IN_ONLYDIR|IN_MASK_ADD);
+        if (wd < 0)
+                return -errno;
+
+        if (!hashmap_contains(s->client_slice_watches, INT_TO_PTR(wd))) {
+                char *p;
+
+                p = strdup(slice);
+                if (!p)
+                        return -ENOMEM;
+
+                r = hashmap_put(s->client_slice_watches, INT_TO_PTR(wd), p);
+                if (r < 0) {
+                        free(p);
+                        return r;
+                }
+        }
+
+        return 0;
+}
+
+static int client_unit_new(Server *s, const char *slice, const char *path, ClientUnit **ret) {
+        _cleanup_free_ char *fs = NULL;
+        ClientUnit *u;
+        int r;
+
+        assert(s);
+        assert(slice);
+        assert(path);
+        assert(ret);
+
+        /* Adds a cache entry for the unit cgroup, watched for changes but without an invocation ID yet. The
+         * watches are set up before the ID is read, so that no change in between may be missed. */
+
+        if (hashmap_size(s->client_units) >= UNITS_MAX)
+                client_units_flush(s);
+
+        r = client_units_ensure_allocated(s);
+        if (r < 0)
+                return r;
+
+        r = client_unit_watch_slice(s, slice);
+        if (r < 0)
+                return r;
+
+        r = cg_get_path(SYSTEMD_CGROUP_CONTROLLER, path, NULL, &fs);
+        if (r < 0)
+                return r;
+
+        u = new0(ClientUnit, 1);
+        if (!u)
+                return -ENOMEM;
+
+        u->wd = -1;
+
+        u->path = strdup(path);
+        if (!u->path) {
+                free(u);
+                return -ENOMEM;
+        }
+
+        r = hashmap_put(s->client_units, u->path, u);
+        if (r < 0) {
+                free(u->path);
+                free(u);
+                return r;
+        }
+
+        r = inotify_add_watch(s->client_units_inotify_fd, fs, IN_ATTRIB|IN_ONLYDIR|IN_MASK_ADD);
+        if (r < 0) {
+                r = -errno;
+                goto fail;
+        }
+
+        u->wd = r;
+
+        r = hashmap_put(s->client_unit_watches, INT_TO_PTR(u->wd), u);
+        if (r < 0) {
+                u->wd = -1;
+                goto fail;
+        }
+
+        *ret = u;
+        return 0;
+
+fail:
+        client_unit_free(s, u);
+        return r;
+}
+
+static bool audit_in_kernel(void) {
+        static int cached = -1;
+
+        /* Without audit support in the kernel, these files don't exist for any process, not even for us */
+        if (cached < 0)
+                cached = access("/proc/self/loginuid", F_OK) >= 0;
+
+        return cached;
+}
+
+static void client_context_read_uid_gid(Server *s, ClientContext *c) {
+        assert(s);
         assert(c);
         assert(pid_is_valid(c->pid));
 
-        /* The ucred data passed in is always the most current and accurate, if we have any. Use it. */
-        if (ucred && uid_is_valid(ucred->uid))
-                c->uid = ucred->uid;
-        else
-                (void) get_process_uid(c->pid, &c->uid);
+        (void) get_process_uid(c->pid, &c->uid);
+        (void) get_process_gid(c->pid, &c->gid);
 
-        if (ucred && gid_is_valid(ucred->gid))
-                c->gid = ucred->gid;
-        else
-                (void) get_process_gid(c->pid, &c->gid);
+        s->client_context_stats.n_proc_reads += 2;
 }
 
-static void client_context_read_basic(ClientContext *c) {
+static void client_context_read_basic(Server *s, ClientContext *c) {
         char *t;
 
+        assert(s);
         assert(c);
         assert(pid_is_valid(c->pid));
 
@@ -205,42 +501,66 @@ static void client_context_read_basic(ClientContext *c) {
 
         if (get_process_capeff(c->pid, &t) >= 0)
                 free_and_replace(c->capeff, t);
+
+        s->client_context_stats.n_proc_reads += 4;
 }
 
-static int client_context_read_label(
+static int client_context_set_label(
                 ClientContext *c,
                 const char *label, size_t label_size) {
 
+        char *l;
+
         assert(c);
-        assert(pid_is_valid(c->pid));
-        assert(label_size == 0 || label);
+        assert(label_size > 0);
+        assert(label);
+
+        /* If we got an SELinux label passed in it counts. */
 
-        if (label_size > 0) {
-                char *l;
+        l = newdup_suffix0(char, label, label_size);
+        if (!l)
+                return -ENOMEM;
 
-                /* If we got an SELinux label passed in it counts. */
+        free_and_replace(c->label, l);
+        c->label_size = label_size;
 
-                l = newdup_suffix0(char, label, label_size);
-                if (!l)
-                        return -ENOMEM;
+        return 0;
+}
 
-                free_and_replace(c->label, l);
-                c->label_size = label_size;
-        }
+static void client_context_read_label(Server *s, ClientContext *c) {
 #ifdef HAVE_SELINUX
-        else {
-                char *con;
+        char *con;
+
+        assert(s);
+        assert(c);
+        assert(pid_is_valid(c->pid));
 
-                /* If we got no SELinux label passed in, let's try to acquire one */
+        /* If we got no SELinux label passed in, let's try to acquire one, unless there can't be any */
 
-                if (getpidcon(c->pid, &con) >= 0) {
-                        free_and_replace(c->label, con);
-                        c->label_size = strlen(c->label);
-                }
+        if (!mac_selinux_use())
+                return;
+
+        if (getpidcon(c->pid, &con) >= 0) {
+                free_and_replace(c->label, con);
+                c->label_size = strlen(c->label);
         }
+
+        s->client_context_stats.n_proc_reads++;
 #endif
+}
 
-        return 0;
+static void client_context_read_audit(Server *s, ClientContext *c) {
+        assert(s);
+        assert(c);
+        assert(pid_is_valid(c->pid));
+
+        if (!audit_in_kernel())
+                return;
+
+        (void) audit_session_from_pid(c->pid, &c->auditid);
+        (void) audit_loginuid_from_pid(c->pid, &c->loginuid);
+
+        s->client_context_stats.n_proc_reads += 2;
 }
 
 static int client_context_read_cgroup(Server *s, ClientContext *c, const char *unit_id) {
@@ -251,6 +571,7 @@ static int client_context_read_cgroup(Server *s, ClientContext *c, const char *u
 
         /* Try to acquire the current cgroup path */
         r = cg_pid_get_path_shifted(c->pid, s->cgroup_root, &t);
+        s->client_context_stats.n_proc_reads++;
         if (r < 0) {
 
                 /* If that didn't work, we use the unit ID passed in as fallback, if we have nothing cached yet */
@@ -298,7 +619,8 @@ static int client_context_read_invocation_id(
 
         _cleanup_free_ char *escaped = NULL, *slice_path = NULL;
         char ids[SD_ID128_STRING_MAX];
-        const char *p;
+        ClientUnit *u = NULL;
+        const char *slice, *p;
         int r;
 
         assert(s);
@@ -318,18 +640,82 @@ static int client_context_read_invocation_id(
         if (!escaped)
                 return -ENOMEM;
 
-        p = strjoina(s->cgroup_root, "/", slice_path, "/", escaped);
-        if (!p)
-                return -ENOMEM;
+        slice = strjoina(s->cgroup_root, "/", slice_path);
+        p = strjoina(slice, "/", escaped);
+
+        (void) client_context_process_unit_events(s);
+
+        u = hashmap_get(s->client_units, p);
+        if (u) {
+                c->invocation_id = u->invocation_id;
+                s->client_context_stats.n_invocation_id_hits++;
+                return 0;
+        }
+
+        /* If we can't watch the cgroup, we simply don't cache the ID */
+        r = client_unit_new(s, slice, p, &u);
+        if (r < 0)
+                log_debug_errno(r, "Failed to watch control group %s, not caching invocation ID: %m", p);
 
         r = cg_get_xattr(SYSTEMD_CGROUP_CONTROLLER, p, "trusted.invocation_id", ids, 32);
+        s->client_context_stats.n_proc_reads++;
         if (r < 0)
-                return r;
-        if (r != 32)
-                return -EINVAL;
+                goto fail;
+        if (r != 32) {
+                r = -EINVAL;
+                goto fail;
+        }
         ids[32] = 0;
 
-        return sd_id128_from_string(ids, &c->invocation_id);
+        r = sd_id128_from_string(ids, &c->invocation_id);
+        if (r < 0)
+                goto fail;
+
+        if (u)
+                u->invocation_id = c->invocation_id;
+
+        return 0;
+
+fail:
+        client_unit_free(s, u);
+        return r;
+}
+
+static void client_context_load_internal(
+                Server *s,
+                ClientContext *c,
+                unsigned fields,
+                const char *unit_id) {
+
+        assert(s);
+        assert(c);
+        assert(pid_is_valid(c->pid));
+
+        fields &= ~c->loaded;
+
+        if (fields & CLIENT_CONTEXT_CREDENTIALS)
+                client_context_read_uid_gid(s, c);
+
+        if (fields & CLIENT_CONTEXT_BASIC)
+                client_context_read_basic(s, c);
+
+        if (fields & CLIENT_CONTEXT_LABEL)
+                client_context_read_label(s, c);
+
+        if (fields & CLIENT_CONTEXT_AUDIT)
+                client_context_read_audit(s, c);
+
+        if (fields & CLIENT_CONTEXT_CGROUP) {
+                (void) client_context_read_cgroup(s, c, unit_id);
+                (void) client_context_read_invocation_id(s, c);
+        }
+
+        c->loaded |= fields;
+        s->client_context_stats.n_loads += __builtin_popcount(fields);
+}
+
+void client_context_load(Server *s, ClientContext *c, unsigned fields) {
+        client_context_load_internal(s, c, fields, NULL);
 }
 
 static void client_context_really_refresh(
@@ -347,15 +733,25 @@ static void client_context_really_refresh(
         if (timestamp == USEC_INFINITY)
                 timestamp = now(CLOCK_MONOTONIC);
 
-        client_context_read_uid_gid(c, ucred);
-        client_context_read_basic(c);
-        (void) client_context_read_label(c, label, label_size);
+        /* Don't read anything yet, but mark everything we have as out-of-date, so that it is read again when it
+         * is needed. We keep the old data though, for all we can't update then. */
+        c->loaded = 0;
 
-        (void) audit_session_from_pid(c->pid, &c->auditid);
-        (void) audit_loginuid_from_pid(c->pid, &c->loginuid);
+        /* The ucred data and label passed in are always the most current and accurate, if we have any. Use them. */
+        if (ucred && uid_is_valid(ucred->uid))
+                c->uid = ucred->uid;
+        if (ucred && gid_is_valid(ucred->gid))
+                c->gid = ucred->gid;
+        if (ucred && uid_is_valid(ucred->uid) && gid_is_valid(ucred->gid))
+                c->loaded |= CLIENT_CONTEXT_CREDENTIALS;
+
+        if (label_size > 0 && client_context_set_label(c, label, label_size) >= 0)
+                c->loaded |= CLIENT_CONTEXT_LABEL;
 
-        (void) client_context_read_cgroup(s, c, unit_id);
-        (void) client_context_read_invocation_id(s, c);
+        /* The unit ID passed in is the fallback for when the cgroup can't be read anymore, which is only useful
+         * while we are still reading it now. */
+        if (unit_id)
+                client_context_load_internal(s, c, CLIENT_CONTEXT_CGROUP, unit_id);
 
         c->timestamp = timestamp;
 
@@ -404,9 +800,11 @@ void client_context_maybe_refresh(
         if (label_size > 0 && (label_size != c->label_size || memcmp(label, c->label, label_size) != 0))
                 goto refresh;
 
+        s->client_context_stats.n_hits++;
         return;
 
 refresh:
+        s->client_context_stats.n_refreshes++;
         client_context_really_refresh(s, c, ucred, label, label_size, unit_id, timestamp);
 }
 
@@ -442,6 +840,7 @@ void client_context_flush_all(Server *s) {
         s->pid1_context = client_context_release(s, s->pid1_context);
 
         client_context_try_shrink_to(s, 0);
+        client_units_flush(s);
 
         assert(prioq_size(s->client_contexts_lru) == 0);
         assert(hashmap_size(s->client_contexts) == 0);
@@ -558,6 +957,23 @@ ClientContext *client_context_release(Server *s, ClientContext *c) {
         return NULL;
 }
 
+void client_context_log_stats(Server *s) {
+        const ClientContextStats *st;
+
+        assert(s);
+
+        st = &s->client_context_stats;
+
+        log_info("Client metadata cache: %u contexts, %u invocation IDs cached; "
+                 "%" PRIu64 " contexts created, %" PRIu64 " used as cached, %" PRIu64 " refreshed; "
+                 "%" PRIu64 " field groups loaded, %" PRIu64 " files read; "
+                 "%" PRIu64 " invocation ID cache hits, %" PRIu64 " invalidations.",
+                 hashmap_size(s->client_contexts), hashmap_size(s->client_units),
+                 st->n_new, st->n_hits, st->n_refreshes,
+                 st->n_loads, st->n_proc_reads,
+                 st->n_invocation_id_hits, st->n_invocation_id_invalidations);
+}
+
 void client_context_acquire_default(Server *s) {
         int r;
 
@@ -25,15 +25,37 @@
 #include "sd-id128.h"
 
 typedef struct ClientContext ClientContext;
+typedef struct ClientContextStats {
+        uint64_t n_new;                         /* contexts created */
+        uint64_t n_hits;                        /* contexts used as cached */
+        uint64_t n_refreshes;                   /* contexts marked for reading again */
+        uint64_t n_loads;                       /* field groups read */
+        uint64_t n_proc_reads;                  /* files read from /proc and the cgroup tree */
+        uint64_t n_invocation_id_hits;          /* invocation IDs taken from the cache */
+        uint64_t n_invocation_id_invalidations; /* invocation IDs dropped from the cache */
+} ClientContextStats;
 
 #include "journald-server.h"
 
+/* Groups of fields of a context, which are read together from /proc or the cgroup tree when first needed */
+typedef enum ClientContextField {
+        CLIENT_CONTEXT_CREDENTIALS = 1 << 0, /* uid, gid */
+        CLIENT_CONTEXT_BASIC       = 1 << 1, /* comm, exe, cmdline, capeff */
+        CLIENT_CONTEXT_LABEL       = 1 << 2, /* SELinux label */
+        CLIENT_CONTEXT_AUDIT       = 1 << 3, /* audit session, login UID */
+        CLIENT_CONTEXT_CGROUP      = 1 << 4, /* cgroup, everything derived from it, invocation ID */
+        _CLIENT_CONTEXT_ALL        = (1 << 5) - 1,
+} ClientContextField;
+
 struct ClientContext {
         unsigned n_ref;
         unsigned lru_index;
         usec_t timestamp;
         bool in_lru;
 
+        /* The field groups that are current, all others are read when needed */
+        unsigned loaded;
+
         pid_t pid;
         uid_t uid;
         gid_t gid;
@@ -88,5 +110,9 @@ void client_context_maybe_refresh(
                 const char *unit_id,
                 usec_t tstamp);
 
+void client_context_load(Server *s, ClientContext *c, unsigned fields);
+
 void client_context_acquire_default(Server *s);
 void client_context_flush_all(Server *s);
+
+void client_context_log_stats(Server *s);
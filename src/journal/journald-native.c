@@ -82,6 +82,10 @@ static bool allow_object_pid(const struct ucred *ucred) {
         return ucred && ucred->uid == 0;
 }
 
+static bool server_wants_message(Server *s) {
+        return s->forward_to_syslog || s->forward_to_kmsg || s->forward_to_console || s->forward_to_wall;
+}
+
 static void server_process_entry_meta(
                 const char *p, size_t l,
                 const struct ucred *ucred,
@@ -118,7 +122,8 @@ static void server_process_entry_meta(
                         *identifier = t;
                 }
 
-        } else if (l >= 8 &&
+        } else if (message &&
+                   l >= 8 &&
                    startswith(p, "MESSAGE=")) {
                 char *t;
 
@@ -142,7 +147,7 @@ static void server_process_entry_meta(
 
 static int server_process_entry(
                 Server *s,
-                const void *buffer, size_t *remaining,
+                void *buffer, size_t *remaining,
                 ClientContext *context,
                 const struct ucred *ucred,
                 const struct timeval *tv,
@@ -152,21 +157,26 @@ static int server_process_entry(
          * Returns 0 if nothing special happened and the message processing should continue,
          * and a negative or positive value otherwise.
          *
-         * Note that *remaining is altered on both success and failure. */
+         * Note that *remaining is altered on both success and failure.
+         *
+         * All fields are passed on by reference into the buffer, which is modified in place for that. */
 
         struct iovec *iovec = NULL;
-        unsigned n = 0, j, tn = (unsigned) -1;
-        const char *p;
+        unsigned n = 0;
+        char *p;
         size_t m = 0, entry_size = 0;
         int priority = LOG_INFO;
         char *identifier = NULL, *message = NULL;
+        bool want_message;
         pid_t object_pid = 0;
         int r = 0;
 
+        want_message = server_wants_message(s);
+
         p = buffer;
 
         while (*remaining > 0) {
-                const char *e, *q;
+                char *e, *q;
 
                 e = memchr(p, '\n', *remaining);
 
@@ -218,7 +228,7 @@ static int server_process_entry(
                                 server_process_entry_meta(p, l, ucred,
                                                           &priority,
                                                           &identifier,
-                                                          &message,
+                                                          want_message ? &message : NULL,
                                                           &object_pid);
                         }
 
@@ -247,17 +257,15 @@ static int server_process_entry(
                                 break;
                         }
 
-                        k = malloc((e - p) + 1 + l);
-                        if (!k) {
-                                log_oom();
-                                break;
-                        }
-
-                        memcpy(k, p, e - p);
-                        k[e - p] = '=';
-                        memcpy(k + (e - p) + 1, e + 1 + sizeof(uint64_t), l);
-
                         if (valid_user_field(p, e - p, false)) {
+                                /* The field name is followed by a newline and the 64bit size, and then the
+                                 * data. Move the field name and a '=' right in front of the data, so that we
+                                 * can pass it on by reference instead of copying the data, which may be
+                                 * large. */
+                                k = e + 1 + sizeof(uint64_t) - (e - p) - 1;
+                                memmove(k, p, e - p);
+                                k[e - p] = '=';
+
                                 iovec[n].iov_base = k;
                                 iovec[n].iov_len = (e - p) + 1 + l;
                                 entry_size += iovec[n].iov_len;
@@ -266,10 +274,9 @@ static int server_process_entry(
                                 server_process_entry_meta(k, (e - p) + 1 + l, ucred,
                                                           &priority,
                                                           &identifier,
-                                                          &message,
+                                                          want_message ? &message : NULL,
                                                           &object_pid);
-                        } else
-                                free(k);
+                        }
 
                         *remaining -= (e - p) + 1 + sizeof(uint64_t) + l + 1;
                         p = e + 1 + sizeof(uint64_t) + l + 1;
@@ -281,8 +288,7 @@ static int server_process_entry(
                 goto finish;
         }
 
-        tn = n++;
-        IOVEC_SET_STRING(iovec[tn], "_TRANSPORT=journal");
+        IOVEC_SET_STRING(iovec[n++], "_TRANSPORT=journal");
         entry_size += strlen("_TRANSPORT=journal");
 
         if (entry_size + n + 1 > ENTRY_SIZE_MAX) { /* data + separators + trailer */
@@ -308,15 +314,6 @@ static int server_process_entry(
         server_dispatch_message(s, iovec, n, m, context, tv, priority, object_pid);
 
 finish:
-        for (j = 0; j < n; j++)  {
-                if (j == tn)
-                        continue;
-
-                if (iovec[j].iov_base < buffer ||
-                    (const char*) iovec[j].iov_base >= p + *remaining)
-                        free(iovec[j].iov_base);
-        }
-
         free(iovec);
         free(identifier);
         free(message);
@@ -326,13 +323,13 @@ finish:
 
 void server_process_native_message(
                 Server *s,
-                const void *buffer, size_t buffer_size,
+                void *buffer, size_t buffer_size,
                 const struct ucred *ucred,
                 const struct timeval *tv,
                 const char *label, size_t label_len) {
 
         size_t remaining = buffer_size;
-        ClientContext *context;
+        ClientContext *context = NULL;
         int r;
 
         assert(s);
@@ -346,7 +343,7 @@ void server_process_native_message(
 
         do {
                 r = server_process_entry(s,
-                                         (const uint8_t*) buffer + (buffer_size - remaining), &remaining,
+                                         (uint8_t*) buffer + (buffer_size - remaining), &remaining,
                                          context, ucred, tv, label, label_len);
         } while (r == 0);
 }
@@ -429,10 +426,12 @@ void server_process_native_file(
                 void *p;
                 size_t ps;
 
-                /* The file is sealed, we can just map it and use it. */
+                /* The file is sealed, we can just map it and use it. The mapping is private, so that we
+                 * may modify it while parsing it in place. This only copies the pages actually modified,
+                 * i.e. those with the names of binary fields in them, but never the data itself. */
 
                 ps = PAGE_ALIGN(st.st_size);
-                p = mmap(NULL, ps, PROT_READ, MAP_PRIVATE, fd, 0);
+                p = mmap(NULL, ps, PROT_READ|PROT_WRITE, MAP_PRIVATE, fd, 0);
                 if (p == MAP_FAILED) {
                         log_error_errno(errno, "Failed to map memfd, ignoring: %m");
                         return;
@@ -24,13 +24,20 @@
 #include "hashmap.h"
 #include "journald-rate-limit.h"
 #include "list.h"
-#include "random-util.h"
 #include "string-util.h"
 #include "util.h"
 
+/* Rate limiting is done with a token bucket for each group, i.e. unit, and priority: a group may log up to "burst"
+ * messages at once, and then one more message for each interval/burst that passes. Slices may have a bucket of their
+ * own, shared by all units in the slice, so that a slice with many noisy units can't flood the journal even if each
+ * of its units stays within its own limit.
+ *
+ * Groups are looked up in a hashmap, one for units and one for slices, so that their names can't collide, and are
+ * kept in an LRU list, whose tail is dropped when the tables are full or the groups at the tail are idle for longer
+ * than the interval, in which case their buckets would be full again anyway. */
+
 #define POOLS_MAX 5
-#define BUCKETS_MAX 127
-#define GROUPS_MAX 2047
+#define GROUPS_MAX (64*1024)
 
 static const int priority_map[] = {
         [LOG_EMERG]   = 0,
@@ -47,8 +54,10 @@ typedef struct JournalRateLimitPool JournalRateLimitPool;
 typedef struct JournalRateLimitGroup JournalRateLimitGroup;
 
 struct JournalRateLimitPool {
-        usec_t begin;
-        unsigned num;
+        usec_t timestamp;       /* when tokens were last added, 0 if never used */
+        unsigned tokens;
+
+        usec_t suppressed_begin;
         unsigned suppressed;
 };
 
@@ -56,26 +65,23 @@ struct JournalRateLimitGroup {
         JournalRateLimit *parent;
 
         char *id;
+        bool slice;
         JournalRateLimitPool pools[POOLS_MAX];
-        uint64_t hash;
 
-        LIST_FIELDS(JournalRateLimitGroup, bucket);
         LIST_FIELDS(JournalRateLimitGroup, lru);
 };
 
 struct JournalRateLimit {
         usec_t interval;
         unsigned burst;
+        unsigned slice_burst;
 
-        JournalRateLimitGroup* buckets[BUCKETS_MAX];
+        Hashmap *groups;
+        Hashmap *slice_groups;
         JournalRateLimitGroup *lru, *lru_tail;
-
-        unsigned n_groups;
-
-        uint8_t hash_key[16];
 };
 
-JournalRateLimit *journal_rate_limit_new(usec_t interval, unsigned burst) {
+JournalRateLimit *journal_rate_limit_new(usec_t interval, unsigned burst, unsigned slice_burst) {
         JournalRateLimit *r;
 
         assert(interval > 0 || burst == 0);
@@ -86,8 +92,15 @@ JournalRateLimit *journal_rate_limit_new(usec_t interval, unsigned burst) {
 
         r->interval = interval;
         r->burst = burst;
-
-        random_bytes(r->hash_key, sizeof(r->hash_key));
+        r->slice_burst = slice_burst;
+
+        r->groups = hashmap_new(&string_hash_ops);
+        r->slice_groups = hashmap_new(&string_hash_ops);
+        if (!r->groups || !r->slice_groups) {
+                hashmap_free(r->groups);
+                hashmap_free(r->slice_groups);
+                return mfree(r);
+        }
 
         return r;
 }
@@ -96,15 +109,11 @@ static void journal_rate_limit_group_free(JournalRateLimitGroup *g) {
         assert(g);
 
         if (g->parent) {
-                assert(g->parent->n_groups > 0);
-
                 if (g->parent->lru_tail == g)
                         g->parent->lru_tail = g->lru_prev;
 
                 LIST_REMOVE(lru, g->parent->lru, g);
-                LIST_REMOVE(bucket, g->parent->buckets[g->hash % BUCKETS_MAX], g);
-
-                g->parent->n_groups--;
+                assert_se(hashmap_remove(g->slice ? g->parent->slice_groups : g->parent->groups, g->id) == g);
         }
 
         free(g->id);
@@ -117,6 +126,8 @@ void journal_rate_limit_free(JournalRateLimit *r) {
         while (r->lru)
                 journal_rate_limit_group_free(r->lru);
 
+        hashmap_free(r->groups);
+        hashmap_free(r->slice_groups);
         free(r);
 }
 
@@ -126,7 +137,7 @@ _pure_ static bool journal_rate_limit_group_expired(JournalRateLimitGroup *g, us
         assert(g);
 
         for (i = 0; i < POOLS_MAX; i++)
-                if (g->pools[i].begin + g->parent->interval >= ts)
+                if (g->pools[i].timestamp + g->parent->interval >= ts)
                         return false;
 
         return true;
@@ -136,16 +147,15 @@ static void journal_rate_limit_vacuum(JournalRateLimit *r, usec_t ts) {
         assert(r);
 
         /* Makes room for at least one new item, but drop all
-         * expored items too. */
+         * expired items too. */
 
-        while (r->n_groups >= GROUPS_MAX ||
+        while (hashmap_size(r->groups) + hashmap_size(r->slice_groups) >= GROUPS_MAX ||
                (r->lru_tail && journal_rate_limit_group_expired(r->lru_tail, ts)))
                 journal_rate_limit_group_free(r->lru_tail);
 }
 
-static JournalRateLimitGroup* journal_rate_limit_group_new(JournalRateLimit *r, const char *id, usec_t ts) {
+static JournalRateLimitGroup* journal_rate_limit_group_new(JournalRateLimit *r, const char *id, bool slice, usec_t ts) {
         JournalRateLimitGroup *g;
-        struct siphash state;
 
         assert(r);
         assert(id);
@@ -158,17 +168,16 @@ static JournalRateLimitGroup* journal_rate_limit_group_new(JournalRateLimit *r,
         if (!g->id)
                 goto fail;
 
-        siphash24_init(&state, r->hash_key);
-        string_hash_func(g->id, &state);
-        g->hash = siphash24_finalize(&state);
+        g->slice = slice;
 
         journal_rate_limit_vacuum(r, ts);
 
-        LIST_PREPEND(bucket, r->buckets[g->hash % BUCKETS_MAX], g);
+        if (hashmap_put(slice ? r->slice_groups : r->groups, g->id, g) < 0)
+                goto fail;
+
         LIST_PREPEND(lru, r->lru, g);
         if (!g->lru_next)
                 r->lru_tail = g;
-        r->n_groups++;
 
         g->parent = r;
         return g;
@@ -178,6 +187,28 @@ fail:
         return NULL;
 }
 
+static JournalRateLimitGroup* journal_rate_limit_group_get(JournalRateLimit *r, const char *id, bool slice, usec_t ts) {
+        JournalRateLimitGroup *g;
+
+        assert(r);
+        assert(id);
+
+        g = hashmap_get(slice ? r->slice_groups : r->groups, id);
+        if (!g)
+                return journal_rate_limit_group_new(r, id, slice, ts);
+
+        /* Move the group to the front of the LRU list */
+        if (r->lru != g) {
+                if (r->lru_tail == g)
+                        r->lru_tail = g->lru_prev;
+
+                LIST_REMOVE(lru, r->lru, g);
+                LIST_PREPEND(lru, r->lru, g);
+        }
+
+        return g;
+}
+
 static unsigned burst_modulate(unsigned burst, uint64_t available) {
         unsigned k;
 
@@ -206,13 +237,73 @@ static unsigned burst_modulate(unsigned burst, uint64_t available) {
         return burst;
 }
 
-int journal_rate_limit_test(JournalRateLimit *r, const char *id, int priority, uint64_t available) {
-        uint64_t h;
-        JournalRateLimitGroup *g;
-        JournalRateLimitPool *p;
-        struct siphash state;
+static void journal_rate_limit_pool_suppress(JournalRateLimitPool *p, usec_t ts) {
+        assert(p);
+
+        if (p->suppressed == 0)
+                p->suppressed_begin = ts;
+
+        p->suppressed++;
+}
+
+static unsigned journal_rate_limit_pool_report(JournalRateLimitPool *p, usec_t interval, usec_t ts) {
+        unsigned s;
+
+        assert(p);
+
+        /* Under a steady flood a token becomes available every now and then. Let's not report the suppressed
+         * messages every time that happens, but only once per interval. */
+        if (p->suppressed == 0 || ts < p->suppressed_begin + interval)
+                return 0;
+
+        s = p->suppressed;
+        p->suppressed = 0;
+
+        return s;
+}
+
+static bool journal_rate_limit_pool_take(JournalRateLimitPool *p, usec_t interval, unsigned burst, usec_t ts) {
+        usec_t per_token, n;
+
+        assert(p);
+
+        /* Adds the tokens earned since the last time, and takes one if there is one */
+
+        if (p->timestamp <= 0 || ts >= p->timestamp + interval) {
+                p->tokens = burst;
+                p->timestamp = ts;
+        } else if (ts > p->timestamp) {
+                per_token = MAX(interval / burst, 1U);
+
+                n = (ts - p->timestamp) / per_token;
+                if (n > 0) {
+                        p->tokens = (unsigned) MIN(p->tokens + n, (usec_t) burst);
+                        p->timestamp += n * per_token;
+                }
+        }
+
+        /* The burst is modulated with the available disk space, hence might have gone down since */
+        p->tokens = MIN(p->tokens, burst);
+
+        if (p->tokens <= 0)
+                return false;
+
+        p->tokens--;
+        return true;
+}
+
+int journal_rate_limit_test(
+                JournalRateLimit *r,
+                const char *id,
+                const char *slice,
+                int priority,
+                uint64_t available,
+                usec_t ts,
+                unsigned *ret_slice_suppressed) {
+
+        JournalRateLimitGroup *g, *sg;
+        JournalRateLimitPool *p, *sp;
         unsigned burst;
-        usec_t ts;
 
         assert(id);
 
@@ -221,7 +312,15 @@ int journal_rate_limit_test(JournalRateLimit *r, const char *id, int priority, u
          * 0     → the log message shall be suppressed,
          * 1 + n → the log message shall be permitted, and n messages were dropped from the peer before
          * < 0   → error
-         */
+         *
+         * Messages dropped because of the limit of the slice are counted for the slice instead, and their
+         * number is returned in ret_slice_suppressed, once one of its units may log again.
+         *
+         * The timestamp is the time the message was received, usually the timestamp of the current event loop
+         * iteration, so that the clock doesn't need to be read for every message. */
+
+        if (ret_slice_suppressed)
+                *ret_slice_suppressed = 0;
 
         if (!r)
                 return 1;
@@ -231,48 +330,34 @@ int journal_rate_limit_test(JournalRateLimit *r, const char *id, int priority, u
 
         burst = burst_modulate(r->burst, available);
 
-        ts = now(CLOCK_MONOTONIC);
-
-        siphash24_init(&state, r->hash_key);
-        string_hash_func(id, &state);
-        h = siphash24_finalize(&state);
-        g = r->buckets[h % BUCKETS_MAX];
-
-        LIST_FOREACH(bucket, g, g)
-                if (streq(g->id, id))
-                        break;
-
-        if (!g) {
-                g = journal_rate_limit_group_new(r, id, ts);
-                if (!g)
-                        return -ENOMEM;
-        }
+        g = journal_rate_limit_group_get(r, id, false, ts);
+        if (!g)
+                return -ENOMEM;
 
         p = &g->pools[priority_map[priority]];
 
-        if (p->begin <= 0) {
-                p->suppressed = 0;
-                p->num = 1;
-                p->begin = ts;
-                return 1;
+        if (!journal_rate_limit_pool_take(p, r->interval, burst, ts)) {
+                journal_rate_limit_pool_suppress(p, ts);
+                return 0;
         }
 
-        if (p->begin + r->interval < ts) {
-                unsigned s;
+        if (slice && r->slice_burst > 0) {
+                sg = journal_rate_limit_group_get(r, slice, true, ts);
+                if (!sg)
+                        return -ENOMEM;
 
-                s = p->suppressed;
-                p->suppressed = 0;
-                p->num = 1;
-                p->begin = ts;
+                sp = &sg->pools[priority_map[priority]];
 
-                return 1 + s;
-        }
+                if (!journal_rate_limit_pool_take(sp, r->interval, burst_modulate(r->slice_burst, available), ts)) {
+                        /* The message is not logged after all, hence give the unit its token back */
+                        p->tokens++;
+                        journal_rate_limit_pool_suppress(sp, ts);
+                        return 0;
+                }
 
-        if (p->num < burst) {
-                p->num++;
-                return 1;
+                if (ret_slice_suppressed)
+                        *ret_slice_suppressed = journal_rate_limit_pool_report(sp, r->interval, ts);
         }
 
-        p->suppressed++;
-        return 0;
+        return 1 + journal_rate_limit_pool_report(p, r->interval, ts);
 }
@@ -20,6 +20,7 @@
 #ifdef HAVE_SELINUX
 #include <selinux/selinux.h>
 #endif
+#include <sys/eventfd.h>
 #include <sys/ioctl.h>
 #include <sys/mman.h>
 #include <sys/signalfd.h>
@@ -36,7 +37,7 @@
 #include "audit-util.h"
 #include "cgroup-util.h"
 #include "conf-parser.h"
-#include "dirent-util.h"
+#include "event-util.h"
 #include "extract-word.h"
 #include "fd-util.h"
 #include "fileio.h"
@@ -64,6 +65,7 @@
 #include "parse-util.h"
 #include "proc-cmdline.h"
 #include "process-util.h"
+#include "rlimit-util.h"
 #include "rm-rf.h"
 #include "selinux-util.h"
 #include "signal-util.h"
@@ -71,6 +73,7 @@
 #include "stdio-util.h"
 #include "string-table.h"
 #include "string-util.h"
+#include "strv.h"
 #include "syslog-util.h"
 #include "user-util.h"
 
@@ -80,6 +83,7 @@
 #define DEFAULT_RATE_LIMIT_INTERVAL (30*USEC_PER_SEC)
 #define DEFAULT_RATE_LIMIT_BURST 1000
 #define DEFAULT_MAX_FILE_USEC USEC_PER_MONTH
+#define DEFAULT_STDOUT_STREAMS_MAX 4096
 
 #define RECHECK_SPACE_USEC (30*USEC_PER_SEC)
 
@@ -88,41 +92,74 @@
 /* The period to insert between posting changes for coalescing */
 #define POST_CHANGE_TIMER_INTERVAL_USEC (250*USEC_PER_MSEC)
 
-static int determine_path_usage(Server *s, const char *path, uint64_t *ret_used, uint64_t *ret_free) {
-        _cleanup_closedir_ DIR *d = NULL;
-        struct dirent *de;
-        struct statvfs ss;
+/* How many events the event loop fetches at most while others are still pending. With many busy stdout
+ * streams, fetching all of them again for every line dispatched would make dispatching each one O(n). */
+#define EVENT_FETCH_MAX 64U
 
-        assert(ret_used);
-        assert(ret_free);
+static int storage_vacuum_index(JournalStorage *storage) {
+        int r;
 
-        d = opendir(path);
-        if (!d)
-                return log_full_errno(errno == ENOENT ? LOG_DEBUG : LOG_ERR,
-                                      errno, "Failed to open %s: %m", path);
+        assert(storage);
 
-        if (fstatvfs(dirfd(d), &ss) < 0)
-                return log_error_errno(errno, "Failed to fstatvfs(%s): %m", path);
+        /* The directory is listed once, afterwards the index is kept up-to-date as we rotate and vacuum */
+        if (storage->vacuum_index)
+                return 0;
 
-        *ret_free = ss.f_bsize * ss.f_bavail;
-        *ret_used = 0;
-        FOREACH_DIRENT_ALL(de, d, break) {
-                struct stat st;
+        r = journal_vacuum_index_new(storage->path, false, &storage->vacuum_index);
+        if (r < 0) {
+                log_full_errno(r == -ENOENT ? LOG_DEBUG : LOG_ERR, r, "Failed to list %s: %m", storage->path);
+                return r;
+        }
 
-                if (!endswith(de->d_name, ".journal") &&
-                    !endswith(de->d_name, ".journal~"))
-                        continue;
+        return 0;
+}
 
-                if (fstatat(dirfd(d), de->d_name, &st, AT_SYMLINK_NOFOLLOW) < 0) {
-                        log_debug_errno(errno, "Failed to stat %s/%s, ignoring: %m", path, de->d_name);
-                        continue;
-                }
+static void server_update_vacuum_index(Server *s, const char *path) {
+        JournalStorage *storages[] = { &s->system_storage, &s->runtime_storage };
+        unsigned k;
+        int r;
 
-                if (!S_ISREG(st.st_mode))
+        assert(s);
+        assert(path);
+
+        /* Each index ignores files that are not in its directory */
+        for (k = 0; k < ELEMENTSOF(storages); k++) {
+                if (!storages[k]->vacuum_index)
                         continue;
 
-                *ret_used += (uint64_t) st.st_blocks * 512UL;
+                r = journal_vacuum_index_update(storages[k]->vacuum_index, path);
+                if (r < 0)
+                        log_debug_errno(r, "Failed to update index of %s with %s, ignoring: %m", storages[k]->path, path);
         }
+}
+
+static int determine_path_usage(Server *s, JournalStorage *storage, uint64_t *ret_used, uint64_t *ret_free) {
+        struct statvfs ss;
+        JournalFile *f;
+        Iterator i;
+        int r;
+
+        assert(storage);
+        assert(ret_used);
+        assert(ret_free);
+
+        r = storage_vacuum_index(storage);
+        if (r < 0)
+                return r;
+
+        if (statvfs(storage->path, &ss) < 0)
+                return log_error_errno(errno, "Failed to statvfs(%s): %m", storage->path);
+
+        /* Only the files we write to grow behind the back of the index */
+        if (s->runtime_journal)
+                (void) journal_vacuum_index_update(storage->vacuum_index, s->runtime_journal->path);
+        if (s->system_journal)
+                (void) journal_vacuum_index_update(storage->vacuum_index, s->system_journal->path);
+        ORDERED_HASHMAP_FOREACH(f, s->user_journals, i)
+                (void) journal_vacuum_index_update(storage->vacuum_index, f->path);
+
+        *ret_free = ss.f_bsize * ss.f_bavail;
+        *ret_used = journal_vacuum_index_usage(storage->vacuum_index);
 
         return 0;
 }
@@ -134,7 +171,7 @@ static void cache_space_invalidate(JournalStorageSpace *space) {
 static int cache_space_refresh(Server *s, JournalStorage *storage) {
         JournalStorageSpace *space;
         JournalMetrics *metrics;
-        uint64_t vfs_used, vfs_avail, avail;
+        uint64_t vfs_used = 0, vfs_avail = 0, avail;
         usec_t ts;
         int r;
 
@@ -148,7 +185,7 @@ static int cache_space_refresh(Server *s, JournalStorage *storage) {
         if (space->timestamp != 0 && space->timestamp + RECHECK_SPACE_USEC > ts)
                 return 0;
 
-        r = determine_path_usage(s, storage->path, &vfs_used, &vfs_avail);
+        r = determine_path_usage(s, storage, &vfs_used, &vfs_avail);
         if (r < 0)
                 return r;
 
@@ -273,6 +310,14 @@ static int open_journal(
         if (r < 0)
                 return r;
 
+        if (s->summary_fields) {
+                f->summary_fields = strv_copy(s->summary_fields);
+                if (!f->summary_fields) {
+                        (void) journal_file_close(f);
+                        return -ENOMEM;
+                }
+        }
+
         r = journal_file_enable_post_change_timer(f, s->event, POST_CHANGE_TIMER_INTERVAL_USEC);
         if (r < 0) {
                 (void) journal_file_close(f);
@@ -444,12 +489,15 @@ static int do_rotate(
                 bool seal,
                 uint32_t uid) {
 
+        _cleanup_free_ char *archived = NULL;
         int r;
         assert(s);
 
         if (!*f)
                 return -EINVAL;
 
+        (void) journal_file_archived_path(*f, &archived);
+
         r = journal_file_rotate(f, s->compress, seal, s->deferred_closes);
         if (r < 0)
                 if (*f)
@@ -459,6 +507,10 @@ static int do_rotate(
         else
                 server_add_acls(*f, uid);
 
+        /* Vacuuming will find the old file under its new name right away */
+        if (archived)
+                server_update_vacuum_index(s, archived);
+
         return r;
 }
 
@@ -482,9 +534,39 @@ void server_rotate(Server *s) {
                         ordered_hashmap_remove(s->user_journals, k);
         }
 
+        server_process_offlined(s);
+}
+
+static void server_log_offline_latency(JournalFile *f) {
+        char ts[FORMAT_TIMESPAN_MAX];
+        usec_t u;
+
+        u = journal_file_get_offline_latency(f);
+        if (u > 0)
+                log_debug("Synced %s in %s.", f->path, format_timespan(ts, sizeof(ts), u, USEC_PER_MSEC));
+}
+
+void server_process_offlined(Server *s) {
+        JournalFile *f;
+        Iterator i;
+
+        assert(s);
+
+        if (s->system_journal)
+                server_log_offline_latency(s->system_journal);
+
+        ORDERED_HASHMAP_FOREACH(f, s->user_journals, i)
+                server_log_offline_latency(f);
+
         /* Perform any deferred closes which aren't still offlining. */
         SET_FOREACH(f, s->deferred_closes, i)
                 if (!journal_file_is_offlining(f)) {
+                        server_log_offline_latency(f);
+
+                        /* Its summary has been written by now */
+                        if (f->archive)
+                                server_update_vacuum_index(s, f->path);
+
                         (void) set_remove(s->deferred_closes, f);
                         (void) journal_file_close(f);
                 }
@@ -523,15 +605,25 @@ static void do_vacuum(Server *s, JournalStorage *storage, bool verbose) {
         assert(s);
         assert(storage);
 
+        if (verbose) {
+                /* When asked explicitly, list the directory again, in case files were added or removed behind our
+                 * back */
+                storage->vacuum_index = journal_vacuum_index_free(storage->vacuum_index);
+                cache_space_invalidate(&storage->space);
+        }
+
         (void) cache_space_refresh(s, storage);
 
         if (verbose)
                 server_space_usage_message(s, storage);
 
-        r = journal_directory_vacuum(storage->path, storage->space.limit,
-                                     storage->metrics.n_max_files, s->max_retention_usec,
-                                     &s->oldest_file_usec, verbose);
-        if (r < 0 && r != -ENOENT)
+        if (storage_vacuum_index(storage) < 0)
+                return;
+
+        r = journal_vacuum_index_vacuum(storage->vacuum_index, storage->space.limit,
+                                        storage->metrics.n_max_files, s->max_retention_usec,
+                                        &s->oldest_file_usec, verbose);
+        if (r < 0)
                 log_warning_errno(r, "Failed to vacuum %s, ignoring: %m", storage->path);
 
         cache_space_invalidate(&storage->space);
@@ -552,6 +644,33 @@ int server_vacuum(Server *s, bool verbose) {
         return 0;
 }
 
+static int dispatch_vacuum(sd_event_source *es, void *userdata) {
+        Server *s = userdata;
+
+        assert(s);
+
+        server_vacuum(s, false);
+        return 0;
+}
+
+static int server_schedule_vacuum(Server *s) {
+        int r;
+
+        assert(s);
+
+        /* Vacuum after the messages that are already queued have been written, rather than while writing one
+         * of them. The source has the priority of the sockets, so that it is not starved by a busy one. */
+
+        if (s->vacuum_event_source)
+                return sd_event_source_set_enabled(s->vacuum_event_source, SD_EVENT_ONESHOT);
+
+        r = sd_event_add_defer(s->event, &s->vacuum_event_source, dispatch_vacuum, s);
+        if (r < 0)
+                return r;
+
+        return sd_event_source_set_priority(s->vacuum_event_source, SD_EVENT_PRIORITY_NORMAL+5);
+}
+
 static void server_cache_machine_id(Server *s) {
         sd_id128_t id;
         int r;
@@ -641,23 +760,18 @@ static bool shall_try_append_again(JournalFile *f, int r) {
         }
 }
 
-static void write_to_journal(Server *s, uid_t uid, struct iovec *iovec, unsigned n, int priority) {
-        bool vacuumed = false, rotate = false;
-        struct dual_timestamp ts;
+static void write_entries_to_journal(Server *s, uid_t uid, const JournalEntryBatchItem *entries, unsigned n, int priority) {
+        bool rotated = false, rotate = false;
         JournalFile *f;
+        unsigned k;
         int r;
 
         assert(s);
-        assert(iovec);
+        assert(entries);
         assert(n > 0);
 
-        /* Get the closest, linearized time we have for this log event from the event loop. (Note that we do not use
-         * the source time, and not even the time the event was originally seen, but instead simply the time we started
-         * processing it, as we want strictly linear ordering in what we write out.) */
-        assert_se(sd_event_now(s->event, CLOCK_REALTIME, &ts.realtime) >= 0);
-        assert_se(sd_event_now(s->event, CLOCK_MONOTONIC, &ts.monotonic) >= 0);
-
-        if (ts.realtime < s->last_realtime_clock) {
+        /* The entries are ordered by time, hence checking the first one is enough */
+        if (entries[0].ts->realtime < s->last_realtime_clock) {
                 /* When the time jumps backwards, let's immediately rotate. Of course, this should not happen during
                  * regular operation. However, when it does happen, then we should make sure that we start fresh files
                  * to ensure that the entries in the journal files are strictly ordered by time, in order to ensure
@@ -678,41 +792,191 @@ static void write_to_journal(Server *s, uid_t uid, struct iovec *iovec, unsigned
         }
 
         if (rotate) {
+                server_rotate(s);
+                rotated = true;
+
+                if (server_schedule_vacuum(s) < 0)
+                        server_vacuum(s, false);
+
+                f = find_journal(s, uid);
+                if (!f)
+                        return;
+        }
+
+        s->last_realtime_clock = entries[n-1].ts->realtime;
+
+        for (;;) {
+                r = journal_file_append_entries(f, entries, n, &s->seqnum, &k);
+                if (r >= 0)
+                        break;
+
+                /* The entries before the failing one have been written */
+                entries += k;
+                n -= k;
+
+                if (rotated || !shall_try_append_again(f, r)) {
+                        log_error_errno(r, "Failed to write entry (%u items, %zu bytes)%s, ignoring: %m",
+                                        entries[0].n_iovec, IOVEC_TOTAL_SIZE(entries[0].iovec, entries[0].n_iovec),
+                                        rotated ? " despite vacuuming" : "");
+
+                        /* Skip it, but not the ones after it */
+                        entries++;
+                        n--;
+                        if (n == 0)
+                                break;
+
+                        continue;
+                }
+
+                /* The write might have failed because we ran out of space, hence vacuum right away before trying again */
                 server_rotate(s);
                 server_vacuum(s, false);
-                vacuumed = true;
+                rotated = true;
 
                 f = find_journal(s, uid);
                 if (!f)
                         return;
+
+                log_debug("Retrying write.");
         }
 
-        s->last_realtime_clock = ts.realtime;
+        server_schedule_sync(s, priority);
+}
 
-        r = journal_file_append_entry(f, &ts, iovec, n, &s->seqnum, NULL, NULL);
-        if (r >= 0) {
-                server_schedule_sync(s, priority);
+static bool server_batch_fits(Server *s, unsigned n, size_t size) {
+        assert(s);
+
+        return s->batch.n_entries < SERVER_BATCH_ENTRIES_MAX &&
+                s->batch.n_iovec + n <= SERVER_BATCH_IOVEC_MAX &&
+                s->batch.data_size + size <= SERVER_BATCH_DATA_MAX;
+}
+
+static void server_batch_flush(Server *s) {
+        bool active;
+
+        assert(s);
+
+        if (s->batch.n_entries == 0)
                 return;
+
+        /* Messages logged while writing, e.g. about rotation, must not be queued behind the entries being written */
+        active = s->batch.active;
+        s->batch.active = false;
+
+        write_entries_to_journal(s, s->batch.uid, s->batch.entries, s->batch.n_entries, s->batch.priority);
+
+        s->batch.n_entries = s->batch.n_iovec = 0;
+        s->batch.data_size = 0;
+        s->batch.active = active;
+}
+
+static bool server_batch_queue(Server *s, uid_t uid, const dual_timestamp *ts, const struct iovec *iovec, unsigned n, int priority) {
+        JournalEntryBatchItem *e;
+        size_t size;
+        unsigned i;
+
+        assert(s);
+        assert(s->batch.active);
+        assert(ts);
+        assert(iovec);
+
+        /* Returns false if the entry is not queued, and needs to be written right away. The queued entries
+         * are written first then, so that the order is kept.
+         *
+         * The fields of an entry point into buffers that are reused for the next message, or onto the stack,
+         * hence queueing means copying. For the usual few lines of text that's cheaper than appending the
+         * entry on its own, but larger entries, e.g. binary fields passed on by reference from a native
+         * datagram or memfd, are not worth a copy, and are written directly. */
+
+        size = IOVEC_TOTAL_SIZE(iovec, n);
+        if (n > SERVER_BATCH_IOVEC_MAX || size > SERVER_BATCH_ENTRY_SIZE_MAX)
+                goto unqueued;
+
+        if (!s->batch.iovec) {
+                s->batch.iovec = new(struct iovec, SERVER_BATCH_IOVEC_MAX);
+                if (!s->batch.iovec)
+                        goto unqueued;
         }
 
-        if (vacuumed || !shall_try_append_again(f, r)) {
-                log_error_errno(r, "Failed to write entry (%d items, %zu bytes), ignoring: %m", n, IOVEC_TOTAL_SIZE(iovec, n));
-                return;
+        if (!s->batch.data) {
+                s->batch.data = malloc(SERVER_BATCH_DATA_MAX);
+                if (!s->batch.data)
+                        goto unqueued;
         }
 
-        server_rotate(s);
-        server_vacuum(s, false);
+        /* A batch goes to one file, and its entries must be ordered by time */
+        if (s->batch.n_entries > 0 &&
+            (s->batch.uid != uid ||
+             s->batch.timestamps[s->batch.n_entries-1].realtime > ts->realtime ||
+             !server_batch_fits(s, n, size)))
+                server_batch_flush(s);
+
+        if (s->batch.n_entries == 0) {
+                s->batch.uid = uid;
+                s->batch.priority = priority;
+        } else
+                s->batch.priority = MIN(s->batch.priority, priority);
+
+        s->batch.timestamps[s->batch.n_entries] = *ts;
+
+        e = s->batch.entries + s->batch.n_entries++;
+        *e = (JournalEntryBatchItem) {
+                .ts = s->batch.timestamps + (e - s->batch.entries),
+                .iovec = s->batch.iovec + s->batch.n_iovec,
+                .n_iovec = n,
+        };
+
+        for (i = 0; i < n; i++) {
+                s->batch.iovec[s->batch.n_iovec++] = (struct iovec) {
+                        .iov_base = s->batch.data + s->batch.data_size,
+                        .iov_len = iovec[i].iov_len,
+                };
+                memcpy_safe(s->batch.data + s->batch.data_size, iovec[i].iov_base, iovec[i].iov_len);
+                s->batch.data_size += iovec[i].iov_len;
+        }
+
+        return true;
+
+unqueued:
+        server_batch_flush(s);
+        return false;
+}
+
+void server_batch_begin(Server *s) {
+        assert(s);
+        assert(!s->batch.active);
+
+        /* Messages dispatched from now on until server_batch_end() are queued and appended to the journal in one
+         * go, which is cheaper than appending them one by one */
+
+        s->batch.active = true;
+}
+
+void server_batch_end(Server *s) {
+        assert(s);
+        assert(s->batch.active);
 
-        f = find_journal(s, uid);
-        if (!f)
+        s->batch.active = false;
+        server_batch_flush(s);
+}
+
+static void write_to_journal(Server *s, uid_t uid, struct iovec *iovec, unsigned n, int priority) {
+        struct dual_timestamp ts;
+
+        assert(s);
+        assert(iovec);
+        assert(n > 0);
+
+        /* Get the closest, linearized time we have for this log event from the event loop. (Note that we do not use
+         * the source time, and not even the time the event was originally seen, but instead simply the time we started
+         * processing it, as we want strictly linear ordering in what we write out.) */
+        assert_se(sd_event_now(s->event, CLOCK_REALTIME, &ts.realtime) >= 0);
+        assert_se(sd_event_now(s->event, CLOCK_MONOTONIC, &ts.monotonic) >= 0);
+
+        if (s->batch.active && server_batch_queue(s, uid, &ts, iovec, n, priority))
                 return;
 
-        log_debug("Retrying write.");
-        r = journal_file_append_entry(f, &ts, iovec, n, &s->seqnum, NULL, NULL);
-        if (r < 0)
-                log_error_errno(r, "Failed to write entry (%d items, %zu bytes) despite vacuuming, ignoring: %m", n, IOVEC_TOTAL_SIZE(iovec, n));
-        else
-                server_schedule_sync(s, priority);
+        write_entries_to_journal(s, uid, &(JournalEntryBatchItem) { .ts = &ts, .iovec = iovec, .n_iovec = n }, 1, priority);
 }
 
 #define IOVEC_ADD_NUMERIC_FIELD(iovec, n, value, type, isset, format, field)  \
@@ -749,7 +1013,7 @@ static void write_to_journal(Server *s, uid_t uid, struct iovec *iovec, unsigned
 static void dispatch_message_real(
                 Server *s,
                 struct iovec *iovec, unsigned n, unsigned m,
-                const ClientContext *c,
+                ClientContext *c,
                 const struct timeval *tv,
                 int priority,
                 pid_t object_pid) {
@@ -764,6 +1028,8 @@ static void dispatch_message_real(
         assert(n + N_IOVEC_META_FIELDS + (pid_is_valid(object_pid) ? N_IOVEC_OBJECT_FIELDS : 0) <= m);
 
         if (c) {
+                client_context_load(s, c, _CLIENT_CONTEXT_ALL);
+
                 IOVEC_ADD_NUMERIC_FIELD(iovec, n, c->pid, pid_t, pid_is_valid, PID_FMT, "_PID");
                 IOVEC_ADD_NUMERIC_FIELD(iovec, n, c->uid, uid_t, uid_is_valid, UID_FMT, "_UID");
                 IOVEC_ADD_NUMERIC_FIELD(iovec, n, c->gid, gid_t, gid_is_valid, GID_FMT, "_GID");
@@ -792,6 +1058,7 @@ static void dispatch_message_real(
         assert(n <= m);
 
         if (pid_is_valid(object_pid) && client_context_get(s, object_pid, NULL, NULL, 0, NULL, &o) >= 0) {
+                client_context_load(s, o, _CLIENT_CONTEXT_ALL);
 
                 IOVEC_ADD_NUMERIC_FIELD(iovec, n, o->pid, pid_t, pid_is_valid, PID_FMT, "OBJECT_PID");
                 IOVEC_ADD_NUMERIC_FIELD(iovec, n, o->uid, uid_t, uid_is_valid, UID_FMT, "OBJECT_UID");
@@ -926,10 +1193,22 @@ void server_dispatch_message(
         if (s->storage == STORAGE_NONE)
                 return;
 
+        /* Rate limiting only needs to know the unit, everything else is read once we know we store the message */
+        if (c)
+                client_context_load(s, c, CLIENT_CONTEXT_CGROUP);
+
         if (c && c->unit) {
+                unsigned slice_suppressed;
+                usec_t ts;
+
                 (void) determine_space(s, &available, NULL);
 
-                rl = journal_rate_limit_test(s->rate_limit, c->unit, priority & LOG_PRIMASK, available);
+                /* Messages are received in this event loop iteration, hence there's no need to read the clock */
+                if (!s->event || sd_event_now(s->event, CLOCK_MONOTONIC, &ts) < 0)
+                        ts = now(CLOCK_MONOTONIC);
+
+                rl = journal_rate_limit_test(s->rate_limit, c->unit, c->slice, priority & LOG_PRIMASK, available, ts,
+                                             &slice_suppressed);
                 if (rl == 0)
                         return;
 
@@ -938,6 +1217,10 @@ void server_dispatch_message(
                         server_driver_message(s, "MESSAGE_ID=" SD_MESSAGE_JOURNAL_DROPPED_STR,
                                               LOG_MESSAGE("Suppressed %u messages from %s", rl - 1, c->unit),
                                               NULL);
+                if (slice_suppressed > 0)
+                        server_driver_message(s, "MESSAGE_ID=" SD_MESSAGE_JOURNAL_DROPPED_STR,
+                                              LOG_MESSAGE("Suppressed %u messages from slice %s", slice_suppressed, c->slice),
+                                              NULL);
         }
 
         dispatch_message_real(s, iovec, n, m, c, tv, priority, object_pid);
@@ -1029,8 +1312,10 @@ finish:
 
         s->runtime_journal = journal_file_close(s->runtime_journal);
 
-        if (r >= 0)
+        if (r >= 0) {
                 (void) rm_rf("/run/log/journal", REMOVE_ROOT);
+                s->runtime_storage.vacuum_index = journal_vacuum_index_free(s->runtime_storage.vacuum_index);
+        }
 
         sd_journal_close(j);
 
@@ -1043,8 +1328,7 @@ finish:
         return r;
 }
 
-int server_process_datagram(sd_event_source *es, int fd, uint32_t revents, void *userdata) {
-        Server *s = userdata;
+static int server_receive_datagram(Server *s, int fd) {
         struct ucred *ucred = NULL;
         struct timeval *tv = NULL;
         struct cmsghdr *cmsg;
@@ -1085,11 +1369,6 @@ int server_process_datagram(sd_event_source *es, int fd, uint32_t revents, void
         assert(s);
         assert(fd == s->native_fd || fd == s->syslog_fd || fd == s->audit_fd);
 
-        if (revents != EPOLLIN) {
-                log_error("Got invalid event from epoll for datagram fd: %"PRIx32, revents);
-                return -EIO;
-        }
-
         /* Try to get the right size, if we can. (Not all sockets support SIOCINQ, hence we just try, but don't rely on
          * it.) */
         (void) ioctl(fd, SIOCINQ, &v);
@@ -1161,7 +1440,34 @@ int server_process_datagram(sd_event_source *es, int fd, uint32_t revents, void
         }
 
         close_many(fds, n_fds);
-        return 0;
+        return 1;
+}
+
+int server_process_datagram(sd_event_source *es, int fd, uint32_t revents, void *userdata) {
+        Server *s = userdata;
+        unsigned i;
+        int r = 0;
+
+        assert(s);
+
+        if (revents != EPOLLIN) {
+                log_error("Got invalid event from epoll for datagram fd: %"PRIx32, revents);
+                return -EIO;
+        }
+
+        /* Read the datagrams that are queued already, up to a limit, so that their entries are appended to the
+         * journal in one go */
+        server_batch_begin(s);
+
+        for (i = 0; i < SERVER_BATCH_ENTRIES_MAX; i++) {
+                r = server_receive_datagram(s, fd);
+                if (r <= 0)
+                        break;
+        }
+
+        server_batch_end(s);
+
+        return r < 0 ? r : 0;
 }
 
 static int dispatch_sigusr1(sd_event_source *es, const struct signalfd_siginfo *si, void *userdata) {
@@ -1236,12 +1542,23 @@ static int dispatch_sigrtmin1(sd_event_source *es, const struct signalfd_siginfo
         return 0;
 }
 
+static int dispatch_sigrtmin2(sd_event_source *es, const struct signalfd_siginfo *si, void *userdata) {
+        Server *s = userdata;
+
+        assert(s);
+
+        log_debug("Received request to log statistics from PID " PID_FMT, si->ssi_pid);
+
+        client_context_log_stats(s);
+        return 0;
+}
+
 static int setup_signals(Server *s) {
         int r;
 
         assert(s);
 
-        assert_se(sigprocmask_many(SIG_SETMASK, NULL, SIGINT, SIGTERM, SIGUSR1, SIGUSR2, SIGRTMIN+1, -1) >= 0);
+        assert_se(sigprocmask_many(SIG_SETMASK, NULL, SIGINT, SIGTERM, SIGUSR1, SIGUSR2, SIGRTMIN+1, SIGRTMIN+2, -1) >= 0);
 
         r = sd_event_add_signal(s->event, &s->sigusr1_event_source, SIGUSR1, dispatch_sigusr1, s);
         if (r < 0)
@@ -1284,6 +1601,11 @@ static int setup_signals(Server *s) {
         if (r < 0)
                 return r;
 
+        /* SIGRTMIN+2 logs statistics about the client metadata cache */
+        r = sd_event_add_signal(s->event, &s->sigrtmin2_event_source, SIGRTMIN+2, dispatch_sigrtmin2, s);
+        if (r < 0)
+                return r;
+
         return 0;
 }
 
@@ -1494,6 +1816,36 @@ static int server_open_hostname(Server *s) {
         return 0;
 }
 
+static int dispatch_offline_event(sd_event_source *es, int fd, uint32_t revents, void *userdata) {
+        Server *s = userdata;
+        eventfd_t x;
+
+        assert(s);
+
+        (void) eventfd_read(fd, &x);
+
+        server_process_offlined(s);
+        return 0;
+}
+
+static int server_open_offline_notify(Server *s) {
+        int fd, r;
+
+        assert(s);
+
+        /* Journal files are synced and offlined from a thread pool, get notified when that's done, so that
+         * we can close rotated files right away */
+        fd = journal_file_offline_notify_fd();
+        if (fd < 0)
+                return log_error_errno(fd, "Failed to get journal file offline notification fd: %m");
+
+        r = sd_event_add_io(s->event, &s->offline_event_source, fd, EPOLLIN, dispatch_offline_event, s);
+        if (r < 0)
+                return log_error_errno(r, "Failed to add journal file offline notification event source: %m");
+
+        return 0;
+}
+
 static int dispatch_notify_event(sd_event_source *es, int fd, uint32_t revents, void *userdata) {
         Server *s = userdata;
         int r;
@@ -1658,6 +2010,28 @@ static int server_connect_notify(Server *s) {
         return 0;
 }
 
+static int server_raise_nofile(Server *s) {
+        struct rlimit rl;
+        rlim_t n;
+
+        assert(s);
+
+        /* Each stream takes a file descriptor, and so do the journal files, make sure we may open enough. Never
+         * lower a limit that is higher already. */
+
+        if (getrlimit(RLIMIT_NOFILE, &rl) < 0)
+                return -errno;
+
+        n = (rlim_t) s->stdout_streams_max + USER_JOURNALS_MAX + 64;
+        if (rl.rlim_cur >= n)
+                return 0;
+
+        rl.rlim_cur = n;
+        rl.rlim_max = MAX(rl.rlim_max, n);
+
+        return setrlimit_closest(RLIMIT_NOFILE, &rl);
+}
+
 int server_init(Server *s) {
         _cleanup_fdset_free_ FDSet *fds = NULL;
         int n, r, fd;
@@ -1667,6 +2041,7 @@ int server_init(Server *s) {
 
         zero(*s);
         s->syslog_fd = s->native_fd = s->stdout_fd = s->dev_kmsg_fd = s->audit_fd = s->hostname_fd = s->notify_fd = -1;
+        s->client_units_inotify_fd = -1;
         s->compress = true;
         s->seal = true;
         s->read_kmsg = true;
@@ -1683,6 +2058,8 @@ int server_init(Server *s) {
 
         s->max_file_usec = DEFAULT_MAX_FILE_USEC;
 
+        s->stdout_streams_max = DEFAULT_STDOUT_STREAMS_MAX;
+
         s->max_level_store = LOG_DEBUG;
         s->max_level_syslog = LOG_DEBUG;
         s->max_level_kmsg = LOG_NOTICE;
@@ -1704,6 +2081,15 @@ int server_init(Server *s) {
                 s->rate_limit_interval = s->rate_limit_burst = 0;
         }
 
+        if (s->stdout_streams_max == 0) {
+                log_warning("MaxStdoutStreams= must be positive, using the default of %u.", DEFAULT_STDOUT_STREAMS_MAX);
+                s->stdout_streams_max = DEFAULT_STDOUT_STREAMS_MAX;
+        }
+
+        r = server_raise_nofile(s);
+        if (r < 0)
+                log_warning_errno(r, "Failed to raise file descriptor limit for %u stdout streams, ignoring: %m", s->stdout_streams_max);
+
         (void) mkdir_p("/run/systemd/journal", 0755);
 
         s->user_journals = ordered_hashmap_new(NULL);
@@ -1722,6 +2108,10 @@ int server_init(Server *s) {
         if (r < 0)
                 return log_error_errno(r, "Failed to create event loop: %m");
 
+        r = event_set_fetch_max(s->event, EVENT_FETCH_MAX);
+        if (r < 0)
+                return log_error_errno(r, "Failed to limit event loop fetches: %m");
+
         n = sd_listen_fds(true);
         if (n < 0)
                 return log_error_errno(n, "Failed to read listening file descriptors from environment: %m");
@@ -1826,6 +2216,10 @@ int server_init(Server *s) {
         if (r < 0)
                 return r;
 
+        r = server_open_offline_notify(s);
+        if (r < 0)
+                return r;
+
         r = setup_signals(s);
         if (r < 0)
                 return r;
@@ -1834,7 +2228,7 @@ int server_init(Server *s) {
         if (!s->udev)
                 return -ENOMEM;
 
-        s->rate_limit = journal_rate_limit_new(s->rate_limit_interval, s->rate_limit_burst);
+        s->rate_limit = journal_rate_limit_new(s->rate_limit_interval, s->rate_limit_burst, s->rate_limit_slice_burst);
         if (!s->rate_limit)
                 return -ENOMEM;
 
@@ -1908,12 +2302,15 @@ void server_done(Server *s) {
         sd_event_source_unref(s->dev_kmsg_event_source);
         sd_event_source_unref(s->audit_event_source);
         sd_event_source_unref(s->sync_event_source);
+        sd_event_source_unref(s->vacuum_event_source);
         sd_event_source_unref(s->sigusr1_event_source);
         sd_event_source_unref(s->sigusr2_event_source);
         sd_event_source_unref(s->sigterm_event_source);
         sd_event_source_unref(s->sigint_event_source);
         sd_event_source_unref(s->sigrtmin1_event_source);
+        sd_event_source_unref(s->sigrtmin2_event_source);
         sd_event_source_unref(s->hostname_event_source);
+        sd_event_source_unref(s->offline_event_source);
         sd_event_source_unref(s->notify_event_source);
         sd_event_source_unref(s->watchdog_event_source);
         sd_event_unref(s->event);
@@ -1933,9 +2330,15 @@ void server_done(Server *s) {
                 munmap(s->kernel_seqnum, sizeof(uint64_t));
 
         free(s->buffer);
+        free(s->stdout_buffer);
+        free(s->batch.iovec);
+        free(s->batch.data);
         free(s->tty_path);
         free(s->cgroup_root);
         free(s->hostname_field);
+        strv_free(s->summary_fields);
+        journal_vacuum_index_free(s->runtime_storage.vacuum_index);
+        journal_vacuum_index_free(s->system_storage.vacuum_index);
         free(s->runtime_storage.path);
         free(s->system_storage.path);
 
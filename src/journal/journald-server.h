@@ -28,6 +28,7 @@ typedef struct Server Server;
 
 #include "hashmap.h"
 #include "journal-file.h"
+#include "journal-vacuum.h"
 #include "journald-context.h"
 #include "journald-rate-limit.h"
 #include "journald-stream.h"
@@ -67,8 +68,37 @@ typedef struct JournalStorage {
 
         JournalMetrics metrics;
         JournalStorageSpace space;
+
+        /* The journal files in path, so that we don't need to list it each time we vacuum */
+        JournalVacuumIndex *vacuum_index;
 } JournalStorage;
 
+#define SERVER_BATCH_ENTRIES_MAX 64U
+#define SERVER_BATCH_IOVEC_MAX 4096U
+#define SERVER_BATCH_ENTRY_SIZE_MAX (16U*1024U)
+#define SERVER_BATCH_DATA_MAX (SERVER_BATCH_ENTRIES_MAX * SERVER_BATCH_ENTRY_SIZE_MAX)
+
+/* Entries queued while messages are read in bulk, and appended to the journal file in one go, see
+ * server_batch_begin(). The iovecs and the data are allocated at their full size on first use, so that the
+ * entries may point into them. Only small entries are copied into the batch, larger ones are written by
+ * reference, right after the queued ones. */
+typedef struct ServerBatch {
+        bool active;
+
+        uid_t uid;
+        int priority; /* the most urgent one of the queued entries */
+
+        JournalEntryBatchItem entries[SERVER_BATCH_ENTRIES_MAX];
+        dual_timestamp timestamps[SERVER_BATCH_ENTRIES_MAX];
+        unsigned n_entries;
+
+        struct iovec *iovec;
+        unsigned n_iovec;
+
+        char *data;
+        size_t data_size;
+} ServerBatch;
+
 struct Server {
         int syslog_fd;
         int native_fd;
@@ -86,12 +116,15 @@ struct Server {
         sd_event_source *dev_kmsg_event_source;
         sd_event_source *audit_event_source;
         sd_event_source *sync_event_source;
+        sd_event_source *vacuum_event_source;
         sd_event_source *sigusr1_event_source;
         sd_event_source *sigusr2_event_source;
         sd_event_source *sigterm_event_source;
         sd_event_source *sigint_event_source;
         sd_event_source *sigrtmin1_event_source;
+        sd_event_source *sigrtmin2_event_source;
         sd_event_source *hostname_event_source;
+        sd_event_source *offline_event_source;
         sd_event_source *notify_event_source;
         sd_event_source *watchdog_event_source;
 
@@ -108,6 +141,7 @@ struct Server {
         usec_t sync_interval_usec;
         usec_t rate_limit_interval;
         unsigned rate_limit_burst;
+        unsigned rate_limit_slice_burst;
 
         JournalStorage runtime_storage;
         JournalStorage system_storage;
@@ -130,9 +164,13 @@ struct Server {
         usec_t max_file_usec;
         usec_t oldest_file_usec;
 
+        char **summary_fields;
+
         LIST_HEAD(StdoutStream, stdout_streams);
         LIST_HEAD(StdoutStream, stdout_streams_notify_queue);
         unsigned n_stdout_streams;
+        unsigned stdout_streams_max;
+        char *stdout_buffer;
 
         char *tty_path;
 
@@ -169,12 +207,23 @@ struct Server {
 
         usec_t last_realtime_clock;
 
+        ServerBatch batch;
+
         /* Caching of client metadata */
         Hashmap *client_contexts;
         Prioq *client_contexts_lru;
 
         ClientContext *my_context; /* the context of journald itself */
         ClientContext *pid1_context; /* the context of PID 1 */
+
+        /* Caching of invocation IDs, invalidated through inotify when unit cgroups change */
+        Hashmap *client_units;
+        Hashmap *client_unit_watches;
+        Hashmap *client_slice_watches;
+        int client_units_inotify_fd;
+        sd_event_source *client_units_event_source;
+
+        ClientContextStats client_context_stats;
 };
 
 #define SERVER_MACHINE_ID(s) ((s)->machine_id_field + strlen("_MACHINE_ID="))
@@ -185,6 +234,8 @@ struct Server {
 #define N_IOVEC_OBJECT_FIELDS 14
 #define N_IOVEC_PAYLOAD_FIELDS 15
 
+void server_batch_begin(Server *s);
+void server_batch_end(Server *s);
 void server_dispatch_message(Server *s, struct iovec *iovec, unsigned n, unsigned m, ClientContext *c, const struct timeval *tv, int priority, pid_t object_pid);
 void server_driver_message(Server *s, const char *message_id, const char *format, ...) _printf_(3,0) _sentinel_;
 
@@ -206,6 +257,7 @@ void server_done(Server *s);
 void server_sync(Server *s);
 int server_vacuum(Server *s, bool verbose);
 void server_rotate(Server *s);
+void server_process_offlined(Server *s);
 int server_schedule_sync(Server *s, int priority);
 int server_flush_to_var(Server *s, bool require_flag_file);
 void server_maybe_append_tags(Server *s);
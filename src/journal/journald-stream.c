@@ -50,7 +50,9 @@
 #include "syslog-util.h"
 #include "unit-name.h"
 
-#define STDOUT_STREAMS_MAX 4096
+/* Data is read into a buffer shared by all streams, which is large enough for many lines */
+#define STDOUT_STREAM_READ_SIZE (64U*1024U)
+assert_cc(STDOUT_STREAM_READ_SIZE > LINE_MAX);
 
 typedef enum StdoutStreamState {
         STDOUT_STREAM_IDENTIFIER,
@@ -82,8 +84,10 @@ struct StdoutStream {
         bool fdstore:1;
         bool in_notify_queue:1;
 
-        char buffer[LINE_MAX+1];
-        size_t length;
+        /* An incomplete line, kept until the rest of it arrives. Streams that are idle between lines hold no
+         * buffer at all. */
+        char *buffer;
+        size_t length, allocated;
 
         sd_event_source *event_source;
 
@@ -122,6 +126,7 @@ void stdout_stream_free(StdoutStream *s) {
         free(s->identifier);
         free(s->unit_id);
         free(s->state_file);
+        free(s->buffer);
 
         free(s);
 }
@@ -148,6 +153,10 @@ static int stdout_stream_save(StdoutStream *s) {
         if (s->state != STDOUT_STREAM_RUNNING)
                 return 0;
 
+        /* Without a service manager to store the stream in, the state could never be restored */
+        if (s->server->notify_fd < 0)
+                return 0;
+
         if (!s->state_file) {
                 struct stat st;
 
@@ -239,7 +248,7 @@ static int stdout_stream_log(StdoutStream *s, const char *p) {
         int priority;
         char syslog_priority[] = "PRIORITY=\0";
         char syslog_facility[sizeof("SYSLOG_FACILITY=")-1 + DECIMAL_STR_MAX(int) + 1];
-        _cleanup_free_ char *message = NULL, *syslog_identifier = NULL;
+        const char *message, *syslog_identifier;
         unsigned n = 0;
         int r;
 
@@ -276,15 +285,14 @@ static int stdout_stream_log(StdoutStream *s, const char *p) {
                 IOVEC_SET_STRING(iovec[n++], syslog_facility);
         }
 
+        /* Both are at most LINE_MAX long, hence put them on the stack */
         if (s->identifier) {
-                syslog_identifier = strappend("SYSLOG_IDENTIFIER=", s->identifier);
-                if (syslog_identifier)
-                        IOVEC_SET_STRING(iovec[n++], syslog_identifier);
+                syslog_identifier = strjoina("SYSLOG_IDENTIFIER=", s->identifier);
+                IOVEC_SET_STRING(iovec[n++], syslog_identifier);
         }
 
-        message = strappend("MESSAGE=", p);
-        if (message)
-                IOVEC_SET_STRING(iovec[n++], message);
+        message = strjoina("MESSAGE=", p);
+        IOVEC_SET_STRING(iovec[n++], message);
 
         if (s->context)
                 (void) client_context_maybe_refresh(s->server, s->context, NULL, NULL, 0, NULL, USEC_INFINITY);
@@ -396,28 +404,27 @@ static int stdout_stream_line(StdoutStream *s, char *p) {
         assert_not_reached("Unknown stream state");
 }
 
-static int stdout_stream_scan(StdoutStream *s, bool force_flush) {
-        char *p;
-        size_t remaining;
+static int stdout_stream_scan(StdoutStream *s, char *p, size_t remaining, bool force_flush) {
         int r;
 
         assert(s);
+        assert(p);
 
-        p = s->buffer;
-        remaining = s->length;
-
-        /* XXX: This function does nothing if (s->length == 0) */
+        /* Hands all complete lines in the buffer to the writer, and keeps what is left of an incomplete line
+         * in the stream. The buffer must have room for one more byte after the data. */
 
         for (;;) {
-                char *end;
+                char *end, c = 0;
                 size_t skip;
 
-                end = memchr(p, '\n', remaining);
+                end = memchr(p, '\n', MIN(remaining, LINE_MAX + 1));
                 if (end)
                         skip = end - p + 1;
-                else if (remaining >= sizeof(s->buffer) - 1) {
-                        end = p + sizeof(s->buffer) - 1;
-                        skip = remaining;
+                else if (remaining > LINE_MAX) {
+                        /* Split overly long lines, but leave the start of the next part alone */
+                        end = p + LINE_MAX;
+                        skip = LINE_MAX;
+                        c = *end;
                 } else
                         break;
 
@@ -427,6 +434,9 @@ static int stdout_stream_scan(StdoutStream *s, bool force_flush) {
                 if (r < 0)
                         return r;
 
+                if (c != 0)
+                        *end = c;
+
                 remaining -= skip;
                 p += skip;
         }
@@ -437,20 +447,26 @@ static int stdout_stream_scan(StdoutStream *s, bool force_flush) {
                 if (r < 0)
                         return r;
 
-                p += remaining;
                 remaining = 0;
         }
 
-        if (p > s->buffer) {
-                memmove(s->buffer, p, remaining);
-                s->length = remaining;
+        if (remaining == 0) {
+                s->buffer = mfree(s->buffer);
+                s->allocated = 0;
+        } else {
+                if (!GREEDY_REALLOC(s->buffer, s->allocated, remaining))
+                        return log_oom();
+
+                memcpy(s->buffer, p, remaining);
         }
 
+        s->length = remaining;
         return 0;
 }
 
 static int stdout_stream_process(sd_event_source *es, int fd, uint32_t revents, void *userdata) {
         StdoutStream *s = userdata;
+        char *buffer;
         ssize_t l;
         int r;
 
@@ -461,7 +477,11 @@ static int stdout_stream_process(sd_event_source *es, int fd, uint32_t revents,
                 goto terminate;
         }
 
-        l = read(s->fd, s->buffer+s->length, sizeof(s->buffer)-1-s->length);
+        /* Continue with the incomplete line from last time, if there is one */
+        buffer = s->server->stdout_buffer;
+        memcpy_safe(buffer, s->buffer, s->length);
+
+        l = read(s->fd, buffer + s->length, STDOUT_STREAM_READ_SIZE - 1 - s->length);
         if (l < 0) {
 
                 if (errno == EAGAIN)
@@ -471,13 +491,17 @@ static int stdout_stream_process(sd_event_source *es, int fd, uint32_t revents,
                 goto terminate;
         }
 
+        /* Append the lines read in one go to the journal */
+        server_batch_begin(s->server);
+
         if (l == 0) {
-                stdout_stream_scan(s, true);
+                stdout_stream_scan(s, buffer, s->length, true);
+                server_batch_end(s->server);
                 goto terminate;
         }
 
-        s->length += l;
-        r = stdout_stream_scan(s, false);
+        r = stdout_stream_scan(s, buffer, s->length + l, false);
+        server_batch_end(s->server);
         if (r < 0)
                 goto terminate;
 
@@ -495,6 +519,12 @@ static int stdout_stream_install(Server *s, int fd, StdoutStream **ret) {
         assert(s);
         assert(fd >= 0);
 
+        if (!s->stdout_buffer) {
+                s->stdout_buffer = malloc(STDOUT_STREAM_READ_SIZE);
+                if (!s->stdout_buffer)
+                        return log_oom();
+        }
+
         stream = new0(StdoutStream, 1);
         if (!stream)
                 return log_oom();
@@ -556,7 +586,7 @@ static int stdout_stream_new(sd_event_source *es, int listen_fd, uint32_t revent
                 return log_error_errno(errno, "Failed to accept stdout connection: %m");
         }
 
-        if (s->n_stdout_streams >= STDOUT_STREAMS_MAX) {
+        if (s->n_stdout_streams >= s->stdout_streams_max) {
                 log_warning("Too many stdout streams, refusing connection.");
                 return 0;
         }
@@ -642,7 +672,7 @@ static int stdout_stream_restore(Server *s, const char *fname, int fd) {
         assert(fname);
         assert(fd >= 0);
 
-        if (s->n_stdout_streams >= STDOUT_STREAMS_MAX) {
+        if (s->n_stdout_streams >= s->stdout_streams_max) {
                 log_warning("Too many stdout streams, refusing restoring of stream.");
                 return -ENOBUFS;
         }
@@ -0,0 +1,115 @@
+/***
+  This file is part of systemd.
+
+  systemd is free software; you can redistribute it and/or modify it
+  under the terms of the GNU Lesser General Public License as published by
+  the Free Software Foundation; either version 2.1 of the License, or
+  (at your option) any later version.
+
+  systemd is distributed in the hope that it will be useful, but
+  WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+  Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public License
+  along with systemd; If not, see <http://www.gnu.org/licenses/>.
+***/
+
+#include <endian.h>
+#include <string.h>
+
+#include "keyed-hash.h"
+
+/* This follows the construction of wyhash by Wang Yi (public domain): input is
+ * consumed 16 bytes at a time, each step folding the full 128bit product of two
+ * 64bit words into the state. Long inputs are processed in three independent
+ * lanes, so that the multiplications can execute in parallel. */
+
+#define P0 UINT64_C(0xa0761d6478bd642f)
+#define P1 UINT64_C(0xe7037ed1a0b428db)
+#define P2 UINT64_C(0x8ebc6af09c88c6e3)
+#define P3 UINT64_C(0x589965cc75374cc3)
+
+static inline uint64_t mum(uint64_t a, uint64_t b) {
+#ifdef __SIZEOF_INT128__
+        __uint128_t r = (__uint128_t) a * b;
+
+        return (uint64_t) r ^ (uint64_t) (r >> 64);
+#else
+        uint64_t ha = a >> 32, hb = b >> 32, la = (uint32_t) a, lb = (uint32_t) b;
+        uint64_t rh = ha * hb, rm0 = ha * lb, rm1 = hb * la, rl = la * lb, t, c, lo;
+
+        t = rl + (rm0 << 32);
+        c = t < rl;
+        lo = t + (rm1 << 32);
+        c += lo < t;
+
+        return lo ^ (rh + (rm0 >> 32) + (rm1 >> 32) + c);
+#endif
+}
+
+/* memcpy() compiles to a single load, also where unaligned loads aren't allowed otherwise */
+static inline uint64_t read64(const uint8_t *p) {
+        uint64_t v;
+
+        memcpy(&v, p, sizeof(v));
+        return le64toh(v);
+}
+
+static inline uint64_t read32(const uint8_t *p) {
+        uint32_t v;
+
+        memcpy(&v, p, sizeof(v));
+        return le32toh(v);
+}
+
+static inline uint64_t read_small(const uint8_t *p, size_t k) {
+        /* 1 ≤ k ≤ 3 */
+        return ((uint64_t) p[0] << 16) | ((uint64_t) p[k >> 1] << 8) | p[k - 1];
+}
+
+uint64_t keyed_hash64(const void *data, size_t length, const uint8_t key[16]) {
+        const uint8_t *p = data;
+        uint64_t seed, a, b;
+        size_t i = length;
+
+        seed = read64(key) ^ mum(read64(key + 8) ^ P0, P1);
+
+        if (length <= 16) {
+                if (length >= 4) {
+                        /* Two possibly overlapping 32bit reads from each end cover all bytes */
+                        a = (read32(p) << 32) | read32(p + ((length >> 3) << 2));
+                        b = (read32(p + length - 4) << 32) | read32(p + length - 4 - ((length >> 3) << 2));
+                } else if (length > 0) {
+                        a = read_small(p, length);
+                        b = 0;
+                } else
+                        a = b = 0;
+        } else {
+                if (i > 48) {
+                        uint64_t seed1 = seed, seed2 = seed;
+
+                        do {
+                                seed = mum(read64(p) ^ P1, read64(p + 8) ^ seed);
+                                seed1 = mum(read64(p + 16) ^ P2, read64(p + 24) ^ seed1);
+                                seed2 = mum(read64(p + 32) ^ P3, read64(p + 40) ^ seed2);
+                                p += 48;
+                                i -= 48;
+                        } while (i > 48);
+
+                        seed ^= seed1 ^ seed2;
+                }
+
+                while (i > 16) {
+                        seed = mum(read64(p) ^ P1, read64(p + 8) ^ seed);
+                        p += 16;
+                        i -= 16;
+                }
+
+                /* The last 16 bytes, possibly overlapping with what we already consumed */
+                a = read64(p + i - 16);
+                b = read64(p + i - 8);
+        }
+
+        return mum(P1 ^ (uint64_t) length, mum(a ^ P1, b ^ seed));
+}
@@ -67,13 +67,20 @@ struct MMapFileDescriptor {
         int fd;
         bool sigbus;
         LIST_HEAD(Window, windows);
+
+        /* Where the last window we mapped for a miss ended, and how large the next one shall be. If
+         * misses keep hitting right after the previous window, the file is read sequentially and the
+         * windows grow, otherwise they shrink. */
+        uint64_t last_window_end;
+        uint64_t window_size;
+        unsigned n_random;
 };
 
 struct MMapCache {
         int n_ref;
         unsigned n_windows;
 
-        unsigned n_hit, n_missed;
+        unsigned n_hit, n_missed, n_unmapped;
 
         Hashmap *fds;
         Context *contexts[MMAP_CACHE_MAX_CONTEXTS];
@@ -87,10 +94,18 @@ struct MMapCache {
 #ifdef ENABLE_DEBUG_MMAP_CACHE
 /* Tiny windows increase mmap activity and the chance of exposing unsafe use. */
 # define WINDOW_SIZE (page_size())
+# define WINDOW_SIZE_MIN (page_size())
+# define WINDOW_SIZE_MAX (page_size())
 #else
 # define WINDOW_SIZE (8ULL*1024ULL*1024ULL)
+# define WINDOW_SIZE_MIN (1ULL*1024ULL*1024ULL)
+# define WINDOW_SIZE_MAX MMAP_CACHE_WINDOW_SIZE_MAX
 #endif
 
+/* After this many misses in a row that didn't continue where the previous window ended, tell the kernel
+ * that read-ahead is pointless for the file */
+#define RANDOM_MISSES_MIN 4
+
 MMapCache* mmap_cache_new(void) {
         MMapCache *m;
 
@@ -115,8 +130,10 @@ static void window_unlink(Window *w) {
 
         assert(w);
 
-        if (w->ptr)
+        if (w->ptr) {
                 munmap(w->ptr, w->size);
+                w->cache->n_unmapped++;
+        }
 
         if (w->fd)
                 LIST_REMOVE(by_fd, w->fd->windows, w);
@@ -467,6 +484,7 @@ static int add_mmap(
                 size_t *ret_size) {
 
         uint64_t woffset, wsize;
+        bool sequential;
         Context *c;
         Window *w;
         void *d;
@@ -478,21 +496,41 @@ static int add_mmap(
         assert(size > 0);
         assert(ret);
 
+        /* A miss right where the previous window ended means somebody is reading the file front to
+         * back, e.g. for an export. Double the window size then, and map ahead of the offset only.
+         * Everything else, e.g. bisection, halves the window size, down to a minimum. */
+        sequential = f->last_window_end > 0 &&
+                offset + page_size() >= f->last_window_end &&
+                offset < f->last_window_end + f->window_size;
+
+        if (f->window_size == 0)
+                f->window_size = WINDOW_SIZE;
+        else if (sequential) {
+                f->window_size = MIN(f->window_size * 2, WINDOW_SIZE_MAX);
+                f->n_random = 0;
+        } else {
+                f->window_size = MAX(f->window_size / 2, WINDOW_SIZE_MIN);
+                f->n_random++;
+        }
+
         woffset = offset & ~((uint64_t) page_size() - 1ULL);
         wsize = size + (offset - woffset);
         wsize = PAGE_ALIGN(wsize);
 
-        if (wsize < WINDOW_SIZE) {
+        if (wsize < f->window_size) {
                 uint64_t delta;
 
-                delta = PAGE_ALIGN((WINDOW_SIZE - wsize) / 2);
+                if (sequential)
+                        delta = 0;
+                else
+                        delta = PAGE_ALIGN((f->window_size - wsize) / 2);
 
                 if (delta > offset)
                         woffset = 0;
                 else
                         woffset -= delta;
 
-                wsize = WINDOW_SIZE;
+                wsize = f->window_size;
         }
 
         if (st) {
@@ -511,6 +549,15 @@ static int add_mmap(
         if (r < 0)
                 return r;
 
+        f->last_window_end = woffset + wsize;
+
+        /* These are just hints, hence ignore failures */
+        if (sequential) {
+                (void) madvise(d, wsize, MADV_SEQUENTIAL);
+                (void) madvise(d, wsize, MADV_WILLNEED);
+        } else if (f->n_random >= RANDOM_MISSES_MIN)
+                (void) madvise(d, wsize, MADV_RANDOM);
+
         c = context_add(m, context);
         if (!c)
                 goto outofmem;
@@ -585,6 +632,18 @@ unsigned mmap_cache_get_missed(MMapCache *m) {
         return m->n_missed;
 }
 
+unsigned mmap_cache_get_unmapped(MMapCache *m) {
+        assert(m);
+
+        return m->n_unmapped;
+}
+
+unsigned mmap_cache_get_windows(MMapCache *m) {
+        assert(m);
+
+        return m->n_windows;
+}
+
 static void mmap_cache_process_sigbus(MMapCache *m) {
         bool found = false;
         MMapFileDescriptor *f;
@@ -23,7 +23,11 @@
 #include <sys/stat.h>
 
 /* One context per object type, plus one of the header, plus one "additional" one */
-#define MMAP_CACHE_MAX_CONTEXTS 9
+#define MMAP_CACHE_MAX_CONTEXTS 10
+
+/* No window grows larger than this, unless a single object is. Don't use up the address space of 32bit
+ * machines. */
+#define MMAP_CACHE_WINDOW_SIZE_MAX ((sizeof(void*) >= 8 ? 64ULL : 16ULL)*1024ULL*1024ULL)
 
 typedef struct MMapCache MMapCache;
 typedef struct MMapFileDescriptor MMapFileDescriptor;
@@ -48,5 +52,7 @@ void mmap_cache_free_fd(MMapCache *m, MMapFileDescriptor *f);
 
 unsigned mmap_cache_get_hit(MMapCache *m);
 unsigned mmap_cache_get_missed(MMapCache *m);
+unsigned mmap_cache_get_unmapped(MMapCache *m);
+unsigned mmap_cache_get_windows(MMapCache *m);
 
 bool mmap_cache_got_sigbus(MMapCache *m, MMapFileDescriptor *f);
@@ -22,6 +22,7 @@
 #include <inttypes.h>
 #include <linux/magic.h>
 #include <poll.h>
+#include <pthread.h>
 #include <stddef.h>
 #include <sys/inotify.h>
 #include <sys/vfs.h>
@@ -43,6 +44,8 @@
 #include "journal-def.h"
 #include "journal-file.h"
 #include "journal-internal.h"
+#include "journal-summary.h"
+#include "keyed-hash.h"
 #include "list.h"
 #include "lookup3.h"
 #include "missing.h"
@@ -61,6 +64,12 @@
 
 #define DEFAULT_DATA_THRESHOLD (64*1024)
 
+/* With SD_JOURNAL_PARALLEL, only bother with threads if at least this many files need to be positioned */
+#define PARALLEL_FILES_MIN 4
+
+/* With SD_JOURNAL_PARALLEL, never use more than this many threads */
+#define PARALLEL_THREADS_MAX 16
+
 static void remove_file_real(sd_journal *j, JournalFile *f);
 
 static bool journal_pid_changed(sd_journal *j) {
@@ -334,6 +343,7 @@ _public_ int sd_journal_add_match(sd_journal *j, const void *data, size_t size)
         if (!m->data)
                 goto fail;
 
+        j->match_generation++;
         detach_location(j);
 
         return 0;
@@ -443,6 +453,7 @@ _public_ void sd_journal_flush_matches(sd_journal *j) {
 
         j->level0 = j->level1 = j->level2 = NULL;
 
+        j->match_generation++;
         detach_location(j);
 }
 
@@ -497,6 +508,19 @@ _pure_ static int compare_with_location(JournalFile *f, Location *l) {
         return 0;
 }
 
+static uint64_t match_hash(JournalFile *f, Match *m) {
+        assert(f);
+        assert(m);
+        assert(m->type == MATCH_DISCRETE);
+
+        /* Matches carry the hash used by files without keyed hashes, files with keyed hashes need their
+         * own one */
+        if (f->keyed_hash)
+                return journal_file_hash_data(f, m->data, m->size);
+
+        return le64toh(m->le_hash);
+}
+
 static int next_for_match(
                 sd_journal *j,
                 Match *m,
@@ -517,7 +541,7 @@ static int next_for_match(
         if (m->type == MATCH_DISCRETE) {
                 uint64_t dp;
 
-                r = journal_file_find_data_object_with_hash(f, m->data, m->size, le64toh(m->le_hash), NULL, &dp);
+                r = journal_file_find_data_object_with_hash(f, m->data, m->size, match_hash(f, m), NULL, &dp);
                 if (r <= 0)
                         return r;
 
@@ -606,7 +630,7 @@ static int find_location_for_match(
         if (m->type == MATCH_DISCRETE) {
                 uint64_t dp;
 
-                r = journal_file_find_data_object_with_hash(f, m->data, m->size, le64toh(m->le_hash), NULL, &dp);
+                r = journal_file_find_data_object_with_hash(f, m->data, m->size, match_hash(f, m), NULL, &dp);
                 if (r <= 0)
                         return r;
 
@@ -688,6 +712,75 @@ static int find_location_for_match(
         }
 }
 
+static bool match_may_be_in_summary(const Header *h, Match *m, JournalSummary *s) {
+        Match *i;
+
+        assert(h);
+        assert(m);
+        assert(s);
+
+        if (m->type == MATCH_DISCRETE) {
+                uint64_t hash;
+
+                /* Like match_hash(), but files we didn't open yet only have their header read */
+                if (JOURNAL_HEADER_KEYED_HASH(h))
+                        hash = keyed_hash64(m->data, m->size, h->file_id.bytes);
+                else
+                        hash = le64toh(m->le_hash);
+
+                /* Treat errors as a possible match, the summary is just an optimization */
+                return journal_summary_test(s, hash) != 0;
+        }
+
+        if (!m->matches)
+                return true;
+
+        LIST_FOREACH(matches, i, m->matches) {
+                bool b;
+
+                b = match_may_be_in_summary(h, i, s);
+                if (m->type == MATCH_OR_TERM && b)
+                        return true;
+                if (m->type == MATCH_AND_TERM && !b)
+                        return false;
+        }
+
+        return m->type == MATCH_AND_TERM;
+}
+
+static bool file_may_match(sd_journal *j, JournalFile *f, direction_t direction) {
+        JournalSummary *s;
+
+        assert(j);
+        assert(f);
+
+        /* Checks whether the file can be skipped entirely when looking for the first entry after seeking,
+         * without looking at anything but the header of the file and its summary. */
+
+        if (j->current_location.type == LOCATION_SEEK &&
+            j->current_location.realtime_set &&
+            !j->current_location.seqnum_set &&
+            !j->current_location.monotonic_set) {
+
+                if (direction == DIRECTION_DOWN &&
+                    le64toh(f->header->tail_entry_realtime) < j->current_location.realtime)
+                        return false;
+
+                if (direction == DIRECTION_UP &&
+                    le64toh(f->header->head_entry_realtime) > j->current_location.realtime)
+                        return false;
+        }
+
+        /* Only archived files have a summary, as they are not modified anymore */
+        if (!j->level0 || f->header->state != STATE_ARCHIVED)
+                return true;
+
+        if (journal_file_get_summary(f, &s) <= 0)
+                return true;
+
+        return match_may_be_in_summary(f->header, j->level0, s);
+}
+
 static int find_location_with_matches(
                 sd_journal *j,
                 JournalFile *f,
@@ -702,6 +795,9 @@ static int find_location_with_matches(
         assert(ret);
         assert(offset);
 
+        if (!file_may_match(j, f, direction))
+                return 0;
+
         if (!j->level0) {
                 /* No matches is simple */
 
@@ -817,8 +913,213 @@ static int next_beyond_location(sd_journal *j, JournalFile *f, direction_t direc
         }
 }
 
+static bool file_needs_seek(JournalFile *f, direction_t direction) {
+        assert(f);
+
+        /* Returns true if next_beyond_location() will have to look up the location from scratch for this file,
+         * rather than just advance from the entry it is currently positioned on. */
+
+        if (f->last_direction == direction && f->location_type == LOCATION_TAIL &&
+            le64toh(f->header->n_entries) == f->last_n_entries)
+                return false;
+
+        return f->last_direction != direction || f->current_offset == 0;
+}
+
+typedef struct ParallelSeek {
+        sd_journal *journal;
+        direction_t direction;
+        JournalFile **files;
+        int *results;
+        unsigned n_files;
+        unsigned next; /* Accessed atomically */
+} ParallelSeek;
+
+/* The threads positioning files are started on first use, and kept until the journal is closed, so that
+ * iterating doesn't start and join threads each time. Everything in here is protected by the mutex. */
+struct SeekPool {
+        pthread_mutex_t mutex;
+        pthread_cond_t posted;
+        pthread_cond_t done;
+
+        pthread_t *threads;
+        unsigned n_threads;
+
+        ParallelSeek *job;      /* The job being worked on, NULL once the caller has finished its share */
+        uint64_t generation;    /* Counts the jobs posted, so that each thread takes part in each job once */
+        unsigned n_busy;        /* How many threads are still working on the job */
+        bool quit;
+
+        pid_t original_pid;
+};
+
+static void parallel_seek_work(ParallelSeek *s) {
+
+        /* Each file comes with its own MMapCache in parallel mode, and the matches and the location we seek to
+         * are only read, hence the files can be positioned independently of each other. */
+
+        for (;;) {
+                unsigned k;
+
+                k = __sync_fetch_and_add(&s->next, 1);
+                if (k >= s->n_files)
+                        break;
+
+                s->results[k] = next_beyond_location(s->journal, s->files[k], s->direction);
+        }
+}
+
+static void *seek_pool_thread(void *userdata) {
+        SeekPool *p = userdata;
+        uint64_t seen = 0;
+
+        assert_se(pthread_mutex_lock(&p->mutex) == 0);
+
+        for (;;) {
+                ParallelSeek *s;
+
+                while (!p->quit && (!p->job || p->generation == seen))
+                        assert_se(pthread_cond_wait(&p->posted, &p->mutex) == 0);
+
+                if (p->quit)
+                        break;
+
+                seen = p->generation;
+                s = p->job;
+                p->n_busy++;
+
+                assert_se(pthread_mutex_unlock(&p->mutex) == 0);
+                parallel_seek_work(s);
+                assert_se(pthread_mutex_lock(&p->mutex) == 0);
+
+                if (--p->n_busy == 0)
+                        assert_se(pthread_cond_signal(&p->done) == 0);
+        }
+
+        assert_se(pthread_mutex_unlock(&p->mutex) == 0);
+
+        return NULL;
+}
+
+static SeekPool *seek_pool_free(SeekPool *p) {
+        unsigned k;
+
+        if (!p)
+                return NULL;
+
+        /* After a fork the threads only exist in the parent */
+        if (p->original_pid == getpid_cached()) {
+                assert_se(pthread_mutex_lock(&p->mutex) == 0);
+                p->quit = true;
+                assert_se(pthread_cond_broadcast(&p->posted) == 0);
+                assert_se(pthread_mutex_unlock(&p->mutex) == 0);
+
+                for (k = 0; k < p->n_threads; k++)
+                        assert_se(pthread_join(p->threads[k], NULL) == 0);
+
+                (void) pthread_mutex_destroy(&p->mutex);
+                (void) pthread_cond_destroy(&p->posted);
+                (void) pthread_cond_destroy(&p->done);
+        }
+
+        free(p->threads);
+        return mfree(p);
+}
+
+static SeekPool *seek_pool_new(unsigned n_threads) {
+        SeekPool *p;
+        unsigned k;
+        int r;
+
+        p = new0(SeekPool, 1);
+        if (!p)
+                return NULL;
+
+        p->threads = new(pthread_t, n_threads);
+        if (!p->threads)
+                return mfree(p);
+
+        assert_se(pthread_mutex_init(&p->mutex, NULL) == 0);
+        assert_se(pthread_cond_init(&p->posted, NULL) == 0);
+        assert_se(pthread_cond_init(&p->done, NULL) == 0);
+        p->original_pid = getpid_cached();
+
+        /* If we can't start all threads, we continue with fewer. With none at all, the caller ends up doing all
+         * the work on its own. */
+        for (k = 0; k < n_threads; k++) {
+                r = pthread_create(&p->threads[p->n_threads], NULL, seek_pool_thread, p);
+                if (r != 0) {
+                        log_debug_errno(r, "Failed to start seek thread, continuing with %u threads: %m", p->n_threads + 1);
+                        break;
+                }
+
+                p->n_threads++;
+        }
+
+        return p;
+}
+
+static void parallel_seek(sd_journal *j, direction_t direction, JournalFile **files, int *results, unsigned n_files) {
+        ParallelSeek s = {
+                .journal = j,
+                .direction = direction,
+                .files = files,
+                .results = results,
+                .n_files = n_files,
+        };
+        SeekPool *p;
+        unsigned n_threads;
+        long n_cpus;
+
+        assert(j);
+        assert(files);
+        assert(results);
+
+        if (!j->seek_pool) {
+                if (j->n_threads_max > 0)
+                        n_threads = j->n_threads_max;
+                else {
+                        n_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+                        n_threads = n_cpus > 0 ? (unsigned) n_cpus : 1;
+                }
+
+                /* The calling thread takes part in the work, too, hence we only start n_threads - 1 additional
+                 * ones */
+                n_threads = MIN(n_threads, (unsigned) PARALLEL_THREADS_MAX);
+                if (n_threads > 1)
+                        j->seek_pool = seek_pool_new(n_threads - 1);
+        }
+
+        p = j->seek_pool;
+        if (!p || p->n_threads == 0) {
+                parallel_seek_work(&s);
+                return;
+        }
+
+        assert_se(pthread_mutex_lock(&p->mutex) == 0);
+        p->job = &s;
+        p->generation++;
+        assert_se(pthread_cond_broadcast(&p->posted) == 0);
+        assert_se(pthread_mutex_unlock(&p->mutex) == 0);
+
+        parallel_seek_work(&s);
+
+        /* Threads that didn't get to the job before we are done with it won't take it anymore, and we only need
+         * to wait for those working on it */
+        assert_se(pthread_mutex_lock(&p->mutex) == 0);
+        p->job = NULL;
+        while (p->n_busy > 0)
+                assert_se(pthread_cond_wait(&p->done, &p->mutex) == 0);
+        assert_se(pthread_mutex_unlock(&p->mutex) == 0);
+}
+
+static int open_deferred_files(sd_journal *j, bool only_matching);
+
 static int real_journal_next(sd_journal *j, direction_t direction) {
         JournalFile *f, *new_file = NULL;
+        _cleanup_free_ JournalFile **seek_files = NULL;
+        _cleanup_free_ int *seek_results = NULL;
+        unsigned n_seek = 0, seek_idx = 0;
         Iterator i;
         Object *o;
         int r;
@@ -826,10 +1127,45 @@ static int real_journal_next(sd_journal *j, direction_t direction) {
         assert_return(j, -EINVAL);
         assert_return(!journal_pid_changed(j), -ECHILD);
 
+        /* Archived files we didn't open yet are only needed if their summary doesn't rule out the matches */
+        r = open_deferred_files(j, true);
+        if (r < 0)
+                return r;
+
+        if (j->flags & SD_JOURNAL_PARALLEL) {
+
+                /* Positioning each file from scratch is the expensive part of iterating, as it involves
+                 * bisecting the entry arrays of each file and all matches. If many files need it, do this
+                 * in parallel, and only merge the results here. Usually only the file we returned the
+                 * previous entry from has to be moved though, in which case we skip all this. */
+
+                ORDERED_HASHMAP_FOREACH(f, j->files, i)
+                        if (file_needs_seek(f, direction))
+                                n_seek++;
+
+                if (n_seek >= PARALLEL_FILES_MIN) {
+                        seek_files = new(JournalFile*, n_seek);
+                        seek_results = new(int, n_seek);
+                        if (!seek_files || !seek_results)
+                                return -ENOMEM;
+
+                        n_seek = 0;
+                        ORDERED_HASHMAP_FOREACH(f, j->files, i)
+                                if (file_needs_seek(f, direction))
+                                        seek_files[n_seek++] = f;
+
+                        parallel_seek(j, direction, seek_files, seek_results, n_seek);
+                } else
+                        n_seek = 0;
+        }
+
         ORDERED_HASHMAP_FOREACH(f, j->files, i) {
                 bool found;
 
-                r = next_beyond_location(j, f, direction);
+                if (seek_idx < n_seek && seek_files[seek_idx] == f)
+                        r = seek_results[seek_idx++];
+                else
+                        r = next_beyond_location(j, f, direction);
                 if (r < 0) {
                         log_debug_errno(r, "Can't iterate through %s, ignoring: %m", f->path);
                         remove_file_real(j, f);
@@ -1286,7 +1622,11 @@ static int add_any_file(sd_journal *j, int fd, const char *path) {
                 close_fd = true;
         }
 
-        r = journal_file_open(fd, path, O_RDONLY, 0, false, false, NULL, j->mmap, NULL, NULL, &f);
+        /* In parallel mode, files are accessed from multiple threads at the same time, hence give each file its
+         * own MMapCache rather than sharing one. */
+        r = journal_file_open(fd, path, O_RDONLY, 0, false, false, NULL,
+                              (j->flags & SD_JOURNAL_PARALLEL) ? NULL : j->mmap,
+                              NULL, NULL, &f);
         if (r < 0) {
                 if (close_fd)
                         safe_close(fd);
@@ -1324,6 +1664,183 @@ fail:
         return r;
 }
 
+typedef struct DeferredFile {
+        char *path;
+        bool checked;
+
+        /* Read with pread() rather than mapped, and only if the file has a summary */
+        Header header;
+        JournalSummary *summary;
+
+        /* The match generation the summary ruled the file out for, 0 if it never did */
+        unsigned ruled_out_generation;
+} DeferredFile;
+
+static DeferredFile* deferred_file_free(DeferredFile *d) {
+        if (!d)
+                return NULL;
+
+        journal_summary_free(d->summary);
+        free(d->path);
+        return mfree(d);
+}
+
+static bool file_is_archived(const char *filename) {
+        assert(filename);
+
+        /* Archived files are named <prefix>@<seqnum id>-<head seqnum>-<head realtime>.journal. Those that
+         * were renamed because they were corrupted or not closed properly end in "~", and have no summary. */
+        return strchr(filename, '@') && endswith(filename, ".journal");
+}
+
+static int defer_file(sd_journal *j, const char *path) {
+        DeferredFile *d;
+        int r;
+
+        assert(j);
+        assert(path);
+
+        if (ordered_hashmap_get(j->files, path) || hashmap_get(j->deferred_files, path))
+                return 0;
+
+        /* Let add_any_file() deal with the limit */
+        if (ordered_hashmap_size(j->files) + hashmap_size(j->deferred_files) >= JOURNAL_FILES_MAX)
+                return add_any_file(j, -1, path);
+
+        r = hashmap_ensure_allocated(&j->deferred_files, &string_hash_ops);
+        if (r < 0)
+                return r;
+
+        d = new0(DeferredFile, 1);
+        if (!d)
+                return -ENOMEM;
+
+        d->path = strdup(path);
+        if (!d->path) {
+                deferred_file_free(d);
+                return -ENOMEM;
+        }
+
+        r = hashmap_put(j->deferred_files, d->path, d);
+        if (r < 0) {
+                deferred_file_free(d);
+                return r;
+        }
+
+        if (!j->has_runtime_files && path_has_prefix(j, path, "/run"))
+                j->has_runtime_files = true;
+        else if (!j->has_persistent_files && path_has_prefix(j, path, "/var"))
+                j->has_persistent_files = true;
+
+        log_debug("File %s deferred until it is needed.", path);
+
+        j->current_invalidate_counter++;
+
+        return 0;
+}
+
+static int deferred_file_check(DeferredFile *d) {
+        _cleanup_free_ JournalSummary *s = NULL;
+        _cleanup_close_ int fd = -1;
+        ssize_t k;
+        int r;
+
+        assert(d);
+
+        /* Reads the header of the file and opens its summary, if it has one. Returns 0 if it has none, or
+         * something is off, in which case the file is opened like any other, and errors are reported then. */
+
+        fd = open(d->path, O_RDONLY|O_CLOEXEC|O_NOCTTY);
+        if (fd < 0)
+                return 0;
+
+        k = pread(fd, &d->header, sizeof(d->header), 0);
+        if (k < (ssize_t) sizeof(d->header))
+                return 0;
+
+        if (memcmp(d->header.signature, HEADER_SIGNATURE, sizeof(d->header.signature)) != 0 ||
+            d->header.state != STATE_ARCHIVED)
+                return 0;
+
+        s = new0(JournalSummary, 1);
+        if (!s)
+                return -ENOMEM;
+
+        r = journal_summary_open(d->path, &d->header, s);
+        if (r <= 0)
+                return r == -ENOMEM ? r : 0;
+
+        d->summary = s;
+        s = NULL;
+
+        return 1;
+}
+
+static int deferred_file_may_match(sd_journal *j, DeferredFile *d) {
+        int r;
+
+        assert(j);
+        assert(d);
+
+        if (!j->level0)
+                return true;
+
+        if (d->ruled_out_generation == j->match_generation)
+                return false;
+
+        if (!d->checked) {
+                r = deferred_file_check(d);
+                if (r < 0)
+                        return r;
+
+                d->checked = true;
+        }
+
+        if (!d->summary)
+                return true;
+
+        if (match_may_be_in_summary(&d->header, j->level0, d->summary))
+                return true;
+
+        d->ruled_out_generation = j->match_generation;
+        return false;
+}
+
+static int open_deferred_files(sd_journal *j, bool only_matching) {
+        DeferredFile *d;
+        Iterator i;
+        int r;
+
+        assert(j);
+
+        HASHMAP_FOREACH(d, j->deferred_files, i) {
+                if (only_matching) {
+                        r = deferred_file_may_match(j, d);
+                        if (r < 0)
+                                return r;
+                        if (r == 0)
+                                continue;
+                }
+
+                assert_se(hashmap_remove(j->deferred_files, d->path) == d);
+
+                /* Errors are recorded with the file, like for files we open right away */
+                r = add_any_file(j, -1, d->path);
+                deferred_file_free(d);
+                if (r == -ENOMEM)
+                        return r;
+        }
+
+        return 0;
+}
+
+int journal_open_deferred_files(sd_journal *j) {
+        assert(j);
+
+        /* For everything that needs all files, rather than those that may have entries matching */
+        return open_deferred_files(j, false);
+}
+
 static int add_file(sd_journal *j, const char *prefix, const char *filename) {
         const char *path;
 
@@ -1338,11 +1855,18 @@ static int add_file(sd_journal *j, const char *prefix, const char *filename) {
                 return 0;
 
         path = strjoina(prefix, "/", filename);
+
+        /* Archived files are only opened once we know we need them, their summary might tell we don't. Their
+         * summary is looked up by path, hence not if the files are found relative to a top-level fd. */
+        if (j->toplevel_fd < 0 && file_is_archived(filename))
+                return defer_file(j, path);
+
         return add_any_file(j, -1, path);
 }
 
 static void remove_file(sd_journal *j, const char *prefix, const char *filename) {
         const char *path;
+        DeferredFile *d;
         JournalFile *f;
 
         assert(j);
@@ -1350,6 +1874,15 @@ static void remove_file(sd_journal *j, const char *prefix, const char *filename)
         assert(filename);
 
         path = strjoina(prefix, "/", filename);
+
+        d = hashmap_remove(j->deferred_files, path);
+        if (d) {
+                log_debug("File %s removed.", d->path);
+                deferred_file_free(d);
+                j->current_invalidate_counter++;
+                return;
+        }
+
         f = ordered_hashmap_get(j->files, path);
         if (!f)
                 return;
@@ -1357,6 +1890,42 @@ static void remove_file(sd_journal *j, const char *prefix, const char *filename)
         remove_file_real(j, f);
 }
 
+typedef struct UniqueValue {
+        uint64_t hash;
+        JournalFile *file;
+        uint64_t offset;
+} UniqueValue;
+
+static void unique_reset(sd_journal *j) {
+        UniqueValue *v;
+
+        assert(j);
+
+        j->unique_file = NULL;
+        j->unique_offset = 0;
+        j->unique_file_lost = false;
+        journal_summary_values_done(&j->unique_summary_values);
+        j->unique_from_summary = false;
+
+        while ((v = hashmap_steal_first(j->unique_values)))
+                free(v);
+}
+
+static void unique_values_forget_file(sd_journal *j, JournalFile *f) {
+        UniqueValue *v;
+        Iterator i;
+
+        assert(j);
+
+        /* The file is gone, hence values we found in it can't be compared to anymore. Like for the files we
+         * look at to confirm a value, they are returned again if a later file has them, too. */
+        HASHMAP_FOREACH(v, j->unique_values, i)
+                if (v->file == f) {
+                        hashmap_remove(j->unique_values, &v->hash);
+                        free(v);
+                }
+}
+
 static void remove_file_real(sd_journal *j, JournalFile *f) {
         assert(j);
         assert(f);
@@ -1374,10 +1943,14 @@ static void remove_file_real(sd_journal *j, JournalFile *f) {
                 /* Jump to the next unique_file or NULL if that one was last */
                 j->unique_file = ordered_hashmap_next(j->files, j->unique_file->path);
                 j->unique_offset = 0;
+                journal_summary_values_done(&j->unique_summary_values);
+                j->unique_from_summary = false;
                 if (!j->unique_file)
                         j->unique_file_lost = true;
         }
 
+        unique_values_forget_file(j, f);
+
         if (j->fields_file == f) {
                 j->fields_file = ordered_hashmap_next(j->files, j->fields_file->path);
                 j->fields_offset = 0;
@@ -1720,6 +2293,7 @@ static sd_journal *journal_new(int flags, const char *path) {
         j->inotify_fd = -1;
         j->flags = flags;
         j->data_threshold = DEFAULT_DATA_THRESHOLD;
+        j->match_generation = 1;
 
         if (path) {
                 char *t;
@@ -1750,7 +2324,8 @@ fail:
 #define OPEN_ALLOWED_FLAGS                              \
         (SD_JOURNAL_LOCAL_ONLY |                        \
          SD_JOURNAL_RUNTIME_ONLY |                      \
-         SD_JOURNAL_SYSTEM | SD_JOURNAL_CURRENT_USER)
+         SD_JOURNAL_SYSTEM | SD_JOURNAL_CURRENT_USER |  \
+         SD_JOURNAL_PARALLEL)
 
 _public_ int sd_journal_open(sd_journal **ret, int flags) {
         sd_journal *j;
@@ -1777,7 +2352,8 @@ fail:
 }
 
 #define OPEN_CONTAINER_ALLOWED_FLAGS                    \
-        (SD_JOURNAL_LOCAL_ONLY | SD_JOURNAL_SYSTEM)
+        (SD_JOURNAL_LOCAL_ONLY | SD_JOURNAL_SYSTEM |     \
+         SD_JOURNAL_PARALLEL)
 
 _public_ int sd_journal_open_container(sd_journal **ret, const char *machine, int flags) {
         _cleanup_free_ char *root = NULL, *class = NULL;
@@ -1823,7 +2399,8 @@ fail:
 
 #define OPEN_DIRECTORY_ALLOWED_FLAGS                    \
         (SD_JOURNAL_OS_ROOT |                           \
-         SD_JOURNAL_SYSTEM | SD_JOURNAL_CURRENT_USER )
+         SD_JOURNAL_SYSTEM | SD_JOURNAL_CURRENT_USER |  \
+         SD_JOURNAL_PARALLEL)
 
 _public_ int sd_journal_open_directory(sd_journal **ret, const char *path, int flags) {
         sd_journal *j;
@@ -1858,7 +2435,7 @@ _public_ int sd_journal_open_files(sd_journal **ret, const char **paths, int fla
         int r;
 
         assert_return(ret, -EINVAL);
-        assert_return(flags == 0, -EINVAL);
+        assert_return((flags & ~SD_JOURNAL_PARALLEL) == 0, -EINVAL);
 
         j = journal_new(flags, NULL);
         if (!j)
@@ -1882,7 +2459,8 @@ fail:
 
 #define OPEN_DIRECTORY_FD_ALLOWED_FLAGS         \
         (SD_JOURNAL_OS_ROOT |                           \
-         SD_JOURNAL_SYSTEM | SD_JOURNAL_CURRENT_USER )
+         SD_JOURNAL_SYSTEM | SD_JOURNAL_CURRENT_USER |  \
+         SD_JOURNAL_PARALLEL)
 
 _public_ int sd_journal_open_directory_fd(sd_journal **ret, int fd, int flags) {
         sd_journal *j;
@@ -1929,7 +2507,7 @@ _public_ int sd_journal_open_files_fd(sd_journal **ret, int fds[], unsigned n_fd
 
         assert_return(ret, -EINVAL);
         assert_return(n_fds > 0, -EBADF);
-        assert_return(flags == 0, -EINVAL);
+        assert_return((flags & ~SD_JOURNAL_PARALLEL) == 0, -EINVAL);
 
         j = journal_new(flags, NULL);
         if (!j)
@@ -1975,6 +2553,7 @@ fail:
 }
 
 _public_ void sd_journal_close(sd_journal *j) {
+        DeferredFile *df;
         Directory *d;
         JournalFile *f;
         char *p;
@@ -1989,6 +2568,11 @@ _public_ void sd_journal_close(sd_journal *j) {
 
         ordered_hashmap_free(j->files);
 
+        while ((df = hashmap_steal_first(j->deferred_files)))
+                deferred_file_free(df);
+
+        hashmap_free(j->deferred_files);
+
         while ((d = hashmap_first(j->directories_by_path)))
                 remove_directory(j, d);
 
@@ -2001,7 +2585,9 @@ _public_ void sd_journal_close(sd_journal *j) {
         safe_close(j->inotify_fd);
 
         if (j->mmap) {
-                log_debug("mmap cache statistics: %u hit, %u miss", mmap_cache_get_hit(j->mmap), mmap_cache_get_missed(j->mmap));
+                log_debug("mmap cache statistics: %u hit, %u miss, %u unmap, %u windows",
+                          mmap_cache_get_hit(j->mmap), mmap_cache_get_missed(j->mmap),
+                          mmap_cache_get_unmapped(j->mmap), mmap_cache_get_windows(j->mmap));
                 mmap_cache_unref(j->mmap);
         }
 
@@ -2011,8 +2597,12 @@ _public_ void sd_journal_close(sd_journal *j) {
 
         free(j->path);
         free(j->prefix);
+        unique_reset(j);
+        hashmap_free(j->unique_values);
         free(j->unique_field);
+        free(j->unique_buffer);
         free(j->fields_buffer);
+        seek_pool_free(j->seek_pool);
         free(j);
 }
 
@@ -2152,11 +2742,12 @@ _public_ int sd_journal_get_data(sd_journal *j, const char *field, const void **
 
                 compression = o->object.flags & OBJECT_COMPRESSION_MASK;
                 if (compression) {
-#if defined(HAVE_XZ) || defined(HAVE_LZ4)
+#if defined(HAVE_XZ) || defined(HAVE_LZ4) || defined(HAVE_ZSTD)
                         r = decompress_startswith(compression,
                                                   o->data.payload, l,
                                                   &f->compress_buffer, &f->compress_buffer_size,
-                                                  field, field_length, '=');
+                                                  field, field_length, '=',
+                                                  journal_file_dictionary(f));
                         if (r < 0)
                                 log_debug_errno(r, "Cannot decompress %s object of length %"PRIu64" at offset "OFSfmt": %m",
                                                 object_compressed_to_string(compression), l, p);
@@ -2167,7 +2758,7 @@ _public_ int sd_journal_get_data(sd_journal *j, const char *field, const void **
                                 r = decompress_blob(compression,
                                                     o->data.payload, l,
                                                     &f->compress_buffer, &f->compress_buffer_size, &rsize,
-                                                    j->data_threshold);
+                                                    j->data_threshold, journal_file_dictionary(f));
                                 if (r < 0)
                                         return r;
 
@@ -2216,13 +2807,14 @@ static int return_data(sd_journal *j, JournalFile *f, Object *o, const void **da
 
         compression = o->object.flags & OBJECT_COMPRESSION_MASK;
         if (compression) {
-#if defined(HAVE_XZ) || defined(HAVE_LZ4)
+#if defined(HAVE_XZ) || defined(HAVE_LZ4) || defined(HAVE_ZSTD)
                 size_t rsize;
                 int r;
 
                 r = decompress_blob(compression,
                                     o->data.payload, l, &f->compress_buffer,
-                                    &f->compress_buffer_size, &rsize, j->data_threshold);
+                                    &f->compress_buffer_size, &rsize, j->data_threshold,
+                                    journal_file_dictionary(f));
                 if (r < 0)
                         return r;
 
@@ -2507,6 +3099,10 @@ _public_ int sd_journal_get_cutoff_realtime_usec(sd_journal *j, uint64_t *from,
         assert_return(from || to, -EINVAL);
         assert_return(from != to, -EINVAL);
 
+        r = journal_open_deferred_files(j);
+        if (r < 0)
+                return r;
+
         ORDERED_HASHMAP_FOREACH(f, j->files, i) {
                 usec_t fr, t;
 
@@ -2547,6 +3143,10 @@ _public_ int sd_journal_get_cutoff_monotonic_usec(sd_journal *j, sd_id128_t boot
         assert_return(from || to, -EINVAL);
         assert_return(from != to, -EINVAL);
 
+        r = journal_open_deferred_files(j);
+        if (r < 0)
+                return r;
+
         ORDERED_HASHMAP_FOREACH(f, j->files, i) {
                 usec_t fr, t;
 
@@ -2582,6 +3182,8 @@ void journal_print_header(sd_journal *j) {
 
         assert(j);
 
+        (void) journal_open_deferred_files(j);
+
         ORDERED_HASHMAP_FOREACH(f, j->files, i) {
                 if (newline)
                         putchar('\n');
@@ -2590,17 +3192,39 @@ void journal_print_header(sd_journal *j) {
 
                 journal_file_print_header(f);
         }
+
+        if (j->mmap) {
+                unsigned hit, missed;
+
+                hit = mmap_cache_get_hit(j->mmap);
+                missed = mmap_cache_get_missed(j->mmap);
+
+                printf("\nMMap Cache Hits: %u\n"
+                       "MMap Cache Misses: %u\n"
+                       "MMap Cache Hit Rate: %.1f%%\n"
+                       "MMap Cache Unmaps: %u\n"
+                       "MMap Cache Windows: %u\n",
+                       hit, missed,
+                       hit + missed > 0 ? 100.0 * hit / (hit + missed) : 0.0,
+                       mmap_cache_get_unmapped(j->mmap),
+                       mmap_cache_get_windows(j->mmap));
+        }
 }
 
 _public_ int sd_journal_get_usage(sd_journal *j, uint64_t *bytes) {
         Iterator i;
         JournalFile *f;
         uint64_t sum = 0;
+        int r;
 
         assert_return(j, -EINVAL);
         assert_return(!journal_pid_changed(j), -ECHILD);
         assert_return(bytes, -EINVAL);
 
+        r = journal_open_deferred_files(j);
+        if (r < 0)
+                return r;
+
         ORDERED_HASHMAP_FOREACH(f, j->files, i) {
                 struct stat st;
 
@@ -2628,15 +3252,162 @@ _public_ int sd_journal_query_unique(sd_journal *j, const char *field) {
 
         free(j->unique_field);
         j->unique_field = f;
-        j->unique_file = NULL;
-        j->unique_offset = 0;
-        j->unique_file_lost = false;
+        unique_reset(j);
 
         return 0;
 }
 
+static int unique_value_in_earlier_files(sd_journal *j, const void *data, size_t size, uint64_t hash, bool hash_is_data_hash) {
+        JournalFile *of;
+        Iterator i;
+        int r;
+
+        /* Checks if we already returned this data object by checking if it exists in the earlier traversed
+         * files. The hash is only the data hash if the value is from a DATA object of a file without keyed
+         * hashes. */
+
+        ORDERED_HASHMAP_FOREACH(of, j->files, i) {
+                if (of == j->unique_file)
+                        break;
+
+                /* Skip this file it didn't have any fields indexed */
+                if (JOURNAL_HEADER_CONTAINS(of->header, n_fields) && le64toh(of->header->n_fields) <= 0)
+                        continue;
+
+                /* Hashes may be reused across files, unless they are keyed */
+                if (hash_is_data_hash && !of->keyed_hash)
+                        r = journal_file_find_data_object_with_hash(of, data, size, hash, NULL, NULL);
+                else
+                        r = journal_file_find_data_object(of, data, size, NULL, NULL);
+                if (r != 0)
+                        return r;
+        }
+
+        return 0;
+}
+
+static int unique_value_seen(sd_journal *j, const void *data, size_t size, uint64_t hash, bool hash_is_data_hash) {
+        UniqueValue *v;
+        int r;
+
+        /* Returns 1 if the value was returned already, 0 if it wasn't, and remembers it in that case. The
+         * value is compared to the one it shares the hash with: only if they differ we fall back to looking
+         * for it in all earlier files. */
+
+        v = hashmap_get(j->unique_values, &hash);
+        if (v) {
+                const void *vdata;
+                size_t vsize;
+                Object *o;
+
+                /* The same value is never found twice in one file, hence this is a collision. Also, we must not
+                 * decompress into the buffer the value might be in. */
+                if (v->file == j->unique_file)
+                        return unique_value_in_earlier_files(j, data, size, hash, hash_is_data_hash);
+
+                r = journal_file_move_to_object(v->file, OBJECT_DATA, v->offset, &o);
+                if (r < 0)
+                        return r;
+
+                r = return_data(j, v->file, o, &vdata, &vsize);
+                if (r < 0)
+                        return r;
+
+                if (vsize == size && memcmp(vdata, data, size) == 0)
+                        return 1;
+
+                return unique_value_in_earlier_files(j, data, size, hash, hash_is_data_hash);
+        }
+
+        r = hashmap_ensure_allocated(&j->unique_values, &uint64_hash_ops);
+        if (r < 0)
+                return r;
+
+        v = new(UniqueValue, 1);
+        if (!v)
+                return -ENOMEM;
+
+        v->hash = hash;
+        v->file = j->unique_file;
+        v->offset = j->unique_offset;
+
+        r = hashmap_put(j->unique_values, &v->hash, v);
+        if (r < 0) {
+                free(v);
+                return r;
+        }
+
+        return 0;
+}
+
+static void unique_next_file(sd_journal *j) {
+        assert(j);
+
+        j->unique_file = ordered_hashmap_next(j->files, j->unique_file->path);
+        j->unique_offset = 0;
+        journal_summary_values_done(&j->unique_summary_values);
+        j->unique_from_summary = false;
+}
+
+static int unique_open_summary(sd_journal *j) {
+        JournalSummary *s;
+        int r;
+
+        assert(j);
+        assert(j->unique_file);
+
+        /* Only archived files have a summary, as they are not modified anymore */
+        if (j->unique_file->header->state != STATE_ARCHIVED)
+                return 0;
+
+        r = journal_file_get_summary(j->unique_file, &s);
+        if (r <= 0)
+                return r;
+
+        return journal_summary_read_values(s, j->unique_field, &j->unique_summary_values);
+}
+
+static int unique_next_from_summary(sd_journal *j, const void **data, size_t *l) {
+        size_t k = strlen(j->unique_field);
+        const void *value;
+        size_t size;
+        int r;
+
+        for (;;) {
+                r = journal_summary_values_next(&j->unique_summary_values, &value, &size, &j->unique_offset);
+                if (r <= 0)
+                        return r;
+
+                if (!GREEDY_REALLOC(j->unique_buffer, j->unique_buffer_allocated, k + 1 + size + 1))
+                        return -ENOMEM;
+
+                memcpy(mempcpy(j->unique_buffer, j->unique_field, k), "=", 1);
+                memcpy(j->unique_buffer + k + 1, value, size);
+                j->unique_buffer[k + 1 + size] = 0;
+
+                /* Summaries are only read for files we don't look at otherwise, hence hash the value ourselves
+                 * rather than looking up its DATA object */
+                r = unique_value_seen(j, j->unique_buffer, k + 1 + size, hash64(j->unique_buffer, k + 1 + size), false);
+                if (r < 0)
+                        return r;
+                if (r > 0)
+                        continue;
+
+                *data = j->unique_buffer;
+                *l = k + 1 + size;
+
+                /* Values longer than the threshold are truncated, like those read from DATA objects, but we
+                 * always keep the field name */
+                if (j->data_threshold > 0 && *l > MAX(j->data_threshold, k + 1))
+                        *l = MAX(j->data_threshold, k + 1);
+
+                return 1;
+        }
+}
+
 _public_ int sd_journal_enumerate_unique(sd_journal *j, const void **data, size_t *l) {
         size_t k;
+        int r;
 
         assert_return(j, -EINVAL);
         assert_return(!journal_pid_changed(j), -ECHILD);
@@ -2650,6 +3421,10 @@ _public_ int sd_journal_enumerate_unique(sd_journal *j, const void **data, size_
                 if (j->unique_file_lost)
                         return 0;
 
+                r = journal_open_deferred_files(j);
+                if (r < 0)
+                        return r;
+
                 j->unique_file = ordered_hashmap_first(j->files);
                 if (!j->unique_file)
                         return 0;
@@ -2658,16 +3433,36 @@ _public_ int sd_journal_enumerate_unique(sd_journal *j, const void **data, size_
         }
 
         for (;;) {
-                JournalFile *of;
-                Iterator i;
                 Object *o;
                 const void *odata;
                 size_t ol;
-                bool found;
-                int r;
+                uint64_t hash;
+
+                if (j->unique_from_summary) {
+                        r = unique_next_from_summary(j, data, l);
+                        if (r != 0)
+                                return r;
+
+                        /* We reached the end of the list? Then start again, with the next file */
+                        unique_next_file(j);
+                        if (!j->unique_file)
+                                return 0;
+
+                        continue;
+                }
 
                 /* Proceed to next data object in the field's linked list */
                 if (j->unique_offset == 0) {
+                        /* The summary of the file might list the values, then take them from there */
+                        r = unique_open_summary(j);
+                        if (r < 0)
+                                log_debug_errno(r, "Failed to read values of %s from summary of %s, ignoring: %m",
+                                                j->unique_field, j->unique_file->path);
+                        if (r > 0) {
+                                j->unique_from_summary = true;
+                                continue;
+                        }
+
                         r = journal_file_find_field_object(j->unique_file, j->unique_field, k, &o, NULL);
                         if (r < 0)
                                 return r;
@@ -2683,7 +3478,7 @@ _public_ int sd_journal_enumerate_unique(sd_journal *j, const void **data, size_
 
                 /* We reached the end of the list? Then start again, with the next file */
                 if (j->unique_offset == 0) {
-                        j->unique_file = ordered_hashmap_next(j->files, j->unique_file->path);
+                        unique_next_file(j);
                         if (!j->unique_file)
                                 return 0;
 
@@ -2724,28 +3519,16 @@ _public_ int sd_journal_enumerate_unique(sd_journal *j, const void **data, size_
                         return -EBADMSG;
                 }
 
-                /* OK, now let's see if we already returned this data
-                 * object by checking if it exists in the earlier
-                 * traversed files. */
-                found = false;
-                ORDERED_HASHMAP_FOREACH(of, j->files, i) {
-                        if (of == j->unique_file)
-                                break;
-
-                        /* Skip this file it didn't have any fields indexed */
-                        if (JOURNAL_HEADER_CONTAINS(of->header, n_fields) && le64toh(of->header->n_fields) <= 0)
-                                continue;
-
-                        r = journal_file_find_data_object_with_hash(of, odata, ol, le64toh(o->data.hash), NULL, NULL);
-                        if (r < 0)
-                                return r;
-                        if (r > 0) {
-                                found = true;
-                                break;
-                        }
-                }
+                /* Files without keyed hashes store the hash we need, for others we have to hash the value */
+                if (j->unique_file->keyed_hash)
+                        hash = hash64(odata, ol);
+                else
+                        hash = le64toh(o->data.hash);
 
-                if (found)
+                r = unique_value_seen(j, odata, ol, hash, !j->unique_file->keyed_hash);
+                if (r < 0)
+                        return r;
+                if (r > 0)
                         continue;
 
                 r = return_data(j, j->unique_file, o, data, l);
@@ -2760,9 +3543,7 @@ _public_ void sd_journal_restart_unique(sd_journal *j) {
         if (!j)
                 return;
 
-        j->unique_file = NULL;
-        j->unique_offset = 0;
-        j->unique_file_lost = false;
+        unique_reset(j);
 }
 
 _public_ int sd_journal_enumerate_fields(sd_journal *j, const char **field) {
@@ -2776,6 +3557,10 @@ _public_ int sd_journal_enumerate_fields(sd_journal *j, const char **field) {
                 if (j->fields_file_lost)
                         return 0;
 
+                r = journal_open_deferred_files(j);
+                if (r < 0)
+                        return r;
+
                 j->fields_file = ordered_hashmap_first(j->files);
                 if (!j->fields_file)
                         return 0;
@@ -2870,7 +3655,10 @@ _public_ int sd_journal_enumerate_fields(sd_journal *j, const char **field) {
                         if (JOURNAL_HEADER_CONTAINS(of->header, n_fields) && le64toh(of->header->n_fields) <= 0)
                                 continue;
 
-                        r = journal_file_find_field_object_with_hash(of, o->field.payload, sz, le64toh(o->field.hash), NULL, NULL);
+                        if (!of->keyed_hash && !f->keyed_hash)
+                                r = journal_file_find_field_object_with_hash(of, o->field.payload, sz, le64toh(o->field.hash), NULL, NULL);
+                        else
+                                r = journal_file_find_field_object(of, o->field.payload, sz, NULL, NULL);
                         if (r < 0)
                                 return r;
                         if (r > 0) {
@@ -2943,7 +3731,8 @@ _public_ int sd_journal_get_catalog(sd_journal *j, char **ret) {
         const void *data;
         size_t size;
         sd_id128_t id;
-        _cleanup_free_ char *text = NULL, *cid = NULL;
+        _cleanup_free_ char *cid = NULL;
+        const char *text;
         char *t;
         int r;
 
@@ -2963,7 +3752,8 @@ _public_ int sd_journal_get_catalog(sd_journal *j, char **ret) {
         if (r < 0)
                 return r;
 
-        r = catalog_get(CATALOG_DATABASE, id, &text);
+        /* The text stays in the mapped database, only the result of the substitution is allocated */
+        r = catalog_find(CATALOG_DATABASE, id, &text);
         if (r < 0)
                 return r;
 
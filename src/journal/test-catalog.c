@@ -27,11 +27,14 @@
 
 #include "alloc-util.h"
 #include "catalog.h"
+#include "env-util.h"
 #include "fd-util.h"
 #include "fileio.h"
+#include "io-util.h"
 #include "log.h"
 #include "macro.h"
 #include "string-util.h"
+#include "strv.h"
 #include "util.h"
 
 static const char *catalog_dirs[] = {
@@ -201,6 +204,89 @@ static void test_catalog_update(void) {
         assert_se(r >= 0);
 }
 
+static char **list_ids(const char *path) {
+        _cleanup_free_ char *buf = NULL;
+        char **ids = NULL;
+        const char *p;
+        size_t size;
+        FILE *f;
+
+        assert_se(f = open_memstream(&buf, &size));
+        assert_se(catalog_list(f, path, true) >= 0);
+        assert_se(fclose(f) == 0);
+
+        for (p = buf; *p; p = strchr(p, '\n') + 1)
+                assert_se(strv_consume(&ids, strndup(p, 32)) >= 0);
+
+        assert_se(strv_length(ids) > 0);
+
+        return ids;
+}
+
+static char *copy_without_hash_table(const char *path) {
+        static char name[] = "/tmp/test-catalog-bisect.XXXXXX";
+        _cleanup_close_ int fd = -1;
+        _cleanup_free_ char *contents = NULL;
+        size_t size;
+
+        /* Pretend the database was written before there was a hash table, so that it is bisected */
+        assert_se(read_full_file(path, &contents, &size) >= 0);
+        assert_se(size >= 12);
+        memzero(contents + 8, 4); /* compatible_flags, after the signature */
+
+        fd = mkostemp_safe(name);
+        assert_se(fd >= 0);
+        assert_se(loop_write(fd, contents, size, false) >= 0);
+
+        return name;
+}
+
+static void test_catalog_lookup(const char *path, const char *bisect_path, char **ids, const char *locale) {
+        char **id;
+
+        (void) setlocale(LC_MESSAGES, locale);
+
+        /* Both ways of looking an entry up find the same text */
+        STRV_FOREACH(id, ids) {
+                _cleanup_free_ char *a = NULL, *b = NULL;
+                sd_id128_t i;
+
+                assert_se(sd_id128_from_string(*id, &i) >= 0);
+                assert_se(catalog_get(path, i, &a) >= 0);
+                assert_se(catalog_get(bisect_path, i, &b) >= 0);
+                assert_se(streq(a, b));
+        }
+}
+
+static void test_catalog_lookup_missing(const char *path) {
+        const char *text;
+
+        assert_se(catalog_find(path, SD_ID128_MAKE(00,11,22,33,44,55,66,77,88,99,aa,bb,cc,dd,ee,ff), &text) == -ENOENT);
+}
+
+static void benchmark_catalog_lookup(const char *path, char **ids, const char *name, unsigned n) {
+        unsigned i, n_ids;
+        usec_t start, end;
+        sd_id128_t *parsed;
+
+        n_ids = strv_length(ids);
+        assert_se(parsed = new(sd_id128_t, n_ids));
+        for (i = 0; i < n_ids; i++)
+                assert_se(sd_id128_from_string(ids[i], parsed + i) >= 0);
+
+        start = now(CLOCK_MONOTONIC);
+        for (i = 0; i < n; i++) {
+                const char *text;
+
+                assert_se(catalog_find(path, parsed[(i * 7919U) % n_ids], &text) >= 0);
+        }
+        end = now(CLOCK_MONOTONIC);
+
+        log_info("%-8s %10.0f lookups/s", name, (double) n * USEC_PER_SEC / (end - start));
+
+        free(parsed);
+}
+
 static void test_catalog_file_lang(void) {
         _cleanup_free_ char *lang = NULL, *lang2 = NULL, *lang3 = NULL, *lang4 = NULL;
 
@@ -231,6 +317,10 @@ static void test_catalog_file_lang(void) {
 
 int main(int argc, char *argv[]) {
         _cleanup_free_ char *text = NULL;
+        _cleanup_strv_free_ char **ids = NULL;
+        const char *bisect_database;
+        unsigned n;
+        bool slow;
         int r;
 
         setlocale(LC_ALL, "de_DE.UTF-8");
@@ -257,6 +347,25 @@ int main(int argc, char *argv[]) {
         assert_se(catalog_get(database, SD_MESSAGE_COREDUMP, &text) >= 0);
         printf(">>>%s<<<\n", text);
 
+        r = getenv_bool("SYSTEMD_SLOW_TESTS");
+        slow = r >= 0 ? r : SYSTEMD_SLOW_TESTS_DEFAULT;
+
+        n = slow ? 10000000 : 200000;
+
+        ids = list_ids(database);
+        bisect_database = copy_without_hash_table(database);
+
+        test_catalog_lookup(database, bisect_database, ids, "C");
+        test_catalog_lookup(database, bisect_database, ids, "de_DE.UTF-8");
+        test_catalog_lookup(database, bisect_database, ids, "xx_YY");
+        test_catalog_lookup_missing(database);
+        test_catalog_lookup_missing(bisect_database);
+
+        (void) setlocale(LC_MESSAGES, "C");
+        benchmark_catalog_lookup(database, ids, "hashed", n);
+        benchmark_catalog_lookup(bisect_database, ids, "bisected", n);
+
+        unlink(bisect_database);
         if (database)
                 unlink(database);
 
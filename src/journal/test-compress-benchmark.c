@@ -17,13 +17,17 @@
   along with systemd; If not, see <http://www.gnu.org/licenses/>.
 ***/
 
+#include "sd-journal.h"
+
 #include "alloc-util.h"
 #include "compress.h"
 #include "env-util.h"
 #include "macro.h"
 #include "parse-util.h"
 #include "random-util.h"
+#include "stdio-util.h"
 #include "string-util.h"
+#include "strv.h"
 #include "util.h"
 
 typedef int (compress_t)(const void *src, uint64_t src_size, void *dst,
@@ -31,7 +35,7 @@ typedef int (compress_t)(const void *src, uint64_t src_size, void *dst,
 typedef int (decompress_t)(const void *src, uint64_t src_size,
                            void **dst, size_t *dst_alloc_size, size_t* dst_size, size_t dst_max);
 
-#if defined(HAVE_XZ) || defined(HAVE_LZ4)
+#if defined(HAVE_XZ) || defined(HAVE_LZ4) || defined(HAVE_ZSTD)
 
 static usec_t arg_duration;
 static size_t arg_start;
@@ -154,10 +158,165 @@ static void test_compress_decompress(const char* label, const char* type,
                  100 - compressed * 100. / total,
                  skipped);
 }
+
+#define CORPUS_FIELDS_MAX 20000U
+#define CORPUS_FIELDS_MIN 1000U
+#define CORPUS_TRAINING_FIELDS 4000U
+
+static char** make_corpus(void) {
+        _cleanup_strv_free_ char **l = NULL;
+        unsigned n = 0;
+        sd_journal *j;
+        char **ret;
+
+        /* Use the MESSAGE= fields of the local journal, so that we measure what
+         * journald actually has to deal with. Fall back to something that looks
+         * similar if there are not enough of them. */
+
+        if (sd_journal_open(&j, SD_JOURNAL_LOCAL_ONLY) >= 0) {
+                SD_JOURNAL_FOREACH_BACKWARDS(j) {
+                        const void *d;
+                        size_t k;
+
+                        if (sd_journal_get_data(j, "MESSAGE", &d, &k) < 0)
+                                continue;
+
+                        assert_se(strv_consume(&l, strndup(d, k)) >= 0);
+                        if (++n >= CORPUS_FIELDS_MAX)
+                                break;
+                }
+
+                sd_journal_close(j);
+        }
+
+        if (n >= CORPUS_FIELDS_MIN) {
+                log_info("Using %u fields from the local journal.", n);
+                goto finish;
+        }
+
+        log_info("Only %u fields in the local journal, using generated fields.", n);
+
+        for (; n < CORPUS_FIELDS_MAX; n++) {
+                static const char *const units[] = { "systemd-logind", "sshd", "NetworkManager", "cron", "kernel" };
+                char *m;
+
+                if (n % 3 == 0)
+                        assert_se(asprintf(&m, "MESSAGE=New session %u of user %s.",
+                                           n, n % 5 ? "root" : "lennart") >= 0);
+                else if (n % 3 == 1)
+                        assert_se(asprintf(&m, "MESSAGE=Accepted publickey for root from 192.168.%u.%u port %u ssh2: RSA SHA256:%016x",
+                                           n % 256, (n * 7) % 256, 1024 + n % 60000, n * 2654435761U) >= 0);
+                else
+                        assert_se(asprintf(&m, "MESSAGE=%s.service: Succeeded after %ums, consumed %u.%03us CPU time.",
+                                           units[n % ELEMENTSOF(units)], n % 9973, n % 17, n % 1000) >= 0);
+
+                assert_se(strv_consume(&l, m) >= 0);
+        }
+
+finish:
+        ret = l;
+        l = NULL;
+
+        return ret;
+}
+
+#ifdef HAVE_ZSTD
+static CompressDictionary *arg_dictionary = NULL;
+
+static int compress_blob_zstd_with_dictionary(const void *src, uint64_t src_size, void *dst,
+                                              size_t dst_alloc_size, size_t *dst_size) {
+        return compress_blob_zstd_dictionary(src, src_size, dst, dst_alloc_size, dst_size, arg_dictionary);
+}
+
+static int decompress_blob_zstd_with_dictionary(const void *src, uint64_t src_size,
+                                                void **dst, size_t *dst_alloc_size, size_t* dst_size, size_t dst_max) {
+        return decompress_blob(OBJECT_COMPRESSED_ZSTD, src, src_size, dst, dst_alloc_size, dst_size, dst_max, arg_dictionary);
+}
+
+static void train_dictionary(char **corpus) {
+        _cleanup_free_ size_t *sizes = NULL;
+        _cleanup_free_ char *samples = NULL;
+        _cleanup_free_ void *d = NULL;
+        size_t n = 0, allocated = 0, sizes_allocated = 0, d_size;
+        unsigned k = 0;
+        usec_t start;
+        char **i;
+
+        STRV_FOREACH(i, corpus) {
+                size_t l = strlen(*i);
+
+                assert_se(GREEDY_REALLOC(samples, allocated, n + l));
+                memcpy(samples + n, *i, l);
+                n += l;
+
+                assert_se(GREEDY_REALLOC(sizes, sizes_allocated, k + 1));
+                sizes[k++] = l;
+
+                if (k >= CORPUS_TRAINING_FIELDS)
+                        break;
+        }
+
+        start = now(CLOCK_MONOTONIC);
+        assert_se(compress_dictionary_train(samples, sizes, k, 16 * 1024, &d, &d_size) >= 0);
+        log_info("Trained a %zu byte dictionary from %u fields (%zu bytes) in %.3fs.",
+                 d_size, k, n, (now(CLOCK_MONOTONIC) - start) / 1e6);
+
+        assert_se(compress_dictionary_new(d, d_size, &arg_dictionary) >= 0);
+}
+#endif
+
+static void test_compress_decompress_fields(const char *label, char **corpus,
+                                            compress_t compress, decompress_t decompress) {
+        _cleanup_free_ void *buf2 = NULL;
+        size_t buf2_allocated = 0, total = 0, stored = 0, n_compressed = 0, n_fields = 0;
+        char buf[64 * 1024];
+        usec_t n, n2;
+        char **i;
+
+        /* Compresses each field on its own, like journald does. Fields that do
+         * not shrink are counted as stored uncompressed. */
+
+        n = n2 = now(CLOCK_MONOTONIC);
+
+        for (;;) {
+                STRV_FOREACH(i, corpus) {
+                        size_t size = strlen(*i), j = 0, k = 0;
+                        int r;
+
+                        r = compress(*i, size, buf, MIN(size, sizeof(buf)), &j);
+                        if (r == 0) {
+                                r = decompress(buf, j, &buf2, &buf2_allocated, &k, 0);
+                                assert_se(r == 0);
+                                assert_se(k == size);
+                                assert_se(memcmp(*i, buf2, size) == 0);
+
+                                n_compressed++;
+                        } else {
+                                assert_se(r == -ENOBUFS);
+                                j = size;
+                        }
+
+                        total += size;
+                        stored += j;
+                        n_fields++;
+                }
+
+                n2 = now(CLOCK_MONOTONIC);
+                if (n2 - n > arg_duration)
+                        break;
+        }
+
+        log_info("%-15s %zu fields (%zu compressible) of %.1f bytes on average in %.2fs (%.2fMiB/s), "
+                 "mean compression %.2f%%",
+                 label, n_fields, n_compressed, (double) total / n_fields, (n2 - n) / 1e6,
+                 total / 1024. / 1024 / ((n2 - n) / 1e6),
+                 100 - stored * 100. / total);
+}
 #endif
 
 int main(int argc, char *argv[]) {
-#if defined(HAVE_XZ) || defined(HAVE_LZ4)
+#if defined(HAVE_XZ) || defined(HAVE_LZ4) || defined(HAVE_ZSTD)
+        _cleanup_strv_free_ char **corpus = NULL;
         const char *i;
         int r;
 
@@ -188,8 +347,30 @@ int main(int argc, char *argv[]) {
 #endif
 #ifdef HAVE_LZ4
                 test_compress_decompress("LZ4", i, compress_blob_lz4, decompress_blob_lz4);
+#endif
+#ifdef HAVE_ZSTD
+                test_compress_decompress("ZSTD", i, compress_blob_zstd, decompress_blob_zstd);
 #endif
         }
+
+        corpus = make_corpus();
+
+#ifdef HAVE_XZ
+        test_compress_decompress_fields("XZ", corpus, compress_blob_xz, decompress_blob_xz);
+#endif
+#ifdef HAVE_LZ4
+        test_compress_decompress_fields("LZ4", corpus, compress_blob_lz4, decompress_blob_lz4);
+#endif
+#ifdef HAVE_ZSTD
+        test_compress_decompress_fields("ZSTD", corpus, compress_blob_zstd, decompress_blob_zstd);
+
+        train_dictionary(corpus);
+        test_compress_decompress_fields("ZSTD+dictionary", corpus,
+                                        compress_blob_zstd_with_dictionary,
+                                        decompress_blob_zstd_with_dictionary);
+        arg_dictionary = compress_dictionary_free(arg_dictionary);
+#endif
+
         return 0;
 #else
         return EXIT_TEST_SKIP;
@@ -41,6 +41,12 @@
 # define LZ4_OK -EPROTONOSUPPORT
 #endif
 
+#ifdef HAVE_ZSTD
+# define ZSTD_OK 0
+#else
+# define ZSTD_OK -EPROTONOSUPPORT
+#endif
+
 typedef int (compress_blob_t)(const void *src, uint64_t src_size,
                               void *dst, size_t dst_alloc_size, size_t *dst_size);
 typedef int (decompress_blob_t)(const void *src, uint64_t src_size,
@@ -54,7 +60,7 @@ typedef int (decompress_sw_t)(const void *src, uint64_t src_size,
 typedef int (compress_stream_t)(int fdf, int fdt, uint64_t max_bytes);
 typedef int (decompress_stream_t)(int fdf, int fdt, uint64_t max_size);
 
-#if defined(HAVE_XZ) || defined(HAVE_LZ4)
+#if defined(HAVE_XZ) || defined(HAVE_LZ4) || defined(HAVE_ZSTD)
 static void test_compress_decompress(int compression,
                                      compress_blob_t compress,
                                      decompress_blob_t decompress,
@@ -248,8 +254,75 @@ static void test_lz4_decompress_partial(void) {
 }
 #endif
 
+#ifdef HAVE_ZSTD
+static void test_zstd_dictionary(void) {
+        _cleanup_(compress_dictionary_freep) CompressDictionary *dict = NULL;
+        _cleanup_free_ char *samples = NULL, *decompressed = NULL;
+        _cleanup_free_ size_t *sizes = NULL;
+        _cleanup_free_ void *d = NULL;
+        const char *message = "MESSAGE=Started Session 4711 of user lennart.";
+        char compressed[512];
+        size_t n = 0, d_size, csize, csize_plain, usize = 0;
+        unsigned i;
+        int r;
+
+        log_info("/* testing ZSTD dictionary compression/decompression */");
+
+#define N_SAMPLES 2000
+
+        samples = malloc(N_SAMPLES * 64);
+        sizes = new(size_t, N_SAMPLES);
+        assert_se(samples && sizes);
+
+        /* Short, repetitive fields as journald sees them */
+        for (i = 0; i < N_SAMPLES; i++) {
+                sizes[i] = snprintf(samples + n, 64, "MESSAGE=%s Session %u of user %s.",
+                                    i % 2 ? "Started" : "Removed", i, i % 3 ? "root" : "lennart");
+                n += sizes[i];
+        }
+
+        r = compress_dictionary_train(samples, sizes, N_SAMPLES, 4096, &d, &d_size);
+        assert_se(r == 0);
+        log_info("Trained dictionary of %zu bytes", d_size);
+
+        assert_se(compress_dictionary_new(d, d_size, &dict) == 0);
+        assert_se(dict->id != 0);
+
+        assert_se(compress_blob_zstd(message, strlen(message), compressed, sizeof(compressed), &csize_plain) == 0);
+        assert_se(compress_blob_zstd_dictionary(message, strlen(message), compressed, sizeof(compressed), &csize, dict) == 0);
+        log_info("\"%s\": %zu bytes, compressed %zu without and %zu with dictionary",
+                 message, strlen(message), csize_plain, csize);
+        assert_se(csize < csize_plain);
+        assert_se(csize < strlen(message));
+
+        r = decompress_blob(OBJECT_COMPRESSED_ZSTD, compressed, csize,
+                            (void **) &decompressed, &usize, &csize_plain, 0, dict);
+        assert_se(r == 0);
+        assert_se(csize_plain == strlen(message));
+        assert_se(memcmp(decompressed, message, csize_plain) == 0);
+
+        r = decompress_startswith(OBJECT_COMPRESSED_ZSTD, compressed, csize,
+                                  (void **) &decompressed, &usize, "MESSAGE", 7, '=', dict);
+        assert_se(r > 0);
+        r = decompress_startswith(OBJECT_COMPRESSED_ZSTD, compressed, csize,
+                                  (void **) &decompressed, &usize, "MESSAGE", 7, '_', dict);
+        assert_se(r == 0);
+
+        /* Without the dictionary the data cannot be recovered */
+        r = decompress_blob(OBJECT_COMPRESSED_ZSTD, compressed, csize,
+                            (void **) &decompressed, &usize, &csize_plain, 0, NULL);
+        assert_se(r == -EBADMSG);
+        r = decompress_blob_zstd(compressed, csize,
+                                 (void **) &decompressed, &usize, &csize_plain, 0);
+        assert_se(r == -EBADMSG);
+
+        /* Raw content without a dictionary header is refused */
+        assert_se(compress_dictionary_new("foobar", 6, &dict) == -EINVAL);
+}
+#endif
+
 int main(int argc, char *argv[]) {
-#if defined(HAVE_XZ) || defined(HAVE_LZ4)
+#if defined(HAVE_XZ) || defined(HAVE_LZ4) || defined(HAVE_ZSTD)
         const char text[] =
                 "text\0foofoofoofoo AAAA aaaaaaaaa ghost busters barbarbar FFF"
                 "foofoofoofoo AAAA aaaaaaaaa ghost busters barbarbar FFF";
@@ -314,6 +387,27 @@ int main(int argc, char *argv[]) {
         log_info("/* LZ4 test skipped */");
 #endif
 
+#ifdef HAVE_ZSTD
+        test_compress_decompress(OBJECT_COMPRESSED_ZSTD, compress_blob_zstd, decompress_blob_zstd,
+                                 text, sizeof(text), false);
+        test_compress_decompress(OBJECT_COMPRESSED_ZSTD, compress_blob_zstd, decompress_blob_zstd,
+                                 data, sizeof(data), true);
+
+        test_decompress_startswith(OBJECT_COMPRESSED_ZSTD,
+                                   compress_blob_zstd, decompress_startswith_zstd,
+                                   text, sizeof(text), false);
+        test_decompress_startswith(OBJECT_COMPRESSED_ZSTD,
+                                   compress_blob_zstd, decompress_startswith_zstd,
+                                   data, sizeof(data), true);
+        test_decompress_startswith(OBJECT_COMPRESSED_ZSTD,
+                                   compress_blob_zstd, decompress_startswith_zstd,
+                                   huge, sizeof(huge), true);
+
+        test_zstd_dictionary();
+#else
+        log_info("/* ZSTD test skipped */");
+#endif
+
         return 0;
 #else
         return EXIT_TEST_SKIP;
@@ -0,0 +1,257 @@
+/***
+  This file is part of systemd.
+
+  systemd is free software; you can redistribute it and/or modify it
+  under the terms of the GNU Lesser General Public License as published by
+  the Free Software Foundation; either version 2.1 of the License, or
+  (at your option) any later version.
+
+  systemd is distributed in the hope that it will be useful, but
+  WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+  Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public License
+  along with systemd; If not, see <http://www.gnu.org/licenses/>.
+***/
+
+#include <signal.h>
+#include <unistd.h>
+
+#include "alloc-util.h"
+#include "cgroup-util.h"
+#include "env-util.h"
+#include "journald-context.h"
+#include "journald-server.h"
+#include "log.h"
+#include "process-util.h"
+#include "stdio-util.h"
+#include "string-util.h"
+#include "util.h"
+
+/* This program checks that client metadata is only read when needed, and that cached invocation IDs are dropped when
+ * a unit is restarted, and measures how long refreshing a context takes. */
+
+#define SLICE "testjournal.slice"
+
+static void test_lazy(Server *s) {
+        _cleanup_free_ char *comm = NULL;
+        struct ucred ucred = {
+                .pid = getpid_cached(),
+                .uid = getuid(),
+                .gid = getgid(),
+        };
+        ClientContextStats st;
+        ClientContext *c;
+
+        st = s->client_context_stats;
+
+        /* Nothing is read when the context is created, the credentials are passed in */
+        assert_se(client_context_get(s, ucred.pid, &ucred, NULL, 0, NULL, &c) >= 0);
+        assert_se(s->client_context_stats.n_new == st.n_new + 1);
+        assert_se(s->client_context_stats.n_proc_reads == st.n_proc_reads);
+        assert_se(c->uid == ucred.uid);
+        assert_se(c->gid == ucred.gid);
+        assert_se(!c->comm);
+        assert_se(!c->cgroup);
+
+        /* Only the cgroup, as needed for rate limiting */
+        client_context_load(s, c, CLIENT_CONTEXT_CGROUP);
+        assert_se(c->cgroup);
+        assert_se(!c->comm);
+
+        client_context_load(s, c, _CLIENT_CONTEXT_ALL);
+        assert_se(get_process_comm(0, &comm) >= 0);
+        assert_se(streq_ptr(c->comm, comm));
+        assert_se(c->loaded == _CLIENT_CONTEXT_ALL);
+
+        /* Using the context again reads nothing */
+        st = s->client_context_stats;
+        assert_se(client_context_get(s, ucred.pid, &ucred, NULL, 0, NULL, &c) >= 0);
+        client_context_load(s, c, _CLIENT_CONTEXT_ALL);
+        assert_se(s->client_context_stats.n_hits == st.n_hits + 1);
+        assert_se(s->client_context_stats.n_proc_reads == st.n_proc_reads);
+
+        /* Refreshing only marks the data as out-of-date, but keeps it around */
+        client_context_maybe_refresh(s, c, &ucred, NULL, 0, NULL, now(CLOCK_MONOTONIC) + 2 * USEC_PER_SEC);
+        assert_se(s->client_context_stats.n_refreshes == st.n_refreshes + 1);
+        assert_se(s->client_context_stats.n_proc_reads == st.n_proc_reads);
+        assert_se(streq_ptr(c->comm, comm));
+        assert_se(c->loaded == CLIENT_CONTEXT_CREDENTIALS);
+
+        client_context_load(s, c, _CLIENT_CONTEXT_ALL);
+        assert_se(s->client_context_stats.n_proc_reads > st.n_proc_reads);
+}
+
+static pid_t fork_into(const char *path) {
+        pid_t pid;
+
+        pid = fork();
+        assert_se(pid >= 0);
+        if (pid == 0) {
+                pause();
+                _exit(EXIT_SUCCESS);
+        }
+
+        assert_se(cg_attach(SYSTEMD_CGROUP_CONTROLLER, path, pid) >= 0);
+        return pid;
+}
+
+static void kill_and_wait(pid_t pid) {
+        assert_se(kill(pid, SIGKILL) >= 0);
+        (void) wait_for_terminate(pid, NULL);
+}
+
+static int start_unit(const char *path, sd_id128_t *ret) {
+        char ids[SD_ID128_STRING_MAX];
+        int r;
+
+        /* Does what PID 1 does when starting a unit */
+
+        r = cg_create(SYSTEMD_CGROUP_CONTROLLER, path);
+        if (r < 0)
+                return r;
+
+        assert_se(sd_id128_randomize(ret) >= 0);
+        return cg_set_xattr(SYSTEMD_CGROUP_CONTROLLER, path, "trusted.invocation_id", sd_id128_to_string(*ret, ids), 32, 0);
+}
+
+static void check_invocation_id(Server *s, pid_t pid, sd_id128_t id) {
+        ClientContext *c;
+
+        assert_se(client_context_get(s, pid, NULL, NULL, 0, NULL, &c) >= 0);
+        client_context_load(s, c, CLIENT_CONTEXT_CGROUP);
+        assert_se(c->slice && streq(c->slice, SLICE));
+        assert_se(sd_id128_equal(c->invocation_id, id));
+}
+
+static void test_invocation_id(Server *s, const char *path) {
+        sd_id128_t id;
+        pid_t a, b;
+        uint64_t n;
+        int r;
+
+        r = start_unit(path, &id);
+        if (r < 0) {
+                log_info_errno(r, "Can't set up a unit cgroup, skipping invocation ID test: %m");
+                (void) cg_trim(SYSTEMD_CGROUP_CONTROLLER, path, true);
+                return;
+        }
+
+        n = s->client_context_stats.n_invocation_id_hits;
+
+        /* The second process of the unit uses the cached ID */
+        a = fork_into(path);
+        check_invocation_id(s, a, id);
+        b = fork_into(path);
+        check_invocation_id(s, b, id);
+        assert_se(s->client_context_stats.n_invocation_id_hits == n + 1);
+
+        /* The unit is restarted without its cgroup going away, which only changes the attribute */
+        n = s->client_context_stats.n_invocation_id_invalidations;
+        assert_se(start_unit(path, &id) >= 0);
+        kill_and_wait(a);
+        a = fork_into(path);
+        check_invocation_id(s, a, id);
+        assert_se(s->client_context_stats.n_invocation_id_invalidations == n + 1);
+
+        /* The unit is stopped, and started again in a new cgroup */
+        kill_and_wait(a);
+        kill_and_wait(b);
+        assert_se(cg_trim(SYSTEMD_CGROUP_CONTROLLER, path, true) >= 0);
+        assert_se(start_unit(path, &id) >= 0);
+        a = fork_into(path);
+        check_invocation_id(s, a, id);
+        assert_se(s->client_context_stats.n_invocation_id_invalidations == n + 2);
+
+        kill_and_wait(a);
+}
+
+static void benchmark_refresh(Server *s, pid_t pid, unsigned n) {
+        usec_t start, refresh, load, timestamp;
+        ClientContext *c;
+        uint64_t reads;
+        unsigned i;
+
+        assert_se(client_context_get(s, pid, NULL, NULL, 0, NULL, &c) >= 0);
+
+        /* Refreshing, and reading only what is needed for rate limiting */
+        timestamp = now(CLOCK_MONOTONIC);
+        start = now(CLOCK_MONOTONIC);
+        for (i = 0; i < n; i++) {
+                timestamp += 2 * USEC_PER_SEC;
+                client_context_maybe_refresh(s, c, NULL, NULL, 0, NULL, timestamp);
+                client_context_load(s, c, CLIENT_CONTEXT_CGROUP);
+        }
+        refresh = now(CLOCK_MONOTONIC) - start;
+
+        /* Refreshing, and reading all that is stored */
+        reads = s->client_context_stats.n_proc_reads;
+        start = now(CLOCK_MONOTONIC);
+        for (i = 0; i < n; i++) {
+                timestamp += 2 * USEC_PER_SEC;
+                client_context_maybe_refresh(s, c, NULL, NULL, 0, NULL, timestamp);
+                client_context_load(s, c, _CLIENT_CONTEXT_ALL);
+        }
+        load = now(CLOCK_MONOTONIC) - start;
+
+        log_info("Refreshing %s: %.1fµs for the unit, %.1fµs for all fields with %.1f files read",
+                 c->unit ?: "context", (double) refresh / n, (double) load / n,
+                 (double) (s->client_context_stats.n_proc_reads - reads) / n);
+}
+
+int main(int argc, char *argv[]) {
+        char path[sizeof("/" SLICE "/test-journal-context-.service") + DECIMAL_STR_MAX(pid_t)];
+        Server s = {
+                .client_units_inotify_fd = -1,
+        };
+        const char *root;
+        sd_id128_t id;
+        unsigned n;
+        pid_t pid;
+        bool slow;
+        int r;
+
+        log_set_max_level(LOG_INFO);
+
+        r = getenv_bool("SYSTEMD_SLOW_TESTS");
+        slow = r >= 0 ? r : SYSTEMD_SLOW_TESTS_DEFAULT;
+
+        n = slow ? 100000 : 2000;
+
+        r = cg_get_root_path(&s.cgroup_root);
+        if (r < 0) {
+                log_info_errno(r, "Can't determine the cgroup root, skipping: %m");
+                return EXIT_TEST_SKIP;
+        }
+
+        test_lazy(&s);
+        benchmark_refresh(&s, getpid_cached(), n);
+
+        /* Our own unit, in a slice of its own, below the root of the cgroup tree PID 1 manages */
+        root = streq(s.cgroup_root, "/") ? "" : s.cgroup_root;
+        if (strlen(root) > 0) {
+                log_info("Not running in the root cgroup namespace, skipping invocation ID test.");
+                goto finish;
+        }
+
+        xsprintf(path, "/" SLICE "/test-journal-context-" PID_FMT ".service", getpid_cached());
+
+        test_invocation_id(&s, path);
+
+        if (start_unit(path, &id) >= 0) {
+                pid = fork_into(path);
+                benchmark_refresh(&s, pid, n);
+                kill_and_wait(pid);
+        }
+
+        (void) cg_trim(SYSTEMD_CGROUP_CONTROLLER, path, true);
+        (void) cg_trim(SYSTEMD_CGROUP_CONTROLLER, "/" SLICE, true);
+
+finish:
+        client_context_log_stats(&s);
+        client_context_flush_all(&s);
+        free(s.cgroup_root);
+
+        return 0;
+}
@@ -0,0 +1,335 @@
+/***
+  This file is part of systemd.
+
+  systemd is free software; you can redistribute it and/or modify it
+  under the terms of the GNU Lesser General Public License as published by
+  the Free Software Foundation; either version 2.1 of the License, or
+  (at your option) any later version.
+
+  systemd is distributed in the hope that it will be useful, but
+  WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+  Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public License
+  along with systemd; If not, see <http://www.gnu.org/licenses/>.
+***/
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "sd-journal.h"
+
+#include "alloc-util.h"
+#include "env-util.h"
+#include "io-util.h"
+#include "journal-file.h"
+#include "keyed-hash.h"
+#include "log.h"
+#include "lookup3.h"
+#include "rm-rf.h"
+#include "stdio-util.h"
+#include "string-util.h"
+#include "util.h"
+
+/* This program checks the keyed hash used by journal files, and compares the hash chain lengths and
+ * append and lookup latencies of files using keyed hashes and hash tables sized from the file they
+ * replace, with those of files in the old format. */
+
+static unsigned arg_n_entries;
+
+static void test_keyed_hash(void) {
+        static const uint8_t key[16] = { 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15, 16 };
+        static const char text[] = "MESSAGE=The quick brown fox jumps over the lazy dog, again and again and again";
+        uint64_t h[sizeof(text)];
+        unsigned i, k;
+        usec_t start, a, b;
+        uint64_t x = 0;
+
+        /* The hash is part of the file format, hence make sure it never changes */
+        assert_se(keyed_hash64("", 0, key) == UINT64_C(0x775c5a49d8c62eba));
+        assert_se(keyed_hash64("MESSAGE=foo", 11, key) == UINT64_C(0x8eb7f94ae22d1999));
+        assert_se(keyed_hash64(text, strlen(text), key) == UINT64_C(0x884ded111e3996a1));
+        assert_se(keyed_hash64(text, strlen(text), SD_ID128_NULL.bytes) == UINT64_C(0xb699d2e928368fc9));
+
+        /* Every prefix hashes differently, this covers all the code paths for the various lengths */
+        for (i = 0; i < sizeof(text); i++) {
+                h[i] = keyed_hash64(text, i, key);
+
+                for (k = 0; k < i; k++)
+                        assert_se(h[i] != h[k]);
+
+                assert_se(keyed_hash64(text, i, SD_ID128_NULL.bytes) != h[i]);
+        }
+
+        /* Unaligned input hashes the same */
+        for (i = 1; i < 8; i++) {
+                char buf[sizeof(text) + 8];
+
+                memcpy(buf + i, text, strlen(text));
+                assert_se(keyed_hash64(buf + i, strlen(text), key) == h[strlen(text)]);
+        }
+
+        start = now(CLOCK_MONOTONIC);
+        for (i = 0; i < 1000000; i++)
+                x += hash64(text, i % sizeof(text));
+        a = now(CLOCK_MONOTONIC) - start;
+
+        start = now(CLOCK_MONOTONIC);
+        for (i = 0; i < 1000000; i++)
+                x += keyed_hash64(text, i % sizeof(text), key);
+        b = now(CLOCK_MONOTONIC) - start;
+
+        log_info("Hashing %zu bytes on average took %.1fns with lookup3, %.1fns with the keyed hash (%" PRIx64 ").",
+                 sizeof(text) / 2, a * 1e3 / 1000000, b * 1e3 / 1000000, x);
+}
+
+static void append_entries(JournalFile *f, unsigned n) {
+        unsigned i;
+
+        for (i = 0; i < n; i++) {
+                char message[sizeof("MESSAGE=Request  handled in ms") + 2 * DECIMAL_STR_MAX(unsigned)],
+                     request[sizeof("REQUEST_ID=") + 16],
+                     pid[sizeof("_PID=") + DECIMAL_STR_MAX(unsigned)];
+                struct iovec iovec[5];
+
+                /* Two values unique to each entry, and a few repeating ones */
+                xsprintf(message, "MESSAGE=Request %u handled in %ums", i, i % 1000);
+                xsprintf(request, "REQUEST_ID=%016x", i * 2654435761U);
+                xsprintf(pid, "_PID=%u", i % 30000);
+
+                IOVEC_SET_STRING(iovec[0], message);
+                IOVEC_SET_STRING(iovec[1], request);
+                IOVEC_SET_STRING(iovec[2], pid);
+                IOVEC_SET_STRING(iovec[3], "PRIORITY=6");
+                IOVEC_SET_STRING(iovec[4], "_COMM=test-journal-hash");
+
+                assert_se(journal_file_append_entry(f, NULL, iovec, ELEMENTSOF(iovec), NULL, NULL, NULL) == 0);
+        }
+}
+
+static double average_chain_length(JournalFile *f, uint64_t *ret_max) {
+        uint64_t i, n_buckets, n = 0, sum = 0, max = 0;
+
+        /* Returns how many objects a successful lookup has to look at on average */
+
+        assert_se(journal_file_map_data_hash_table(f) >= 0);
+        n_buckets = le64toh(f->header->data_hash_table_size) / sizeof(HashItem);
+
+        for (i = 0; i < n_buckets; i++) {
+                uint64_t p, depth = 0;
+
+                p = le64toh(f->data_hash_table[i].head_hash_offset);
+                while (p > 0) {
+                        Object *o;
+
+                        assert_se(journal_file_move_to_object(f, OBJECT_DATA, p, &o) >= 0);
+                        assert_se(le64toh(o->data.hash) % n_buckets == i);
+
+                        depth++;
+                        sum += depth;
+                        n++;
+
+                        p = le64toh(o->data.next_hash_offset);
+                }
+
+                max = MAX(max, depth);
+        }
+
+        assert_se(n == le64toh(f->header->n_data));
+
+        *ret_max = max;
+        return (double) sum / n;
+}
+
+static void run(const char *directory, const char *label, bool keyed, bool with_template) {
+        _cleanup_free_ char *path = NULL, *template_path = NULL;
+        JournalFile *f, *template = NULL;
+        JournalMetrics metrics;
+        usec_t start, append, lookup;
+        uint64_t max_chain;
+        double chain;
+        unsigned i;
+
+        assert_se(setenv("SYSTEMD_JOURNAL_KEYED_HASH", one_zero(keyed), 1) >= 0);
+
+        /* Leave enough room for all entries, but no more: each one takes about 600 bytes */
+        journal_reset_metrics(&metrics);
+        metrics.max_size = MAX(arg_n_entries * 600ULL, 8ULL * 1024ULL * 1024ULL);
+
+        if (with_template) {
+                /* Pretend we are rotating a file that saw the same kind of entries */
+                assert_se(template_path = strjoin(directory, "/template-", label, ".journal"));
+                assert_se(journal_file_open(-1, template_path, O_RDWR|O_CREAT, 0644, false, false, &metrics, NULL, NULL, NULL, &template) == 0);
+                append_entries(template, arg_n_entries / 20);
+        }
+
+        assert_se(path = strjoin(directory, "/", label, ".journal"));
+        assert_se(journal_file_open(-1, path, O_RDWR|O_CREAT, 0644, false, false, &metrics, NULL, NULL, template, &f) == 0);
+        assert_se(f->keyed_hash == keyed);
+
+        if (template)
+                (void) journal_file_close(template);
+
+        start = now(CLOCK_MONOTONIC);
+        append_entries(f, arg_n_entries);
+        append = now(CLOCK_MONOTONIC) - start;
+
+        start = now(CLOCK_MONOTONIC);
+        for (i = 0; i < arg_n_entries; i += 7) {
+                char request[sizeof("REQUEST_ID=") + 16];
+
+                xsprintf(request, "REQUEST_ID=%016x", i * 2654435761U);
+                assert_se(journal_file_find_data_object(f, request, strlen(request), NULL, NULL) == 1);
+        }
+        lookup = now(CLOCK_MONOTONIC) - start;
+
+        chain = average_chain_length(f, &max_chain);
+
+        log_info("%-15s %u entries, %" PRIu64 " data objects in %" PRIu64 " buckets: "
+                 "average chain length %.2f (max %" PRIu64 "), %.2fµs per entry, %.0fns per lookup",
+                 label, arg_n_entries, le64toh(f->header->n_data),
+                 le64toh(f->header->data_hash_table_size) / sizeof(HashItem),
+                 chain, max_chain, (double) append / arg_n_entries, lookup * 1e3 / DIV_ROUND_UP(arg_n_entries, 7));
+
+        /* Sized from the file it replaces, the hash table must not fill up */
+        if (with_template)
+                assert_se(le64toh(f->header->n_data) * 4 <= le64toh(f->header->data_hash_table_size) / sizeof(HashItem) * 3);
+
+        (void) journal_file_close(f);
+}
+
+static void test_mixed(const char *directory) {
+        const char *fields[] = { "UNIT=foo.service", "UNIT=bar.service", "UNIT=baz.service" };
+        _cleanup_free_ char *path = NULL;
+        unsigned i, n = 0;
+        const char *field;
+        const void *d;
+        size_t l;
+        sd_journal *j;
+
+        /* Files with and without keyed hashes may be read together */
+        for (i = 0; i < 2; i++) {
+                JournalFile *f;
+                struct iovec iovec;
+
+                assert_se(setenv("SYSTEMD_JOURNAL_KEYED_HASH", one_zero(i), 1) >= 0);
+
+                path = mfree(path);
+                assert_se(path = strjoin(directory, i ? "/keyed.journal" : "/lookup3.journal"));
+                assert_se(journal_file_open(-1, path, O_RDWR|O_CREAT, 0644, false, false, NULL, NULL, NULL, NULL, &f) == 0);
+                assert_se(f->keyed_hash == i);
+
+                IOVEC_SET_STRING(iovec, fields[0]);
+                assert_se(journal_file_append_entry(f, NULL, &iovec, 1, NULL, NULL, NULL) == 0);
+                IOVEC_SET_STRING(iovec, fields[1 + i]);
+                assert_se(journal_file_append_entry(f, NULL, &iovec, 1, NULL, NULL, NULL) == 0);
+
+                (void) journal_file_close(f);
+        }
+
+        assert_se(sd_journal_open_directory(&j, directory, 0) >= 0);
+
+        assert_se(sd_journal_add_match(j, fields[0], 0) >= 0);
+        SD_JOURNAL_FOREACH(j)
+                n++;
+        assert_se(n == 2);
+
+        /* Every value is returned once, no matter how many files it is in */
+        n = 0;
+        assert_se(sd_journal_query_unique(j, "UNIT") >= 0);
+        SD_JOURNAL_FOREACH_UNIQUE(j, d, l)
+                n++;
+        assert_se(n == 3);
+
+        n = 0;
+        SD_JOURNAL_FOREACH_FIELD(j, field)
+                if (streq(field, "UNIT"))
+                        n++;
+        assert_se(n == 1);
+
+        sd_journal_close(j);
+
+        assert_se(unsetenv("SYSTEMD_JOURNAL_KEYED_HASH") >= 0);
+}
+
+static void test_mixed_duplicates(const char *directory) {
+        const char *fields[] = { "MESSAGE=Duplicated", "PRIORITY=6", "_COMM=test-journal-hash" };
+        struct iovec iovec[ELEMENTSOF(fields)];
+        uint64_t xor_hash[2];
+        dual_timestamp ts;
+        unsigned i, n = 0;
+        sd_journal *j;
+
+        /* The same entry in files with and without keyed hashes is recognized as such, as it is when
+         * journal-remote or a merged view sees it more than once */
+
+        for (i = 0; i < ELEMENTSOF(fields); i++)
+                IOVEC_SET_STRING(iovec[i], fields[i]);
+
+        dual_timestamp_get(&ts);
+
+        for (i = 0; i < 2; i++) {
+                _cleanup_free_ char *path = NULL;
+                JournalFile *f;
+                Object *o;
+
+                assert_se(setenv("SYSTEMD_JOURNAL_KEYED_HASH", one_zero(i), 1) >= 0);
+
+                assert_se(path = strjoin(directory, i ? "/keyed.journal" : "/lookup3.journal"));
+                assert_se(journal_file_open(-1, path, O_RDWR|O_CREAT, 0644, false, false, NULL, NULL, NULL, NULL, &f) == 0);
+                assert_se(f->keyed_hash == i);
+
+                assert_se(journal_file_append_entry(f, &ts, iovec, ELEMENTSOF(iovec), NULL, &o, NULL) == 0);
+                xor_hash[i] = le64toh(o->entry.xor_hash);
+
+                (void) journal_file_close(f);
+        }
+
+        assert_se(xor_hash[0] == xor_hash[1]);
+
+        assert_se(sd_journal_open_directory(&j, directory, 0) >= 0);
+        SD_JOURNAL_FOREACH(j)
+                n++;
+        assert_se(n == 1);
+        sd_journal_close(j);
+
+        assert_se(unsetenv("SYSTEMD_JOURNAL_KEYED_HASH") >= 0);
+}
+
+int main(int argc, char *argv[]) {
+        char t[] = "/tmp/journal-hash-XXXXXX", u[] = "/tmp/journal-hash-XXXXXX", v[] = "/tmp/journal-hash-XXXXXX";
+        bool slow;
+        int r;
+
+        log_set_max_level(LOG_INFO);
+
+        test_keyed_hash();
+
+        /* journal_file_open requires a valid machine id */
+        if (access("/etc/machine-id", F_OK) != 0)
+                return EXIT_TEST_SKIP;
+
+        r = getenv_bool("SYSTEMD_SLOW_TESTS");
+        slow = r >= 0 ? r : SYSTEMD_SLOW_TESTS_DEFAULT;
+
+        arg_n_entries = slow ? 10000000 : 20000;
+
+        assert_se(mkdtemp(u));
+        test_mixed(u);
+        assert_se(rm_rf(u, REMOVE_ROOT|REMOVE_PHYSICAL) >= 0);
+
+        assert_se(mkdtemp(v));
+        test_mixed_duplicates(v);
+        assert_se(rm_rf(v, REMOVE_ROOT|REMOVE_PHYSICAL) >= 0);
+
+        assert_se(mkdtemp(t));
+
+        run(t, "lookup3", false, false);
+        run(t, "keyed", true, false);
+        run(t, "keyed-template", true, true);
+
+        assert_se(rm_rf(t, REMOVE_ROOT|REMOVE_PHYSICAL) >= 0);
+
+        return 0;
+}
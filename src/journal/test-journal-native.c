@@ -0,0 +1,254 @@
+/***
+  This file is part of systemd.
+
+  systemd is free software; you can redistribute it and/or modify it
+  under the terms of the GNU Lesser General Public License as published by
+  the Free Software Foundation; either version 2.1 of the License, or
+  (at your option) any later version.
+
+  systemd is distributed in the hope that it will be useful, but
+  WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+  Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public License
+  along with systemd; If not, see <http://www.gnu.org/licenses/>.
+***/
+
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "sd-event.h"
+
+#include "alloc-util.h"
+#include "env-util.h"
+#include "fd-util.h"
+#include "io-util.h"
+#include "journal-file.h"
+#include "journald-native.h"
+#include "journald-server.h"
+#include "log.h"
+#include "memfd-util.h"
+#include "random-util.h"
+#include "rm-rf.h"
+#include "socket-util.h"
+#include "string-util.h"
+#include "unaligned.h"
+#include "util.h"
+
+/* This program checks that journald parses native protocol messages correctly when passing their fields on
+ * by reference, and measures how fast large structured messages, such as core dumps, are ingested when
+ * passed as a datagram, and when passed in a sealed memfd. */
+
+static char *make_message(const void *data, size_t size, size_t *ret_size) {
+        static const char header[] = "MESSAGE=Process 4711 dumped core.\nPRIORITY=6\nCOREDUMP\n";
+        static const char footer[] = "\nCOREDUMP_SIGNAL=11\n";
+        char *m, *p;
+
+        /* Serializes a message the way sd_journal_sendv() does for a field containing newlines */
+
+        m = malloc(strlen(header) + sizeof(uint64_t) + size + strlen(footer));
+        assert_se(m);
+
+        p = stpcpy(m, header);
+        unaligned_write_le64(p, size);
+        p = mempcpy(p + sizeof(uint64_t), data, size);
+        p = stpcpy(p, footer);
+
+        *ret_size = p - m;
+        return m;
+}
+
+static int make_memfd(const void *message, size_t size) {
+        int fd;
+
+        fd = memfd_new(NULL);
+        assert_se(fd >= 0);
+        assert_se(loop_write(fd, message, size, false) >= 0);
+        assert_se(memfd_set_sealed(fd) >= 0);
+
+        return fd;
+}
+
+static void check_entry(JournalFile *f, uint64_t *p, const void *data, size_t size) {
+        unsigned found = 0;
+        Object *o;
+        uint64_t i, n;
+
+        assert_se(journal_file_next_entry(f, *p, DIRECTION_DOWN, &o, p) == 1);
+
+        n = journal_file_entry_n_items(o);
+        for (i = 0; i < n; i++) {
+                const char *d;
+                uint64_t q;
+                size_t l;
+
+                assert_se(journal_file_move_to_object(f, OBJECT_ENTRY, *p, &o) >= 0);
+                q = le64toh(o->entry.items[i].object_offset);
+
+                /* The file is not compressed, hence the payload may be looked at directly */
+                assert_se(journal_file_move_to_object(f, OBJECT_DATA, q, &o) >= 0);
+                assert_se((o->object.flags & OBJECT_COMPRESSION_MASK) == 0);
+                d = (const char*) o->data.payload;
+                l = le64toh(o->object.size) - offsetof(Object, data.payload);
+
+                if (l == strlen("COREDUMP=") + size && memcmp(d, "COREDUMP=", strlen("COREDUMP=")) == 0) {
+                        assert_se(memcmp(d + strlen("COREDUMP="), data, size) == 0);
+                        found++;
+                } else if (l == strlen("COREDUMP_SIGNAL=11") && memcmp(d, "COREDUMP_SIGNAL=11", l) == 0)
+                        found++;
+                else if (l == strlen("_TRANSPORT=journal") && memcmp(d, "_TRANSPORT=journal", l) == 0)
+                        found++;
+        }
+
+        assert_se(found == 3);
+}
+
+static void test_native(Server *s) {
+        _cleanup_free_ char *data = NULL, *message = NULL;
+        _cleanup_close_ int fd = -1;
+        size_t size = 64 * 1024 + 3, l;
+        uint64_t p = 0;
+        unsigned i;
+
+        /* The data contains newlines and equal signs, and must come out unmodified in both cases */
+        data = malloc(size);
+        assert_se(data);
+        for (i = 0; i < size; i++)
+                data[i] = "a=\n\0"[i % 4];
+
+        message = make_message(data, size, &l);
+
+        server_process_native_message(s, message, l, NULL, NULL, NULL, 0);
+        check_entry(s->runtime_journal, &p, data, size);
+
+        message = mfree(message);
+        message = make_message(data, size, &l);
+        fd = make_memfd(message, l);
+
+        server_process_native_file(s, fd, NULL, NULL, NULL, 0);
+        check_entry(s->runtime_journal, &p, data, size);
+
+        /* The memfd itself is left alone */
+        assert_se(pread(fd, message, l, 0) == (ssize_t) l);
+        assert_se(memcmp(message + strlen("MESSAGE=Process 4711 dumped core.\nPRIORITY=6\n"), "COREDUMP\n", 9) == 0);
+}
+
+static void benchmark_native(Server *s, size_t size, uint64_t total) {
+        _cleanup_free_ char *data = NULL, *message = NULL, *buffer = NULL;
+        _cleanup_close_pair_ int pair[2] = { -1, -1 };
+        usec_t start, client = 0, server = 0;
+        unsigned i, n;
+        size_t l;
+
+        /* journald processes messages one after the other, hence what matters most is how much time it spends
+         * on each message, i.e. receiving the datagram, or mapping and unmapping the memfd, and writing the
+         * message to the journal file. This is shown separately from the time the client spends on sending
+         * the message. */
+
+        data = malloc(size);
+        assert_se(data);
+        random_bytes(data, size);
+        message = make_message(data, size, &l);
+
+        buffer = malloc(l);
+        assert_se(buffer);
+
+        n = MAX(total / size, 4u);
+
+        /* Like sd_journal_sendv() and journald, use large socket buffers, so that the message fits */
+        assert_se(socketpair(AF_UNIX, SOCK_DGRAM|SOCK_CLOEXEC, 0, pair) >= 0);
+        assert_se(fd_inc_sndbuf(pair[0], 16*1024*1024) >= 0);
+        assert_se(fd_inc_rcvbuf(pair[1], 16*1024*1024) >= 0);
+
+        for (i = 0; i < n; i++) {
+                ssize_t k;
+
+                start = now(CLOCK_MONOTONIC);
+                if (send(pair[0], message, l, 0) < 0) {
+                        /* Without privileges we might not be allowed to increase the buffers */
+                        log_info("%8zu KiB: datagram too large (%m)", size / 1024);
+                        break;
+                }
+                client += now(CLOCK_MONOTONIC) - start;
+
+                start = now(CLOCK_MONOTONIC);
+                k = recv(pair[1], buffer, l, 0);
+                assert_se(k == (ssize_t) l);
+
+                server_process_native_message(s, buffer, k, NULL, NULL, NULL, 0);
+                server += now(CLOCK_MONOTONIC) - start;
+        }
+
+        if (i == n)
+                log_info("%8zu KiB datagram: journald %7.1f MiB/s, client %7.1f MiB/s",
+                         size / 1024,
+                         (double) n * size / 1024 / 1024 / ((double) server / USEC_PER_SEC),
+                         (double) n * size / 1024 / 1024 / ((double) client / USEC_PER_SEC));
+
+        client = server = 0;
+        for (i = 0; i < n; i++) {
+                int fd;
+
+                start = now(CLOCK_MONOTONIC);
+                fd = make_memfd(message, l);
+                client += now(CLOCK_MONOTONIC) - start;
+
+                /* The client closes its reference right after sending it, hence journald's is the last */
+                start = now(CLOCK_MONOTONIC);
+                server_process_native_file(s, fd, NULL, NULL, NULL, 0);
+                safe_close(fd);
+                server += now(CLOCK_MONOTONIC) - start;
+        }
+
+        log_info("%8zu KiB memfd:    journald %7.1f MiB/s, client %7.1f MiB/s",
+                 size / 1024,
+                 (double) n * size / 1024 / 1024 / ((double) server / USEC_PER_SEC),
+                 (double) n * size / 1024 / 1024 / ((double) client / USEC_PER_SEC));
+}
+
+int main(int argc, char *argv[]) {
+        char t[] = "/tmp/journal-native-XXXXXX";
+        _cleanup_free_ char *path = NULL;
+        JournalMetrics metrics;
+        Server s = {
+                .storage = STORAGE_VOLATILE,
+                .max_level_store = LOG_DEBUG,
+                .split_mode = SPLIT_NONE,
+        };
+        size_t size;
+        bool slow;
+        int r;
+
+        log_set_max_level(LOG_INFO);
+
+        /* journal_file_open requires a valid machine id */
+        if (access("/etc/machine-id", F_OK) != 0)
+                return EXIT_TEST_SKIP;
+
+        r = getenv_bool("SYSTEMD_SLOW_TESTS");
+        slow = r >= 0 ? r : SYSTEMD_SLOW_TESTS_DEFAULT;
+
+        assert_se(mkdtemp(t));
+        assert_se(path = strappend(t, "/system.journal"));
+
+        journal_reset_metrics(&metrics);
+        metrics.max_size = (slow ? 4096ULL : 512ULL) * 1024ULL * 1024ULL;
+
+        /* Don't measure compression, this is about getting the data into the file */
+        assert_se(sd_event_default(&s.event) >= 0);
+        assert_se(journal_file_open(-1, path, O_RDWR|O_CREAT, 0644, false, false, &metrics, NULL, NULL, NULL, &s.runtime_journal) == 0);
+
+        test_native(&s);
+
+        for (size = 64 * 1024; size <= 8 * 1024 * 1024; size *= 2)
+                benchmark_native(&s, size, slow ? 1024ULL * 1024ULL * 1024ULL : 64ULL * 1024ULL * 1024ULL);
+
+        (void) journal_file_close(s.runtime_journal);
+        sd_event_unref(s.event);
+
+        assert_se(rm_rf(t, REMOVE_ROOT|REMOVE_PHYSICAL) >= 0);
+
+        return 0;
+}
@@ -0,0 +1,255 @@
+/***
+  This file is part of systemd.
+
+  systemd is free software; you can redistribute it and/or modify it
+  under the terms of the GNU Lesser General Public License as published by
+  the Free Software Foundation; either version 2.1 of the License, or
+  (at your option) any later version.
+
+  systemd is distributed in the hope that it will be useful, but
+  WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+  Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public License
+  along with systemd; If not, see <http://www.gnu.org/licenses/>.
+***/
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "sd-journal.h"
+
+#include "alloc-util.h"
+#include "env-util.h"
+#include "fd-util.h"
+#include "io-util.h"
+#include "journal-file.h"
+#include "log.h"
+#include "logs-show.h"
+#include "output-mode.h"
+#include "rm-rf.h"
+#include "set.h"
+#include "stdio-util.h"
+#include "string-util.h"
+#include "util.h"
+
+/* This program checks the JSON and export output of entries with repeated and binary fields, with and without
+ * a selection of fields, and measures how many entries per second are formatted in the json, export and
+ * short modes. */
+
+static void make_test_file(const char *path) {
+        JournalFile *f;
+        unsigned i;
+
+        assert_se(journal_file_open(-1, path, O_RDWR|O_CREAT, 0644, false, false, NULL, NULL, NULL, NULL, &f) == 0);
+
+        for (i = 0; i < 2; i++) {
+                struct iovec iovec[6];
+                dual_timestamp ts;
+
+                dual_timestamp_get(&ts);
+
+                IOVEC_SET_STRING(iovec[0], "MESSAGE=hello \"world\"");
+                IOVEC_SET_STRING(iovec[1], "FOO=1");
+                IOVEC_SET_STRING(iovec[2], "BAR=x");
+                IOVEC_SET_STRING(iovec[3], "FOO=2");
+                IOVEC_SET_STRING(iovec[4], "BIN=a\001b");
+                IOVEC_SET_STRING(iovec[5], "EMPTY=");
+
+                assert_se(journal_file_append_entry(f, &ts, iovec, ELEMENTSOF(iovec), NULL, NULL, NULL) == 0);
+        }
+
+        (void) journal_file_close(f);
+}
+
+static char *format_entries(const char *path, OutputMode mode, Set *output_fields, size_t *ret_size) {
+        const char *paths[] = { path, NULL };
+        char *buf = NULL;
+        size_t size = 0;
+        sd_journal *j;
+        FILE *f;
+
+        assert_se(f = open_memstream(&buf, &size));
+        assert_se(sd_journal_open_files(&j, paths, 0) >= 0);
+
+        SD_JOURNAL_FOREACH(j)
+                assert_se(output_journal(f, j, mode, 0, 0, output_fields, NULL) >= 0);
+
+        sd_journal_close(j);
+        assert_se(fclose(f) == 0);
+
+        *ret_size = size;
+        return buf;
+}
+
+static void check_json(const char *path, Set *output_fields, const char *expected) {
+        _cleanup_free_ char *buf = NULL;
+        const char *p;
+        unsigned n = 0;
+        size_t size;
+
+        buf = format_entries(path, OUTPUT_JSON, output_fields, &size);
+
+        /* The fields follow the header, which ends with the boot ID */
+        for (p = buf; (p = strstr(p, "\"_BOOT_ID\" : \"")); n++) {
+                p += strlen("\"_BOOT_ID\" : \"") + 32 + 1;
+                assert_se(startswith(p, expected));
+        }
+
+        assert_se(n == 2);
+}
+
+static void test_json(const char *path) {
+        _cleanup_set_free_ Set *fields = NULL;
+
+        /* Repeated fields are printed once, with all values, in the position of the first one */
+        check_json(path, NULL, ", \"MESSAGE\" : \"hello \\\"world\\\"\", \"FOO\" : [ \"1\", \"2\" ], \"BAR\" : \"x\", \"BIN\" : [ 97, 1, 98 ], \"EMPTY\" : \"\" }\n");
+
+        assert_se(fields = set_new(&string_hash_ops));
+        assert_se(set_put(fields, "FOO") >= 0);
+        assert_se(set_put(fields, "BIN") >= 0);
+        assert_se(set_put(fields, "NOT_THERE") >= 0);
+
+        check_json(path, fields, ", \"FOO\" : [ \"1\", \"2\" ], \"BIN\" : [ 97, 1, 98 ] }\n");
+}
+
+static void test_export(const char *path) {
+        static const char expected[] =
+                "MESSAGE=hello \"world\"\n"
+                "FOO=1\n"
+                "BAR=x\n"
+                "FOO=2\n"
+                "BIN\n\003\0\0\0\0\0\0\0a\001b\n"
+                "EMPTY=\n"
+                "\n";
+        static const char expected_bin[] = "BIN\n\003\0\0\0\0\0\0\0a\001b\n\n";
+        _cleanup_set_free_ Set *fields = NULL;
+        _cleanup_free_ char *buf = NULL;
+        const char *p;
+        size_t size;
+
+        /* Binary fields are prefixed by their size, everything else is printed as is */
+        buf = format_entries(path, OUTPUT_EXPORT, NULL, &size);
+        assert_se(p = strstr(buf, "_BOOT_ID="));
+        p += strlen("_BOOT_ID=") + 32 + 1;
+        assert_se(p + sizeof(expected) - 1 <= buf + size);
+        assert_se(memcmp(p, expected, sizeof(expected) - 1) == 0);
+
+        buf = mfree(buf);
+
+        assert_se(fields = set_new(&string_hash_ops));
+        assert_se(set_put(fields, "BIN") >= 0);
+
+        buf = format_entries(path, OUTPUT_EXPORT, fields, &size);
+        assert_se(p = strstr(buf, "_BOOT_ID="));
+        p += strlen("_BOOT_ID=") + 32 + 1;
+        assert_se(p + sizeof(expected_bin) - 1 <= buf + size);
+        assert_se(memcmp(p, expected_bin, sizeof(expected_bin) - 1) == 0);
+}
+
+static void make_benchmark_file(const char *path, unsigned n) {
+        JournalMetrics metrics;
+        JournalFile *f;
+        unsigned i;
+
+        journal_reset_metrics(&metrics);
+        metrics.max_size = MAX(n * 1024ULL, 8ULL * 1024ULL * 1024ULL);
+
+        assert_se(journal_file_open(-1, path, O_RDWR|O_CREAT, 0644, false, false, &metrics, NULL, NULL, NULL, &f) == 0);
+
+        /* About the fields journald adds to a message from a service */
+        for (i = 0; i < n; i++) {
+                char message[sizeof("MESSAGE=Request  handled in  ms, status \"OK\"") + 2 * DECIMAL_STR_MAX(unsigned)],
+                     pid[sizeof("_PID=") + DECIMAL_STR_MAX(unsigned)],
+                     realtime[sizeof("_SOURCE_REALTIME_TIMESTAMP=") + DECIMAL_STR_MAX(usec_t)];
+                struct iovec iovec[12];
+                dual_timestamp ts;
+                unsigned k = 0;
+
+                ts.realtime = 1500000000ULL * USEC_PER_SEC + i * 1000ULL;
+                ts.monotonic = i * 1000ULL + 1;
+
+                xsprintf(message, "MESSAGE=Request %u handled in %u ms, status \"OK\"", i, i % 97);
+                xsprintf(pid, "_PID=%u", 100 + i % 10);
+                xsprintf(realtime, "_SOURCE_REALTIME_TIMESTAMP="USEC_FMT, ts.realtime - 5);
+
+                IOVEC_SET_STRING(iovec[k++], message);
+                IOVEC_SET_STRING(iovec[k++], "PRIORITY=6");
+                IOVEC_SET_STRING(iovec[k++], "SYSLOG_FACILITY=3");
+                IOVEC_SET_STRING(iovec[k++], "SYSLOG_IDENTIFIER=test-service");
+                IOVEC_SET_STRING(iovec[k++], "_TRANSPORT=stdout");
+                IOVEC_SET_STRING(iovec[k++], pid);
+                IOVEC_SET_STRING(iovec[k++], "_UID=0");
+                IOVEC_SET_STRING(iovec[k++], "_COMM=test-service");
+                IOVEC_SET_STRING(iovec[k++], "_SYSTEMD_UNIT=test-service.service");
+                IOVEC_SET_STRING(iovec[k++], "_SYSTEMD_CGROUP=/system.slice/test-service.service");
+                IOVEC_SET_STRING(iovec[k++], "_HOSTNAME=localhost");
+                IOVEC_SET_STRING(iovec[k++], realtime);
+
+                assert_se(journal_file_append_entry(f, &ts, iovec, k, NULL, NULL, NULL) == 0);
+        }
+
+        (void) journal_file_close(f);
+}
+
+static void benchmark_output(const char *path, OutputMode mode, unsigned n) {
+        const char *paths[] = { path, NULL };
+        _cleanup_fclose_ FILE *f = NULL;
+        usec_t start, end;
+        unsigned k = 0;
+        sd_journal *j;
+
+        assert_se(f = fopen("/dev/null", "we"));
+        assert_se(sd_journal_open_files(&j, paths, 0) >= 0);
+
+        start = now(CLOCK_MONOTONIC);
+        SD_JOURNAL_FOREACH(j) {
+                assert_se(output_journal(f, j, mode, 80, OUTPUT_FULL_WIDTH, NULL, NULL) >= 0);
+                k++;
+        }
+        assert_se(fflush(f) == 0);
+        end = now(CLOCK_MONOTONIC);
+
+        assert_se(k == n);
+
+        log_info("%-6s %8.0f entries/s", output_mode_to_string(mode), (double) n * USEC_PER_SEC / (end - start));
+
+        sd_journal_close(j);
+}
+
+int main(int argc, char *argv[]) {
+        char t[] = "/tmp/journal-output-XXXXXX";
+        _cleanup_free_ char *path = NULL, *benchmark_path = NULL;
+        unsigned n;
+        bool slow;
+        int r;
+
+        log_set_max_level(LOG_INFO);
+
+        /* journal_file_open requires a valid machine id */
+        if (access("/etc/machine-id", F_OK) != 0)
+                return EXIT_TEST_SKIP;
+
+        r = getenv_bool("SYSTEMD_SLOW_TESTS");
+        slow = r >= 0 ? r : SYSTEMD_SLOW_TESTS_DEFAULT;
+
+        n = slow ? 1000000 : 50000;
+
+        assert_se(mkdtemp(t));
+        assert_se(path = strappend(t, "/test.journal"));
+        assert_se(benchmark_path = strappend(t, "/benchmark.journal"));
+
+        make_test_file(path);
+        test_json(path);
+        test_export(path);
+
+        make_benchmark_file(benchmark_path, n);
+        benchmark_output(benchmark_path, OUTPUT_JSON, n);
+        benchmark_output(benchmark_path, OUTPUT_EXPORT, n);
+        benchmark_output(benchmark_path, OUTPUT_SHORT, n);
+
+        assert_se(rm_rf(t, REMOVE_ROOT|REMOVE_PHYSICAL) >= 0);
+
+        return 0;
+}
@@ -0,0 +1,210 @@
+/***
+  This file is part of systemd.
+
+  systemd is free software; you can redistribute it and/or modify it
+  under the terms of the GNU Lesser General Public License as published by
+  the Free Software Foundation; either version 2.1 of the License, or
+  (at your option) any later version.
+
+  systemd is distributed in the hope that it will be useful, but
+  WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+  Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public License
+  along with systemd; If not, see <http://www.gnu.org/licenses/>.
+***/
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "sd-journal.h"
+
+#include "alloc-util.h"
+#include "env-util.h"
+#include "io-util.h"
+#include "journal-file.h"
+#include "journal-internal.h"
+#include "log.h"
+#include "parse-util.h"
+#include "rm-rf.h"
+#include "stdio-util.h"
+#include "string-util.h"
+#include "util.h"
+
+/* This program checks that positioning journal files in parallel yields the same results as doing so
+ * serially, and measures how long seeking and iterating through a multi-file journal takes with a varying
+ * number of threads. */
+
+#define N_UNITS 8
+
+static unsigned arg_n_files, arg_n_entries;
+
+static void make_journal(const char *directory) {
+        uint64_t seqnum = 0;
+        unsigned i, k;
+
+        for (i = 0; i < arg_n_files; i++) {
+                char fn[sizeof("/system@.journal") + DECIMAL_STR_MAX(unsigned)];
+                _cleanup_free_ char *path = NULL;
+                JournalFile *f;
+
+                xsprintf(fn, "/system@%u.journal", i);
+                assert_se(path = strappend(directory, fn));
+
+                assert_se(journal_file_open(-1, path, O_RDWR|O_CREAT, 0644, false, false, NULL, NULL, NULL, NULL, &f) == 0);
+
+                for (k = 0; k < arg_n_entries; k++) {
+                        char number[sizeof("NUMBER=") + DECIMAL_STR_MAX(unsigned)],
+                             unit[sizeof("UNIT=unit-.service") + DECIMAL_STR_MAX(unsigned)];
+                        struct iovec iovec[3];
+                        dual_timestamp ts;
+
+                        /* The files are written one after the other, as if they had been rotated */
+                        ts.realtime = 1000000 + i * arg_n_entries + k;
+                        ts.monotonic = ts.realtime;
+
+                        xsprintf(number, "NUMBER=%u", i * arg_n_entries + k);
+                        xsprintf(unit, "UNIT=unit-%u.service", k % N_UNITS);
+
+                        IOVEC_SET_STRING(iovec[0], number);
+                        IOVEC_SET_STRING(iovec[1], unit);
+                        IOVEC_SET_STRING(iovec[2], "MESSAGE=Lorem ipsum dolor sit amet");
+
+                        assert_se(journal_file_append_entry(f, &ts, iovec, ELEMENTSOF(iovec), &seqnum, NULL, NULL) == 0);
+                }
+
+                (void) journal_file_close(f);
+        }
+}
+
+static unsigned iterate(sd_journal *j, uint64_t since, unsigned **ret_numbers) {
+        _cleanup_free_ unsigned *numbers = NULL;
+        size_t allocated = 0;
+        unsigned n = 0;
+        int r;
+
+        sd_journal_flush_matches(j);
+        assert_se(sd_journal_add_match(j, "UNIT=unit-3.service", 0) >= 0);
+        assert_se(sd_journal_add_disjunction(j) >= 0);
+        assert_se(sd_journal_add_match(j, "UNIT=unit-5.service", 0) >= 0);
+
+        if (since > 0)
+                assert_se(sd_journal_seek_realtime_usec(j, since) >= 0);
+        else
+                assert_se(sd_journal_seek_head(j) >= 0);
+
+        while ((r = sd_journal_next(j)) > 0) {
+                char k[DECIMAL_STR_MAX(unsigned)];
+                const void *d;
+                size_t l;
+
+                if (!ret_numbers) {
+                        n++;
+                        continue;
+                }
+
+                assert_se(sd_journal_get_data(j, "NUMBER", &d, &l) >= 0);
+                assert_se(l > strlen("NUMBER=") && l - strlen("NUMBER=") < sizeof(k));
+                *((char*) mempcpy(k, (const char*) d + strlen("NUMBER="), l - strlen("NUMBER="))) = 0;
+
+                assert_se(GREEDY_REALLOC(numbers, allocated, n + 1));
+                assert_se(safe_atou(k, &numbers[n++]) >= 0);
+        }
+        assert_se(r == 0);
+
+        if (ret_numbers) {
+                *ret_numbers = numbers;
+                numbers = NULL;
+        }
+
+        return n;
+}
+
+static void test_parallel_matches_serial(const char *directory) {
+        _cleanup_free_ unsigned *serial = NULL, *parallel = NULL;
+        sd_journal *j;
+        uint64_t since;
+        unsigned n, m, i;
+
+        since = 1000000 + arg_n_files * arg_n_entries / 3;
+
+        assert_se(sd_journal_open_directory(&j, directory, 0) >= 0);
+        n = iterate(j, 0, &serial);
+        sd_journal_close(j);
+
+        assert_se(n == arg_n_files * arg_n_entries * 2 / N_UNITS);
+        for (i = 1; i < n; i++)
+                assert_se(serial[i] > serial[i-1]);
+
+        assert_se(sd_journal_open_directory(&j, directory, SD_JOURNAL_PARALLEL) >= 0);
+        m = iterate(j, 0, &parallel);
+        assert_se(m == n);
+        assert_se(memcmp(serial, parallel, n * sizeof(unsigned)) == 0);
+
+        serial = mfree(serial);
+        parallel = mfree(parallel);
+
+        /* Seek into the middle, reusing the same journal object, so that files are positioned again */
+        m = iterate(j, since, &parallel);
+        sd_journal_close(j);
+
+        assert_se(sd_journal_open_directory(&j, directory, 0) >= 0);
+        n = iterate(j, since, &serial);
+        sd_journal_close(j);
+
+        assert_se(n > 0);
+        assert_se(m == n);
+        assert_se(memcmp(serial, parallel, n * sizeof(unsigned)) == 0);
+}
+
+static void benchmark_threads(const char *directory, unsigned n_threads) {
+        usec_t start, end;
+        sd_journal *j;
+        unsigned n;
+
+        assert_se(sd_journal_open_directory(&j, directory, n_threads > 0 ? SD_JOURNAL_PARALLEL : 0) >= 0);
+        j->n_threads_max = n_threads;
+
+        start = now(CLOCK_MONOTONIC);
+        n = iterate(j, 1000000 + arg_n_files * arg_n_entries / 2, NULL);
+        end = now(CLOCK_MONOTONIC);
+
+        sd_journal_close(j);
+
+        log_info("%-8s %2u threads: %u matching entries in %u files in %.3fs (%.0f entries/s)",
+                 n_threads > 0 ? "parallel" : "serial", MAX(n_threads, 1u),
+                 n, arg_n_files, (end - start) / 1e6, n * 1e6 / (end - start));
+}
+
+int main(int argc, char *argv[]) {
+        char t[] = "/tmp/journal-parallel-XXXXXX";
+        unsigned n_threads;
+        bool slow;
+        int r;
+
+        log_set_max_level(LOG_INFO);
+
+        /* journal_file_open requires a valid machine id */
+        if (access("/etc/machine-id", F_OK) != 0)
+                return EXIT_TEST_SKIP;
+
+        r = getenv_bool("SYSTEMD_SLOW_TESTS");
+        slow = r >= 0 ? r : SYSTEMD_SLOW_TESTS_DEFAULT;
+
+        arg_n_files = slow ? 128 : 16;
+        arg_n_entries = slow ? 8192 : 512;
+
+        assert_se(mkdtemp(t));
+        make_journal(t);
+
+        test_parallel_matches_serial(t);
+
+        benchmark_threads(t, 0);
+        for (n_threads = 1; n_threads <= 16; n_threads *= 2)
+                benchmark_threads(t, n_threads);
+
+        assert_se(rm_rf(t, REMOVE_ROOT|REMOVE_PHYSICAL) >= 0);
+
+        return 0;
+}
@@ -0,0 +1,160 @@
+/***
+  This file is part of systemd.
+
+  systemd is free software; you can redistribute it and/or modify it
+  under the terms of the GNU Lesser General Public License as published by
+  the Free Software Foundation; either version 2.1 of the License, or
+  (at your option) any later version.
+
+  systemd is distributed in the hope that it will be useful, but
+  WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+  Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public License
+  along with systemd; If not, see <http://www.gnu.org/licenses/>.
+***/
+
+#include <syslog.h>
+
+#include "alloc-util.h"
+#include "env-util.h"
+#include "journald-rate-limit.h"
+#include "log.h"
+#include "stdio-util.h"
+#include "strv.h"
+#include "util.h"
+
+/* This program checks the rate limiting journald applies to units and slices, and measures how long
+ * journal_rate_limit_test() takes with many units logging. */
+
+#define INTERVAL (30 * USEC_PER_SEC)
+#define BURST 10U
+
+static void test_burst(void) {
+        JournalRateLimit *r;
+        usec_t ts = USEC_PER_SEC;
+        unsigned i;
+
+        assert_se(r = journal_rate_limit_new(INTERVAL, BURST, 0));
+
+        /* The burst may be logged right-away, but no more */
+        for (i = 0; i < BURST; i++)
+                assert_se(journal_rate_limit_test(r, "foo.service", NULL, LOG_INFO, 0, ts, NULL) == 1);
+        assert_se(journal_rate_limit_test(r, "foo.service", NULL, LOG_INFO, 0, ts, NULL) == 0);
+
+        /* Other units and priorities have their own limits */
+        assert_se(journal_rate_limit_test(r, "bar.service", NULL, LOG_INFO, 0, ts, NULL) == 1);
+        assert_se(journal_rate_limit_test(r, "foo.service", NULL, LOG_ERR, 0, ts, NULL) == 1);
+
+        /* One more message after a tenth of the interval, but the dropped one isn't reported yet */
+        ts += INTERVAL / BURST - 1;
+        assert_se(journal_rate_limit_test(r, "foo.service", NULL, LOG_INFO, 0, ts, NULL) == 0);
+        ts += 1;
+        assert_se(journal_rate_limit_test(r, "foo.service", NULL, LOG_INFO, 0, ts, NULL) == 1);
+        assert_se(journal_rate_limit_test(r, "foo.service", NULL, LOG_INFO, 0, ts, NULL) == 0);
+
+        /* After the interval, the full burst is available again, and all dropped messages are reported */
+        ts += INTERVAL;
+        assert_se(journal_rate_limit_test(r, "foo.service", NULL, LOG_INFO, 0, ts, NULL) == 1 + 3);
+        for (i = 1; i < BURST; i++)
+                assert_se(journal_rate_limit_test(r, "foo.service", NULL, LOG_INFO, 0, ts, NULL) == 1);
+        assert_se(journal_rate_limit_test(r, "foo.service", NULL, LOG_INFO, 0, ts, NULL) == 0);
+
+        /* More disk space, larger bursts */
+        assert_se(journal_rate_limit_test(r, "baz.service", NULL, LOG_INFO, UINT64_C(1) << 32, ts, NULL) == 1);
+        for (i = 1; i < BURST * 4; i++)
+                assert_se(journal_rate_limit_test(r, "baz.service", NULL, LOG_INFO, UINT64_C(1) << 32, ts, NULL) == 1);
+        assert_se(journal_rate_limit_test(r, "baz.service", NULL, LOG_INFO, UINT64_C(1) << 32, ts, NULL) == 0);
+
+        journal_rate_limit_free(r);
+}
+
+static void test_slice(void) {
+        JournalRateLimit *r;
+        usec_t ts = USEC_PER_SEC;
+        unsigned i, n;
+
+        assert_se(r = journal_rate_limit_new(INTERVAL, BURST, BURST * 3 / 2));
+
+        /* Two units of the same slice share its limit, even though each stays within its own */
+        for (i = 0; i < BURST; i++)
+                assert_se(journal_rate_limit_test(r, "a.service", "noisy.slice", LOG_INFO, 0, ts, NULL) == 1);
+        for (i = 0; i < BURST / 2; i++)
+                assert_se(journal_rate_limit_test(r, "b.service", "noisy.slice", LOG_INFO, 0, ts, NULL) == 1);
+        assert_se(journal_rate_limit_test(r, "b.service", "noisy.slice", LOG_INFO, 0, ts, NULL) == 0);
+
+        /* Other slices are not affected */
+        assert_se(journal_rate_limit_test(r, "c.service", "quiet.slice", LOG_INFO, 0, ts, NULL) == 1);
+
+        /* The messages dropped because of the slice are reported for the slice, not the unit */
+        ts += INTERVAL + 1;
+        assert_se(journal_rate_limit_test(r, "b.service", "noisy.slice", LOG_INFO, 0, ts, &n) == 1);
+        assert_se(n == 1);
+        assert_se(journal_rate_limit_test(r, "a.service", "noisy.slice", LOG_INFO, 0, ts, &n) == 1);
+        assert_se(n == 0);
+
+        /* Units and slices of the same name don't share their limit */
+        for (i = 0; i < BURST; i++)
+                assert_se(journal_rate_limit_test(r, "same", "same", LOG_INFO, 0, ts, NULL) == 1);
+        assert_se(journal_rate_limit_test(r, "same", "same", LOG_INFO, 0, ts, NULL) == 0);
+
+        journal_rate_limit_free(r);
+}
+
+static void benchmark(unsigned n_units, unsigned n) {
+        char **ids;
+        JournalRateLimit *r;
+        usec_t ts, start, end;
+        unsigned i, permitted = 0;
+
+        /* Many units each log a message now and then, well below their limits. All messages are permitted, and
+         * most of the time is spent on finding the unit's group. */
+
+        assert_se(ids = new0(char*, n_units + 1));
+        for (i = 0; i < n_units; i++)
+                assert_se(asprintf(&ids[i], "test-journal-rate-limit-%u.service", i) >= 0);
+
+        assert_se(r = journal_rate_limit_new(INTERVAL, 1000000, 0));
+
+        ts = now(CLOCK_MONOTONIC);
+        start = now(CLOCK_MONOTONIC);
+        for (i = 0; i < n; i++) {
+                /* Spread the messages over twice the interval */
+                ts += 2 * INTERVAL / n;
+
+                if (journal_rate_limit_test(r, ids[(i * 7919U) % n_units], NULL, LOG_INFO, 0, ts, NULL) > 0)
+                        permitted++;
+        }
+        end = now(CLOCK_MONOTONIC);
+
+        assert_se(permitted == n);
+
+        log_info("%6u units: %.0fns per message", n_units, (double) (end - start) * 1000 / n);
+
+        journal_rate_limit_free(r);
+        strv_free(ids);
+}
+
+int main(int argc, char *argv[]) {
+        unsigned n;
+        bool slow;
+        int r;
+
+        log_set_max_level(LOG_INFO);
+
+        test_burst();
+        test_slice();
+
+        r = getenv_bool("SYSTEMD_SLOW_TESTS");
+        slow = r >= 0 ? r : SYSTEMD_SLOW_TESTS_DEFAULT;
+
+        n = slow ? 10000000 : 500000;
+
+        benchmark(100, n);
+        benchmark(2000, n);
+        benchmark(10000, n);
+        benchmark(50000, n);
+
+        return 0;
+}
@@ -0,0 +1,246 @@
+/***
+  This file is part of systemd.
+
+  systemd is free software; you can redistribute it and/or modify it
+  under the terms of the GNU Lesser General Public License as published by
+  the Free Software Foundation; either version 2.1 of the License, or
+  (at your option) any later version.
+
+  systemd is distributed in the hope that it will be useful, but
+  WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+  Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public License
+  along with systemd; If not, see <http://www.gnu.org/licenses/>.
+***/
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "sd-journal.h"
+
+#include "alloc-util.h"
+#include "env-util.h"
+#include "io-util.h"
+#include "journal-file.h"
+#include "log.h"
+#include "random-util.h"
+#include "rm-rf.h"
+#include "stdio-util.h"
+#include "string-util.h"
+#include "strv.h"
+#include "util.h"
+
+/* This program checks seeking in files with many entry arrays, and measures how long seeking by
+ * realtime (as done for --since), by seqnum, by realtime for one field value, and by cursor takes. */
+
+#define N_VALUES 100U
+#define N_SEEKS 10000U
+#define REALTIME_BASE (1500000000ULL * USEC_PER_SEC)
+
+static unsigned arg_n_entries;
+
+static usec_t entry_realtime(unsigned i) {
+        return REALTIME_BASE + i * 1000ULL;
+}
+
+static void make_file(const char *path) {
+        JournalMetrics metrics;
+        JournalFile *f;
+        unsigned i;
+
+        /* Size the hash tables for the number of entries: each one takes about 300 bytes */
+        journal_reset_metrics(&metrics);
+        metrics.max_size = MAX(arg_n_entries * 300ULL, 8ULL * 1024ULL * 1024ULL);
+
+        assert_se(journal_file_open(-1, path, O_RDWR|O_CREAT, 0644, false, false, &metrics, NULL, NULL, NULL, &f) == 0);
+
+        for (i = 0; i < arg_n_entries; i++) {
+                char message[sizeof("MESSAGE=Entry ") + DECIMAL_STR_MAX(unsigned)],
+                     value[sizeof("VALUE=") + DECIMAL_STR_MAX(unsigned)];
+                struct iovec iovec[2];
+                dual_timestamp ts;
+
+                ts.realtime = entry_realtime(i);
+                ts.monotonic = i * 1000ULL + 1;
+
+                xsprintf(message, "MESSAGE=Entry %u", i);
+                xsprintf(value, "VALUE=%u", i % N_VALUES);
+
+                IOVEC_SET_STRING(iovec[0], message);
+                IOVEC_SET_STRING(iovec[1], value);
+
+                assert_se(journal_file_append_entry(f, &ts, iovec, ELEMENTSOF(iovec), NULL, NULL, NULL) == 0);
+        }
+
+        log_info("%u entries in %" PRIu64 " entry arrays",
+                 arg_n_entries, le64toh(f->header->n_entry_arrays));
+
+        (void) journal_file_close(f);
+}
+
+static void test_seek_realtime(JournalFile *f) {
+        usec_t start, first = 0, end;
+        unsigned k;
+
+        start = now(CLOCK_MONOTONIC);
+        for (k = 0; k < N_SEEKS; k++) {
+                unsigned i = random_u64() % arg_n_entries;
+                Object *o;
+
+                /* An exact match is found in both directions */
+                assert_se(journal_file_move_to_entry_by_realtime(f, entry_realtime(i), DIRECTION_DOWN, &o, NULL) == 1);
+                assert_se(le64toh(o->entry.realtime) == entry_realtime(i));
+                assert_se(journal_file_move_to_entry_by_realtime(f, entry_realtime(i), DIRECTION_UP, &o, NULL) == 1);
+                assert_se(le64toh(o->entry.realtime) == entry_realtime(i));
+
+                /* Between two entries, the next or the previous one is found */
+                if (i + 1 < arg_n_entries) {
+                        assert_se(journal_file_move_to_entry_by_realtime(f, entry_realtime(i) + 1, DIRECTION_DOWN, &o, NULL) == 1);
+                        assert_se(le64toh(o->entry.realtime) == entry_realtime(i + 1));
+                } else
+                        assert_se(journal_file_move_to_entry_by_realtime(f, entry_realtime(i) + 1, DIRECTION_DOWN, &o, NULL) == 0);
+
+                assert_se(journal_file_move_to_entry_by_realtime(f, entry_realtime(i) + 1, DIRECTION_UP, &o, NULL) == 1);
+                assert_se(le64toh(o->entry.realtime) == entry_realtime(i));
+
+                if (k == 0)
+                        first = now(CLOCK_MONOTONIC);
+        }
+        end = now(CLOCK_MONOTONIC);
+
+        log_info("realtime:           first seek %6.1fµs, then %6.2fµs per seek",
+                 (double) (first - start) / 4, (double) (end - first) / (N_SEEKS - 1) / 4);
+
+        assert_se(journal_file_move_to_entry_by_realtime(f, entry_realtime(0) - 1, DIRECTION_UP, NULL, NULL) == 0);
+}
+
+static void test_seek_seqnum(JournalFile *f) {
+        usec_t start, end;
+        unsigned k;
+
+        start = now(CLOCK_MONOTONIC);
+        for (k = 0; k < N_SEEKS; k++) {
+                unsigned i = random_u64() % arg_n_entries;
+                Object *o;
+
+                assert_se(journal_file_move_to_entry_by_seqnum(f, i + 1, DIRECTION_DOWN, &o, NULL) == 1);
+                assert_se(le64toh(o->entry.seqnum) == i + 1);
+        }
+        end = now(CLOCK_MONOTONIC);
+
+        log_info("seqnum:             %6.2fµs per seek", (double) (end - start) / N_SEEKS);
+}
+
+static void test_seek_realtime_for_data(JournalFile *f) {
+        uint64_t d[N_VALUES];
+        usec_t start, end;
+        unsigned k;
+
+        for (k = 0; k < N_VALUES; k++) {
+                char value[sizeof("VALUE=") + DECIMAL_STR_MAX(unsigned)];
+
+                xsprintf(value, "VALUE=%u", k);
+                assert_se(journal_file_find_data_object(f, value, strlen(value), NULL, &d[k]) == 1);
+        }
+
+        start = now(CLOCK_MONOTONIC);
+        for (k = 0; k < N_SEEKS; k++) {
+                unsigned i = random_u64() % arg_n_entries, v = random_u64() % N_VALUES, j;
+                Object *o;
+                int r;
+
+                /* The next entry with this value at or after entry i */
+                j = i - i % N_VALUES + v;
+                if (j < i)
+                        j += N_VALUES;
+
+                r = journal_file_move_to_entry_by_realtime_for_data(f, d[v], entry_realtime(i), DIRECTION_DOWN, &o, NULL);
+                if (j < arg_n_entries) {
+                        assert_se(r == 1);
+                        assert_se(le64toh(o->entry.realtime) == entry_realtime(j));
+                } else
+                        assert_se(r == 0);
+        }
+        end = now(CLOCK_MONOTONIC);
+
+        log_info("realtime for data:  %6.2fµs per seek", (double) (end - start) / N_SEEKS);
+}
+
+static void test_seek_cursor(const char *path) {
+        _cleanup_strv_free_ char **cursors = NULL;
+        const char *paths[] = { path, NULL };
+        unsigned k, n = 0, *indices;
+        usec_t start, end;
+        sd_journal *j;
+
+        assert_se(sd_journal_open_files(&j, paths, 0) >= 0);
+
+        /* Collect the cursors of a few random entries first */
+        indices = newa(unsigned, N_SEEKS / 10);
+        assert_se(cursors = new0(char*, N_SEEKS / 10 + 1));
+        for (k = 0; k < N_SEEKS / 10; k++) {
+                indices[k] = random_u64() % arg_n_entries;
+
+                assert_se(sd_journal_seek_realtime_usec(j, entry_realtime(indices[k])) >= 0);
+                assert_se(sd_journal_next(j) == 1);
+                assert_se(sd_journal_get_cursor(j, &cursors[k]) >= 0);
+                n++;
+        }
+
+        sd_journal_close(j);
+        assert_se(sd_journal_open_files(&j, paths, 0) >= 0);
+
+        start = now(CLOCK_MONOTONIC);
+        for (k = 0; k < n; k++) {
+                uint64_t t;
+
+                assert_se(sd_journal_seek_cursor(j, cursors[k]) >= 0);
+                assert_se(sd_journal_next(j) == 1);
+                assert_se(sd_journal_test_cursor(j, cursors[k]) > 0);
+                assert_se(sd_journal_get_realtime_usec(j, &t) >= 0);
+                assert_se(t == entry_realtime(indices[k]));
+        }
+        end = now(CLOCK_MONOTONIC);
+
+        log_info("cursor:             %6.2fµs per seek", (double) (end - start) / n);
+
+        sd_journal_close(j);
+}
+
+int main(int argc, char *argv[]) {
+        char t[] = "/tmp/journal-seek-XXXXXX";
+        _cleanup_free_ char *path = NULL;
+        JournalFile *f;
+        bool slow;
+        int r;
+
+        log_set_max_level(LOG_INFO);
+
+        /* journal_file_open requires a valid machine id */
+        if (access("/etc/machine-id", F_OK) != 0)
+                return EXIT_TEST_SKIP;
+
+        r = getenv_bool("SYSTEMD_SLOW_TESTS");
+        slow = r >= 0 ? r : SYSTEMD_SLOW_TESTS_DEFAULT;
+
+        arg_n_entries = slow ? 5000000 : 200000;
+
+        assert_se(mkdtemp(t));
+        assert_se(path = strappend(t, "/test.journal"));
+
+        make_file(path);
+
+        assert_se(journal_file_open(-1, path, O_RDONLY, 0, false, false, NULL, NULL, NULL, NULL, &f) == 0);
+        test_seek_realtime(f);
+        test_seek_seqnum(f);
+        test_seek_realtime_for_data(f);
+        (void) journal_file_close(f);
+
+        test_seek_cursor(path);
+
+        assert_se(rm_rf(t, REMOVE_ROOT|REMOVE_PHYSICAL) >= 0);
+
+        return 0;
+}
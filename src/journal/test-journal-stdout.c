@@ -0,0 +1,314 @@
+/***
+  This file is part of systemd.
+
+  systemd is free software; you can redistribute it and/or modify it
+  under the terms of the GNU Lesser General Public License as published by
+  the Free Software Foundation; either version 2.1 of the License, or
+  (at your option) any later version.
+
+  systemd is distributed in the hope that it will be useful, but
+  WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+  Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public License
+  along with systemd; If not, see <http://www.gnu.org/licenses/>.
+***/
+
+#include <fcntl.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "sd-event.h"
+
+#include "alloc-util.h"
+#include "env-util.h"
+#include "fd-util.h"
+#include "fileio.h"
+#include "io-util.h"
+#include "journal-file.h"
+#include "journald-context.h"
+#include "journald-server.h"
+#include "journald-stream.h"
+#include "log.h"
+#include "parse-util.h"
+#include "process-util.h"
+#include "rm-rf.h"
+#include "socket-util.h"
+#include "stdio-util.h"
+#include "string-util.h"
+#include "util.h"
+
+/* This program checks that journald splits stdout streams into lines correctly, and measures how much memory
+ * many connected streams take up, and how many lines per second journald processes from them. */
+
+#define STREAM_HEADER "test-journal-stdout\n\n6\n0\n0\n0\n0\n"
+
+static int connect_stream(const char *path) {
+        union sockaddr_union sa = {
+                .un.sun_family = AF_UNIX,
+        };
+        int fd;
+
+        strncpy(sa.un.sun_path, path, sizeof(sa.un.sun_path));
+
+        fd = socket(AF_UNIX, SOCK_STREAM|SOCK_CLOEXEC, 0);
+        assert_se(fd >= 0);
+        assert_se(connect(fd, &sa.sa, SOCKADDR_UN_LEN(sa.un)) >= 0);
+
+        return fd;
+}
+
+static void write_string(int fd, const char *s) {
+        assert_se(loop_write(fd, s, strlen(s), false) >= 0);
+}
+
+static void run_pending(Server *s) {
+        while (sd_event_run(s->event, 0) > 0)
+                ;
+}
+
+static uint64_t n_entries(Server *s) {
+        return le64toh(s->runtime_journal->header->n_entries);
+}
+
+static uint64_t rss_anon(void) {
+        _cleanup_free_ char *v = NULL;
+        uint64_t kb;
+
+        assert_se(get_proc_field("/proc/self/status", "RssAnon", WHITESPACE, &v) == 0);
+        assert_se(safe_atou64(v, &kb) >= 0);
+
+        return kb * 1024;
+}
+
+static void check_message(JournalFile *f, uint64_t *p, const char *message) {
+        uint64_t i, n;
+        Object *o;
+
+        assert_se(journal_file_next_entry(f, *p, DIRECTION_DOWN, &o, p) == 1);
+
+        n = journal_file_entry_n_items(o);
+        for (i = 0; i < n; i++) {
+                uint64_t q;
+                size_t l;
+
+                assert_se(journal_file_move_to_object(f, OBJECT_ENTRY, *p, &o) >= 0);
+                q = le64toh(o->entry.items[i].object_offset);
+
+                /* The file is not compressed, hence the payload may be looked at directly */
+                assert_se(journal_file_move_to_object(f, OBJECT_DATA, q, &o) >= 0);
+                l = le64toh(o->object.size) - offsetof(Object, data.payload);
+
+                if (l >= strlen("MESSAGE=") && memcmp(o->data.payload, "MESSAGE=", strlen("MESSAGE=")) == 0) {
+                        assert_se(l == strlen("MESSAGE=") + strlen(message));
+                        assert_se(memcmp(o->data.payload + strlen("MESSAGE="), message, strlen(message)) == 0);
+                        return;
+                }
+        }
+
+        assert_not_reached("No message found");
+}
+
+static void test_lines(Server *s, const char *path) {
+        char long_line[2 * LINE_MAX + 100 + 1];
+        uint64_t p = 0;
+        int fd;
+
+        memset(long_line, 'x', sizeof(long_line) - 1);
+        long_line[sizeof(long_line) - 1] = 0;
+
+        assert_se(n_entries(s) == 0);
+
+        fd = connect_stream(path);
+        write_string(fd, STREAM_HEADER "foo\nba");
+        run_pending(s);
+
+        /* A line continued in a later read */
+        write_string(fd, "r\n");
+        run_pending(s);
+
+        /* Overly long lines are split, but lines of exactly LINE_MAX are not */
+        write_string(fd, long_line);
+        write_string(fd, "\n");
+        write_string(fd, long_line + LINE_MAX + 100);
+        write_string(fd, "\nlast line without newline");
+        safe_close(fd);
+
+        while (s->n_stdout_streams > 0)
+                assert_se(sd_event_run(s->event, USEC_PER_SEC) >= 0);
+
+        check_message(s->runtime_journal, &p, "foo");
+        check_message(s->runtime_journal, &p, "bar");
+        check_message(s->runtime_journal, &p, long_line + LINE_MAX + 100);
+        check_message(s->runtime_journal, &p, long_line + LINE_MAX + 100);
+        check_message(s->runtime_journal, &p, long_line + 2 * LINE_MAX);
+        check_message(s->runtime_journal, &p, long_line + LINE_MAX + 100);
+        check_message(s->runtime_journal, &p, "last line without newline");
+        assert_se(journal_file_next_entry(s->runtime_journal, p, DIRECTION_DOWN, NULL, NULL) == 0);
+}
+
+static void run_clients(const char *path, unsigned n_streams, unsigned n_lines, int go) {
+        unsigned i, j;
+        int *fds;
+        char c;
+
+        fds = new(int, n_streams);
+        assert_se(fds);
+
+        /* Connect all streams first, and log one line on each */
+        for (i = 0; i < n_streams; i++) {
+                char line[sizeof(STREAM_HEADER "Stream  started\n") + DECIMAL_STR_MAX(unsigned)];
+
+                fds[i] = connect_stream(path);
+
+                xsprintf(line, STREAM_HEADER "Stream %u started\n", i);
+                write_string(fds[i], line);
+        }
+
+        assert_se(read(go, &c, 1) == 1);
+
+        /* Then take turns, like many services logging at the same time */
+        for (j = 0; j < n_lines; j++)
+                for (i = 0; i < n_streams; i++) {
+                        char line[sizeof("Stream  logged line , which is about as long as a typical log message\n") + 2 * DECIMAL_STR_MAX(unsigned)];
+
+                        xsprintf(line, "Stream %u logged line %u, which is about as long as a typical log message\n", i, j);
+                        write_string(fds[i], line);
+                }
+
+        for (i = 0; i < n_streams; i++)
+                safe_close(fds[i]);
+
+        free(fds);
+}
+
+static void test_many_streams(Server *s, const char *path, unsigned n_streams, unsigned n_lines) {
+        _cleanup_close_pair_ int go[2] = { -1, -1 };
+        char bytes[FORMAT_BYTES_MAX], timespan[FORMAT_TIMESPAN_MAX];
+        uint64_t base, before, after;
+        usec_t start, end;
+        pid_t pid;
+
+        base = n_entries(s);
+        s->stdout_streams_max = n_streams;
+
+        assert_se(pipe2(go, O_CLOEXEC) >= 0);
+
+        pid = fork();
+        assert_se(pid >= 0);
+        if (pid == 0) {
+                go[1] = safe_close(go[1]);
+                run_clients(path, n_streams, n_lines, go[0]);
+                _exit(EXIT_SUCCESS);
+        }
+
+        go[0] = safe_close(go[0]);
+
+        before = rss_anon();
+
+        while (n_entries(s) < base + n_streams)
+                assert_se(sd_event_run(s->event, USEC_PER_SEC) >= 0);
+
+        assert_se(s->n_stdout_streams == n_streams);
+        after = rss_anon();
+
+        log_info("%u streams take up %s, %"PRIu64" bytes per stream",
+                 n_streams, strna(format_bytes(bytes, sizeof(bytes), after - before)),
+                 (after - before) / n_streams);
+
+        /* No stream may hold on to a line buffer while it is idle */
+        assert_se((after - before) / n_streams < LINE_MAX);
+
+        start = now(CLOCK_MONOTONIC);
+        assert_se(write(go[1], "x", 1) == 1);
+
+        while (s->n_stdout_streams > 0)
+                assert_se(sd_event_run(s->event, USEC_PER_SEC) >= 0);
+        end = now(CLOCK_MONOTONIC);
+
+        assert_se(wait_for_terminate_and_warn("clients", pid, true) == 0);
+        assert_se(n_entries(s) == base + (uint64_t) n_streams * (n_lines + 1));
+
+        log_info("%u lines from %u streams in %s, %.0f lines/s",
+                 n_streams * n_lines, n_streams,
+                 strna(format_timespan(timespan, sizeof(timespan), end - start, USEC_PER_MSEC)),
+                 (double) n_streams * n_lines * USEC_PER_SEC / (end - start));
+}
+
+int main(int argc, char *argv[]) {
+        char t[] = "/tmp/journal-stdout-XXXXXX";
+        _cleanup_free_ char *path = NULL, *socket_path = NULL;
+        union sockaddr_union sa = {
+                .un.sun_family = AF_UNIX,
+        };
+        JournalMetrics metrics;
+        Server s = {
+                .storage = STORAGE_VOLATILE,
+                .max_level_store = LOG_DEBUG,
+                .split_mode = SPLIT_NONE,
+                .stdout_streams_max = 1,
+                .notify_fd = -1,
+        };
+        unsigned n_streams, n_lines;
+        struct rlimit rl;
+        bool slow;
+        int r;
+
+        log_set_max_level(LOG_INFO);
+
+        /* journal_file_open requires a valid machine id */
+        if (access("/etc/machine-id", F_OK) != 0)
+                return EXIT_TEST_SKIP;
+
+        r = getenv_bool("SYSTEMD_SLOW_TESTS");
+        slow = r >= 0 ? r : SYSTEMD_SLOW_TESTS_DEFAULT;
+
+        n_streams = slow ? 20000 : 1000;
+        n_lines = slow ? 10 : 20;
+
+        /* Each stream takes a file descriptor in both processes, use as many as we may */
+        assert_se(getrlimit(RLIMIT_NOFILE, &rl) >= 0);
+        rl.rlim_cur = rl.rlim_max;
+        (void) setrlimit(RLIMIT_NOFILE, &rl);
+        assert_se(getrlimit(RLIMIT_NOFILE, &rl) >= 0);
+        if (rl.rlim_cur < n_streams + 64) {
+                log_info("File descriptor limit is %llu, using fewer streams.", (unsigned long long) rl.rlim_cur);
+                n_streams = rl.rlim_cur > 128 ? rl.rlim_cur - 64 : 64;
+        }
+
+        assert_se(mkdtemp(t));
+        assert_se(path = strappend(t, "/system.journal"));
+        assert_se(socket_path = strappend(t, "/stdout"));
+
+        journal_reset_metrics(&metrics);
+        metrics.max_size = MAX((uint64_t) n_streams * (n_lines + 1) * 1024ULL, 64ULL * 1024ULL * 1024ULL);
+
+        /* Don't measure compression, this is about getting the lines into the file */
+        assert_se(sd_event_default(&s.event) >= 0);
+        assert_se(journal_file_open(-1, path, O_RDWR|O_CREAT, 0644, false, false, &metrics, NULL, NULL, NULL, &s.runtime_journal) == 0);
+
+        strncpy(sa.un.sun_path, socket_path, sizeof(sa.un.sun_path));
+        s.stdout_fd = socket(AF_UNIX, SOCK_STREAM|SOCK_CLOEXEC|SOCK_NONBLOCK, 0);
+        assert_se(s.stdout_fd >= 0);
+        assert_se(bind(s.stdout_fd, &sa.sa, SOCKADDR_UN_LEN(sa.un)) >= 0);
+        assert_se(listen(s.stdout_fd, SOMAXCONN) >= 0);
+        assert_se(server_open_stdout_socket(&s) >= 0);
+
+        test_lines(&s, socket_path);
+        test_many_streams(&s, socket_path, n_streams, n_lines);
+
+        client_context_flush_all(&s);
+        sd_event_source_unref(s.stdout_event_source);
+        safe_close(s.stdout_fd);
+        free(s.stdout_buffer);
+
+        (void) journal_file_close(s.runtime_journal);
+        sd_event_unref(s.event);
+
+        assert_se(rm_rf(t, REMOVE_ROOT|REMOVE_PHYSICAL) >= 0);
+
+        return 0;
+}
@@ -0,0 +1,407 @@
+/***
+  This file is part of systemd.
+
+  systemd is free software; you can redistribute it and/or modify it
+  under the terms of the GNU Lesser General Public License as published by
+  the Free Software Foundation; either version 2.1 of the License, or
+  (at your option) any later version.
+
+  systemd is distributed in the hope that it will be useful, but
+  WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+  Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public License
+  along with systemd; If not, see <http://www.gnu.org/licenses/>.
+***/
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "sd-journal.h"
+
+#include "alloc-util.h"
+#include "env-util.h"
+#include "io-util.h"
+#include "journal-file.h"
+#include "journal-internal.h"
+#include "journal-summary.h"
+#include "journal-vacuum.h"
+#include "log.h"
+#include "rm-rf.h"
+#include "set.h"
+#include "stdio-util.h"
+#include "string-util.h"
+#include "strv.h"
+#include "util.h"
+
+/* This program checks that summaries rule out files which don't match, and list the values of the configured
+ * fields, and measures how long looking up a unit and enumerating the units of a journal take with and
+ * without summaries. */
+
+#define N_UNITS 8
+
+static unsigned arg_n_files, arg_n_entries;
+
+static char *file_path(const char *directory, unsigned i) {
+        char fn[sizeof("/system@.journal") + DECIMAL_STR_MAX(unsigned)];
+        char *p;
+
+        xsprintf(fn, "/system@%u.journal", i);
+        assert_se(p = strappend(directory, fn));
+
+        return p;
+}
+
+static void make_journal(const char *directory) {
+        uint64_t seqnum = 0;
+        unsigned i, k;
+
+        for (i = 0; i < arg_n_files; i++) {
+                _cleanup_free_ char *path = NULL, *summary = NULL;
+                JournalFile *f;
+
+                path = file_path(directory, i);
+                assert_se(journal_file_open(-1, path, O_RDWR|O_CREAT, 0644, false, false, NULL, NULL, NULL, NULL, &f) == 0);
+
+                for (k = 0; k < arg_n_entries; k++) {
+                        char number[sizeof("NUMBER=") + DECIMAL_STR_MAX(unsigned)],
+                             unit[sizeof("UNIT=unit--.service") + 2 * DECIMAL_STR_MAX(unsigned)];
+                        struct iovec iovec[3];
+                        dual_timestamp ts;
+
+                        ts.realtime = 1000000 + i * arg_n_entries + k;
+                        ts.monotonic = ts.realtime;
+
+                        /* Every file has its own set of units, as if services came and went over time, except
+                         * for one that is always there */
+                        xsprintf(number, "NUMBER=%u", i * arg_n_entries + k);
+                        if (k % N_UNITS == N_UNITS - 1)
+                                strcpy(unit, "UNIT=unit-always.service");
+                        else
+                                xsprintf(unit, "UNIT=unit-%u-%u.service", i, k % N_UNITS);
+
+                        IOVEC_SET_STRING(iovec[0], number);
+                        IOVEC_SET_STRING(iovec[1], unit);
+                        IOVEC_SET_STRING(iovec[2], "MESSAGE=Lorem ipsum dolor sit amet");
+
+                        assert_se(journal_file_append_entry(f, &ts, iovec, ELEMENTSOF(iovec), &seqnum, NULL, NULL) == 0);
+                }
+
+                /* Pretend the file was rotated, so that a summary is written when it is taken offline. Every
+                 * other file lists the units, so that files with and without the list are mixed. */
+                f->archive = true;
+                if (i % 2 == 0)
+                        assert_se(f->summary_fields = strv_new("UNIT", NULL));
+                (void) journal_file_close(f);
+
+                assert_se(journal_summary_path(path, &summary) >= 0);
+                assert_se(access(summary, F_OK) >= 0);
+        }
+}
+
+static void test_summary_contents(const char *directory) {
+        _cleanup_free_ char *path = NULL;
+        unsigned k, n_false = 0;
+        JournalSummaryValues v;
+        JournalSummary s, *p, *q;
+        const void *value;
+        uint64_t offset;
+        JournalFile *f;
+        size_t size;
+        int r;
+
+        path = file_path(directory, 0);
+        assert_se(journal_file_open(-1, path, O_RDONLY, 0, false, false, NULL, NULL, NULL, NULL, &f) == 0);
+        assert_se(f->header->state == STATE_ARCHIVED);
+        assert_se(journal_summary_open(f->path, f->header, &s) > 0);
+
+        /* Every value in the file must be found… */
+        for (k = 0; k < arg_n_entries; k++) {
+                char number[sizeof("NUMBER=") + DECIMAL_STR_MAX(unsigned)];
+
+                xsprintf(number, "NUMBER=%u", k);
+                assert_se(journal_summary_test(&s, journal_file_hash_data(f, number, strlen(number))) > 0);
+        }
+        assert_se(journal_summary_test(&s, journal_file_hash_data(f, "MESSAGE=Lorem ipsum dolor sit amet", strlen("MESSAGE=Lorem ipsum dolor sit amet"))) > 0);
+
+        /* … and most values which are not in it should be ruled out */
+        for (k = 0; k < 10000; k++) {
+                char other[sizeof("OTHER=") + DECIMAL_STR_MAX(unsigned)];
+
+                xsprintf(other, "OTHER=%u", k);
+                if (journal_summary_test(&s, journal_file_hash_data(f, other, strlen(other))) > 0)
+                        n_false++;
+        }
+
+        log_info("%u of 10000 values not in the file were not ruled out by the summary.", n_false);
+        assert_se(n_false < 500);
+
+        /* The units are listed in order, without the field name, the default fields are not in the file */
+        assert_se(journal_summary_read_values(&s, "NUMBER", &v) == 0);
+        assert_se(journal_summary_read_values(&s, "UNIT", &v) > 0);
+
+        for (k = 0; (r = journal_summary_values_next(&v, &value, &size, &offset)) > 0; k++) {
+                char unit[sizeof("unit--.service") + 2 * DECIMAL_STR_MAX(unsigned)];
+
+                if (k < N_UNITS - 1)
+                        xsprintf(unit, "unit-0-%u.service", k);
+                else
+                        strcpy(unit, "unit-always.service");
+
+                assert_se(size == strlen(unit));
+                assert_se(memcmp(value, unit, size) == 0);
+                assert_se(offset > 0);
+        }
+        assert_se(r == 0);
+        assert_se(k == N_UNITS);
+
+        journal_summary_values_done(&v);
+
+        journal_summary_close(&s);
+
+        /* The summary of a file is opened once, and kept with it */
+        assert_se(journal_file_get_summary(f, &p) > 0);
+        assert_se(journal_file_get_summary(f, &q) > 0);
+        assert_se(p == q);
+        assert_se(p->map);
+
+        (void) journal_file_close(f);
+}
+
+static unsigned count_matches(const char *directory, const char *match, uint64_t since) {
+        sd_journal *j;
+        unsigned n = 0;
+        int r;
+
+        assert_se(sd_journal_open_directory(&j, directory, 0) >= 0);
+        assert_se(sd_journal_add_match(j, match, 0) >= 0);
+
+        if (since > 0)
+                assert_se(sd_journal_seek_realtime_usec(j, since) >= 0);
+
+        while ((r = sd_journal_next(j)) > 0)
+                n++;
+        assert_se(r == 0);
+
+        sd_journal_close(j);
+
+        return n;
+}
+
+static void test_open_matching(const char *directory) {
+        char match[sizeof("UNIT=unit--0.service") + DECIMAL_STR_MAX(unsigned)];
+        sd_journal *j;
+        unsigned n;
+        int r;
+
+        xsprintf(match, "UNIT=unit-%u-0.service", arg_n_files / 2);
+
+        /* Archived files are only opened if their summary doesn't rule out the matches… */
+        assert_se(sd_journal_open_directory(&j, directory, 0) >= 0);
+        assert_se(ordered_hashmap_isempty(j->files));
+        assert_se(hashmap_size(j->deferred_files) == arg_n_files);
+
+        assert_se(sd_journal_add_match(j, match, 0) >= 0);
+        assert_se(sd_journal_next(j) > 0);
+
+        n = ordered_hashmap_size(j->files);
+        log_info("Opened %u of %u files to look up %s.", n, arg_n_files, match);
+        assert_se(n >= 1 && n < arg_n_files);
+
+        /* … and all of them once they might */
+        sd_journal_flush_matches(j);
+        assert_se(sd_journal_seek_head(j) >= 0);
+        while ((r = sd_journal_next(j)) > 0)
+                ;
+        assert_se(r == 0);
+
+        assert_se(ordered_hashmap_size(j->files) == arg_n_files);
+        assert_se(hashmap_isempty(j->deferred_files));
+
+        sd_journal_close(j);
+}
+
+static void remove_summaries(const char *directory) {
+        unsigned i;
+
+        for (i = 0; i < arg_n_files; i++) {
+                _cleanup_free_ char *path = NULL, *summary = NULL;
+
+                path = file_path(directory, i);
+                assert_se(journal_summary_path(path, &summary) >= 0);
+                (void) unlink(summary);
+        }
+}
+
+static void test_skip_files(const char *directory) {
+        char match[sizeof("UNIT=unit--0.service") + DECIMAL_STR_MAX(unsigned)];
+        usec_t start, with, without;
+        unsigned n;
+
+        xsprintf(match, "UNIT=unit-%u-0.service", arg_n_files / 2);
+
+        /* Matches that are found in one file only */
+        start = now(CLOCK_MONOTONIC);
+        assert_se(count_matches(directory, match, 0) == arg_n_entries / N_UNITS);
+        with = now(CLOCK_MONOTONIC) - start;
+
+        assert_se(count_matches(directory, "UNIT=unit-nonexistent.service", 0) == 0);
+        assert_se(count_matches(directory, match, 1000000 + arg_n_files * arg_n_entries) == 0);
+        assert_se(count_matches(directory, match, 1000000 + arg_n_files / 2 * arg_n_entries) == arg_n_entries / N_UNITS);
+
+        /* Matches that are found in all files */
+        n = count_matches(directory, "MESSAGE=Lorem ipsum dolor sit amet", 1000000 + arg_n_files * arg_n_entries / 2);
+        assert_se(n == arg_n_files * arg_n_entries / 2);
+
+        remove_summaries(directory);
+
+        start = now(CLOCK_MONOTONIC);
+        assert_se(count_matches(directory, match, 0) == arg_n_entries / N_UNITS);
+        without = now(CLOCK_MONOTONIC) - start;
+
+        assert_se(count_matches(directory, "MESSAGE=Lorem ipsum dolor sit amet", 1000000 + arg_n_files * arg_n_entries / 2) == n);
+
+        log_info("Looking up a unit in %u files took %.3fms with summaries, %.3fms without.",
+                 arg_n_files, with / 1e3, without / 1e3);
+}
+
+static unsigned count_unique(const char *directory, usec_t *ret_duration) {
+        _cleanup_set_free_free_ Set *units = NULL;
+        const void *data;
+        sd_journal *j;
+        usec_t start;
+        size_t size;
+        int r;
+
+        assert_se(units = set_new(&string_hash_ops));
+        assert_se(sd_journal_open_directory(&j, directory, 0) >= 0);
+
+        start = now(CLOCK_MONOTONIC);
+        assert_se(sd_journal_query_unique(j, "UNIT") >= 0);
+
+        /* Every value must be returned once, no matter how many files have it */
+        while ((r = sd_journal_enumerate_unique(j, &data, &size)) > 0) {
+                char *unit;
+
+                assert_se(size > strlen("UNIT=") && memcmp(data, "UNIT=", strlen("UNIT=")) == 0);
+                assert_se(unit = strndup(data, size));
+                assert_se(set_consume(units, unit) > 0);
+        }
+        assert_se(r == 0);
+
+        *ret_duration = now(CLOCK_MONOTONIC) - start;
+
+        /* Once more, after starting over */
+        sd_journal_restart_unique(j);
+        assert_se(sd_journal_enumerate_unique(j, &data, &size) > 0);
+        assert_se(set_contains(units, strndupa(data, size)));
+
+        sd_journal_close(j);
+
+        return set_size(units);
+}
+
+static void test_unique_threshold(const char *directory) {
+        const void *data;
+        unsigned n = 0;
+        sd_journal *j;
+        size_t size;
+        int r;
+
+        assert_se(sd_journal_open_directory(&j, directory, 0) >= 0);
+        assert_se(sd_journal_set_data_threshold(j, strlen("UNIT=unit")) >= 0);
+        assert_se(sd_journal_query_unique(j, "UNIT") >= 0);
+
+        /* Values from summaries are truncated like those from DATA objects */
+        while ((r = sd_journal_enumerate_unique(j, &data, &size)) > 0) {
+                assert_se(size >= strlen("UNIT=unit") && memcmp(data, "UNIT=unit", strlen("UNIT=unit")) == 0);
+                if (size == strlen("UNIT=unit"))
+                        n++;
+        }
+        assert_se(r == 0);
+        assert_se(n > 0);
+
+        sd_journal_close(j);
+}
+
+static void write_summaries(const char *directory) {
+        unsigned i;
+
+        for (i = 0; i < arg_n_files; i++) {
+                _cleanup_free_ char *path = NULL;
+                JournalFile *f;
+
+                path = file_path(directory, i);
+                assert_se(journal_file_open(-1, path, O_RDONLY, 0, false, false, NULL, NULL, NULL, NULL, &f) == 0);
+                if (i % 2 == 0)
+                        assert_se(f->summary_fields = strv_new("UNIT", NULL));
+                assert_se(journal_file_write_summary(f) >= 0);
+                (void) journal_file_close(f);
+        }
+}
+
+static void test_unique(const char *directory) {
+        usec_t with, without;
+
+        /* The summaries were removed by test_skip_files() */
+        assert_se(count_unique(directory, &without) == arg_n_files * (N_UNITS - 1) + 1);
+
+        write_summaries(directory);
+
+        assert_se(count_unique(directory, &with) == arg_n_files * (N_UNITS - 1) + 1);
+        test_unique_threshold(directory);
+
+        log_info("Enumerating the units of %u files took %.3fms with summaries, %.3fms without.",
+                 arg_n_files, with / 1e3, without / 1e3);
+}
+
+static void test_vacuum_stale(const char *directory) {
+        _cleanup_free_ char *path = NULL, *summary = NULL;
+        JournalFile *f;
+
+        path = file_path(directory, 0);
+        assert_se(journal_summary_path(path, &summary) >= 0);
+
+        /* Write the summary again, then remove the journal file it belongs to */
+        assert_se(journal_file_open(-1, path, O_RDONLY, 0, false, false, NULL, NULL, NULL, NULL, &f) == 0);
+        assert_se(journal_file_write_summary(f) >= 0);
+        (void) journal_file_close(f);
+
+        assert_se(access(summary, F_OK) >= 0);
+        assert_se(unlink(path) >= 0);
+
+        assert_se(journal_directory_vacuum(directory, UINT64_MAX, 0, 0, NULL, true) >= 0);
+        assert_se(access(summary, F_OK) < 0 && errno == ENOENT);
+}
+
+int main(int argc, char *argv[]) {
+        char t[] = "/tmp/journal-summary-XXXXXX";
+        bool slow;
+        int r;
+
+        log_set_max_level(LOG_INFO);
+
+        /* journal_file_open requires a valid machine id */
+        if (access("/etc/machine-id", F_OK) != 0)
+                return EXIT_TEST_SKIP;
+
+        r = getenv_bool("SYSTEMD_SLOW_TESTS");
+        slow = r >= 0 ? r : SYSTEMD_SLOW_TESTS_DEFAULT;
+
+        arg_n_files = slow ? 128 : 16;
+        arg_n_entries = slow ? 8192 : 512;
+
+        assert_se(mkdtemp(t));
+        make_journal(t);
+
+        test_summary_contents(t);
+        test_open_matching(t);
+        test_skip_files(t);
+        test_unique(t);
+        test_vacuum_stale(t);
+
+        assert_se(rm_rf(t, REMOVE_ROOT|REMOVE_PHYSICAL) >= 0);
+
+        return 0;
+}
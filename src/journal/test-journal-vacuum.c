@@ -0,0 +1,213 @@
+/***
+  This file is part of systemd.
+
+  systemd is free software; you can redistribute it and/or modify it
+  under the terms of the GNU Lesser General Public License as published by
+  the Free Software Foundation; either version 2.1 of the License, or
+  (at your option) any later version.
+
+  systemd is distributed in the hope that it will be useful, but
+  WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+  Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public License
+  along with systemd; If not, see <http://www.gnu.org/licenses/>.
+***/
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "sd-id128.h"
+
+#include "alloc-util.h"
+#include "env-util.h"
+#include "fd-util.h"
+#include "journal-def.h"
+#include "journal-summary.h"
+#include "journal-vacuum.h"
+#include "log.h"
+#include "rm-rf.h"
+#include "stdio-util.h"
+#include "string-util.h"
+#include "util.h"
+
+/* This program checks that the vacuum index removes the oldest archived files first, picks up rotated and
+ * deleted files, and accounts for all journal files and summaries, and measures how long a rotation followed by
+ * vacuuming takes in a directory with many archived files, with and without the index. */
+
+#define SEQNUM_ID SD_ID128_MAKE(e1,a7,59,0b,5e,6f,4a,58,9c,3a,26,2e,6d,3b,0b,35)
+#define REALTIME (UINT64_C(1500000000) * USEC_PER_SEC)
+
+static uint64_t make_file(const char *directory, const char *fn, uint64_t n_entries) {
+        char buf[4096] = {};
+        _cleanup_close_ int fd = -1;
+        Header *h = (Header*) buf;
+        struct stat st;
+
+        /* Only the number of entries in the header is looked at */
+        h->n_entries = htole64(n_entries);
+
+        fd = open(strjoina(directory, "/", fn), O_WRONLY|O_CREAT|O_TRUNC|O_CLOEXEC, 0644);
+        assert_se(fd >= 0);
+        assert_se(write(fd, buf, sizeof(buf)) == sizeof(buf));
+        assert_se(fstat(fd, &st) >= 0);
+
+        return 512UL * (uint64_t) st.st_blocks;
+}
+
+static char *archived_name(uint64_t seqnum) {
+        char *fn;
+
+        assert_se(asprintf(&fn, "system@" SD_ID128_FORMAT_STR "-%016" PRIx64 "-%016" PRIx64 ".journal",
+                           SD_ID128_FORMAT_VAL(SEQNUM_ID), seqnum, REALTIME + seqnum * USEC_PER_SEC) >= 0);
+        return fn;
+}
+
+static uint64_t make_archived(const char *directory, uint64_t seqnum) {
+        _cleanup_free_ char *fn = NULL;
+
+        fn = archived_name(seqnum);
+        return make_file(directory, fn, 1);
+}
+
+static bool archived_exists(const char *directory, uint64_t seqnum) {
+        _cleanup_free_ char *fn = NULL;
+
+        fn = archived_name(seqnum);
+        return access(strjoina(directory, "/", fn), F_OK) >= 0;
+}
+
+static void test_index(const char *directory) {
+        _cleanup_(journal_vacuum_index_freep) JournalVacuumIndex *i = NULL;
+        _cleanup_free_ char *fn = NULL;
+        uint64_t usage = 0, active, seqnum;
+        usec_t oldest = 0;
+
+        /* Created out of order, they are removed by sequence number */
+        for (seqnum = 10; seqnum > 0; seqnum--)
+                usage += make_archived(directory, seqnum);
+        active = make_file(directory, "system.journal", 1);
+        usage += active;
+
+        fn = archived_name(5);
+        usage += make_file(directory, strjoina(fn, JOURNAL_SUMMARY_SUFFIX), 0);
+
+        /* Empty archived files and summaries without a journal file are removed right-away */
+        fn = mfree(fn);
+        fn = archived_name(100);
+        make_file(directory, fn, 0);
+        make_file(directory, "gone.journal" JOURNAL_SUMMARY_SUFFIX, 0);
+
+        assert_se(journal_vacuum_index_new(directory, false, &i) >= 0);
+        assert_se(journal_vacuum_index_n_archived(i) == 10);
+        assert_se(journal_vacuum_index_usage(i) == usage);
+        assert_se(!archived_exists(directory, 100));
+        assert_se(access(strjoina(directory, "/gone.journal" JOURNAL_SUMMARY_SUFFIX), F_OK) < 0);
+
+        /* The active file counts towards the number of files */
+        assert_se(journal_vacuum_index_vacuum(i, 0, 8, 0, &oldest, false) >= 0);
+        assert_se(journal_vacuum_index_n_archived(i) == 7);
+        for (seqnum = 1; seqnum <= 10; seqnum++)
+                assert_se(archived_exists(directory, seqnum) == (seqnum > 3));
+        assert_se(oldest == REALTIME + 4 * USEC_PER_SEC);
+
+        /* A rotated file, and one deleted behind our back */
+        usage = journal_vacuum_index_usage(i);
+        fn = mfree(fn);
+        fn = archived_name(11);
+        usage += make_archived(directory, 11);
+        assert_se(journal_vacuum_index_update(i, strjoina(directory, "/", fn)) > 0);
+        assert_se(journal_vacuum_index_n_archived(i) == 8);
+        assert_se(journal_vacuum_index_usage(i) == usage);
+
+        fn = mfree(fn);
+        fn = archived_name(4);
+        assert_se(unlink(strjoina(directory, "/", fn)) >= 0);
+        assert_se(journal_vacuum_index_update(i, strjoina(directory, "/", fn)) == 0);
+        assert_se(journal_vacuum_index_n_archived(i) == 7);
+
+        /* Files elsewhere are none of our business */
+        assert_se(journal_vacuum_index_update(i, "/var/log/journal/system.journal") == 0);
+
+        /* The summary goes away with its file */
+        fn = mfree(fn);
+        fn = archived_name(5);
+        assert_se(journal_vacuum_index_vacuum(i, 0, 7, 0, NULL, false) >= 0);
+        assert_se(!archived_exists(directory, 5));
+        assert_se(access(strjoina(directory, "/", fn, JOURNAL_SUMMARY_SUFFIX), F_OK) < 0);
+        assert_se(archived_exists(directory, 6));
+
+        /* Sizes are only counted for archived files */
+        assert_se(journal_vacuum_index_vacuum(i, 1, 0, 0, NULL, false) >= 0);
+        assert_se(journal_vacuum_index_n_archived(i) == 0);
+        assert_se(access(strjoina(directory, "/system.journal"), F_OK) >= 0);
+        assert_se(journal_vacuum_index_usage(i) == active);
+}
+
+static void benchmark_rotate(const char *directory, unsigned n_files, unsigned n) {
+        _cleanup_(journal_vacuum_index_freep) JournalVacuumIndex *i = NULL;
+        usec_t start, listing, indexed;
+        uint64_t seqnum;
+        unsigned k;
+
+        /* Each rotation archives a file and removes the oldest one, first listing the directory each time, as
+         * journald used to, then keeping the index up-to-date */
+
+        for (seqnum = 0; seqnum < n_files; seqnum++)
+                make_archived(directory, seqnum);
+
+        start = now(CLOCK_MONOTONIC);
+        for (k = 0; k < n; k++, seqnum++) {
+                make_archived(directory, seqnum);
+                assert_se(journal_directory_vacuum(directory, 0, n_files, 0, NULL, false) >= 0);
+        }
+        listing = now(CLOCK_MONOTONIC) - start;
+
+        assert_se(journal_vacuum_index_new(directory, false, &i) >= 0);
+
+        start = now(CLOCK_MONOTONIC);
+        for (k = 0; k < n; k++, seqnum++) {
+                _cleanup_free_ char *fn = NULL;
+
+                fn = archived_name(seqnum);
+                make_file(directory, fn, 1);
+                assert_se(journal_vacuum_index_update(i, strjoina(directory, "/", fn)) > 0);
+                assert_se(journal_vacuum_index_vacuum(i, 0, n_files, 0, NULL, false) >= 0);
+        }
+        indexed = now(CLOCK_MONOTONIC) - start;
+
+        assert_se(journal_vacuum_index_n_archived(i) == n_files);
+        assert_se(!archived_exists(directory, seqnum - n_files - 1));
+        assert_se(archived_exists(directory, seqnum - n_files));
+
+        log_info("%6u files: %8.1fµs per rotation listing the directory, %6.1fµs with the index",
+                 n_files, (double) listing / n, (double) indexed / n);
+
+        assert_se(rm_rf(directory, REMOVE_PHYSICAL) >= 0);
+}
+
+int main(int argc, char *argv[]) {
+        char t[] = "/tmp/journal-vacuum-XXXXXX";
+        bool slow;
+        int r;
+
+        log_set_max_level(LOG_INFO);
+
+        r = getenv_bool("SYSTEMD_SLOW_TESTS");
+        slow = r >= 0 ? r : SYSTEMD_SLOW_TESTS_DEFAULT;
+
+        assert_se(mkdtemp(t));
+
+        test_index(t);
+        assert_se(rm_rf(t, REMOVE_PHYSICAL) >= 0);
+
+        benchmark_rotate(t, 100, 200);
+        benchmark_rotate(t, 1000, 100);
+        benchmark_rotate(t, slow ? 20000 : 5000, slow ? 100 : 20);
+
+        assert_se(rm_rf(t, REMOVE_ROOT|REMOVE_PHYSICAL) >= 0);
+
+        return 0;
+}
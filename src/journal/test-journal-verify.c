@@ -21,11 +21,16 @@
 #include <stdio.h>
 #include <unistd.h>
 
+#include "env-util.h"
 #include "fd-util.h"
+#include "io-util.h"
 #include "journal-file.h"
 #include "journal-verify.h"
 #include "log.h"
+#include "parse-util.h"
 #include "rm-rf.h"
+#include "stdio-util.h"
+#include "string-util.h"
 #include "terminal-util.h"
 #include "util.h"
 
@@ -59,12 +64,122 @@ static int raw_verify(const char *fn, const char *verification_key) {
         if (r < 0)
                 return r;
 
-        r = journal_file_verify(f, verification_key, NULL, NULL, NULL, false);
+        r = journal_file_verify(f, verification_key, 0, NULL, NULL, NULL, false);
         (void) journal_file_close(f);
 
         return r;
 }
 
+static void benchmark_verify(const char *fn, unsigned n_entries) {
+        char bytes[FORMAT_BYTES_MAX], limit[FORMAT_BYTES_MAX];
+        JournalMetrics metrics;
+        usec_t start, end;
+        uint64_t size;
+        JournalFile *f;
+        unsigned n;
+
+        /* Verification takes two passes over the file, and looks up the offsets of all referenced objects. The
+         * rate is given relative to the size of the file, as journalctl --verify does. */
+
+        journal_reset_metrics(&metrics);
+        metrics.max_size = MAX(n_entries * 512ULL, 8ULL * 1024ULL * 1024ULL);
+
+        assert_se(journal_file_open(-1, fn, O_RDWR|O_CREAT, 0666, true, false, &metrics, NULL, NULL, NULL, &f) == 0);
+
+        for (n = 0; n < n_entries; n++) {
+                char message[sizeof("MESSAGE=Entry ") + DECIMAL_STR_MAX(unsigned)],
+                     value[sizeof("RANDOM=") + DECIMAL_STR_MAX(unsigned)];
+                struct iovec iovec[2];
+                struct dual_timestamp ts;
+
+                dual_timestamp_get(&ts);
+
+                xsprintf(message, "MESSAGE=Entry %u", n);
+                xsprintf(value, "RANDOM=%lu", random() % (RANDOM_RANGE * 100));
+
+                IOVEC_SET_STRING(iovec[0], message);
+                IOVEC_SET_STRING(iovec[1], value);
+
+                assert_se(journal_file_append_entry(f, &ts, iovec, ELEMENTSOF(iovec), NULL, NULL, NULL) == 0);
+        }
+
+        (void) journal_file_close(f);
+
+        assert_se(journal_file_open(-1, fn, O_RDONLY, 0666, true, false, NULL, NULL, NULL, NULL, &f) == 0);
+        size = le64toh(f->header->header_size) + le64toh(f->header->arena_size);
+
+        start = now(CLOCK_MONOTONIC);
+        assert_se(journal_file_verify(f, NULL, 0, NULL, NULL, NULL, false) >= 0);
+        end = now(CLOCK_MONOTONIC);
+
+        log_info("%u entries, %s: %.1f MiB/s",
+                 n_entries, strna(format_bytes(bytes, sizeof(bytes), size)),
+                 (double) size / 1024 / 1024 / ((double) (end - start) / USEC_PER_SEC));
+
+        /* Limited to four times the size per second, the first pass alone takes almost a quarter of a second */
+        start = now(CLOCK_MONOTONIC);
+        assert_se(journal_file_verify(f, NULL, 4 * size, NULL, NULL, NULL, false) >= 0);
+        end = now(CLOCK_MONOTONIC);
+
+        log_info("%u entries, %s, limited to %s/s: %.1f MiB/s",
+                 n_entries, strna(format_bytes(bytes, sizeof(bytes), size)),
+                 strna(format_bytes(limit, sizeof(limit), 4 * size)),
+                 (double) size / 1024 / 1024 / ((double) (end - start) / USEC_PER_SEC));
+
+        assert_se(end - start >= USEC_PER_SEC / 5);
+
+        (void) journal_file_close(f);
+}
+
+static void benchmark_append(const char *fn, unsigned n_entries, bool seal) {
+        JournalMetrics metrics;
+        usec_t start, end;
+        JournalFile *f;
+        unsigned n;
+
+        /* Sealing is only enabled if the FSS key of this machine was set up with journalctl --setup-keys */
+
+        journal_reset_metrics(&metrics);
+        metrics.max_size = MAX(n_entries * 1024ULL, 8ULL * 1024ULL * 1024ULL);
+
+        assert_se(journal_file_open(-1, fn, O_RDWR|O_CREAT, 0666, true, seal, &metrics, NULL, NULL, NULL, &f) == 0);
+
+        if (seal && !JOURNAL_HEADER_SEALED(f->header)) {
+                log_info("No FSS key set up, skipping sealed append benchmark.");
+                (void) journal_file_close(f);
+                (void) unlink(fn);
+                return;
+        }
+
+        start = now(CLOCK_MONOTONIC);
+        for (n = 0; n < n_entries; n++) {
+                char message[sizeof("MESSAGE=Request  handled in  ms, status \"OK\"") + 2 * DECIMAL_STR_MAX(unsigned)],
+                     value[sizeof("RANDOM=") + DECIMAL_STR_MAX(unsigned)];
+                struct iovec iovec[4];
+                struct dual_timestamp ts;
+
+                dual_timestamp_get(&ts);
+
+                xsprintf(message, "MESSAGE=Request %u handled in %u ms, status \"OK\"", n, n % 97);
+                xsprintf(value, "RANDOM=%lu", random() % (RANDOM_RANGE * 100));
+
+                IOVEC_SET_STRING(iovec[0], message);
+                IOVEC_SET_STRING(iovec[1], value);
+                IOVEC_SET_STRING(iovec[2], "PRIORITY=6");
+                IOVEC_SET_STRING(iovec[3], "_SYSTEMD_UNIT=test-service.service");
+
+                assert_se(journal_file_append_entry(f, &ts, iovec, ELEMENTSOF(iovec), NULL, NULL, NULL) == 0);
+        }
+        end = now(CLOCK_MONOTONIC);
+
+        log_info("%u entries appended %s: %.0f entries/s",
+                 n_entries, seal ? "with sealing" : "without sealing",
+                 (double) n_entries * USEC_PER_SEC / (end - start));
+
+        (void) journal_file_close(f);
+        (void) unlink(fn);
+}
+
 int main(int argc, char *argv[]) {
         char t[] = "/tmp/journal-XXXXXX";
         unsigned n;
@@ -76,6 +191,8 @@ int main(int argc, char *argv[]) {
         char c[FORMAT_TIMESPAN_MAX];
         struct stat st;
         uint64_t p;
+        bool slow;
+        int r;
 
         /* journal_file_open requires a valid machine id */
         if (access("/etc/machine-id", F_OK) != 0)
@@ -115,7 +232,7 @@ int main(int argc, char *argv[]) {
         /* journal_file_print_header(f); */
         journal_file_dump(f);
 
-        assert_se(journal_file_verify(f, verification_key, &from, &to, &total, true) >= 0);
+        assert_se(journal_file_verify(f, verification_key, 0, &from, &to, &total, true) >= 0);
 
         if (verification_key && JOURNAL_HEADER_SEALED(f->header))
                 log_info("=> Validated from %s to %s, %s missing",
@@ -125,6 +242,20 @@ int main(int argc, char *argv[]) {
 
         (void) journal_file_close(f);
 
+        log_info("Benchmarking...");
+
+        log_set_max_level(LOG_INFO);
+
+        r = getenv_bool("SYSTEMD_SLOW_TESTS");
+        slow = r >= 0 ? r : SYSTEMD_SLOW_TESTS_DEFAULT;
+
+        benchmark_verify("benchmark.journal", slow ? 2000000 : 100000);
+
+        benchmark_append("append.journal", slow ? 2000000 : 100000, false);
+        benchmark_append("append-sealed.journal", slow ? 2000000 : 100000, true);
+
+        log_set_max_level(LOG_DEBUG);
+
         if (verification_key) {
                 log_info("Toggling bits...");
 
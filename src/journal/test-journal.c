@@ -18,13 +18,22 @@
 ***/
 
 #include <fcntl.h>
+#include <poll.h>
+#include <sys/eventfd.h>
 #include <unistd.h>
 
+#include "sd-journal.h"
+
+#include "env-util.h"
+#include "io-util.h"
 #include "journal-authenticate.h"
 #include "journal-file.h"
 #include "journal-vacuum.h"
+#include "journal-verify.h"
 #include "log.h"
 #include "rm-rf.h"
+#include "stdio-util.h"
+#include "util.h"
 
 static bool arg_keep = false;
 
@@ -164,7 +173,337 @@ static void test_empty(void) {
         (void) journal_file_close(f4);
 }
 
+static void test_append_entries(void) {
+        static const char common1[] = "_HOSTNAME=test", common2[] = "_TRANSPORT=journal";
+        char messages[16][DECIMAL_STR_MAX(unsigned) + 9];
+        struct iovec iovec[16][3];
+        JournalEntryBatchItem entries[16];
+        JournalFile *f;
+        unsigned i, n;
+        Object *o;
+        uint64_t p;
+        char t[] = "/tmp/journal-XXXXXX";
+
+        log_set_max_level(LOG_DEBUG);
+
+        assert_se(mkdtemp(t));
+        assert_se(chdir(t) >= 0);
+
+        assert_se(journal_file_open(-1, "test.journal", O_RDWR|O_CREAT, 0666, true, false, NULL, NULL, NULL, NULL, &f) == 0);
+
+        for (i = 0; i < ELEMENTSOF(entries); i++) {
+                xsprintf(messages[i], "MESSAGE=%u", i % 4);
+
+                IOVEC_SET_STRING(iovec[i][0], common1);
+                IOVEC_SET_STRING(iovec[i][1], messages[i]);
+                IOVEC_SET_STRING(iovec[i][2], common2);
+
+                entries[i] = (JournalEntryBatchItem) {
+                        .iovec = iovec[i],
+                        .n_iovec = ELEMENTSOF(iovec[i]),
+                };
+        }
+
+        assert_se(journal_file_append_entries(f, entries, 0, NULL, &n) == 0);
+        assert_se(n == 0);
+
+        assert_se(journal_file_append_entries(f, entries, ELEMENTSOF(entries), NULL, &n) == 0);
+        assert_se(n == ELEMENTSOF(entries));
+
+        assert_se(le64toh(f->header->n_entries) == ELEMENTSOF(entries));
+        /* Two common fields plus four distinct messages */
+        assert_se(le64toh(f->header->n_data) == 6);
+
+        p = 0;
+        for (i = 0; i < ELEMENTSOF(entries); i++) {
+                assert_se(journal_file_next_entry(f, p, DIRECTION_DOWN, &o, &p) == 1);
+                assert_se(le64toh(o->entry.seqnum) == i + 1);
+                assert_se(journal_file_entry_n_items(o) == 3);
+        }
+        assert_se(journal_file_next_entry(f, p, DIRECTION_DOWN, &o, &p) == 0);
+
+        assert_se(journal_file_find_data_object(f, common1, strlen(common1), &o, NULL) == 1);
+        assert_se(le64toh(o->data.n_entries) == ELEMENTSOF(entries));
+
+        assert_se(journal_file_find_data_object(f, "MESSAGE=1", strlen("MESSAGE=1"), &o, NULL) == 1);
+        assert_se(le64toh(o->data.n_entries) == ELEMENTSOF(entries) / 4);
+
+        (void) journal_file_close(f);
+
+        assert_se(rm_rf(t, REMOVE_ROOT|REMOVE_PHYSICAL) >= 0);
+
+        puts("------------------------------------------------------------");
+}
+
+#define N_OFFLINE_FILES 32U
+
+static void test_offline(void) {
+        char a[FORMAT_TIMESPAN_MAX], b[FORMAT_TIMESPAN_MAX];
+        JournalFile *f[N_OFFLINE_FILES];
+        usec_t start, end, max = 0;
+        unsigned i, n;
+        char t[] = "/tmp/journal-XXXXXX";
+        int fd;
+
+        log_set_max_level(LOG_DEBUG);
+
+        assert_se(mkdtemp(t));
+        assert_se(chdir(t) >= 0);
+
+        fd = journal_file_offline_notify_fd();
+        assert_se(fd >= 0);
+
+        for (i = 0; i < N_OFFLINE_FILES; i++) {
+                char path[sizeof("test.journal") + DECIMAL_STR_MAX(unsigned)];
+                struct iovec iovec;
+
+                xsprintf(path, "test%u.journal", i);
+                assert_se(journal_file_open(-1, path, O_RDWR|O_CREAT, 0666, true, false, NULL, NULL, NULL, NULL, &f[i]) == 0);
+
+                IOVEC_SET_STRING(iovec, "MESSAGE=offline");
+                assert_se(journal_file_append_entry(f[i], NULL, &iovec, 1, NULL, NULL, NULL) == 0);
+        }
+
+        /* Offline all files at once, and wait for the notifications that they are done */
+        start = now(CLOCK_MONOTONIC);
+        for (i = 0; i < N_OFFLINE_FILES; i++)
+                assert_se(journal_file_set_offline(f[i], false) == 0);
+
+        for (;;) {
+                eventfd_t x;
+
+                for (i = 0, n = 0; i < N_OFFLINE_FILES; i++)
+                        if (!journal_file_is_offlining(f[i]))
+                                n++;
+                if (n == N_OFFLINE_FILES)
+                        break;
+
+                assert_se(fd_wait_for_event(fd, POLLIN, USEC_INFINITY) > 0);
+                (void) eventfd_read(fd, &x);
+        }
+        end = now(CLOCK_MONOTONIC);
+
+        for (i = 0; i < N_OFFLINE_FILES; i++) {
+                usec_t u;
+
+                /* Joining a file which is done does not block */
+                assert_se(journal_file_set_offline(f[i], false) == 0);
+                assert_se(f[i]->header->state == STATE_OFFLINE);
+
+                u = journal_file_get_offline_latency(f[i]);
+                assert_se(u > 0);
+                assert_se(journal_file_get_offline_latency(f[i]) == 0);
+                max = MAX(max, u);
+        }
+
+        log_info("Offlined %u files in %s, slowest one took %s.", N_OFFLINE_FILES,
+                 format_timespan(a, sizeof(a), end - start, 1),
+                 format_timespan(b, sizeof(b), max, 1));
+
+        /* Writing brings files back online, and a pending offline may be restarted or raced with closing */
+        for (i = 0; i < N_OFFLINE_FILES; i++) {
+                struct iovec iovec;
+
+                IOVEC_SET_STRING(iovec, "MESSAGE=online");
+                assert_se(journal_file_append_entry(f[i], NULL, &iovec, 1, NULL, NULL, NULL) == 0);
+                assert_se(f[i]->header->state == STATE_ONLINE);
+
+                assert_se(journal_file_set_offline(f[i], false) == 0);
+                if (i % 2 == 0)
+                        assert_se(journal_file_set_offline(f[i], false) == 0);
+        }
+
+        for (i = 0; i < N_OFFLINE_FILES; i++)
+                (void) journal_file_close(f[i]);
+
+        assert_se(rm_rf(t, REMOVE_ROOT|REMOVE_PHYSICAL) >= 0);
+
+        puts("------------------------------------------------------------");
+}
+
+#ifdef HAVE_ZSTD
+#define N_DICTIONARY_ENTRIES 5000U
+
+static void append_messages(JournalFile *f, unsigned first, unsigned n) {
+        unsigned i;
+
+        for (i = first; i < first + n; i++) {
+                char message[sizeof("MESSAGE=Accepted publickey for root from 10.0.. port  ssh2") + 3 * DECIMAL_STR_MAX(unsigned)];
+                struct iovec iovec;
+
+                xsprintf(message, "MESSAGE=Accepted publickey for root from 10.0.%u.%u port %u ssh2", i % 256, i / 256, 1024 + i);
+                IOVEC_SET_STRING(iovec, message);
+
+                assert_se(journal_file_append_entry(f, NULL, &iovec, 1, NULL, NULL, NULL) == 0);
+        }
+}
+
+static void check_messages(const char *path, unsigned first, unsigned n) {
+        const char *paths[] = { path, NULL };
+        unsigned i = first;
+        sd_journal *j;
+        int r;
+
+        assert_se(sd_journal_open_files(&j, paths, 0) >= 0);
+
+        while ((r = sd_journal_next(j)) > 0) {
+                char message[sizeof("MESSAGE=Accepted publickey for root from 10.0.. port  ssh2") + 3 * DECIMAL_STR_MAX(unsigned)];
+                const void *d;
+                size_t l;
+
+                xsprintf(message, "MESSAGE=Accepted publickey for root from 10.0.%u.%u port %u ssh2", i % 256, i / 256, 1024 + i);
+
+                assert_se(sd_journal_get_data(j, "MESSAGE", &d, &l) >= 0);
+                assert_se(l == strlen(message) && memcmp(d, message, l) == 0);
+                i++;
+        }
+        assert_se(r == 0);
+        assert_se(i == first + n);
+
+        sd_journal_close(j);
+}
+
+static void test_dictionary(void) {
+        JournalFile *f, *g, *h, *k, *l;
+        uint64_t size_without, size_with;
+        char t[] = "/tmp/journal-XXXXXX";
+
+        log_set_max_level(LOG_DEBUG);
+
+        assert_se(mkdtemp(t));
+        assert_se(chdir(t) >= 0);
+
+        assert_se(journal_file_open(-1, "test.journal", O_RDWR|O_CREAT, 0666, true, false, NULL, NULL, NULL, NULL, &f) == 0);
+        assert_se(JOURNAL_HEADER_COMPRESSED_ZSTD(f->header));
+        assert_se(f->header->dictionary_offset == 0);
+
+        /* Short messages like these are not compressed at all without a dictionary. The first file only
+         * collects them, and a dictionary is trained from them in the background, not while appending. */
+        append_messages(f, 0, N_DICTIONARY_ENTRIES);
+        assert_se(f->header->dictionary_offset == 0);
+        assert_se(f->n_dictionary_samples > 0);
+        assert_se(f->dictionary_training_submitted);
+        size_without = le64toh(f->header->tail_object_offset);
+
+        assert_se(journal_file_verify(f, NULL, 0, NULL, NULL, NULL, false) >= 0);
+
+        /* The file replacing it starts out with a dictionary trained from them, once the training is done */
+        journal_file_wait_for_dictionary(f);
+        assert_se(journal_file_open(-1, "test2.journal", O_RDWR|O_CREAT, 0666, true, false, NULL, NULL, NULL, f, &g) == 0);
+        assert_se(g->header->dictionary_offset != 0);
+        assert_se(journal_file_dictionary(g));
+        assert_se(f->n_dictionary_samples == 0);
+
+        size_with = le64toh(g->header->tail_object_offset);
+        append_messages(g, 0, N_DICTIONARY_ENTRIES);
+        size_with = le64toh(g->header->tail_object_offset) - size_with;
+        log_info("%u entries took %" PRIu64 " bytes without dictionary, %" PRIu64 " bytes with dictionary.",
+                 N_DICTIONARY_ENTRIES, size_without, size_with);
+        assert_se(size_with < size_without);
+
+        /* A fresh dictionary is passed on as it is, without collecting payloads */
+        assert_se(g->n_dictionary_samples == 0);
+
+        assert_se(journal_file_verify(g, NULL, 0, NULL, NULL, NULL, false) >= 0);
+
+        assert_se(journal_file_open(-1, "test3.journal", O_RDWR|O_CREAT, 0666, true, false, NULL, NULL, NULL, g, &h) == 0);
+        assert_se(h->header->dictionary_offset != 0);
+        assert_se(journal_file_dictionary(h)->id == journal_file_dictionary(g)->id);
+
+        append_messages(h, 0, 100);
+        assert_se(journal_file_verify(h, NULL, 0, NULL, NULL, NULL, false) >= 0);
+
+        /* A file rotated before it collected enough payloads passes them on to the file replacing it */
+        assert_se(journal_file_open(-1, "test4.journal", O_RDWR|O_CREAT, 0666, true, false, NULL, NULL, NULL, NULL, &k) == 0);
+        append_messages(k, 0, 100);
+        assert_se(k->n_dictionary_samples > 0);
+        assert_se(!k->dictionary_training_submitted);
+
+        assert_se(journal_file_open(-1, "test5.journal", O_RDWR|O_CREAT, 0666, true, false, NULL, NULL, NULL, k, &l) == 0);
+        assert_se(l->header->dictionary_offset == 0);
+        assert_se(l->n_dictionary_samples > 0);
+        assert_se(k->n_dictionary_samples == 0);
+
+        (void) journal_file_close(f);
+        (void) journal_file_close(g);
+        (void) journal_file_close(h);
+        (void) journal_file_close(k);
+        (void) journal_file_close(l);
+
+        check_messages("test.journal", 0, N_DICTIONARY_ENTRIES);
+        check_messages("test2.journal", 0, N_DICTIONARY_ENTRIES);
+        check_messages("test3.journal", 0, 100);
+
+        assert_se(rm_rf(t, REMOVE_ROOT|REMOVE_PHYSICAL) >= 0);
+
+        puts("------------------------------------------------------------");
+}
+#endif
+
+#define N_BENCHMARK_FIELDS 8
+
+static void benchmark_append_entries(unsigned batch_size, usec_t duration) {
+        char messages[256][DECIMAL_STR_MAX(uint64_t) + 9], t[] = "/tmp/journal-XXXXXX";
+        struct iovec iovec[256][N_BENCHMARK_FIELDS];
+        JournalEntryBatchItem entries[256];
+        uint64_t total = 0;
+        usec_t start, end;
+        JournalFile *f;
+        unsigned i, j;
+
+        assert_se(batch_size > 0 && batch_size <= ELEMENTSOF(entries));
+
+        log_set_max_level(LOG_INFO);
+
+        assert_se(mkdtemp(t));
+        assert_se(chdir(t) >= 0);
+
+        assert_se(journal_file_open(-1, "test.journal", O_RDWR|O_CREAT, 0666, false, false, NULL, NULL, NULL, NULL, &f) == 0);
+
+        /* Resemble what journald writes: mostly fields shared by all entries of a service, and a message */
+        for (i = 0; i < batch_size; i++) {
+                IOVEC_SET_STRING(iovec[i][0], "PRIORITY=6");
+                IOVEC_SET_STRING(iovec[i][1], "SYSLOG_FACILITY=3");
+                IOVEC_SET_STRING(iovec[i][2], "SYSLOG_IDENTIFIER=test-journal");
+                IOVEC_SET_STRING(iovec[i][3], "_TRANSPORT=stdout");
+                IOVEC_SET_STRING(iovec[i][4], "_COMM=test-journal");
+                IOVEC_SET_STRING(iovec[i][5], "_SYSTEMD_UNIT=test-journal.service");
+                IOVEC_SET_STRING(iovec[i][6], "_HOSTNAME=localhost");
+
+                entries[i] = (JournalEntryBatchItem) {
+                        .iovec = iovec[i],
+                        .n_iovec = N_BENCHMARK_FIELDS,
+                };
+        }
+
+        start = now(CLOCK_MONOTONIC);
+
+        do {
+                for (i = 0; i < batch_size; i++) {
+                        xsprintf(messages[i], "MESSAGE=%" PRIu64, total + i);
+                        IOVEC_SET_STRING(iovec[i][7], messages[i]);
+                }
+
+                assert_se(journal_file_append_entries(f, entries, batch_size, NULL, &j) == 0);
+                assert_se(j == batch_size);
+
+                total += batch_size;
+                end = now(CLOCK_MONOTONIC);
+        } while (end - start < duration);
+
+        log_info("Batches of %3u: appended %" PRIu64 " entries in %.2fs (%.0f entries/s)",
+                 batch_size, total, (end - start) / 1e6, total * 1e6 / (end - start));
+
+        (void) journal_file_close(f);
+
+        assert_se(rm_rf(t, REMOVE_ROOT|REMOVE_PHYSICAL) >= 0);
+}
+
 int main(int argc, char *argv[]) {
+        usec_t duration;
+        bool slow;
+        int r;
+
         arg_keep = argc > 1;
 
         /* journal_file_open requires a valid machine id */
@@ -173,6 +512,19 @@ int main(int argc, char *argv[]) {
 
         test_non_empty();
         test_empty();
+        test_append_entries();
+        test_offline();
+#ifdef HAVE_ZSTD
+        test_dictionary();
+#endif
+
+        r = getenv_bool("SYSTEMD_SLOW_TESTS");
+        slow = r >= 0 ? r : SYSTEMD_SLOW_TESTS_DEFAULT;
+        duration = slow ? 2 * USEC_PER_SEC : USEC_PER_SEC / 50;
+
+        benchmark_append_entries(1, duration);
+        benchmark_append_entries(16, duration);
+        benchmark_append_entries(256, duration);
 
         return 0;
 }
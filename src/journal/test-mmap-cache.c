@@ -22,13 +22,17 @@
 #include <sys/mman.h>
 #include <unistd.h>
 
+#include "env-util.h"
 #include "fd-util.h"
 #include "fileio.h"
 #include "macro.h"
 #include "mmap-cache.h"
+#include "random-util.h"
 #include "util.h"
 
-int main(int argc, char *argv[]) {
+static uint64_t arg_file_size;
+
+static void test_basic(void) {
         MMapFileDescriptor *fx;
         int x, y, z, r;
         char px[] = "/tmp/testmmapXXXXXXX", py[] = "/tmp/testmmapYXXXXXX", pz[] = "/tmp/testmmapZXXXXXX";
@@ -78,6 +82,123 @@ int main(int argc, char *argv[]) {
         safe_close(x);
         safe_close(y);
         safe_close(z);
+}
+
+static int make_file(void) {
+        char p[] = "/tmp/testmmapAXXXXXX";
+        uint8_t buf[64 * 1024];
+        uint64_t i;
+        int fd;
+
+        fd = mkostemp_safe(p);
+        assert_se(fd >= 0);
+        (void) unlink(p);
+
+        /* Write actual data, so that page cache behaviour is somewhat realistic */
+        random_bytes(buf, sizeof(buf));
+        for (i = 0; i < arg_file_size; i += sizeof(buf))
+                assert_se(write(fd, buf, sizeof(buf)) == sizeof(buf));
+
+        return fd;
+}
+
+static void test_sequential(int fd) {
+        size_t first = 0, n;
+        MMapFileDescriptor *f;
+        usec_t start, end;
+        MMapCache *m;
+        uint64_t i, sum = 0;
+
+        assert_se(m = mmap_cache_new());
+        assert_se(f = mmap_cache_add_fd(m, fd));
+
+        /* Read the file front to back in small steps, like an export of all entries does */
+        start = now(CLOCK_MONOTONIC);
+        for (i = 0; i + 64 <= arg_file_size; i += 512) {
+                void *p;
+                size_t l;
+
+                assert_se(mmap_cache_get(m, f, PROT_READ, 0, false, i, 64, NULL, &p, &l) > 0);
+                sum += *(uint8_t*) p;
+
+                /* Windows grow, but never beyond the maximum */
+                assert_se(l <= MMAP_CACHE_WINDOW_SIZE_MAX);
+
+                /* Remember how far ahead of us the first window reaches */
+                if (first == 0)
+                        first = l;
+        }
+        end = now(CLOCK_MONOTONIC);
+
+        n = mmap_cache_get_missed(m);
+
+        log_info("sequential: %u hits, %u misses, %u unmaps in %.3fs (%.1f MiB/s, %" PRIu64 ")",
+                 mmap_cache_get_hit(m), mmap_cache_get_missed(m), mmap_cache_get_unmapped(m),
+                 (end - start) / 1e6, arg_file_size / 1024.0 / 1024.0 / ((end - start) / 1e6), sum);
+
+        /* Windows grow, hence there are fewer misses than with fixed 8MiB windows */
+        assert_se(n < arg_file_size / (8ULL*1024ULL*1024ULL));
+        assert_se(first <= 8ULL*1024ULL*1024ULL);
+
+        mmap_cache_free_fd(m, f);
+        mmap_cache_unref(m);
+}
+
+static void test_random(int fd) {
+        MMapFileDescriptor *f;
+        usec_t start, end;
+        MMapCache *m;
+        uint64_t sum = 0;
+        unsigned i, n;
+
+        assert_se(m = mmap_cache_new());
+        assert_se(f = mmap_cache_add_fd(m, fd));
+
+        /* Jump around the file, like bisecting through entry arrays does */
+        n = arg_file_size / 4096;
+        start = now(CLOCK_MONOTONIC);
+        for (i = 0; i < n; i++) {
+                uint64_t offset;
+                void *p;
+                size_t l;
+
+                offset = random_u64() % (arg_file_size - 64);
+
+                assert_se(mmap_cache_get(m, f, PROT_READ, 1, false, offset, 64, NULL, &p, &l) > 0);
+                sum += *(uint8_t*) p;
+
+                /* Windows shrink while we jump around, but a random miss close to the end of the previous
+                 * window looks like sequential access, and lets the next window grow again. Hence all that
+                 * is guaranteed is that no window is larger than the maximum window size. */
+                assert_se(l <= MMAP_CACHE_WINDOW_SIZE_MAX);
+        }
+        end = now(CLOCK_MONOTONIC);
+
+        log_info("random: %u lookups, %u hits, %u misses, %u unmaps in %.3fs (%.0fns per lookup, %" PRIu64 ")",
+                 n, mmap_cache_get_hit(m), mmap_cache_get_missed(m), mmap_cache_get_unmapped(m),
+                 (end - start) / 1e6, (end - start) * 1e3 / n, sum);
+
+        mmap_cache_free_fd(m, f);
+        mmap_cache_unref(m);
+}
+
+int main(int argc, char *argv[]) {
+        bool slow;
+        int r, fd;
+
+        log_set_max_level(LOG_INFO);
+
+        test_basic();
+
+        r = getenv_bool("SYSTEMD_SLOW_TESTS");
+        slow = r >= 0 ? r : SYSTEMD_SLOW_TESTS_DEFAULT;
+
+        arg_file_size = (slow ? 1024ULL : 128ULL) * 1024ULL * 1024ULL;
+
+        fd = make_file();
+        test_sequential(fd);
+        test_random(fd);
+        safe_close(fd);
 
         return 0;
 }
@@ -107,6 +107,15 @@ struct node_vtable {
         const sd_bus_vtable *vtable;
         sd_bus_object_find_t find;
 
+        /* The properties returned by GetAll(), picked from the vtable when it is added */
+        const sd_bus_vtable **get_all_properties;
+        unsigned n_get_all_properties;
+
+        /* The vtable as introspection XML, generated on first use */
+        char *introspection;
+        size_t introspection_size;
+        bool introspection_trusted;
+
         unsigned last_iteration;
 
         LIST_FIELDS(struct node_vtable, vtables);
@@ -214,6 +223,8 @@ struct sd_bus {
 
         void *rbuffer;
         size_t rbuffer_size;
+        size_t rbuffer_allocated;
+        struct BusMessageArena *rarena;
 
         sd_bus_message **rqueue;
         unsigned rqueue_size;
@@ -224,6 +235,11 @@ struct sd_bus {
         size_t windex;
         size_t wqueue_allocated;
 
+        /* How many messages were sent in how many write calls, for tuning the write path. These are
+         * deliberately not public API, see bus_get_write_stats(). */
+        uint64_t n_messages_written;
+        uint64_t n_write_calls;
+
         uint64_t cookie;
 
         char *unique_name;
@@ -324,6 +340,15 @@ struct sd_bus {
 #define BUS_MESSAGE_SIZE_MAX (64*1024*1024)
 #define BUS_AUTH_SIZE_MAX (64*1024)
 
+/* We read at least this much from the socket at once, and copy the complete messages up to
+ * BUS_ARENA_MESSAGE_MAX bytes into the arena of the connection, which is at least BUS_ARENA_SIZE bytes */
+#define BUS_READ_SIZE (16*1024)
+#define BUS_ARENA_MESSAGE_MAX (4*1024)
+#define BUS_ARENA_SIZE (32*1024)
+
+/* Queued messages are written with up to this many iovecs at once */
+#define BUS_WRITE_IOVEC_MAX 256
+
 #define BUS_CONTAINER_DEPTH 128
 
 /* Defined by the specification as maximum size of an array in
@@ -362,6 +387,8 @@ int bus_rqueue_make_room(sd_bus *bus);
 
 bool bus_pid_changed(sd_bus *bus);
 
+void bus_get_write_stats(sd_bus *bus, uint64_t *ret_messages, uint64_t *ret_writes);
+
 char *bus_address_escape(const char *v);
 
 #define OBJECT_PATH_FOREACH_PREFIX(prefix, path)                        \
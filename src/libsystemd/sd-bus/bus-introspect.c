@@ -174,6 +174,35 @@ int introspect_write_interface(struct introspect *i, const sd_bus_vtable *v) {
         return 0;
 }
 
+int introspect_interface_to_string(const sd_bus_vtable *v, bool trusted, char **ret, size_t *ret_size) {
+        struct introspect i = {
+                .trusted = trusted,
+        };
+        int r;
+
+        assert(v);
+        assert(ret);
+        assert(ret_size);
+
+        i.f = open_memstream(&i.introspection, &i.size);
+        if (!i.f)
+                return -ENOMEM;
+
+        r = introspect_write_interface(&i, v);
+        if (r >= 0)
+                r = fflush_and_check(i.f);
+        if (r < 0) {
+                introspect_free(&i);
+                return r;
+        }
+
+        i.f = safe_fclose(i.f);
+
+        *ret = i.introspection;
+        *ret_size = i.size;
+        return 0;
+}
+
 int introspect_finish(struct introspect *i, sd_bus *bus, sd_bus_message *m, sd_bus_message **reply) {
         sd_bus_message *q;
         int r;
@@ -62,16 +62,23 @@
  *  ` BUS_MATCH_SENDER
  *    ` BUS_MATCH_VALUE: value == miau
  *      ` BUS_MATCH_LEAF: E
+ *
+ * The value nodes of each compare node are kept in a hash table
+ * indexed by their value, so that a message only visits the ones it
+ * matches, no matter how many there are. For the path and namespace
+ * prefix matches we look up the value of the message and each of its
+ * prefixes that may match, just like the fallback vtables of object
+ * paths are found.
  */
 
 static inline bool BUS_MATCH_IS_COMPARE(enum bus_match_node_type t) {
         return t >= BUS_MATCH_SENDER && t <= BUS_MATCH_ARG_HAS_LAST;
 }
 
-static inline bool BUS_MATCH_CAN_HASH(enum bus_match_node_type t) {
-        return (t >= BUS_MATCH_MESSAGE_TYPE && t <= BUS_MATCH_PATH) ||
-                (t >= BUS_MATCH_ARG && t <= BUS_MATCH_ARG_LAST) ||
-                (t >= BUS_MATCH_ARG_HAS && t <= BUS_MATCH_ARG_HAS_LAST);
+static inline bool BUS_MATCH_IS_WELL_KNOWN(struct bus_match_node *node) {
+        return node->type == BUS_MATCH_VALUE &&
+                node->parent->type == BUS_MATCH_SENDER &&
+                node->value.str[0] != ':';
 }
 
 static void bus_match_node_free(struct bus_match_node *node) {
@@ -92,6 +99,19 @@ static void bus_match_node_free(struct bus_match_node *node) {
                         node->parent->child = node->next;
                 }
 
+                if (node->next)
+                        node->next->prev = node->prev;
+        } else if (BUS_MATCH_IS_WELL_KNOWN(node)) {
+                /* We are linked into the parent's list of
+                 * well-known names. */
+                if (node->prev) {
+                        assert(node->prev->next == node);
+                        node->prev->next = node->next;
+                } else {
+                        assert(node->parent->compare.well_known == node);
+                        node->parent->compare.well_known = node->next;
+                }
+
                 if (node->next)
                         node->next->prev = node->prev;
         }
@@ -102,7 +122,7 @@ static void bus_match_node_free(struct bus_match_node *node) {
 
                 if (node->parent->type == BUS_MATCH_MESSAGE_TYPE)
                         hashmap_remove(node->parent->compare.children, UINT_TO_PTR(node->value.u8));
-                else if (BUS_MATCH_CAN_HASH(node->parent->type) && node->value.str)
+                else if (BUS_MATCH_IS_COMPARE(node->parent->type) && node->value.str)
                         hashmap_remove(node->parent->compare.children, node->value.str);
 
                 free(node->value.str);
@@ -220,39 +240,181 @@ static bool value_node_test(
         }
 }
 
-static bool value_node_same(
+static int bus_match_run_value(
+                sd_bus *bus,
                 struct bus_match_node *node,
-                enum bus_match_node_type parent_type,
-                uint8_t value_u8,
-                const char *value_str) {
+                const void *value,
+                sd_bus_message *m) {
 
-        /* Tests parameters against this value node, not doing prefix
-         * magic and stuff, i.e. this one actually compares the match
-         * itself. */
+        struct bus_match_node *found;
 
         assert(node);
-        assert(node->type == BUS_MATCH_VALUE);
 
-        switch (parent_type) {
+        if (!value)
+                return 0;
 
-        case BUS_MATCH_MESSAGE_TYPE:
-                return node->value.u8 == value_u8;
+        found = hashmap_get(node->compare.children, value);
+        if (!found)
+                return 0;
 
-        case BUS_MATCH_SENDER:
-        case BUS_MATCH_DESTINATION:
-        case BUS_MATCH_INTERFACE:
-        case BUS_MATCH_MEMBER:
-        case BUS_MATCH_PATH:
-        case BUS_MATCH_ARG ... BUS_MATCH_ARG_LAST:
-        case BUS_MATCH_ARG_HAS ... BUS_MATCH_ARG_HAS_LAST:
-        case BUS_MATCH_ARG_NAMESPACE ... BUS_MATCH_ARG_NAMESPACE_LAST:
-        case BUS_MATCH_PATH_NAMESPACE:
-        case BUS_MATCH_ARG_PATH ... BUS_MATCH_ARG_PATH_LAST:
-                return streq(node->value.str, value_str);
+        return bus_match_run(bus, found, m);
+}
 
-        default:
-                assert_not_reached("Invalid node type");
+static int bus_match_run_all(
+                sd_bus *bus,
+                struct bus_match_node *node,
+                const char *value,
+                sd_bus_message *m) {
+
+        struct bus_match_node *c;
+        Iterator i;
+        int r;
+
+        assert(node);
+
+        /* Tests all value nodes, for the matches we can't look
+         * up. We stop once a callback changed the matches, since
+         * that might have invalidated the iterator. */
+
+        HASHMAP_FOREACH(c, node->compare.children, i) {
+                if (!value_node_test(c, node->type, 0, value, NULL, m))
+                        continue;
+
+                r = bus_match_run(bus, c, m);
+                if (r != 0)
+                        return r;
+
+                if (bus && bus->match_callbacks_modified)
+                        return 0;
+        }
+
+        return 0;
+}
+
+static int bus_match_run_sender(
+                sd_bus *bus,
+                struct bus_match_node *node,
+                const char *sender,
+                sd_bus_message *m) {
+
+        char **i;
+        int r;
+
+        assert(node);
+        assert(m);
+
+        r = bus_match_run_value(bus, node, sender, m);
+        if (r != 0)
+                return r;
+
+        if (!(m->creds.mask & SD_BUS_CREDS_WELL_KNOWN_NAMES)) {
+                struct bus_match_node *c;
+
+                /* If we don't know the well-known names of a
+                 * unique sender, we let it match all of them, see
+                 * value_node_test(). */
+                if (!sender || sender[0] != ':')
+                        return 0;
+
+                for (c = node->compare.well_known; c; c = c->next) {
+                        r = bus_match_run(bus, c, m);
+                        if (r != 0)
+                                return r;
+
+                        if (bus && bus->match_callbacks_modified)
+                                return 0;
+                }
+
+                return 0;
         }
+
+        STRV_FOREACH(i, m->creds.well_known_names) {
+                if (streq_ptr(*i, sender))
+                        continue;
+
+                r = bus_match_run_value(bus, node, *i, m);
+                if (r != 0)
+                        return r;
+
+                if (bus && bus->match_callbacks_modified)
+                        return 0;
+        }
+
+        return 0;
+}
+
+static int bus_match_run_prefixes(
+                sd_bus *bus,
+                struct bus_match_node *node,
+                const char *value,
+                char separator,
+                bool simple,
+                sd_bus_message *m) {
+
+        _cleanup_free_ char *allocated = NULL;
+        char buffer[256], *prefix;
+        size_t l, k;
+        int r;
+
+        assert(node);
+
+        if (!value)
+                return 0;
+
+        /* Looks up the value, and all of its prefixes that end
+         * in the separator. For simple patterns, which match
+         * all values that continue with a separator, also all
+         * the prefixes that end right before one. */
+
+        l = strlen(value);
+        if (l < sizeof(buffer))
+                prefix = buffer;
+        else {
+                prefix = allocated = new(char, l + 1);
+                if (!prefix)
+                        return -ENOMEM;
+        }
+
+        memcpy(prefix, value, l + 1);
+
+        /* A callback that changed the matches might have freed
+         * the node, hence stop then. */
+
+        r = bus_match_run_value(bus, node, prefix, m);
+        if (r != 0)
+                return r;
+
+        if (bus && bus->match_callbacks_modified)
+                return 0;
+
+        for (k = l; k > 0; k--) {
+                if (prefix[k - 1] != separator)
+                        continue;
+
+                if (k < l) {
+                        prefix[k] = 0;
+
+                        r = bus_match_run_value(bus, node, prefix, m);
+                        if (r != 0)
+                                return r;
+
+                        if (bus && bus->match_callbacks_modified)
+                                return 0;
+                }
+
+                if (simple && k > 1) {
+                        prefix[k - 1] = 0;
+
+                        r = bus_match_run_value(bus, node, prefix, m);
+                        if (r != 0)
+                                return r;
+
+                        if (bus && bus->match_callbacks_modified)
+                                return 0;
+                }
+        }
+
+        return 0;
 }
 
 int bus_match_run(
@@ -387,53 +549,44 @@ int bus_match_run(
                 assert_not_reached("Unknown match type.");
         }
 
-        if (BUS_MATCH_CAN_HASH(node->type)) {
-                struct bus_match_node *found;
+        if (node->type == BUS_MATCH_MESSAGE_TYPE)
+                r = bus_match_run_value(bus, node, UINT_TO_PTR(test_u8), m);
 
-                /* Lookup via hash table, nice! So let's jump directly. */
-
-                if (test_str)
-                        found = hashmap_get(node->compare.children, test_str);
-                else if (test_strv) {
-                        char **i;
+        else if (node->type == BUS_MATCH_SENDER)
+                r = bus_match_run_sender(bus, node, test_str, m);
 
-                        STRV_FOREACH(i, test_strv) {
-                                found = hashmap_get(node->compare.children, *i);
-                                if (found) {
-                                        r = bus_match_run(bus, found, m);
-                                        if (r != 0)
-                                                return r;
-                                }
-                        }
+        else if (node->type == BUS_MATCH_PATH_NAMESPACE)
+                r = bus_match_run_prefixes(bus, node, test_str, '/', true, m);
 
-                        found = NULL;
-                } else if (node->type == BUS_MATCH_MESSAGE_TYPE)
-                        found = hashmap_get(node->compare.children, UINT_TO_PTR(test_u8));
-                else
-                        found = NULL;
+        else if (node->type >= BUS_MATCH_ARG_NAMESPACE && node->type <= BUS_MATCH_ARG_NAMESPACE_LAST)
+                r = bus_match_run_prefixes(bus, node, test_str, '.', true, m);
 
-                if (found) {
-                        r = bus_match_run(bus, found, m);
-                        if (r != 0)
-                                return r;
-                }
-        } else {
-                struct bus_match_node *c;
+        else if (node->type >= BUS_MATCH_ARG_PATH && node->type <= BUS_MATCH_ARG_PATH_LAST) {
 
-                /* No hash table, so let's iterate manually... */
+                /* A value ending in a slash also matches all paths
+                 * it is a prefix of, and those we can't look up */
+                if (test_str && endswith(test_str, "/"))
+                        r = bus_match_run_all(bus, node, test_str, m);
+                else
+                        r = bus_match_run_prefixes(bus, node, test_str, '/', false, m);
 
-                for (c = node->child; c; c = c->next) {
-                        if (!value_node_test(c, node->type, test_u8, test_str, test_strv, m))
-                                continue;
+        } else if (test_strv) {
+                char **i;
 
-                        r = bus_match_run(bus, c, m);
+                r = 0;
+                STRV_FOREACH(i, test_strv) {
+                        r = bus_match_run_value(bus, node, *i, m);
                         if (r != 0)
-                                return r;
+                                break;
 
                         if (bus && bus->match_callbacks_modified)
                                 return 0;
                 }
-        }
+        } else
+                r = bus_match_run_value(bus, node, test_str, m);
+
+        if (r != 0)
+                return r;
 
         if (bus && bus->match_callbacks_modified)
                 return 0;
@@ -466,12 +619,8 @@ static int bus_match_add_compare_value(
 
                 if (t == BUS_MATCH_MESSAGE_TYPE)
                         n = hashmap_get(c->compare.children, UINT_TO_PTR(value_u8));
-                else if (BUS_MATCH_CAN_HASH(t))
+                else
                         n = hashmap_get(c->compare.children, value_str);
-                else {
-                        for (n = c->child; n && !value_node_same(n, t, value_u8, value_str); n = n->next)
-                                ;
-                }
 
                 if (n) {
                         *ret = n;
@@ -494,18 +643,13 @@ static int bus_match_add_compare_value(
                         c->next->prev = c;
                 where->child = c;
 
-                if (t == BUS_MATCH_MESSAGE_TYPE) {
+                if (t == BUS_MATCH_MESSAGE_TYPE)
                         c->compare.children = hashmap_new(NULL);
-                        if (!c->compare.children) {
-                                r = -ENOMEM;
-                                goto fail;
-                        }
-                } else if (BUS_MATCH_CAN_HASH(t)) {
+                else
                         c->compare.children = hashmap_new(&string_hash_ops);
-                        if (!c->compare.children) {
-                                r = -ENOMEM;
-                                goto fail;
-                        }
+                if (!c->compare.children) {
+                        r = -ENOMEM;
+                        goto fail;
                 }
         }
 
@@ -526,20 +670,19 @@ static int bus_match_add_compare_value(
         }
 
         n->parent = c;
-        if (c->compare.children) {
 
-                if (t == BUS_MATCH_MESSAGE_TYPE)
-                        r = hashmap_put(c->compare.children, UINT_TO_PTR(value_u8), n);
-                else
-                        r = hashmap_put(c->compare.children, n->value.str, n);
+        if (t == BUS_MATCH_MESSAGE_TYPE)
+                r = hashmap_put(c->compare.children, UINT_TO_PTR(value_u8), n);
+        else
+                r = hashmap_put(c->compare.children, n->value.str, n);
+        if (r < 0)
+                goto fail;
 
-                if (r < 0)
-                        goto fail;
-        } else {
-                n->next = c->child;
+        if (BUS_MATCH_IS_WELL_KNOWN(n)) {
+                n->next = c->compare.well_known;
                 if (n->next)
                         n->next->prev = n;
-                c->child = n;
+                c->compare.well_known = n;
         }
 
         *ret = n;
@@ -579,12 +722,8 @@ static int bus_match_find_compare_value(
 
         if (t == BUS_MATCH_MESSAGE_TYPE)
                 n = hashmap_get(c->compare.children, UINT_TO_PTR(value_u8));
-        else if (BUS_MATCH_CAN_HASH(t))
+        else
                 n = hashmap_get(c->compare.children, value_str);
-        else {
-                for (n = c->child; n && !value_node_same(n, t, value_u8, value_str); n = n->next)
-                        ;
-        }
 
         if (n) {
                 *ret = n;
@@ -1079,7 +1218,7 @@ void bus_match_free(struct bus_match_node *node) {
         if (!node)
                 return;
 
-        if (BUS_MATCH_CAN_HASH(node->type)) {
+        if (BUS_MATCH_IS_COMPARE(node->type)) {
                 Iterator i;
 
                 HASHMAP_FOREACH(c, node->compare.children, i)
@@ -1172,7 +1311,7 @@ void bus_match_dump(struct bus_match_node *node, unsigned level) {
         else
                 putchar('\n');
 
-        if (BUS_MATCH_CAN_HASH(node->type)) {
+        if (BUS_MATCH_IS_COMPARE(node->type)) {
                 Iterator i;
 
                 HASHMAP_FOREACH(c, node->compare.children, i)
@@ -61,8 +61,11 @@ struct bus_match_node {
                         struct match_callback *callback;
                 } leaf;
                 struct {
-                        /* If this is set, then the child is NULL */
+                        /* The value nodes, indexed by their value. The child is NULL. */
                         Hashmap *children;
+
+                        /* For BUS_MATCH_SENDER, the value nodes of well-known names are also linked here */
+                        struct bus_match_node *well_known;
                 } compare;
         };
 };
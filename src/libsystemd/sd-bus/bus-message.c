@@ -128,13 +128,19 @@ static void message_free(sd_bus_message *m) {
 
         m->destination_ptr = mfree(m->destination_ptr);
         message_reset_containers(m);
-        free(m->root_container.signature);
+        if (!m->signature_in_header)
+                free(m->root_container.signature);
         free(m->root_container.offsets);
 
         free(m->root_container.peeked_signature);
 
         bus_creds_done(&m->creds);
-        free(m);
+
+        /* Messages from an arena are part of it, hence don't touch them after letting go of it */
+        if (m->arena)
+                bus_message_arena_unref(m->arena);
+        else
+                free(m);
 }
 
 static void *message_extend_fields(sd_bus_message *m, size_t align, size_t sz, bool add_offset) {
@@ -158,16 +164,19 @@ static void *message_extend_fields(sd_bus_message *m, size_t align, size_t sz, b
                 return (uint8_t*) m->header + old_size;
 
         if (m->free_header) {
-                np = realloc(m->header, ALIGN8(new_size));
-                if (!np)
+                /* Leave room for the next fields, so that they don't
+                 * need a realloc() each */
+                np = m->header;
+                if (!greedy_realloc(&np, &m->header_allocated, ALIGN8(new_size), 1))
                         goto poison;
         } else {
                 /* Initially, the header is allocated as part of
                  * the sd_bus_message itself, let's replace it by
                  * dynamic data */
 
-                np = malloc(ALIGN8(new_size));
-                if (!np)
+                np = NULL;
+                m->header_allocated = 0;
+                if (!greedy_realloc(&np, &m->header_allocated, ALIGN8(new_size), 1))
                         goto poison;
 
                 memcpy(np, m->header, sizeof(struct bus_header));
@@ -404,28 +413,17 @@ static int message_append_reply_cookie(sd_bus_message *m, uint64_t cookie) {
         }
 }
 
-int bus_message_from_header(
-                sd_bus *bus,
+static int message_init_header(
+                sd_bus_message *m,
                 void *header,
                 size_t header_accessible,
                 void *footer,
                 size_t footer_accessible,
-                size_t message_size,
-                int *fds,
-                unsigned n_fds,
-                const char *label,
-                size_t extra,
-                sd_bus_message **ret) {
+                size_t message_size) {
 
-        _cleanup_free_ sd_bus_message *m = NULL;
         struct bus_header *h;
-        size_t a, label_sz;
 
-        assert(bus);
-        assert(header || header_accessible <= 0);
-        assert(footer || footer_accessible <= 0);
-        assert(fds || n_fds <= 0);
-        assert(ret);
+        assert(m);
 
         if (header_accessible < sizeof(struct bus_header))
                 return -EBADMSG;
@@ -447,17 +445,6 @@ int bus_message_from_header(
 
         /* Note that we are happy with unknown flags in the flags header! */
 
-        a = ALIGN(sizeof(sd_bus_message)) + ALIGN(extra);
-
-        if (label) {
-                label_sz = strlen(label);
-                a += label_sz + 1;
-        }
-
-        m = malloc0(a);
-        if (!m)
-                return -ENOMEM;
-
         m->n_ref = 1;
         m->sealed = true;
         m->header = header;
@@ -502,6 +489,47 @@ int bus_message_from_header(
                         return -EBADMSG;
         }
 
+        return 0;
+}
+
+int bus_message_from_header(
+                sd_bus *bus,
+                void *header,
+                size_t header_accessible,
+                void *footer,
+                size_t footer_accessible,
+                size_t message_size,
+                int *fds,
+                unsigned n_fds,
+                const char *label,
+                size_t extra,
+                sd_bus_message **ret) {
+
+        _cleanup_free_ sd_bus_message *m = NULL;
+        size_t a, label_sz;
+        int r;
+
+        assert(bus);
+        assert(header || header_accessible <= 0);
+        assert(footer || footer_accessible <= 0);
+        assert(fds || n_fds <= 0);
+        assert(ret);
+
+        a = ALIGN(sizeof(sd_bus_message)) + ALIGN(extra);
+
+        if (label) {
+                label_sz = strlen(label);
+                a += label_sz + 1;
+        }
+
+        m = malloc0(a);
+        if (!m)
+                return -ENOMEM;
+
+        r = message_init_header(m, header, header_accessible, footer, footer_accessible, message_size);
+        if (r < 0)
+                return r;
+
         m->fds = fds;
         m->n_fds = n_fds;
 
@@ -519,6 +547,28 @@ int bus_message_from_header(
         return 0;
 }
 
+static int message_init_body(sd_bus_message *m, void *buffer, size_t length) {
+        size_t sz;
+
+        assert(m);
+
+        sz = length - sizeof(struct bus_header) - ALIGN8(m->fields_size);
+        if (sz > 0) {
+                m->n_body_parts = 1;
+                m->body.data = (uint8_t*) buffer + sizeof(struct bus_header) + ALIGN8(m->fields_size);
+                m->body.size = sz;
+                m->body.sealed = true;
+                m->body.memfd = -1;
+        }
+
+        m->n_iovec = 1;
+        m->iovec = m->iovec_fixed;
+        m->iovec[0].iov_base = buffer;
+        m->iovec[0].iov_len = length;
+
+        return bus_message_parse_fields(m);
+}
+
 int bus_message_from_malloc(
                 sd_bus *bus,
                 void *buffer,
@@ -529,7 +579,6 @@ int bus_message_from_malloc(
                 sd_bus_message **ret) {
 
         sd_bus_message *m;
-        size_t sz;
         int r;
 
         r = bus_message_from_header(
@@ -543,21 +592,7 @@ int bus_message_from_malloc(
         if (r < 0)
                 return r;
 
-        sz = length - sizeof(struct bus_header) - ALIGN8(m->fields_size);
-        if (sz > 0) {
-                m->n_body_parts = 1;
-                m->body.data = (uint8_t*) buffer + sizeof(struct bus_header) + ALIGN8(m->fields_size);
-                m->body.size = sz;
-                m->body.sealed = true;
-                m->body.memfd = -1;
-        }
-
-        m->n_iovec = 1;
-        m->iovec = m->iovec_fixed;
-        m->iovec[0].iov_base = buffer;
-        m->iovec[0].iov_len = length;
-
-        r = bus_message_parse_fields(m);
+        r = message_init_body(m, buffer, length);
         if (r < 0)
                 goto fail;
 
@@ -573,6 +608,84 @@ fail:
         return r;
 }
 
+BusMessageArena* bus_message_arena_new(size_t size) {
+        BusMessageArena *a;
+
+        a = malloc(offsetof(BusMessageArena, data) + size);
+        if (!a)
+                return NULL;
+
+        a->n_ref = REFCNT_INIT;
+        a->size = size;
+        a->used = 0;
+        return a;
+}
+
+BusMessageArena* bus_message_arena_unref(BusMessageArena *a) {
+        if (!a)
+                return NULL;
+
+        assert(REFCNT_GET(a->n_ref) > 0);
+
+        if (REFCNT_DEC(a->n_ref) <= 0)
+                free(a);
+
+        return NULL;
+}
+
+int bus_message_from_arena(
+                sd_bus *bus,
+                BusMessageArena *arena,
+                const void *data,
+                size_t length,
+                int *fds,
+                unsigned n_fds,
+                sd_bus_message **ret) {
+
+        sd_bus_message *m;
+        void *buffer;
+        int r;
+
+        assert(bus);
+        assert(arena);
+        assert(data);
+        assert(fds || n_fds <= 0);
+        assert(ret);
+
+        /* Takes both the object and a copy of the data from the arena, which gives the data the alignment the
+         * parser expects. The caller makes sure there's enough room. */
+        assert(arena->size - arena->used >= BUS_MESSAGE_ARENA_SIZE(length));
+
+        m = (sd_bus_message*) ((uint8_t*) arena->data + arena->used);
+        buffer = (uint8_t*) m + ALIGN8(sizeof(sd_bus_message));
+        arena->used += BUS_MESSAGE_ARENA_SIZE(length);
+
+        memzero(m, sizeof(sd_bus_message));
+        memcpy(buffer, data, length);
+
+        r = message_init_header(m, buffer, length, buffer, length, length);
+        if (r < 0)
+                return r;
+
+        m->fds = fds;
+        m->n_fds = n_fds;
+        m->bus = sd_bus_ref(bus);
+        m->arena = arena;
+        REFCNT_INC(arena->n_ref);
+
+        r = message_init_body(m, buffer, length);
+        if (r < 0) {
+                message_free(m);
+                return r;
+        }
+
+        /* The memory is released with the arena, but the fds are ours now */
+        m->free_fds = true;
+
+        *ret = m;
+        return 0;
+}
+
 static sd_bus_message *message_new(sd_bus *bus, uint8_t type) {
         sd_bus_message *m;
 
@@ -5316,7 +5429,6 @@ int bus_message_parse_fields(sd_bus_message *m) {
 
                 case BUS_MESSAGE_HEADER_SIGNATURE: {
                         const char *s;
-                        char *c;
 
                         if (BUS_MESSAGE_IS_GVARIANT(m)) /* only applies to dbus1 */
                                 return -EBADMSG;
@@ -5331,12 +5443,9 @@ int bus_message_parse_fields(sd_bus_message *m) {
                         if (r < 0)
                                 return r;
 
-                        c = strdup(s);
-                        if (!c)
-                                return -ENOMEM;
-
-                        free(m->root_container.signature);
-                        m->root_container.signature = c;
+                        /* The signature is NUL terminated in the header, and stays around as long as the message */
+                        m->root_container.signature = (char*) s;
+                        m->signature_in_header = true;
                         break;
                 }
 
@@ -28,6 +28,7 @@
 #include "bus-creds.h"
 #include "bus-protocol.h"
 #include "macro.h"
+#include "refcnt.h"
 #include "time-util.h"
 
 struct bus_container {
@@ -65,6 +66,19 @@ struct bus_body_part {
         bool is_zero:1;
 };
 
+/* Holds small messages read from the socket, both the sd_bus_message objects and their data, and is freed
+ * together with the last of them. The connection keeps filling its arena until it is full, and starts over
+ * when it holds the only reference. Messages may be unref'd from other threads than the connection's, hence
+ * the reference count is atomic. */
+typedef struct BusMessageArena {
+        RefCount n_ref;
+        size_t size, used;
+        uint64_t data[];
+} BusMessageArena;
+
+/* The arena space a message of the specified size takes */
+#define BUS_MESSAGE_ARENA_SIZE(size) (ALIGN8(sizeof(sd_bus_message)) + ALIGN8(size))
+
 struct sd_bus_message {
         unsigned n_ref;
 
@@ -94,11 +108,18 @@ struct sd_bus_message {
         bool free_header:1;
         bool free_fds:1;
         bool poisoned:1;
+        bool signature_in_header:1;
 
         /* The first and last bytes of the message */
         struct bus_header *header;
         void *footer;
 
+        /* If set, the above and this object itself are part of this arena, rather than malloc()ed */
+        BusMessageArena *arena;
+
+        /* How many bytes are allocated for the header, if we allocated it */
+        size_t header_allocated;
+
         /* How many bytes are accessible in the above pointers */
         size_t header_accessible;
         size_t footer_accessible;
@@ -213,6 +234,18 @@ int bus_message_from_malloc(
                 const char *label,
                 sd_bus_message **ret);
 
+BusMessageArena* bus_message_arena_new(size_t size);
+BusMessageArena* bus_message_arena_unref(BusMessageArena *a);
+
+int bus_message_from_arena(
+                sd_bus *bus,
+                BusMessageArena *arena,
+                const void *data,
+                size_t length,
+                int *fds,
+                unsigned n_fds,
+                sd_bus_message **ret);
+
 int bus_message_get_arg(sd_bus_message *m, unsigned i, const char **str);
 int bus_message_get_arg_strv(sd_bus_message *m, unsigned i, char ***strv);
 
@@ -740,7 +740,7 @@ static int vtable_append_all_properties(
                 void *userdata,
                 sd_bus_error *error) {
 
-        const sd_bus_vtable *v;
+        unsigned i;
         int r;
 
         assert(bus);
@@ -748,20 +748,8 @@ static int vtable_append_all_properties(
         assert(path);
         assert(c);
 
-        if (c->vtable[0].flags & SD_BUS_VTABLE_HIDDEN)
-                return 1;
-
-        for (v = c->vtable+1; v->type != _SD_BUS_VTABLE_END; v++) {
-                if (v->type != _SD_BUS_VTABLE_PROPERTY && v->type != _SD_BUS_VTABLE_WRITABLE_PROPERTY)
-                        continue;
-
-                if (v->flags & SD_BUS_VTABLE_HIDDEN)
-                        continue;
-
-                if (v->flags & SD_BUS_VTABLE_PROPERTY_EXPLICIT)
-                        continue;
-
-                r = vtable_append_one_property(bus, reply, path, c, v, userdata, error);
+        for (i = 0; i < c->n_get_all_properties; i++) {
+                r = vtable_append_one_property(bus, reply, path, c, c->get_all_properties[i], userdata, error);
                 if (r < 0)
                         return r;
                 if (bus->nodes_modified)
@@ -894,6 +882,36 @@ static int bus_node_exists(
         return 0;
 }
 
+static int node_vtable_get_introspection(sd_bus *bus, struct node_vtable *c, const char **ret, size_t *ret_size) {
+        int r;
+
+        assert(bus);
+        assert(c);
+        assert(ret);
+        assert(ret_size);
+
+        /* The XML only depends on the vtable and on whether the bus is trusted, so let's generate it only once
+         * for all objects it is registered for */
+
+        if (!c->introspection || c->introspection_trusted != bus->trusted) {
+                char *xml;
+                size_t xml_size;
+
+                r = introspect_interface_to_string(c->vtable, bus->trusted, &xml, &xml_size);
+                if (r < 0)
+                        return r;
+
+                free(c->introspection);
+                c->introspection = xml;
+                c->introspection_size = xml_size;
+                c->introspection_trusted = bus->trusted;
+        }
+
+        *ret = c->introspection;
+        *ret_size = c->introspection_size;
+        return 0;
+}
+
 static int process_introspect(
                 sd_bus *bus,
                 sd_bus_message *m,
@@ -904,9 +922,10 @@ static int process_introspect(
         _cleanup_(sd_bus_error_free) sd_bus_error error = SD_BUS_ERROR_NULL;
         _cleanup_(sd_bus_message_unrefp) sd_bus_message *reply = NULL;
         _cleanup_set_free_free_ Set *s = NULL;
-        const char *previous_interface = NULL;
+        const char *previous_interface = NULL, *xml;
         struct introspect intro;
         struct node_vtable *c;
+        size_t xml_size;
         bool empty;
         int r;
 
@@ -960,10 +979,12 @@ static int process_introspect(
                         fprintf(intro.f, " <interface name=\"%s\">\n", c->interface);
                 }
 
-                r = introspect_write_interface(&intro, c->vtable);
+                r = node_vtable_get_introspection(bus, c, &xml, &xml_size);
                 if (r < 0)
                         goto finish;
 
+                fwrite_unlocked(xml, 1, xml_size, intro.f);
+
                 previous_interface = c->interface;
         }
 
@@ -1642,6 +1663,7 @@ static int add_object_vtable_internal(
         sd_bus_slot *s = NULL;
         struct node_vtable *i, *existing = NULL;
         const sd_bus_vtable *v;
+        unsigned n_properties;
         struct node *n;
         int r;
 
@@ -1702,6 +1724,19 @@ static int add_object_vtable_internal(
                 goto fail;
         }
 
+        n_properties = 0;
+        for (v = s->node_vtable.vtable+1; v->type != _SD_BUS_VTABLE_END; v++)
+                if (IN_SET(v->type, _SD_BUS_VTABLE_PROPERTY, _SD_BUS_VTABLE_WRITABLE_PROPERTY))
+                        n_properties++;
+
+        if (n_properties > 0) {
+                s->node_vtable.get_all_properties = new(const sd_bus_vtable*, n_properties);
+                if (!s->node_vtable.get_all_properties) {
+                        r = -ENOMEM;
+                        goto fail;
+                }
+        }
+
         for (v = s->node_vtable.vtable+1; v->type != _SD_BUS_VTABLE_END; v++) {
 
                 switch (v->type) {
@@ -1785,6 +1820,11 @@ static int add_object_vtable_internal(
                                 goto fail;
                         }
 
+                        /* Hidden and explicit properties are only returned when asked for by name */
+                        if (!(s->node_vtable.vtable[0].flags & SD_BUS_VTABLE_HIDDEN) &&
+                            !(v->flags & (SD_BUS_VTABLE_HIDDEN|SD_BUS_VTABLE_PROPERTY_EXPLICIT)))
+                                s->node_vtable.get_all_properties[s->node_vtable.n_get_all_properties++] = v;
+
                         break;
                 }
 
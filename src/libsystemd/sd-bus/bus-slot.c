@@ -174,6 +174,8 @@ void bus_slot_disconnect(sd_bus_slot *slot) {
                 }
 
                 free(slot->node_vtable.interface);
+                free(slot->node_vtable.get_all_properties);
+                free(slot->node_vtable.introspection);
 
                 if (slot->node_vtable.node) {
                         LIST_REMOVE(vtables, slot->node_vtable.node->vtables, &slot->node_vtable);
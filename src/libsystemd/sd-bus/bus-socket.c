@@ -38,6 +38,7 @@
 #include "signal-util.h"
 #include "stdio-util.h"
 #include "string-util.h"
+#include "unaligned.h"
 #include "user-util.h"
 #include "utf8.h"
 #include "util.h"
@@ -90,7 +91,7 @@ static int bus_message_setup_iovec(sd_bus_message *m) {
         assert(!m->iovec);
 
         n = 1 + m->n_body_parts;
-        if (n < ELEMENTSOF(m->iovec_fixed))
+        if (n <= ELEMENTSOF(m->iovec_fixed))
                 m->iovec = m->iovec_fixed;
         else {
                 m->iovec = new(struct iovec, n);
@@ -533,6 +534,7 @@ static int bus_socket_read_auth(sd_bus *b) {
                 return -ENOMEM;
 
         b->rbuffer = p;
+        b->rbuffer_allocated = n;
 
         iov.iov_base = (uint8_t*) b->rbuffer + b->rbuffer_size;
         iov.iov_len = n - b->rbuffer_size;
@@ -765,6 +767,44 @@ int bus_socket_take_fd(sd_bus *b) {
         return bus_socket_start_auth(b);
 }
 
+static ssize_t bus_socket_write_iovec(sd_bus *bus, struct iovec *iov, unsigned n, const int *fds, unsigned n_fds) {
+        ssize_t k;
+
+        assert(bus);
+        assert(iov);
+
+        if (bus->prefer_writev)
+                k = writev(bus->output_fd, iov, n);
+        else {
+                struct msghdr mh = {
+                        .msg_iov = iov,
+                        .msg_iovlen = n,
+                };
+
+                if (n_fds > 0) {
+                        struct cmsghdr *control;
+
+                        mh.msg_control = control = alloca(CMSG_SPACE(sizeof(int) * n_fds));
+                        mh.msg_controllen = control->cmsg_len = CMSG_LEN(sizeof(int) * n_fds);
+                        control->cmsg_level = SOL_SOCKET;
+                        control->cmsg_type = SCM_RIGHTS;
+                        memcpy(CMSG_DATA(control), fds, sizeof(int) * n_fds);
+                }
+
+                k = sendmsg(bus->output_fd, &mh, MSG_DONTWAIT|MSG_NOSIGNAL);
+                if (k < 0 && errno == ENOTSOCK) {
+                        bus->prefer_writev = true;
+                        k = writev(bus->output_fd, iov, n);
+                }
+        }
+
+        if (k < 0)
+                return errno == EAGAIN ? 0 : -errno;
+
+        bus->n_write_calls++;
+        return k;
+}
+
 int bus_socket_write_message(sd_bus *bus, sd_bus_message *m, size_t *idx) {
         struct iovec *iov;
         ssize_t k;
@@ -791,48 +831,81 @@ int bus_socket_write_message(sd_bus *bus, sd_bus_message *m, size_t *idx) {
         j = 0;
         iovec_advance(iov, &j, *idx);
 
-        if (bus->prefer_writev)
-                k = writev(bus->output_fd, iov, m->n_iovec);
-        else {
-                struct msghdr mh = {
-                        .msg_iov = iov,
-                        .msg_iovlen = m->n_iovec,
-                };
+        k = bus_socket_write_iovec(bus, iov, m->n_iovec, m->fds, *idx == 0 ? m->n_fds : 0);
+        if (k <= 0)
+                return (int) k;
 
-                if (m->n_fds > 0 && *idx == 0) {
-                        struct cmsghdr *control;
+        *idx += (size_t) k;
+        return 1;
+}
 
-                        mh.msg_control = control = alloca(CMSG_SPACE(sizeof(int) * m->n_fds));
-                        mh.msg_controllen = control->cmsg_len = CMSG_LEN(sizeof(int) * m->n_fds);
-                        control->cmsg_level = SOL_SOCKET;
-                        control->cmsg_type = SCM_RIGHTS;
-                        memcpy(CMSG_DATA(control), m->fds, sizeof(int) * m->n_fds);
-                }
+int bus_socket_write_queue(sd_bus *bus, sd_bus_message **queue, unsigned n_queue, size_t *idx) {
+        struct iovec iov[BUS_WRITE_IOVEC_MAX];
+        unsigned i, j, n = 0;
+        ssize_t k;
+        int r;
 
-                k = sendmsg(bus->output_fd, &mh, MSG_DONTWAIT|MSG_NOSIGNAL);
-                if (k < 0 && errno == ENOTSOCK) {
-                        bus->prefer_writev = true;
-                        k = writev(bus->output_fd, iov, m->n_iovec);
+        assert(bus);
+        assert(queue);
+        assert(n_queue > 0);
+        assert(idx);
+        assert(bus->state == BUS_RUNNING || bus->state == BUS_HELLO);
+
+        /* Writes as many of the queued messages as fit into one iovec array at once, starting at *idx of the
+         * first one, and advances *idx by what was written, possibly past the end of the first message. A
+         * message with fds always starts a write of its own, so that they are sent along with its first
+         * byte. */
+
+        for (i = 0; i < n_queue; i++) {
+                sd_bus_message *m = queue[i];
+
+                if (i > 0 && m->n_fds > 0)
+                        break;
+
+                r = bus_message_setup_iovec(m);
+                if (r < 0) {
+                        if (i == 0)
+                                return r;
+
+                        /* Let's report this when it's this message's turn */
+                        break;
                 }
+
+                if (n + m->n_iovec > ELEMENTSOF(iov))
+                        break;
+
+                memcpy(iov + n, m->iovec, sizeof(struct iovec) * m->n_iovec);
+                n += m->n_iovec;
         }
 
-        if (k < 0)
-                return errno == EAGAIN ? 0 : -errno;
+        /* A message of many parts is written on its own */
+        if (i <= 1)
+                return bus_socket_write_message(bus, queue[0], idx);
+
+        j = 0;
+        iovec_advance(iov, &j, *idx);
+
+        k = bus_socket_write_iovec(bus, iov + j, n - j, queue[0]->fds, *idx == 0 ? queue[0]->n_fds : 0);
+        if (k <= 0)
+                return (int) k;
 
         *idx += (size_t) k;
         return 1;
 }
 
-static int bus_socket_read_message_need(sd_bus *bus, size_t *need) {
+static uint32_t read_uint32(const uint8_t *p, bool little_endian) {
+        return little_endian ? unaligned_read_le32(p) : unaligned_read_be32(p);
+}
+
+static int bus_socket_read_message_need(const void *p, size_t size, size_t *need) {
         uint32_t a, b;
         uint8_t e;
         uint64_t sum;
 
-        assert(bus);
+        assert(p || size == 0);
         assert(need);
-        assert(bus->state == BUS_RUNNING || bus->state == BUS_HELLO);
 
-        if (bus->rbuffer_size < sizeof(struct bus_header)) {
+        if (size < sizeof(struct bus_header)) {
                 *need = sizeof(struct bus_header) + 8;
 
                 /* Minimum message size:
@@ -854,19 +927,14 @@ static int bus_socket_read_message_need(sd_bus *bus, size_t *need) {
                 return 0;
         }
 
-        a = ((const uint32_t*) bus->rbuffer)[1];
-        b = ((const uint32_t*) bus->rbuffer)[3];
-
-        e = ((const uint8_t*) bus->rbuffer)[0];
-        if (e == BUS_LITTLE_ENDIAN) {
-                a = le32toh(a);
-                b = le32toh(b);
-        } else if (e == BUS_BIG_ENDIAN) {
-                a = be32toh(a);
-                b = be32toh(b);
-        } else
+        /* Messages are packed back to back in the read buffer, hence the header may not be aligned */
+        e = ((const uint8_t*) p)[0];
+        if (!IN_SET(e, BUS_LITTLE_ENDIAN, BUS_BIG_ENDIAN))
                 return -EBADMSG;
 
+        a = read_uint32((const uint8_t*) p + 4, e == BUS_LITTLE_ENDIAN);
+        b = read_uint32((const uint8_t*) p + 12, e == BUS_LITTLE_ENDIAN);
+
         sum = (uint64_t) sizeof(struct bus_header) + (uint64_t) ALIGN_TO(b, 8) + (uint64_t) a;
         if (sum >= BUS_MESSAGE_SIZE_MAX)
                 return -ENOBUFS;
@@ -875,46 +943,329 @@ static int bus_socket_read_message_need(sd_bus *bus, size_t *need) {
         return 0;
 }
 
-static int bus_socket_make_message(sd_bus *bus, size_t size) {
-        sd_bus_message *t;
-        void *b;
+static int bus_socket_peek_unix_fds(const uint8_t *p, size_t size, unsigned *ret) {
+        bool le;
+        size_t i, end;
+
+        assert(p);
+        assert(size >= sizeof(struct bus_header));
+        assert(ret);
+
+        /* Finds the UNIX_FDS header field of a complete message, without parsing the message. We need this to
+         * know which of the fds we got belong to which message, since one read may return several messages.
+         * Only the basic types are understood, for anything else -EOPNOTSUPP is returned. */
+
+        if (p[3] != 1)
+                return -EOPNOTSUPP;
+
+        le = p[0] == BUS_LITTLE_ENDIAN;
+        end = sizeof(struct bus_header) + read_uint32(p + 12, le);
+        if (end > size)
+                return -EBADMSG;
+
+        for (i = sizeof(struct bus_header);; ) {
+                uint8_t code;
+                uint32_t l;
+
+                /* Each field is a struct of the code, and a variant */
+                i = ALIGN8(i);
+                if (i >= end)
+                        break;
+
+                if (end - i < 4)
+                        return -EBADMSG;
+                if (p[i + 1] != 1 || p[i + 3] != 0)
+                        return -EOPNOTSUPP;
+
+                code = p[i];
+
+                switch (p[i + 2]) {
+
+                case SD_BUS_TYPE_BYTE:
+                        i += 4 + 1;
+                        break;
+
+                case SD_BUS_TYPE_INT16:
+                case SD_BUS_TYPE_UINT16:
+                        i = ALIGN_TO(i + 4, 2) + 2;
+                        break;
+
+                case SD_BUS_TYPE_BOOLEAN:
+                case SD_BUS_TYPE_INT32:
+                case SD_BUS_TYPE_UINT32:
+                case SD_BUS_TYPE_UNIX_FD:
+                        i = ALIGN_TO(i + 4, 4);
+                        if (end - i < 4)
+                                return -EBADMSG;
+
+                        if (code == BUS_MESSAGE_HEADER_UNIX_FDS) {
+                                *ret = read_uint32(p + i, le);
+                                return 0;
+                        }
+
+                        i += 4;
+                        break;
+
+                case SD_BUS_TYPE_INT64:
+                case SD_BUS_TYPE_UINT64:
+                case SD_BUS_TYPE_DOUBLE:
+                        i = ALIGN_TO(i + 4, 8) + 8;
+                        break;
+
+                case SD_BUS_TYPE_STRING:
+                case SD_BUS_TYPE_OBJECT_PATH:
+                        i += 4;
+                        if (end - i < 4)
+                                return -EBADMSG;
+
+                        l = read_uint32(p + i, le);
+                        if (end - i - 4 <= l)
+                                return -EBADMSG;
+
+                        i += 4 + l + 1;
+                        break;
+
+                case SD_BUS_TYPE_SIGNATURE:
+                        i += 4;
+                        if (i >= end)
+                                return -EBADMSG;
+
+                        i += 1 + p[i] + 1;
+                        break;
+
+                default:
+                        return -EOPNOTSUPP;
+                }
+
+                if (i > end)
+                        return -EBADMSG;
+        }
+
+        *ret = 0;
+        return 0;
+}
+
+static int bus_socket_message_fds(sd_bus *bus, const uint8_t *p, size_t size, bool last, int **ret_fds, unsigned *ret_n_fds) {
+        unsigned n = 0;
         int r;
 
         assert(bus);
-        assert(bus->rbuffer_size >= size);
-        assert(bus->state == BUS_RUNNING || bus->state == BUS_HELLO);
+        assert(ret_fds);
+        assert(ret_n_fds);
+
+        if (bus->n_fds > 0) {
+                r = bus_socket_peek_unix_fds(p, size, &n);
+                if (r == -EOPNOTSUPP)
+                        /* If nothing follows the message, all pending fds must be its own, and the parser checks
+                         * that their number matches. Otherwise some may belong to what follows, hence give it
+                         * none: if it declared any, it fails to parse. */
+                        n = last ? bus->n_fds : 0;
+                else if (r < 0)
+                        return r;
+                else
+                        n = MIN(n, bus->n_fds);
+        }
+
+        if (n == 0) {
+                *ret_fds = NULL;
+                *ret_n_fds = 0;
+                return 0;
+        }
+
+        /* The caller drops the fds from the bus once the message took them */
+        if (n == bus->n_fds)
+                *ret_fds = bus->fds;
+        else {
+                *ret_fds = newdup(int, bus->fds, n);
+                if (!*ret_fds)
+                        return -ENOMEM;
+        }
+
+        *ret_n_fds = n;
+        return 0;
+}
+
+static void bus_socket_drop_fds(sd_bus *bus, unsigned n) {
+        assert(bus);
+        assert(n <= bus->n_fds);
+
+        if (n == 0)
+                return;
+
+        if (n == bus->n_fds) {
+                bus->fds = NULL;
+                bus->n_fds = 0;
+                return;
+        }
+
+        memmove(bus->fds, bus->fds + n, sizeof(int) * (bus->n_fds - n));
+        bus->n_fds -= n;
+}
+
+static int bus_socket_make_message(sd_bus *bus, size_t offset, size_t size) {
+        sd_bus_message *t;
+        uint8_t *p;
+        void *b = NULL;
+        unsigned n_fds;
+        int *fds, r;
+
+        assert(bus);
+        assert(bus->rbuffer_size >= offset + size);
 
         r = bus_rqueue_make_room(bus);
         if (r < 0)
                 return r;
 
-        if (bus->rbuffer_size > size) {
-                b = memdup((const uint8_t*) bus->rbuffer + size,
-                           bus->rbuffer_size - size);
+        p = (uint8_t*) bus->rbuffer + offset;
+
+        r = bus_socket_message_fds(bus, p, size, offset + size == bus->rbuffer_size, &fds, &n_fds);
+        if (r < 0)
+                return r;
+
+        if (size <= BUS_ARENA_MESSAGE_MAX) {
+                /* Small messages are copied into the arena, together with their sd_bus_message object */
+                r = bus_message_from_arena(bus, bus->rarena, p, size, fds, n_fds, &t);
+
+        } else if (offset == 0) {
+                /* A large message at the beginning of the buffer takes the buffer, and what follows it is
+                 * moved into a new one */
+                if (bus->rbuffer_size > size) {
+                        b = memdup(p + size, bus->rbuffer_size - size);
+                        if (!b)
+                                r = -ENOMEM;
+                }
+
+                if (r >= 0) {
+                        r = bus_message_from_malloc(bus, bus->rbuffer, size, fds, n_fds, NULL, &t);
+                        if (r >= 0) {
+                                bus->rbuffer = b;
+                                bus->rbuffer_size -= size;
+                                bus->rbuffer_allocated = bus->rbuffer_size;
+                                b = NULL;
+
+                                /* Tell the caller that the buffer starts anew */
+                                r = 1;
+                        }
+                }
+
+                free(b);
+
+        } else {
+                b = memdup(p, size);
                 if (!b)
-                        return -ENOMEM;
-        } else
-                b = NULL;
-
-        r = bus_message_from_malloc(bus,
-                                    bus->rbuffer, size,
-                                    bus->fds, bus->n_fds,
-                                    NULL,
-                                    &t);
+                        r = -ENOMEM;
+                else {
+                        r = bus_message_from_malloc(bus, b, size, fds, n_fds, NULL, &t);
+                        if (r < 0)
+                                free(b);
+                }
+        }
+
         if (r < 0) {
-                free(b);
+                if (fds != bus->fds)
+                        free(fds);
                 return r;
         }
 
-        bus->rbuffer = b;
-        bus->rbuffer_size -= size;
+        bus_socket_drop_fds(bus, n_fds);
+        bus->rqueue[bus->rqueue_size++] = t;
+
+        return r;
+}
+
+static int bus_socket_reserve_arena(sd_bus *bus, size_t size) {
+        BusMessageArena *a;
 
-        bus->fds = NULL;
-        bus->n_fds = 0;
+        assert(bus);
 
-        bus->rqueue[bus->rqueue_size++] = t;
+        /* Once none of the messages from the arena are around anymore, it may be filled again from the start.
+         * Usually that's the case by the time we read again, so this doesn't allocate anything at all. Only we
+         * take references to the arena, and other threads only drop them, and don't touch the message anymore
+         * once they did. Hence once we see ours is the only one left, it stays that way. The barrier makes sure
+         * we don't overwrite anything before we saw that. */
+        if (bus->rarena && REFCNT_GET(bus->rarena->n_ref) <= 1) {
+                __sync_synchronize();
+                bus->rarena->used = 0;
+        }
 
-        return 1;
+        if (bus->rarena && bus->rarena->size - bus->rarena->used >= size)
+                return 0;
+
+        a = bus_message_arena_new(MAX(size, (size_t) BUS_ARENA_SIZE));
+        if (!a)
+                return -ENOMEM;
+
+        /* The messages still in the old arena keep it around as long as they need it */
+        bus_message_arena_unref(bus->rarena);
+        bus->rarena = a;
+
+        return 0;
+}
+
+static int bus_socket_split_messages(sd_bus *bus) {
+        size_t offset = 0, arena_size = 0, need;
+        bool progress = false;
+        int r;
+
+        assert(bus);
+        assert(bus->state == BUS_RUNNING || bus->state == BUS_HELLO);
+
+        /* Turns all complete messages in the read buffer into sd_bus_message objects, and queues them. The small
+         * ones are carved out of the arena of the connection, so that we allocate at most once for them all.
+         * First, let's see how much room they need. */
+        while (bus_socket_read_message_need((uint8_t*) bus->rbuffer + offset, bus->rbuffer_size - offset, &need) >= 0 &&
+               bus->rbuffer_size - offset >= need) {
+
+                if (need <= BUS_ARENA_MESSAGE_MAX)
+                        arena_size += BUS_MESSAGE_ARENA_SIZE(need);
+
+                offset += need;
+        }
+
+        if (arena_size > 0) {
+                r = bus_socket_reserve_arena(bus, arena_size);
+                if (r < 0)
+                        return r;
+        }
+
+        offset = 0;
+        for (;;) {
+                r = bus_socket_read_message_need((uint8_t*) bus->rbuffer + offset, bus->rbuffer_size - offset, &need);
+                if (r < 0)
+                        break;
+
+                if (bus->rbuffer_size - offset < need)
+                        break;
+
+                r = bus_socket_make_message(bus, offset, need);
+                if (r < 0)
+                        break;
+
+                progress = true;
+
+                if (r > 0)
+                        offset = 0;
+                else
+                        offset += need;
+        }
+
+        if (offset > 0) {
+                bus->rbuffer_size -= offset;
+                memmove(bus->rbuffer, (uint8_t*) bus->rbuffer + offset, bus->rbuffer_size);
+        }
+
+        /* Keep a buffer of the usual size around for the next read, but don't hold on to a larger one when
+         * there's nothing in it */
+        if (bus->rbuffer_size == 0 && bus->rbuffer_allocated != BUS_READ_SIZE) {
+                bus->rbuffer = mfree(bus->rbuffer);
+                bus->rbuffer_allocated = 0;
+        }
+
+        /* Errors are only reported once the messages before the broken one have been dispatched */
+        if (progress)
+                return 1;
+
+        return r;
 }
 
 int bus_socket_read_message(sd_bus *bus) {
@@ -923,7 +1274,6 @@ int bus_socket_read_message(sd_bus *bus) {
         ssize_t k;
         size_t need;
         int r;
-        void *b;
         union {
                 struct cmsghdr cmsghdr;
                 uint8_t buf[CMSG_SPACE(sizeof(int) * BUS_FDS_MAX)];
@@ -933,21 +1283,31 @@ int bus_socket_read_message(sd_bus *bus) {
         assert(bus);
         assert(bus->state == BUS_RUNNING || bus->state == BUS_HELLO);
 
-        r = bus_socket_read_message_need(bus, &need);
+        /* There might be complete messages left over from a previous read, or from the authentication */
+        r = bus_socket_split_messages(bus);
+        if (r != 0)
+                return r;
+
+        r = bus_socket_read_message_need(bus->rbuffer, bus->rbuffer_size, &need);
         if (r < 0)
                 return r;
 
-        if (bus->rbuffer_size >= need)
-                return bus_socket_make_message(bus, need);
+        /* Read as much as we can get, not just the next message, so that a flood of small messages doesn't cost
+         * a syscall each */
+        need = MAX(need, (size_t) BUS_READ_SIZE);
+        if (bus->rbuffer_allocated < need) {
+                void *b;
 
-        b = realloc(bus->rbuffer, need);
-        if (!b)
-                return -ENOMEM;
+                b = realloc(bus->rbuffer, need);
+                if (!b)
+                        return -ENOMEM;
 
-        bus->rbuffer = b;
+                bus->rbuffer = b;
+                bus->rbuffer_allocated = need;
+        }
 
         iov.iov_base = (uint8_t*) bus->rbuffer + bus->rbuffer_size;
-        iov.iov_len = need - bus->rbuffer_size;
+        iov.iov_len = bus->rbuffer_allocated - bus->rbuffer_size;
 
         if (bus->prefer_readv)
                 k = readv(bus->input_fd, &iov, 1);
@@ -991,6 +1351,13 @@ int bus_socket_read_message(sd_bus *bus) {
                                         return -EIO;
                                 }
 
+                                /* The kernel dropped the fds that didn't fit, or there are more than any message
+                                 * may carry */
+                                if ((mh.msg_flags & MSG_CTRUNC) || bus->n_fds + n > BUS_FDS_MAX) {
+                                        close_many((int*) CMSG_DATA(cmsg), n);
+                                        return -EIO;
+                                }
+
                                 f = realloc(bus->fds, sizeof(int) * (bus->n_fds + n));
                                 if (!f) {
                                         close_many((int*) CMSG_DATA(cmsg), n);
@@ -1005,12 +1372,19 @@ int bus_socket_read_message(sd_bus *bus) {
                                           cmsg->cmsg_level, cmsg->cmsg_type);
         }
 
-        r = bus_socket_read_message_need(bus, &need);
+        r = bus_socket_split_messages(bus);
         if (r < 0)
                 return r;
 
-        if (bus->rbuffer_size >= need)
-                return bus_socket_make_message(bus, need);
+        /* The complete messages took their fds, hence the ones left over belong to the message that isn't
+         * complete yet, if there is one. If there are more than it may carry, the peer sent more fds than its
+         * messages declared. */
+        if (bus->n_fds > (bus->rbuffer_size > 0 ? BUS_FDS_MAX : 0)) {
+                close_many(bus->fds, bus->n_fds);
+                bus->fds = mfree(bus->fds);
+                bus->n_fds = 0;
+                return -EIO;
+        }
 
         return 1;
 }
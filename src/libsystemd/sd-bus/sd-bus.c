@@ -111,6 +111,10 @@ static void bus_free(sd_bus *b) {
 
         b->state = BUS_CLOSED;
 
+        if (b->n_write_calls > 0)
+                log_debug("Bus %s: sent %" PRIu64 " messages in %" PRIu64 " write calls.",
+                          strna(b->description), b->n_messages_written, b->n_write_calls);
+
         sd_bus_detach_event(b);
 
         while ((s = b->slots)) {
@@ -133,6 +137,7 @@ static void bus_free(sd_bus *b) {
 
         free(b->label);
         free(b->rbuffer);
+        bus_message_arena_unref(b->rarena);
         free(b->unique_name);
         free(b->auth_buffer);
         free(b->address);
@@ -1457,6 +1462,24 @@ int bus_seal_synthetic_message(sd_bus *b, sd_bus_message *m) {
         return bus_message_seal(m, 0xFFFFFFFFULL, 0);
 }
 
+static void bus_message_sent(sd_bus *bus, sd_bus_message *m) {
+        assert(bus);
+        assert(m);
+
+        bus->n_messages_written++;
+
+        log_debug("Sent message type=%s sender=%s destination=%s object=%s interface=%s member=%s cookie=%" PRIu64 " reply_cookie=%" PRIu64 " error=%s",
+                  bus_message_type_to_string(m->header->type),
+                  strna(sd_bus_message_get_sender(m)),
+                  strna(sd_bus_message_get_destination(m)),
+                  strna(sd_bus_message_get_path(m)),
+                  strna(sd_bus_message_get_interface(m)),
+                  strna(sd_bus_message_get_member(m)),
+                  BUS_MESSAGE_COOKIE(m),
+                  m->reply_cookie,
+                  strna(m->error.message));
+}
+
 static int bus_write_message(sd_bus *bus, sd_bus_message *m, bool hint_sync_call, size_t *idx) {
         int r;
 
@@ -1468,16 +1491,7 @@ static int bus_write_message(sd_bus *bus, sd_bus_message *m, bool hint_sync_call
                 return r;
 
         if (*idx >= BUS_MESSAGE_SIZE(m))
-                log_debug("Sent message type=%s sender=%s destination=%s object=%s interface=%s member=%s cookie=%" PRIu64 " reply_cookie=%" PRIu64 " error=%s",
-                          bus_message_type_to_string(m->header->type),
-                          strna(sd_bus_message_get_sender(m)),
-                          strna(sd_bus_message_get_destination(m)),
-                          strna(sd_bus_message_get_path(m)),
-                          strna(sd_bus_message_get_interface(m)),
-                          strna(sd_bus_message_get_member(m)),
-                          BUS_MESSAGE_COOKIE(m),
-                          m->reply_cookie,
-                          strna(m->error.message));
+                bus_message_sent(bus, m);
 
         return r;
 }
@@ -1489,28 +1503,34 @@ static int dispatch_wqueue(sd_bus *bus) {
         assert(bus->state == BUS_RUNNING || bus->state == BUS_HELLO);
 
         while (bus->wqueue_size > 0) {
+                unsigned n = 0;
 
-                r = bus_write_message(bus, bus->wqueue[0], false, &bus->windex);
+                /* This writes as many of the queued messages as it can at once */
+                r = bus_socket_write_queue(bus, bus->wqueue, bus->wqueue_size, &bus->windex);
                 if (r < 0)
                         return r;
                 else if (r == 0)
                         /* Didn't do anything this time */
                         return ret;
-                else if (bus->windex >= BUS_MESSAGE_SIZE(bus->wqueue[0])) {
-                        /* Fully written. Let's drop the entry from
-                         * the queue.
-                         *
-                         * This isn't particularly optimized, but
-                         * well, this is supposed to be our worst-case
-                         * buffer only, and the socket buffer is
-                         * supposed to be our primary buffer, and if
-                         * it got full, then all bets are off
-                         * anyway. */
-
-                        bus->wqueue_size--;
-                        sd_bus_message_unref(bus->wqueue[0]);
-                        memmove(bus->wqueue, bus->wqueue + 1, sizeof(sd_bus_message*) * bus->wqueue_size);
-                        bus->windex = 0;
+
+                /* Let's drop the entries that were written fully from the queue.
+                 *
+                 * This isn't particularly optimized, but
+                 * well, this is supposed to be our worst-case
+                 * buffer only, and the socket buffer is
+                 * supposed to be our primary buffer, and if
+                 * it got full, then all bets are off
+                 * anyway. */
+                while (n < bus->wqueue_size && bus->windex >= BUS_MESSAGE_SIZE(bus->wqueue[n])) {
+                        bus->windex -= BUS_MESSAGE_SIZE(bus->wqueue[n]);
+                        bus_message_sent(bus, bus->wqueue[n]);
+                        sd_bus_message_unref(bus->wqueue[n]);
+                        n++;
+                }
+
+                if (n > 0) {
+                        bus->wqueue_size -= n;
+                        memmove(bus->wqueue, bus->wqueue + n, sizeof(sd_bus_message*) * bus->wqueue_size);
 
                         ret = 1;
                 }
@@ -2945,6 +2965,15 @@ bool bus_pid_changed(sd_bus *bus) {
         return bus->original_pid != getpid_cached();
 }
 
+void bus_get_write_stats(sd_bus *bus, uint64_t *ret_messages, uint64_t *ret_writes) {
+        assert(bus);
+
+        if (ret_messages)
+                *ret_messages = bus->n_messages_written;
+        if (ret_writes)
+                *ret_writes = bus->n_write_calls;
+}
+
 static int io_callback(sd_event_source *s, int fd, uint32_t revents, void *userdata) {
         sd_bus *bus = userdata;
         int r;
@@ -33,13 +33,106 @@
 #define MAX_SIZE (2*1024*1024)
 
 static usec_t arg_loop_usec = 100 * USEC_PER_MSEC;
+static bool arg_backlog = false;
+
+static unsigned long n_allocations = 0;
+
+#if defined(ENABLE_DEBUG_BUS_ALLOCATIONS) && defined(__GLIBC__)
+/* We count the allocations by wrapping those of glibc. This replaces the allocator of the whole binary, which
+ * ASan and valgrind do too, hence it is only done when configured with -Ddebug=bus-allocations. */
+# define COUNT_ALLOCATIONS true
+
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t n, size_t size);
+extern void *__libc_realloc(void *p, size_t size);
+
+void *malloc(size_t size) {
+        n_allocations++;
+        return __libc_malloc(size);
+}
+
+void *calloc(size_t n, size_t size) {
+        n_allocations++;
+        return __libc_calloc(n, size);
+}
+
+void *realloc(void *p, size_t size) {
+        n_allocations++;
+        return __libc_realloc(p, size);
+}
+#else
+# define COUNT_ALLOCATIONS false
+#endif
 
 typedef enum Type {
         TYPE_LEGACY,
         TYPE_DIRECT,
 } Type;
 
+#define N_PROPERTIES 200U
+#define OBJECT_PATH "/org/freedesktop/systemd1/unit/test_2eservice"
+#define OBJECT_INTERFACE "benchmark.server.Object"
+
+/* About as many properties as org.freedesktop.systemd1.Unit and .Service have together */
+static struct {
+        uint64_t t[N_PROPERTIES / 4];
+        uint32_t u[N_PROPERTIES / 4];
+        int b[N_PROPERTIES / 4];
+        char *s[N_PROPERTIES / 4];
+} object_data;
+
+static void add_object(sd_bus *b) {
+        sd_bus_vtable *vtable;
+        unsigned i;
+
+        /* The vtable and the names in it are never freed, they have to stay around as long as the bus */
+        vtable = new0(sd_bus_vtable, 1 + N_PROPERTIES + 1);
+        assert_se(vtable);
+
+        vtable[0] = (sd_bus_vtable) SD_BUS_VTABLE_START(0);
+
+        for (i = 0; i < N_PROPERTIES; i++) {
+                const char *signature;
+                uint64_t flags;
+                char *name;
+                void *p;
+
+                assert_se(asprintf(&name, "Property%u", i) >= 0);
+
+                switch (i % 4) {
+                case 0:
+                        signature = "t";
+                        p = object_data.t + i / 4;
+                        break;
+                case 1:
+                        signature = "u";
+                        p = object_data.u + i / 4;
+                        break;
+                case 2:
+                        signature = "b";
+                        p = object_data.b + i / 4;
+                        break;
+                default:
+                        signature = "s";
+                        p = object_data.s + i / 4;
+                        assert_se(asprintf(&object_data.s[i / 4], "value-%u", i) >= 0);
+                }
+
+                flags = i % 3 == 0 ? SD_BUS_VTABLE_PROPERTY_CONST :
+                        i % 3 == 1 ? SD_BUS_VTABLE_PROPERTY_EMITS_CHANGE : 0;
+
+                vtable[1 + i] = (sd_bus_vtable) SD_BUS_PROPERTY(name, signature, NULL, (uint8_t*) p - (uint8_t*) &object_data, flags);
+        }
+
+        vtable[1 + N_PROPERTIES] = (sd_bus_vtable) SD_BUS_VTABLE_END;
+
+        assert_se(sd_bus_add_object_vtable(b, NULL, OBJECT_PATH, OBJECT_INTERFACE, vtable, &object_data) >= 0);
+}
+
 static void server(sd_bus *b, size_t *result) {
+        usec_t first_signal = 0, first_signal_cpu = 0;
+        unsigned n_signals = 0, n_calls = 0;
+        unsigned long first_call_allocations = 0;
         int r;
 
         for (;;) {
@@ -55,7 +148,15 @@ static void server(sd_bus *b, size_t *result) {
 
                 if (sd_bus_message_is_method_call(m, "benchmark.server", "Ping"))
                         assert_se(sd_bus_reply_method_return(m, NULL) >= 0);
-                else if (sd_bus_message_is_method_call(m, "benchmark.server", "Work")) {
+                else if (sd_bus_message_is_method_call(m, "benchmark.server", "GetUnit")) {
+                        const char *name;
+
+                        if (n_calls++ == 0)
+                                first_call_allocations = n_allocations;
+
+                        assert_se(sd_bus_message_read(m, "s", &name) > 0);
+                        assert_se(sd_bus_reply_method_return(m, "o", "/org/freedesktop/systemd1/unit/test_2eservice") >= 0);
+                } else if (sd_bus_message_is_method_call(m, "benchmark.server", "Work")) {
                         const void *p;
                         size_t sz;
 
@@ -68,9 +169,26 @@ static void server(sd_bus *b, size_t *result) {
                         uint64_t res;
                         assert_se(sd_bus_message_read(m, "t", &res) > 0);
 
+                        /* The client runs in a process of its own, hence this is the time spent receiving */
+                        if (n_signals > 0)
+                                printf("Received %u signals, %.0f messages/s, %.0f ns CPU per message\n",
+                                       n_signals, (double) n_signals * USEC_PER_SEC / (now(CLOCK_MONOTONIC) - first_signal),
+                                       (double) (now(CLOCK_PROCESS_CPUTIME_ID) - first_signal_cpu) * NSEC_PER_USEC / n_signals);
+
+                        if (n_calls > 0 && COUNT_ALLOCATIONS)
+                                printf("Served %u calls, %.1f allocations per call\n",
+                                       n_calls, (double) (n_allocations - first_call_allocations) / n_calls);
+                        else if (n_calls > 0)
+                                printf("Served %u calls\n", n_calls);
+
                         *result = res;
                         return;
 
+                } else if (sd_bus_message_is_signal(m, "benchmark.server", "Flood")) {
+                        if (n_signals++ == 0) {
+                                first_signal = now(CLOCK_MONOTONIC);
+                                first_signal_cpu = now(CLOCK_PROCESS_CPUTIME_ID);
+                        }
                 } else if (!sd_bus_message_is_signal(m, NULL, NULL))
                         assert_not_reached("Unknown method");
         }
@@ -221,10 +339,201 @@ static void client_chart(Type type, const char *address, const char *server_name
         sd_bus_unref(b);
 }
 
+static void client_flood(Type type, const char *address, const char *server_name, int fd) {
+        _cleanup_(sd_bus_message_unrefp) sd_bus_message *x = NULL;
+        uint64_t n_messages, n_writes;
+        unsigned n_signals;
+        sd_bus *b;
+        usec_t t;
+        int r;
+
+        /* Sends small signals as fast as possible, the way PID 1 sends PropertiesChanged during a boot
+         * transaction, and leaves the counting to the server */
+
+        r = sd_bus_new(&b);
+        assert_se(r >= 0);
+
+        if (type == TYPE_DIRECT) {
+                r = sd_bus_set_fd(b, fd, fd);
+                assert_se(r >= 0);
+        } else {
+                r = sd_bus_set_address(b, address);
+                assert_se(r >= 0);
+
+                r = sd_bus_set_bus_client(b, true);
+                assert_se(r >= 0);
+        }
+
+        r = sd_bus_start(b);
+        assert_se(r >= 0);
+
+        /* With a small socket buffer, the signals pile up in our write queue, as they do when PID 1 emits them
+         * faster than dbus-daemon reads them */
+        if (arg_backlog)
+                assert_se(setsockopt(b->output_fd, SOL_SOCKET, SO_SNDBUF, &(int) { 64 * 1024 }, sizeof(int)) >= 0);
+
+        r = sd_bus_call_method(b, server_name, "/", "benchmark.server", "Ping", NULL, NULL, NULL);
+        assert_se(r >= 0);
+
+        t = now(CLOCK_MONOTONIC);
+        for (n_signals = 0;; n_signals++) {
+                _cleanup_(sd_bus_message_unrefp) sd_bus_message *m = NULL;
+
+                assert_se(sd_bus_message_new_signal(b, &m, "/org/freedesktop/systemd1/unit/test_2eservice", "benchmark.server", "Flood") >= 0);
+                if (server_name)
+                        assert_se(sd_bus_message_set_destination(m, server_name) >= 0);
+                assert_se(sd_bus_message_append(m, "su", "ActiveState", n_signals) >= 0);
+                assert_se(sd_bus_send(b, m, NULL) >= 0);
+
+                if (n_signals % 1000 == 999) {
+                        assert_se(sd_bus_flush(b) >= 0);
+
+                        if (now(CLOCK_MONOTONIC) >= t + arg_loop_usec)
+                                break;
+                }
+        }
+
+        assert_se(sd_bus_message_new_method_call(b, &x, server_name, "/", "benchmark.server", "Exit") >= 0);
+        assert_se(sd_bus_message_append(x, "t", (uint64_t) n_signals + 1) >= 0);
+        assert_se(sd_bus_send(b, x, NULL) >= 0);
+        assert_se(sd_bus_flush(b) >= 0);
+
+        bus_get_write_stats(b, &n_messages, &n_writes);
+        printf("Sent %u signals, %.1f messages per write\n",
+               n_signals, (double) n_messages / n_writes);
+        fflush(stdout);
+
+        sd_bus_unref(b);
+}
+
+static void call_repeatedly(sd_bus *b, const char *server_name, const char *interface, const char *member, const char *argument) {
+        usec_t t, n;
+        unsigned n_calls;
+        int r;
+
+        t = now(CLOCK_MONOTONIC);
+        for (n_calls = 1;; n_calls++) {
+                _cleanup_(sd_bus_message_unrefp) sd_bus_message *reply = NULL;
+
+                if (argument)
+                        r = sd_bus_call_method(b, server_name, OBJECT_PATH, interface, member, NULL, &reply, "s", argument);
+                else
+                        r = sd_bus_call_method(b, server_name, OBJECT_PATH, interface, member, NULL, &reply, NULL);
+                assert_se(r >= 0);
+
+                n = now(CLOCK_MONOTONIC);
+                if (n >= t + arg_loop_usec)
+                        break;
+        }
+
+        printf("%s: %.0f calls/s\n", member, (double) n_calls * USEC_PER_SEC / (n - t));
+}
+
+static void client_calls(Type type, const char *address, const char *server_name, int fd) {
+        _cleanup_(sd_bus_message_unrefp) sd_bus_message *x = NULL;
+        unsigned long first_allocations;
+        unsigned n_calls;
+        sd_bus *b;
+        usec_t t, n;
+        int r;
+
+        /* Makes small method calls one after the other, like systemctl does when it looks up units */
+
+        r = sd_bus_new(&b);
+        assert_se(r >= 0);
+
+        if (type == TYPE_DIRECT) {
+                r = sd_bus_set_fd(b, fd, fd);
+                assert_se(r >= 0);
+        } else {
+                r = sd_bus_set_address(b, address);
+                assert_se(r >= 0);
+
+                r = sd_bus_set_bus_client(b, true);
+                assert_se(r >= 0);
+        }
+
+        r = sd_bus_start(b);
+        assert_se(r >= 0);
+
+        r = sd_bus_call_method(b, server_name, "/", "benchmark.server", "Ping", NULL, NULL, NULL);
+        assert_se(r >= 0);
+
+        first_allocations = n_allocations;
+        t = now(CLOCK_MONOTONIC);
+        for (n_calls = 1;; n_calls++) {
+                _cleanup_(sd_bus_message_unrefp) sd_bus_message *reply = NULL;
+                const char *path;
+
+                r = sd_bus_call_method(b, server_name, "/", "benchmark.server", "GetUnit", NULL, &reply, "s", "test.service");
+                assert_se(r >= 0);
+
+                assert_se(sd_bus_message_read(reply, "o", &path) > 0);
+
+                n = now(CLOCK_MONOTONIC);
+                if (n >= t + arg_loop_usec)
+                        break;
+        }
+
+        if (COUNT_ALLOCATIONS)
+                printf("Made %u calls, %.0f calls/s, %.1f allocations per call\n",
+                       n_calls, (double) n_calls * USEC_PER_SEC / (n - t), (double) (n_allocations - first_allocations) / n_calls);
+        else
+                printf("Made %u calls, %.0f calls/s\n", n_calls, (double) n_calls * USEC_PER_SEC / (n - t));
+        fflush(stdout);
+
+        assert_se(sd_bus_message_new_method_call(b, &x, server_name, "/", "benchmark.server", "Exit") >= 0);
+        assert_se(sd_bus_message_append(x, "t", (uint64_t) 0) >= 0);
+        assert_se(sd_bus_send(b, x, NULL) >= 0);
+        assert_se(sd_bus_flush(b) >= 0);
+
+        sd_bus_unref(b);
+}
+
+static void client_objects(Type type, const char *address, const char *server_name, int fd) {
+        _cleanup_(sd_bus_message_unrefp) sd_bus_message *x = NULL;
+        sd_bus *b;
+        int r;
+
+        /* Introspects and gets all properties of an object with N_PROPERTIES properties, as busctl and
+         * monitoring tools do for each unit */
+
+        r = sd_bus_new(&b);
+        assert_se(r >= 0);
+
+        if (type == TYPE_DIRECT) {
+                r = sd_bus_set_fd(b, fd, fd);
+                assert_se(r >= 0);
+        } else {
+                r = sd_bus_set_address(b, address);
+                assert_se(r >= 0);
+
+                r = sd_bus_set_bus_client(b, true);
+                assert_se(r >= 0);
+        }
+
+        r = sd_bus_start(b);
+        assert_se(r >= 0);
+
+        call_repeatedly(b, server_name, "org.freedesktop.DBus.Introspectable", "Introspect", NULL);
+        call_repeatedly(b, server_name, "org.freedesktop.DBus.Properties", "GetAll", OBJECT_INTERFACE);
+        fflush(stdout);
+
+        assert_se(sd_bus_message_new_method_call(b, &x, server_name, "/", "benchmark.server", "Exit") >= 0);
+        assert_se(sd_bus_message_append(x, "t", (uint64_t) 0) >= 0);
+        assert_se(sd_bus_send(b, x, NULL) >= 0);
+        assert_se(sd_bus_flush(b) >= 0);
+
+        sd_bus_unref(b);
+}
+
 int main(int argc, char *argv[]) {
         enum {
                 MODE_BISECT,
                 MODE_CHART,
+                MODE_FLOOD,
+                MODE_OBJECTS,
+                MODE_CALLS,
         } mode = MODE_BISECT;
         Type type = TYPE_LEGACY;
         int i, pair[2] = { -1, -1 };
@@ -241,6 +550,19 @@ int main(int argc, char *argv[]) {
                 if (streq(argv[i], "chart")) {
                         mode = MODE_CHART;
                         continue;
+                } else if (streq(argv[i], "flood")) {
+                        mode = MODE_FLOOD;
+                        continue;
+                } else if (streq(argv[i], "calls")) {
+                        mode = MODE_CALLS;
+                        continue;
+                } else if (streq(argv[i], "objects")) {
+                        mode = MODE_OBJECTS;
+                        continue;
+                } else if (streq(argv[i], "backlog")) {
+                        mode = MODE_FLOOD;
+                        arg_backlog = true;
+                        continue;
                 } else if (streq(argv[i], "legacy")) {
                         type = TYPE_LEGACY;
                         continue;
@@ -294,6 +616,9 @@ int main(int argc, char *argv[]) {
                 assert_se(server_name);
         }
 
+        if (mode == MODE_OBJECTS)
+                add_object(b);
+
         sync();
         setpriority(PRIO_PROCESS, 0, -19);
 
@@ -316,6 +641,18 @@ int main(int argc, char *argv[]) {
                 case MODE_CHART:
                         client_chart(type, address, server_name, pair[1]);
                         break;
+
+                case MODE_FLOOD:
+                        client_flood(type, address, server_name, pair[1]);
+                        break;
+
+                case MODE_OBJECTS:
+                        client_objects(type, address, server_name, pair[1]);
+                        break;
+
+                case MODE_CALLS:
+                        client_calls(type, address, server_name, pair[1]);
+                        break;
                 }
 
                 _exit(0);
@@ -17,12 +17,18 @@
   along with systemd; If not, see <http://www.gnu.org/licenses/>.
 ***/
 
+#include "alloc-util.h"
+#include "bus-internal.h"
 #include "bus-match.h"
 #include "bus-message.h"
 #include "bus-slot.h"
 #include "bus-util.h"
+#include "env-util.h"
 #include "log.h"
 #include "macro.h"
+#include "random-util.h"
+#include "stdio-util.h"
+#include "time-util.h"
 
 static bool mask[32];
 
@@ -83,6 +89,188 @@ static void test_match_scope(const char *match, enum bus_match_scope scope) {
         bus_match_parse_free(components, n_components);
 }
 
+static unsigned n_removed;
+
+static int remove_self(sd_bus_message *m, void *userdata, sd_bus_error *ret_error) {
+        sd_bus_slot **slot = userdata;
+
+        n_removed++;
+        *slot = sd_bus_slot_unref(*slot);
+
+        return 0;
+}
+
+static void test_remove_self(sd_bus_message *m, const char *match) {
+        _cleanup_(sd_bus_unrefp) sd_bus *bus = NULL;
+        sd_bus_slot *slot = NULL;
+
+        /* A callback which removes its own match frees the nodes it hangs off, which the lookup of the
+         * remaining values must not touch anymore */
+
+        log_info("Removing %s from its callback", match);
+
+        assert_se(sd_bus_new(&bus) >= 0);
+        assert_se(sd_bus_add_match(bus, &slot, match, remove_self, &slot) >= 0);
+
+        n_removed = 0;
+        bus->iteration_counter++;
+
+        do {
+                bus->match_callbacks_modified = false;
+                assert_se(bus_match_run(bus, &bus->match_callbacks, m) == 0);
+        } while (bus->match_callbacks_modified);
+
+        assert_se(n_removed == 1);
+        assert_se(!slot);
+        assert_se(!bus->match_callbacks.child);
+}
+
+static void test_remove_self_all(sd_bus *bus) {
+        _cleanup_(sd_bus_message_unrefp) sd_bus_message *m = NULL;
+
+        assert_se(sd_bus_message_new_signal(bus, &m, "/foo/bar", "bar.x", "waldo") >= 0);
+        assert_se(sd_bus_message_append(m, "as", 2, "pi", "pa") >= 0);
+        assert_se(bus_message_seal(m, 1, 0) >= 0);
+
+        m->sender = ":1.1";
+        assert_se(m->creds.well_known_names = new(char*, 3));
+        m->creds.well_known_names[0] = (char*) "org.example.A";
+        m->creds.well_known_names[1] = (char*) "org.example.B";
+        m->creds.well_known_names[2] = NULL;
+        m->creds.mask |= SD_BUS_CREDS_WELL_KNOWN_NAMES;
+
+        test_remove_self(m, "path_namespace='/foo'");
+        test_remove_self(m, "arg0has='pi'");
+        test_remove_self(m, "sender='org.example.A'");
+}
+
+static unsigned expected_rule, n_matched;
+
+static int benchmark_filter(sd_bus_message *m, void *userdata, sd_bus_error *ret_error) {
+        assert_se(PTR_TO_UINT(userdata) == expected_rule);
+        n_matched++;
+        return 0;
+}
+
+#define BENCHMARK_SIGNALS 1000U
+
+static void benchmark(sd_bus *bus, unsigned n_rules, unsigned n) {
+        struct bus_match_node root = {
+                .type = BUS_MATCH_ROOT,
+        };
+
+        static const char senders[][sizeof(":1.") + DECIMAL_STR_MAX(unsigned)] = { ":1.1", ":1.2", ":1.3" };
+        char senders_by_rule[BENCHMARK_SIGNALS][sizeof(":1.") + DECIMAL_STR_MAX(unsigned)];
+        sd_bus_message *signals[BENCHMARK_SIGNALS];
+        unsigned rules[BENCHMARK_SIGNALS];
+        sd_bus_slot *slots;
+        usec_t start, end;
+        unsigned i;
+
+        /* A client which watches many units, peers, objects and names, as systemctl or a desktop does: each rule
+         * is for a single path, sender, path namespace or arg0 namespace, and each signal matches one of them. */
+
+        assert_se(slots = new0(sd_bus_slot, n_rules));
+
+        for (i = 0; i < n_rules; i++) {
+                struct bus_match_component *components = NULL;
+                unsigned n_components = 0;
+                _cleanup_free_ char *match = NULL;
+
+                switch (i % 4) {
+
+                case 0:
+                        assert_se(asprintf(&match, "type='signal',sender='org.freedesktop.systemd1',interface='org.freedesktop.DBus.Properties',"
+                                           "member='PropertiesChanged',path='/org/freedesktop/systemd1/unit/unit_%u_2eservice'", i) >= 0);
+                        break;
+
+                case 1:
+                        assert_se(asprintf(&match, "type='signal',sender=':1.%u',interface='org.example.Peer',member='Changed'", i + 100) >= 0);
+                        break;
+
+                case 2:
+                        assert_se(asprintf(&match, "type='signal',path_namespace='/org/example/object%u'", i) >= 0);
+                        break;
+
+                case 3:
+                        assert_se(asprintf(&match, "type='signal',sender='org.freedesktop.DBus',interface='org.freedesktop.DBus',"
+                                           "member='NameOwnerChanged',arg0namespace='org.example.service%u'", i) >= 0);
+                        break;
+                }
+
+                assert_se(bus_match_parse(match, &components, &n_components) >= 0);
+
+                slots[i].userdata = UINT_TO_PTR(i);
+                slots[i].match_callback.callback = benchmark_filter;
+                assert_se(bus_match_add(&root, components, n_components, &slots[i].match_callback) >= 0);
+
+                bus_match_parse_free(components, n_components);
+        }
+
+        for (i = 0; i < BENCHMARK_SIGNALS; i++) {
+                char path[sizeof("/org/freedesktop/systemd1/unit/unit__2eservice") + DECIMAL_STR_MAX(unsigned)],
+                     name[sizeof("org.example.service.Sub") + DECIMAL_STR_MAX(unsigned)];
+                unsigned k;
+
+                k = random_u64() % n_rules;
+                rules[i] = k;
+
+                switch (k % 4) {
+
+                case 0:
+                        xsprintf(path, "/org/freedesktop/systemd1/unit/unit_%u_2eservice", k);
+                        assert_se(sd_bus_message_new_signal(bus, &signals[i], path, "org.freedesktop.DBus.Properties", "PropertiesChanged") >= 0);
+                        assert_se(sd_bus_message_append(signals[i], "sa{sv}as", "org.freedesktop.systemd1.Unit", 0, 0) >= 0);
+                        break;
+
+                case 1:
+                        assert_se(sd_bus_message_new_signal(bus, &signals[i], "/org/example/peer", "org.example.Peer", "Changed") >= 0);
+                        break;
+
+                case 2:
+                        xsprintf(path, "/org/example/object%u/child", k);
+                        assert_se(sd_bus_message_new_signal(bus, &signals[i], path, "org.example.Object", "Changed") >= 0);
+                        break;
+
+                case 3:
+                        xsprintf(name, "org.example.service%u.Sub", k);
+                        assert_se(sd_bus_message_new_signal(bus, &signals[i], "/org/freedesktop/DBus", "org.freedesktop.DBus", "NameOwnerChanged") >= 0);
+                        assert_se(sd_bus_message_append(signals[i], "sss", name, "", ":1.4") >= 0);
+                        break;
+                }
+
+                assert_se(bus_message_seal(signals[i], i + 1, 0) >= 0);
+
+                /* Signals from the bus driver come from its well-known name, everything else from a unique name */
+                if (k % 4 == 1) {
+                        xsprintf(senders_by_rule[i], ":1.%u", k + 100);
+                        signals[i]->sender = senders_by_rule[i];
+                } else if (k % 4 == 3)
+                        signals[i]->sender = "org.freedesktop.DBus";
+                else
+                        signals[i]->sender = senders[i % ELEMENTSOF(senders)];
+        }
+
+        n_matched = 0;
+
+        start = now(CLOCK_MONOTONIC);
+        for (i = 0; i < n; i++) {
+                expected_rule = rules[i % BENCHMARK_SIGNALS];
+                assert_se(bus_match_run(NULL, &root, signals[i % BENCHMARK_SIGNALS]) == 0);
+        }
+        end = now(CLOCK_MONOTONIC);
+
+        assert_se(n_matched == n);
+
+        log_info("%6u rules: %.0fns per signal", n_rules, (double) (end - start) * NSEC_PER_USEC / n);
+
+        for (i = 0; i < BENCHMARK_SIGNALS; i++)
+                sd_bus_message_unref(signals[i]);
+
+        bus_match_free(&root);
+        free(slots);
+}
+
 int main(int argc, char *argv[]) {
         struct bus_match_node root = {
                 .type = BUS_MATCH_ROOT,
@@ -92,6 +280,8 @@ int main(int argc, char *argv[]) {
         _cleanup_(sd_bus_flush_close_unrefp) sd_bus *bus = NULL;
         enum bus_match_node_type i;
         sd_bus_slot slots[19];
+        unsigned n;
+        bool slow;
         int r;
 
         r = sd_bus_open_system(&bus);
@@ -155,5 +345,16 @@ int main(int argc, char *argv[]) {
         test_match_scope("member='gurke',path='/org/freedesktop/DBus/Local'", BUS_MATCH_LOCAL);
         test_match_scope("arg2='piep',sender='org.freedesktop.DBus',member='waldo'", BUS_MATCH_DRIVER);
 
+        test_remove_self_all(bus);
+
+        r = getenv_bool("SYSTEMD_SLOW_TESTS");
+        slow = r >= 0 ? r : SYSTEMD_SLOW_TESTS_DEFAULT;
+
+        n = slow ? 1000000 : 20000;
+
+        benchmark(bus, 100, n);
+        benchmark(bus, 1000, n);
+        benchmark(bus, 10000, n);
+
         return 0;
 }
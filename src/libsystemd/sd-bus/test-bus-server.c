@@ -17,13 +17,18 @@
   along with systemd; If not, see <http://www.gnu.org/licenses/>.
 ***/
 
+#include <poll.h>
 #include <pthread.h>
 #include <stdlib.h>
+#include <sys/socket.h>
 
 #include "sd-bus.h"
 
+#include "alloc-util.h"
 #include "bus-internal.h"
+#include "bus-message.h"
 #include "bus-util.h"
+#include "fd-util.h"
 #include "log.h"
 #include "macro.h"
 #include "util.h"
@@ -188,6 +193,114 @@ static int test_one(bool client_negotiate_unix_fds, bool server_negotiate_unix_f
         return 0;
 }
 
+struct extra_fds_context {
+        int fds[2];
+        int pipe[2];
+};
+
+static void *server_extra_fds(void *p) {
+        struct extra_fds_context *c = p;
+        struct pollfd pfd = {};
+        sd_bus *bus = NULL;
+        sd_id128_t id;
+        int r;
+
+        assert_se(sd_id128_randomize(&id) >= 0);
+
+        assert_se(sd_bus_new(&bus) >= 0);
+        assert_se(sd_bus_set_fd(bus, c->fds[0], c->fds[0]) >= 0);
+        assert_se(sd_bus_set_server(bus, 1, id) >= 0);
+        assert_se(sd_bus_negotiate_fds(bus, true) >= 0);
+        assert_se(sd_bus_start(bus) >= 0);
+
+        for (;;) {
+                _cleanup_(sd_bus_message_unrefp) sd_bus_message *m = NULL, *reply = NULL;
+
+                r = sd_bus_process(bus, &m);
+                if (r < 0)
+                        break;
+                if (r == 0) {
+                        assert_se(sd_bus_wait(bus, (uint64_t) -1) >= 0);
+                        continue;
+                }
+
+                if (m && sd_bus_message_is_method_call(m, NULL, NULL)) {
+                        assert_se(sd_bus_message_new_method_return(m, &reply) >= 0);
+                        assert_se(sd_bus_send(bus, reply, NULL) >= 0);
+                }
+        }
+
+        log_info_errno(r, "Server failed, as it should: %m");
+        assert_se(r == -EIO);
+
+        /* The fds nobody claimed must have been closed right away, not just when the connection goes away. Once
+         * the client closed its copy of the read end of the pipe too, the write end notices. */
+        pfd.fd = c->pipe[1];
+        assert_se(poll(&pfd, 1, 10 * MSEC_PER_SEC) == 1);
+        assert_se(pfd.revents & POLLERR);
+
+        sd_bus_unref(bus);
+
+        return NULL;
+}
+
+static void test_extra_fds(void) {
+        _cleanup_(sd_bus_message_unrefp) sd_bus_message *m = NULL, *reply = NULL;
+        _cleanup_(sd_bus_unrefp) sd_bus *bus = NULL;
+        struct extra_fds_context c = {};
+        _cleanup_free_ void *blob = NULL;
+        union {
+                struct cmsghdr cmsghdr;
+                uint8_t buf[CMSG_SPACE(sizeof(int) * 3)];
+        } control = {};
+        struct iovec iov;
+        struct msghdr mh = {
+                .msg_iov = &iov,
+                .msg_iovlen = 1,
+                .msg_control = &control,
+                .msg_controllen = sizeof(control),
+        };
+        struct cmsghdr *cmsg;
+        size_t size;
+        pthread_t s;
+
+        /* A message that declares no fds, sent with three, must fail the connection */
+
+        assert_se(socketpair(AF_UNIX, SOCK_STREAM, 0, c.fds) >= 0);
+        assert_se(pipe2(c.pipe, O_CLOEXEC) >= 0);
+
+        assert_se(pthread_create(&s, NULL, server_extra_fds, &c) == 0);
+
+        assert_se(sd_bus_new(&bus) >= 0);
+        assert_se(sd_bus_set_fd(bus, c.fds[1], c.fds[1]) >= 0);
+        assert_se(sd_bus_negotiate_fds(bus, true) >= 0);
+        assert_se(sd_bus_set_anonymous(bus, false) >= 0);
+        assert_se(sd_bus_start(bus) >= 0);
+
+        /* Make sure the server is done authenticating */
+        assert_se(sd_bus_call_method(bus, "org.freedesktop.systemd.test", "/", "org.freedesktop.systemd.test", "Ping", NULL, &reply, NULL) >= 0);
+        assert_se(sd_bus_can_send(bus, 'h') > 0);
+
+        assert_se(sd_bus_message_new_signal(bus, &m, "/", "org.freedesktop.systemd.test", "ExtraFds") >= 0);
+        assert_se(bus_message_seal(m, 4711, 0) >= 0);
+        assert_se(bus_message_get_blob(m, &blob, &size) >= 0);
+
+        iov = (struct iovec) { .iov_base = blob, .iov_len = size };
+
+        cmsg = CMSG_FIRSTHDR(&mh);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(int) * 3);
+        memcpy(CMSG_DATA(cmsg), (int[]) { c.pipe[0], c.pipe[0], c.pipe[0] }, sizeof(int) * 3);
+
+        assert_se(sendmsg(c.fds[1], &mh, MSG_NOSIGNAL) == (ssize_t) size);
+        c.pipe[0] = safe_close(c.pipe[0]);
+
+        assert_se(pthread_join(s, NULL) == 0);
+
+        safe_close(c.pipe[1]);
+}
+
 int main(int argc, char *argv[]) {
         int r;
 
@@ -212,5 +325,7 @@ int main(int argc, char *argv[]) {
         r = test_one(true, true, true, false);
         assert_se(r == -EPERM);
 
+        test_extra_fds();
+
         return EXIT_SUCCESS;
 }
@@ -26,6 +26,7 @@
 #include "sd-id128.h"
 
 #include "alloc-util.h"
+#include "event-util.h"
 #include "fd-util.h"
 #include "hashmap.h"
 #include "list.h"
@@ -233,6 +234,9 @@ struct sd_event {
 
         unsigned n_sources;
 
+        /* How many events to fetch from epoll at most while other events are still pending, 0 for no limit */
+        unsigned fetch_max;
+
         LIST_HEAD(sd_event_source, sources);
 
         usec_t last_run, last_log;
@@ -2519,7 +2523,11 @@ _public_ int sd_event_wait(sd_event *e, uint64_t timeout) {
                 return 1;
         }
 
+        /* Sources that are not returned because of the fetch limit remain ready, and epoll returns them on later
+         * calls. See event_set_fetch_max(). */
         ev_queue_max = MAX(e->n_sources, 1u);
+        if (e->fetch_max > 0 && prioq_peek(e->pending))
+                ev_queue_max = MIN(ev_queue_max, e->fetch_max);
         ev_queue = newa(struct epoll_event, ev_queue_max);
 
         m = epoll_wait(e->epoll_fd, ev_queue, ev_queue_max,
@@ -2880,6 +2888,14 @@ _public_ int sd_event_get_watchdog(sd_event *e) {
         return e->watchdog;
 }
 
+int event_set_fetch_max(sd_event *e, unsigned max) {
+        assert_return(e, -EINVAL);
+        assert_return(!event_pid_changed(e), -ECHILD);
+
+        e->fetch_max = max;
+        return 0;
+}
+
 _public_ int sd_event_get_iteration(sd_event *e, uint64_t *ret) {
         assert_return(e, -EINVAL);
         assert_return(!event_pid_changed(e), -ECHILD);
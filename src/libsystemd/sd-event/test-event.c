@@ -21,6 +21,7 @@
 
 #include "sd-event.h"
 
+#include "event-util.h"
 #include "fd-util.h"
 #include "log.h"
 #include "macro.h"
@@ -353,6 +354,51 @@ static void test_rtqueue(void) {
         sd_event_unref(e);
 }
 
+#define N_FETCH_PIPES 128
+
+static unsigned n_fetched[N_FETCH_PIPES];
+
+static int fetch_handler(sd_event_source *s, int fd, uint32_t revents, void *userdata) {
+        char c;
+
+        assert_se(read(fd, &c, 1) == 1);
+        n_fetched[PTR_TO_UINT(userdata)]++;
+        return 0;
+}
+
+static void test_fetch_max(void) {
+        sd_event_source *s[N_FETCH_PIPES] = {};
+        int p[N_FETCH_PIPES][2];
+        unsigned i, n = 0;
+        sd_event *e = NULL;
+
+        assert_se(sd_event_new(&e) >= 0);
+
+        assert_se(event_set_fetch_max(e, 4) >= 0);
+
+        for (i = 0; i < N_FETCH_PIPES; i++) {
+                assert_se(pipe2(p[i], O_CLOEXEC|O_NONBLOCK) >= 0);
+                assert_se(sd_event_add_io(e, &s[i], p[i][0], EPOLLIN, fetch_handler, UINT_TO_PTR(i)) >= 0);
+                assert_se(write(p[i][1], "xx", 2) == 2);
+        }
+
+        /* Each source is readable twice, and must be dispatched exactly twice, even though only a few events are
+         * fetched at a time while others are pending */
+        while (sd_event_run(e, 0) > 0)
+                assert_se(++n <= 2 * N_FETCH_PIPES);
+
+        assert_se(n == 2 * N_FETCH_PIPES);
+        for (i = 0; i < N_FETCH_PIPES; i++)
+                assert_se(n_fetched[i] == 2);
+
+        for (i = 0; i < N_FETCH_PIPES; i++) {
+                sd_event_source_unref(s[i]);
+                safe_close_pair(p[i]);
+        }
+
+        sd_event_unref(e);
+}
+
 int main(int argc, char *argv[]) {
 
         log_set_max_level(LOG_DEBUG);
@@ -361,6 +407,7 @@ int main(int argc, char *argv[]) {
         test_basic();
         test_sd_event_now();
         test_rtqueue();
+        test_fetch_max();
 
         return 0;
 }
@@ -19,7 +19,9 @@
 
 #include <errno.h>
 #include <fcntl.h>
+#include <pthread.h>
 #include <signal.h>
+#include <stdarg.h>
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
@@ -44,6 +46,7 @@
 #include "output-mode.h"
 #include "parse-util.h"
 #include "process-util.h"
+#include "set.h"
 #include "sparse-endian.h"
 #include "stdio-util.h"
 #include "string-table.h"
@@ -59,22 +62,449 @@
 
 #define JSON_THRESHOLD 4096
 
-static int print_catalog(FILE *f, sd_journal *j) {
+/* Drop the cached field names when there are more than this many, as the journal does not limit them */
+#define OUTPUT_FIELDS_CACHE_MAX 1024
+
+/* A buffer that is reused for each entry. Running out of memory is remembered, and checked for after the
+ * entry is complete, instead of after every single append. */
+typedef struct OutputBuffer {
+        char *data;
+        size_t size, allocated;
+        bool oom;
+} OutputBuffer;
+
+typedef struct OutputField {
+        char *name;
+        char *key;              /* The name, escaped for JSON */
+        size_t key_len;
+
+        unsigned generation;    /* The entry the field was last seen in */
+        unsigned printed;       /* The entry the field was last printed for */
+        unsigned last;          /* The last value of the field in that entry */
+        unsigned n_values;
+} OutputField;
+
+typedef struct OutputValue {
+        OutputField *field;
+        size_t offset, length;  /* Of the copy of the value */
+        unsigned next;          /* The next value of the same field */
+} OutputValue;
+
+/* Entries are formatted into a buffer that is written out in one go. The buffer, the copies of the values of
+ * the entry, and the escaped field names are all kept around for the next entry, so that formatting an entry
+ * usually doesn't allocate any memory. Each thread that formats entries gets its own state when it first does so,
+ * which is freed again when the thread exits. */
+typedef struct OutputState {
+        OutputBuffer out;
+        OutputBuffer name;
+        OutputBuffer values;
+
+        OutputValue *entry;
+        size_t n_entry, allocated_entry;
+
+        Hashmap *fields;
+        OutputFlags fields_flags;
+        unsigned generation;
+} OutputState;
+
+static pthread_key_t output_state_key;
+static pthread_once_t output_state_once = PTHREAD_ONCE_INIT;
+static bool output_state_key_valid = false;
+
+static char* output_buffer_extend(OutputBuffer *b, size_t n) {
+        char *p;
+
+        assert(b);
+
+        if (b->oom)
+                return NULL;
+
+        /* Always allocate something, so that even the copies of empty values point somewhere */
+        if (!GREEDY_REALLOC(b->data, b->allocated, MAX(b->size + n, (size_t) 1))) {
+                b->oom = true;
+                return NULL;
+        }
+
+        p = b->data + b->size;
+        b->size += n;
+
+        return p;
+}
+
+static void output_buffer_append(OutputBuffer *b, const void *p, size_t n) {
+        char *q;
+
+        q = output_buffer_extend(b, n);
+        if (q)
+                memcpy(q, p, n);
+}
+
+static void output_buffer_append_string(OutputBuffer *b, const char *s) {
+        output_buffer_append(b, s, strlen(s));
+}
+
+static void output_buffer_append_char(OutputBuffer *b, char c) {
+        char *q;
+
+        q = output_buffer_extend(b, 1);
+        if (q)
+                *q = c;
+}
+
+static void output_buffer_append_uint64(OutputBuffer *b, uint64_t u) {
+        char t[DECIMAL_STR_MAX(uint64_t)];
+
+        xsprintf(t, "%" PRIu64, u);
+        output_buffer_append_string(b, t);
+}
+
+static void output_buffer_printf(OutputBuffer *b, const char *format, ...) {
+        va_list ap;
+        size_t n = 256;
+        int k;
+
+        assert(b);
+        assert(format);
+
+        for (;;) {
+                char *p;
+
+                p = output_buffer_extend(b, n);
+                if (!p)
+                        return;
+
+                va_start(ap, format);
+                k = vsnprintf(p, n, format, ap);
+                va_end(ap);
+
+                b->size -= n;
+
+                if (k < 0) {
+                        b->oom = true;
+                        return;
+                }
+
+                if ((size_t) k < n) {
+                        b->size += k;
+                        return;
+                }
+
+                n = k + 1;
+        }
+}
+
+static void output_buffer_reset(OutputBuffer *b) {
+        assert(b);
+
+        b->size = 0;
+        b->oom = false;
+}
+
+static int output_buffer_write(OutputBuffer *b, FILE *f) {
+        assert(b);
+        assert(f);
+
+        if (b->oom)
+                return log_oom();
+
+        fwrite(b->data, 1, b->size, f);
+        return 0;
+}
+
+static void json_escape_buffer(
+                OutputBuffer *b,
+                const char *p,
+                size_t l,
+                OutputFlags flags) {
+
+        assert(b);
+        assert(p);
+
+        if (!(flags & OUTPUT_SHOW_ALL) && l >= JSON_THRESHOLD)
+                output_buffer_append_string(b, "null");
+
+        else if (!(flags & OUTPUT_SHOW_ALL) && !utf8_is_printable(p, l)) {
+                bool not_first = false;
+
+                output_buffer_append_string(b, "[ ");
+
+                while (l > 0) {
+                        if (not_first)
+                                output_buffer_append_string(b, ", ");
+                        else
+                                not_first = true;
+
+                        output_buffer_append_uint64(b, (uint8_t) *p);
+
+                        p++;
+                        l--;
+                }
+
+                output_buffer_append_string(b, " ]");
+        } else {
+                const char *run = p;
+
+                /* Copy everything that doesn't need escaping in one go */
+
+                output_buffer_append_char(b, '"');
+
+                while (l > 0) {
+                        if (*p == '"' || *p == '\\' || *p == '\n' || (uint8_t) *p < ' ') {
+                                output_buffer_append(b, run, p - run);
+
+                                if (*p == '"' || *p == '\\') {
+                                        output_buffer_append_char(b, '\\');
+                                        output_buffer_append_char(b, *p);
+                                } else if (*p == '\n')
+                                        output_buffer_append_string(b, "\\n");
+                                else {
+                                        char t[sizeof("\\u0000")];
+
+                                        xsprintf(t, "\\u%04x", (uint8_t) *p);
+                                        output_buffer_append_string(b, t);
+                                }
+
+                                run = p + 1;
+                        }
+
+                        p++;
+                        l--;
+                }
+
+                output_buffer_append(b, run, p - run);
+                output_buffer_append_char(b, '"');
+        }
+}
+
+static void output_field_free(OutputField *field) {
+        if (!field)
+                return;
+
+        free(field->name);
+        free(field->key);
+        free(field);
+}
+
+static void output_state_flush_fields(OutputState *s) {
+        OutputField *field;
+
+        assert(s);
+
+        while ((field = hashmap_steal_first(s->fields)))
+                output_field_free(field);
+}
+
+static void output_state_free(void *p) {
+        OutputState *s = p;
+
+        if (!s)
+                return;
+
+        free(s->out.data);
+        free(s->name.data);
+        free(s->values.data);
+        free(s->entry);
+
+        output_state_flush_fields(s);
+        hashmap_free(s->fields);
+
+        free(s);
+}
+
+static void output_state_key_create(void) {
+        output_state_key_valid = pthread_key_create(&output_state_key, output_state_free) == 0;
+}
+
+static OutputState* output_state_get(void) {
+        OutputState *s;
+
+        assert_se(pthread_once(&output_state_once, output_state_key_create) == 0);
+        if (!output_state_key_valid)
+                return NULL;
+
+        s = pthread_getspecific(output_state_key);
+        if (s)
+                return s;
+
+        s = new0(OutputState, 1);
+        if (!s)
+                return NULL;
+
+        if (pthread_setspecific(output_state_key, s) != 0) {
+                free(s);
+                return NULL;
+        }
+
+        return s;
+}
+
+static const char* output_state_name(OutputState *s, const void *data, size_t m) {
+        char *name;
+
+        assert(s);
+
+        /* Returns a NUL-terminated copy of the field name, which is valid until the next call */
+
+        output_buffer_reset(&s->name);
+
+        name = output_buffer_extend(&s->name, m + 1);
+        if (!name)
+                return NULL;
+
+        memcpy(name, data, m);
+        name[m] = 0;
+
+        return name;
+}
+
+static OutputField* output_state_get_field(OutputState *s, const char *name) {
+        OutputBuffer key = {};
+        OutputField *field;
+
+        assert(s);
+        assert(name);
+
+        field = hashmap_get(s->fields, name);
+        if (field)
+                return field;
+
+        if (hashmap_ensure_allocated(&s->fields, &string_hash_ops) < 0)
+                return NULL;
+
+        json_escape_buffer(&key, name, strlen(name), s->fields_flags);
+        if (key.oom) {
+                free(key.data);
+                return NULL;
+        }
+
+        field = new0(OutputField, 1);
+        if (!field) {
+                free(key.data);
+                return NULL;
+        }
+
+        field->key = key.data;
+        field->key_len = key.size;
+
+        field->name = strdup(name);
+        if (!field->name || hashmap_put(s->fields, field->name, field) < 0) {
+                output_field_free(field);
+                return NULL;
+        }
+
+        return field;
+}
+
+static int output_state_collect(OutputState *s, sd_journal *j, OutputFlags flags, Set *output_fields) {
+        const void *data;
+        size_t length;
         int r;
-        _cleanup_free_ char *t = NULL, *z = NULL;
 
+        assert(s);
+        assert(j);
 
-        r = sd_journal_get_catalog(j, &t);
+        /* Copies the values of the fields of the current entry, and links the values of each field, so that
+         * fields which appear more than once may be printed together. */
+
+        s->generation++;
+
+        if (s->generation == 0 ||
+            hashmap_size(s->fields) >= OUTPUT_FIELDS_CACHE_MAX ||
+            (flags & OUTPUT_SHOW_ALL) != s->fields_flags) {
+                output_state_flush_fields(s);
+                s->fields_flags = flags & OUTPUT_SHOW_ALL;
+                s->generation = 1;
+        }
+
+        s->n_entry = 0;
+        output_buffer_reset(&s->values);
+
+        JOURNAL_FOREACH_DATA_RETVAL(j, data, length, r) {
+                const char *eq, *name;
+                OutputField *field;
+                OutputValue *v;
+                size_t m;
+
+                /* We already printed the boot id, from the data in
+                 * the header, hence let's suppress it here */
+                if (length >= 9 &&
+                    memcmp(data, "_BOOT_ID=", 9) == 0)
+                        continue;
+
+                eq = memchr(data, '=', length);
+                if (!eq)
+                        continue;
+
+                m = eq - (const char*) data;
+
+                name = output_state_name(s, data, m);
+                if (!name)
+                        return log_oom();
+
+                /* Fields which weren't asked for aren't copied */
+                if (output_fields && !set_contains(output_fields, name))
+                        continue;
+
+                field = output_state_get_field(s, name);
+                if (!field)
+                        return log_oom();
+
+                if (!GREEDY_REALLOC(s->entry, s->allocated_entry, s->n_entry + 1))
+                        return log_oom();
+
+                v = s->entry + s->n_entry;
+                v->field = field;
+                v->offset = s->values.size;
+                v->length = length - m - 1;
+                v->next = 0;
+
+                output_buffer_append(&s->values, eq + 1, v->length);
+
+                if (field->generation != s->generation) {
+                        field->generation = s->generation;
+                        field->n_values = 0;
+                } else
+                        s->entry[field->last].next = s->n_entry;
+
+                field->last = s->n_entry;
+                field->n_values++;
+
+                s->n_entry++;
+        }
         if (r < 0)
                 return r;
 
-        z = strreplace(strstrip(t), "\n", "\n-- ");
-        if (!z)
+        if (s->values.oom)
                 return log_oom();
 
-        fputs("-- ", f);
-        fputs(z, f);
-        fputc('\n', f);
+        return 0;
+}
+
+static int print_catalog(FILE *f, sd_journal *j) {
+        _cleanup_free_ char *t = NULL;
+        const char *p;
+        int r;
+
+        r = sd_journal_get_catalog(j, &t);
+        if (r < 0)
+                return r;
+
+        /* Prefix each line as it is written, rather than building another copy of the text */
+        p = strstrip(t);
+        for (;;) {
+                size_t n;
+
+                n = strcspn(p, "\n");
+
+                fputs("-- ", f);
+                fwrite(p, 1, n, f);
+                fputc('\n', f);
+
+                if (p[n] == 0)
+                        break;
+
+                p += n + 1;
+        }
 
         return 0;
 }
@@ -327,7 +757,8 @@ static int output_short(
                 sd_journal *j,
                 OutputMode mode,
                 unsigned n_columns,
-                OutputFlags flags) {
+                OutputFlags flags,
+                Set *output_fields) {
 
         int r;
         const void *data;
@@ -477,7 +908,8 @@ static int output_verbose(
                 sd_journal *j,
                 OutputMode mode,
                 unsigned n_columns,
-                OutputFlags flags) {
+                OutputFlags flags,
+                Set *output_fields) {
 
         const void *data;
         size_t length;
@@ -538,6 +970,22 @@ static int output_verbose(
                 }
                 fieldlen = c - (const char*) data;
 
+                if (output_fields) {
+                        OutputState *s;
+                        const char *name;
+
+                        s = output_state_get();
+                        if (!s)
+                                return log_oom();
+
+                        name = output_state_name(s, data, fieldlen);
+                        if (!name)
+                                return log_oom();
+
+                        if (!set_contains(output_fields, name))
+                                continue;
+                }
+
                 if (flags & OUTPUT_COLOR && startswith(data, "MESSAGE=")) {
                         on = ANSI_HIGHLIGHT;
                         off = ANSI_NORMAL;
@@ -575,8 +1023,11 @@ static int output_export(
                 sd_journal *j,
                 OutputMode mode,
                 unsigned n_columns,
-                OutputFlags flags) {
+                OutputFlags flags,
+                Set *output_fields) {
 
+        OutputState *s;
+        OutputBuffer *b;
         sd_id128_t boot_id;
         char sid[33];
         int r;
@@ -587,6 +1038,11 @@ static int output_export(
 
         assert(j);
 
+        s = output_state_get();
+        if (!s)
+                return log_oom();
+        b = &s->out;
+
         sd_journal_set_data_threshold(j, 0);
 
         r = sd_journal_get_realtime_usec(j, &realtime);
@@ -601,17 +1057,20 @@ static int output_export(
         if (r < 0)
                 return log_error_errno(r, "Failed to get cursor: %m");
 
-        fprintf(f,
-                "__CURSOR=%s\n"
-                "__REALTIME_TIMESTAMP="USEC_FMT"\n"
-                "__MONOTONIC_TIMESTAMP="USEC_FMT"\n"
-                "_BOOT_ID=%s\n",
-                cursor,
-                realtime,
-                monotonic,
-                sd_id128_to_string(boot_id, sid));
+        output_buffer_reset(b);
+
+        output_buffer_printf(b,
+                             "__CURSOR=%s\n"
+                             "__REALTIME_TIMESTAMP="USEC_FMT"\n"
+                             "__MONOTONIC_TIMESTAMP="USEC_FMT"\n"
+                             "_BOOT_ID=%s\n",
+                             cursor,
+                             realtime,
+                             monotonic,
+                             sd_id128_to_string(boot_id, sid));
 
         JOURNAL_FOREACH_DATA_RETVAL(j, data, length, r) {
+                const char *c;
 
                 /* We already printed the boot id, from the data in
                  * the header, hence let's suppress it here */
@@ -619,34 +1078,48 @@ static int output_export(
                     startswith(data, "_BOOT_ID="))
                         continue;
 
+                c = memchr(data, '=', length);
+
+                if (output_fields) {
+                        const char *name;
+
+                        if (!c)
+                                continue;
+
+                        name = output_state_name(s, data, c - (const char*) data);
+                        if (!name)
+                                return log_oom();
+
+                        if (!set_contains(output_fields, name))
+                                continue;
+                }
+
                 if (utf8_is_printable_newline(data, length, false))
-                        fwrite(data, length, 1, f);
+                        output_buffer_append(b, data, length);
                 else {
-                        const char *c;
                         uint64_t le64;
 
-                        c = memchr(data, '=', length);
                         if (!c) {
                                 log_error("Invalid field.");
                                 return -EINVAL;
                         }
 
-                        fwrite(data, c - (const char*) data, 1, f);
-                        fputc('\n', f);
+                        output_buffer_append(b, data, c - (const char*) data);
+                        output_buffer_append_char(b, '\n');
                         le64 = htole64(length - (c - (const char*) data) - 1);
-                        fwrite(&le64, sizeof(le64), 1, f);
-                        fwrite(c + 1, length - (c - (const char*) data) - 1, 1, f);
+                        output_buffer_append(b, &le64, sizeof(le64));
+                        output_buffer_append(b, c + 1, length - (c - (const char*) data) - 1);
                 }
 
-                fputc('\n', f);
+                output_buffer_append_char(b, '\n');
         }
 
         if (r < 0)
                 return r;
 
-        fputc('\n', f);
+        output_buffer_append_char(b, '\n');
 
-        return 0;
+        return output_buffer_write(b, f);
 }
 
 void json_escape(
@@ -655,50 +1128,18 @@ void json_escape(
                 size_t l,
                 OutputFlags flags) {
 
+        OutputBuffer b = {};
+
         assert(f);
         assert(p);
 
-        if (!(flags & OUTPUT_SHOW_ALL) && l >= JSON_THRESHOLD)
-                fputs("null", f);
-
-        else if (!(flags & OUTPUT_SHOW_ALL) && !utf8_is_printable(p, l)) {
-                bool not_first = false;
-
-                fputs("[ ", f);
-
-                while (l > 0) {
-                        if (not_first)
-                                fprintf(f, ", %u", (uint8_t) *p);
-                        else {
-                                not_first = true;
-                                fprintf(f, "%u", (uint8_t) *p);
-                        }
-
-                        p++;
-                        l--;
-                }
-
-                fputs(" ]", f);
-        } else {
-                fputc('\"', f);
-
-                while (l > 0) {
-                        if (*p == '"' || *p == '\\') {
-                                fputc('\\', f);
-                                fputc(*p, f);
-                        } else if (*p == '\n')
-                                fputs("\\n", f);
-                        else if ((uint8_t) *p < ' ')
-                                fprintf(f, "\\u%04x", (uint8_t) *p);
-                        else
-                                fputc(*p, f);
-
-                        p++;
-                        l--;
-                }
+        json_escape_buffer(&b, p, l, flags);
+        if (b.oom)
+                log_oom();
+        else
+                fwrite(b.data, 1, b.size, f);
 
-                fputc('\"', f);
-        }
+        free(b.data);
 }
 
 static int output_json(
@@ -706,20 +1147,26 @@ static int output_json(
                 sd_journal *j,
                 OutputMode mode,
                 unsigned n_columns,
-                OutputFlags flags) {
+                OutputFlags flags,
+                Set *output_fields) {
 
+        OutputState *s;
+        OutputBuffer *b;
         uint64_t realtime, monotonic;
         _cleanup_free_ char *cursor = NULL;
-        const void *data;
-        size_t length;
         sd_id128_t boot_id;
-        char sid[33], *k;
+        const char *separator;
+        char sid[33];
+        size_t i;
         int r;
-        Hashmap *h = NULL;
-        bool done, separator;
 
         assert(j);
 
+        s = output_state_get();
+        if (!s)
+                return log_oom();
+        b = &s->out;
+
         sd_journal_set_data_threshold(j, flags & OUTPUT_SHOW_ALL ? 0 : JSON_THRESHOLD);
 
         r = sd_journal_get_realtime_usec(j, &realtime);
@@ -734,189 +1181,80 @@ static int output_json(
         if (r < 0)
                 return log_error_errno(r, "Failed to get cursor: %m");
 
+        r = output_state_collect(s, j, flags, output_fields);
+        if (r < 0)
+                return r;
+
+        output_buffer_reset(b);
+
         if (mode == OUTPUT_JSON_PRETTY)
-                fprintf(f,
-                        "{\n"
-                        "\t\"__CURSOR\" : \"%s\",\n"
-                        "\t\"__REALTIME_TIMESTAMP\" : \""USEC_FMT"\",\n"
-                        "\t\"__MONOTONIC_TIMESTAMP\" : \""USEC_FMT"\",\n"
-                        "\t\"_BOOT_ID\" : \"%s\"",
-                        cursor,
-                        realtime,
-                        monotonic,
-                        sd_id128_to_string(boot_id, sid));
+                output_buffer_printf(b,
+                                     "{\n"
+                                     "\t\"__CURSOR\" : \"%s\",\n"
+                                     "\t\"__REALTIME_TIMESTAMP\" : \""USEC_FMT"\",\n"
+                                     "\t\"__MONOTONIC_TIMESTAMP\" : \""USEC_FMT"\",\n"
+                                     "\t\"_BOOT_ID\" : \"%s\"",
+                                     cursor,
+                                     realtime,
+                                     monotonic,
+                                     sd_id128_to_string(boot_id, sid));
         else {
                 if (mode == OUTPUT_JSON_SSE)
-                        fputs("data: ", f);
-
-                fprintf(f,
-                        "{ \"__CURSOR\" : \"%s\", "
-                        "\"__REALTIME_TIMESTAMP\" : \""USEC_FMT"\", "
-                        "\"__MONOTONIC_TIMESTAMP\" : \""USEC_FMT"\", "
-                        "\"_BOOT_ID\" : \"%s\"",
-                        cursor,
-                        realtime,
-                        monotonic,
-                        sd_id128_to_string(boot_id, sid));
+                        output_buffer_append_string(b, "data: ");
+
+                output_buffer_printf(b,
+                                     "{ \"__CURSOR\" : \"%s\", "
+                                     "\"__REALTIME_TIMESTAMP\" : \""USEC_FMT"\", "
+                                     "\"__MONOTONIC_TIMESTAMP\" : \""USEC_FMT"\", "
+                                     "\"_BOOT_ID\" : \"%s\"",
+                                     cursor,
+                                     realtime,
+                                     monotonic,
+                                     sd_id128_to_string(boot_id, sid));
         }
 
-        h = hashmap_new(&string_hash_ops);
-        if (!h)
-                return log_oom();
+        separator = mode == OUTPUT_JSON_PRETTY ? ",\n\t" : ", ";
 
-        /* First round, iterate through the entry and count how often each field appears */
-        JOURNAL_FOREACH_DATA_RETVAL(j, data, length, r) {
-                const char *eq;
-                char *n;
-                unsigned u;
+        /* Fields are printed in the order they first appear in. A field that appears multiple times is
+         * printed as an array of all its values. */
+        for (i = 0; i < s->n_entry; i++) {
+                OutputField *field = s->entry[i].field;
+                unsigned k, n;
 
-                if (length >= 9 &&
-                    memcmp(data, "_BOOT_ID=", 9) == 0)
+                if (field->printed == s->generation)
                         continue;
 
-                eq = memchr(data, '=', length);
-                if (!eq)
-                        continue;
+                field->printed = s->generation;
 
-                n = strndup(data, eq - (const char*) data);
-                if (!n) {
-                        r = log_oom();
-                        goto finish;
-                }
+                output_buffer_append_string(b, separator);
+                output_buffer_append(b, field->key, field->key_len);
 
-                u = PTR_TO_UINT(hashmap_get(h, n));
-                if (u == 0) {
-                        r = hashmap_put(h, n, UINT_TO_PTR(1));
-                        if (r < 0) {
-                                free(n);
-                                log_oom();
-                                goto finish;
-                        }
-                } else {
-                        r = hashmap_update(h, n, UINT_TO_PTR(u + 1));
-                        free(n);
-                        if (r < 0) {
-                                log_oom();
-                                goto finish;
-                        }
+                if (field->n_values == 1) {
+                        output_buffer_append_string(b, " : ");
+                        json_escape_buffer(b, s->values.data + s->entry[i].offset, s->entry[i].length, flags);
+                        continue;
                 }
-        }
-
-        if (r < 0)
-                return r;
-
-        separator = true;
-        do {
-                done = true;
-
-                SD_JOURNAL_FOREACH_DATA(j, data, length) {
-                        const char *eq;
-                        char *kk, *n;
-                        size_t m;
-                        unsigned u;
 
-                        /* We already printed the boot id, from the data in
-                         * the header, hence let's suppress it here */
-                        if (length >= 9 &&
-                            memcmp(data, "_BOOT_ID=", 9) == 0)
-                                continue;
-
-                        eq = memchr(data, '=', length);
-                        if (!eq)
-                                continue;
-
-                        if (separator) {
-                                if (mode == OUTPUT_JSON_PRETTY)
-                                        fputs(",\n\t", f);
-                                else
-                                        fputs(", ", f);
-                        }
-
-                        m = eq - (const char*) data;
-
-                        n = strndup(data, m);
-                        if (!n) {
-                                r = log_oom();
-                                goto finish;
-                        }
-
-                        u = PTR_TO_UINT(hashmap_get2(h, n, (void**) &kk));
-                        if (u == 0) {
-                                /* We already printed this, let's jump to the next */
-                                free(n);
-                                separator = false;
-
-                                continue;
-                        } else if (u == 1) {
-                                /* Field only appears once, output it directly */
-
-                                json_escape(f, data, m, flags);
-                                fputs(" : ", f);
-
-                                json_escape(f, eq + 1, length - m - 1, flags);
-
-                                hashmap_remove(h, n);
-                                free(kk);
-                                free(n);
-
-                                separator = true;
-
-                                continue;
-
-                        } else {
-                                /* Field appears multiple times, output it as array */
-                                json_escape(f, data, m, flags);
-                                fputs(" : [ ", f);
-                                json_escape(f, eq + 1, length - m - 1, flags);
+                output_buffer_append_string(b, " : [ ");
 
-                                /* Iterate through the end of the list */
+                for (k = i, n = 0; n < field->n_values; k = s->entry[k].next, n++) {
+                        if (n > 0)
+                                output_buffer_append_string(b, ", ");
 
-                                while (sd_journal_enumerate_data(j, &data, &length) > 0) {
-                                        if (length < m + 1)
-                                                continue;
-
-                                        if (memcmp(data, n, m) != 0)
-                                                continue;
-
-                                        if (((const char*) data)[m] != '=')
-                                                continue;
-
-                                        fputs(", ", f);
-                                        json_escape(f, (const char*) data + m + 1, length - m - 1, flags);
-                                }
-
-                                fputs(" ]", f);
-
-                                hashmap_remove(h, n);
-                                free(kk);
-                                free(n);
-
-                                /* Iterate data fields form the beginning */
-                                done = false;
-                                separator = true;
-
-                                break;
-                        }
+                        json_escape_buffer(b, s->values.data + s->entry[k].offset, s->entry[k].length, flags);
                 }
 
-        } while (!done);
+                output_buffer_append_string(b, " ]");
+        }
 
         if (mode == OUTPUT_JSON_PRETTY)
-                fputs("\n}\n", f);
+                output_buffer_append_string(b, "\n}\n");
         else if (mode == OUTPUT_JSON_SSE)
-                fputs("}\n\n", f);
+                output_buffer_append_string(b, "}\n\n");
         else
-                fputs(" }\n", f);
-
-        r = 0;
-
-finish:
-        while ((k = hashmap_steal_first_key(h)))
-                free(k);
-
-        hashmap_free(h);
+                output_buffer_append_string(b, " }\n");
 
-        return r;
+        return output_buffer_write(b, f);
 }
 
 static int output_cat(
@@ -924,7 +1262,8 @@ static int output_cat(
                 sd_journal *j,
                 OutputMode mode,
                 unsigned n_columns,
-                OutputFlags flags) {
+                OutputFlags flags,
+                Set *output_fields) {
 
         const void *data;
         size_t l;
@@ -957,7 +1296,8 @@ static int (*output_funcs[_OUTPUT_MODE_MAX])(
                 sd_journal*j,
                 OutputMode mode,
                 unsigned n_columns,
-                OutputFlags flags) = {
+                OutputFlags flags,
+                Set *output_fields) = {
 
         [OUTPUT_SHORT] = output_short,
         [OUTPUT_SHORT_ISO] = output_short,
@@ -980,6 +1320,7 @@ int output_journal(
                 OutputMode mode,
                 unsigned n_columns,
                 OutputFlags flags,
+                Set *output_fields,
                 bool *ellipsized) {
 
         int ret;
@@ -989,7 +1330,7 @@ int output_journal(
         if (n_columns <= 0)
                 n_columns = columns();
 
-        ret = output_funcs[mode](f, j, mode, n_columns, flags);
+        ret = output_funcs[mode](f, j, mode, n_columns, flags, output_fields);
 
         if (ellipsized && ret > 0)
                 *ellipsized = true;
@@ -1071,7 +1412,7 @@ static int show_journal(FILE *f,
                         line++;
                         maybe_print_begin_newline(f, &flags);
 
-                        r = output_journal(f, j, mode, n_columns, flags, ellipsized);
+                        r = output_journal(f, j, mode, n_columns, flags, NULL, ellipsized);
                         if (r < 0)
                                 return r;
                 }
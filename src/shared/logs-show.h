@@ -28,6 +28,7 @@
 
 #include "macro.h"
 #include "output-mode.h"
+#include "set.h"
 #include "time-util.h"
 #include "util.h"
 
@@ -37,6 +38,7 @@ int output_journal(
                 OutputMode mode,
                 unsigned n_columns,
                 OutputFlags flags,
+                Set *output_fields,
                 bool *ellipsized);
 
 int add_match_this_boot(sd_journal *j, const char *machine);